@@ -8,6 +8,8 @@
 #include <kmalloc.h>
 #include <multiboot.h>
 #include <arena.h>
+#include <acpi.h>
+#include <arch/topology.h>
 
 /* Helper.  Adds free entries to the base arena.  Most entries are page aligned,
  * though on some machines below EXTPHYSMEM we may have some that aren't. */
@@ -142,3 +144,58 @@ void base_arena_init(struct multiboot_info *mbi)
 		account_for_pages(boot_freemem_paddr);
 	}
 }
+
+/* Moves the free memory in [lo, hi) from base_arena to node.  We grab the
+ * largest chunks we can, so the node's base arena gets a few big spans. */
+static size_t carve_node_mem(int node, physaddr_t lo, physaddr_t hi)
+{
+	size_t amt = 0;
+	void *chunk;
+
+	for (size_t sz = ROUNDDOWNPWR2(hi - lo); sz >= PGSIZE; sz >>= 1) {
+		while ((chunk = arena_xalloc(base_arena, sz, PGSIZE, 0, 0,
+		                             KADDR(lo), KADDR(hi),
+		                             MEM_ATOMIC))) {
+			mem_node_add(node, chunk, sz);
+			amt += sz;
+		}
+	}
+	return amt;
+}
+
+/* Splits the free memory into per-NUMA-node arenas, based on the SRAT's memory
+ * affinity entries.  Run this after topology_init(), but before any cores call
+ * smp_percpu_init(), which picks each core's local node.
+ *
+ * All of memory starts out in base_arena, which is node 0.  Memory in domains
+ * without any cores (or beyond MAX_NUMA_NODES) stays with node 0. */
+void numa_mem_init(void)
+{
+	struct Srat *st;
+	physaddr_t lo, hi;
+	int node;
+	size_t amt;
+
+	if (!srat || cpu_topology_info.num_numa <= 1)
+		return;
+	for (int i = 0; i < srat->nchildren; i++) {
+		st = srat->children[i]->tbl;
+		if (!st || st->type != SRmem)
+			continue;
+		node = numa_dom_to_id(st->mem.dom);
+		if (node <= 0)
+			continue;
+		if (node >= MAX_NUMA_NODES) {
+			warn("NUMA node %d out of range, using node 0", node);
+			continue;
+		}
+		lo = ROUNDUP(st->mem.addr, PGSIZE);
+		hi = ROUNDDOWN(MIN(st->mem.addr + st->mem.len, max_paddr),
+		               PGSIZE);
+		if (lo >= hi)
+			continue;
+		amt = carve_node_mem(node, lo, hi);
+		printk("NUMA node %d: %lu bytes free in [%p, %p)\n", node, amt,
+		       lo, hi);
+	}
+}
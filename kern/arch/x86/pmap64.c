@@ -84,14 +84,38 @@ static kpte_t *kpte2pml(kpte_t kpte)
 	return (kpte_t*)KADDR(PTE_ADDR(kpte));
 }
 
+/* Helper: points kpte (and its EPTE) at the page table at new_pml_kva. */
+static void __kpte_set_pml(kpte_t *kpte, void *new_pml_kva, uintptr_t va)
+{
+	epte_t *epte = kpte_to_epte(kpte);
+
+	/* We insert the new PT into the PML with U and W perms.  Permissions
+	 * on page table walks are anded together (if any of them are !User,
+	 * the translation is !User).  We put the perms on the last entry, not
+	 * the intermediates. */
+	*kpte = PADDR(new_pml_kva) | PTE_P | PTE_U | PTE_W;
+	/* For a dose of paranoia, we'll avoid mapping intermediate eptes when
+	 * we know we're using an address that should never be ept-accesible. */
+	if (va < ULIM) {
+		/* The physaddr of the new_pml is one page higher than the KPT
+		 * page.
+		 * A few other things:
+		 * - for the same reason that we have U and X set on all
+		 *   intermediate PTEs, we now set R, X, and W for the EPTE.
+		 * - All EPTEs have U perms
+		 * - We can't use epte_write since we're workin on intermediate
+		 *   PTEs, and they don't have the memory type set. */
+		*epte = (PADDR(new_pml_kva) + PGSIZE) | EPTE_R | EPTE_X |
+		        EPTE_W;
+	}
+}
+
 static kpte_t *__pml_walk(kpte_t *pml, uintptr_t va, int flags, int pml_shift)
 {
 	kpte_t *kpte;
-	epte_t *epte;
 	void *new_pml_kva;
 
 	kpte = &pml[PMLx(va, pml_shift)];
-	epte = kpte_to_epte(kpte);
 	if (walk_is_complete(kpte, pml_shift, flags))
 		return kpte;
 	if (!kpte_is_present(kpte)) {
@@ -103,28 +127,7 @@ static kpte_t *__pml_walk(kpte_t *pml, uintptr_t va, int flags, int pml_shift)
 		 * memory) */
 		if (!new_pml_kva)
 			return NULL;
-		/* We insert the new PT into the PML with U and W perms.
-		 * Permissions on page table walks are anded together (if any of
-		 * them are !User, the translation is !User).  We put the perms
-		 * on the last entry, not the intermediates. */
-		*kpte = PADDR(new_pml_kva) | PTE_P | PTE_U | PTE_W;
-		/* For a dose of paranoia, we'll avoid mapping intermediate
-		 * eptes when we know we're using an address that should never
-		 * be ept-accesible. */
-		if (va < ULIM) {
-			/* The physaddr of the new_pml is one page higher than
-			 * the KPT page.
-			 * A few other things:
-			 * - for the same reason that we have U and X set on all
-			 *   intermediate PTEs, we now set R, X, and W for the
-			 *   EPTE.
-			 * - All EPTEs have U perms
-			 * - We can't use epte_write since we're workin on
-			 *   intermediate PTEs, and they don't have the memory
-			 *   type set. */
-			*epte = (PADDR(new_pml_kva) + PGSIZE) | EPTE_R | EPTE_X
-				| EPTE_W;
-		}
+		__kpte_set_pml(kpte, new_pml_kva, va);
 	}
 	return __pml_walk(kpte2pml(*kpte), va, flags, pml_shift - BITS_PER_PML);
 }
@@ -410,6 +413,42 @@ pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create)
 	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
 }
 
+/* Like pgdir_walk, but stops at the PML2, returning the PTE that maps (or would
+ * map) a 2MB user jumbo at va.  If it's not jumbo and not unmapped, it points
+ * to a page table. */
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create)
+{
+	int flags = PML2_SHIFT;
+
+	if (create == 1)
+		flags |= PG_WALK_CREATE;
+	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
+}
+
+/* Replaces the 2MB jumbo mapping va, if any, with a page table of 4K PTEs that
+ * map the same memory with the same settings.  The old TLB entries are still
+ * correct, but the caller should flush them before changing the new PTEs.
+ * Returns 0 on success (or if there was no jumbo), -ENOMEM on failure. */
+int pgdir_split_jumbo(pgdir_t pgdir, const void *va)
+{
+	kpte_t *kpte, *new_pml;
+	physaddr_t pa;
+	int settings;
+
+	kpte = pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, PML2_SHIFT);
+	if (!kpte || !kpte_is_jumbo(kpte))
+		return 0;
+	new_pml = kpages_zalloc(2 * PGSIZE, MEM_ATOMIC);
+	if (!new_pml)
+		return -ENOMEM;
+	pa = pte_get_paddr(kpte);
+	settings = pte_get_settings(kpte) & ~PTE_PS;
+	for (int i = 0; i < NPTENTRIES; i++)
+		pte_write(&new_pml[i], pa + i * PGSIZE, settings);
+	__kpte_set_pml(kpte, new_pml, ROUNDDOWN((uintptr_t)va, PML2_PTE_REACH));
+	return 0;
+}
+
 static int pml_perm_walk(kpte_t *pml, const void *va, int pml_shift)
 {
 	kpte_t *kpte;
@@ -514,8 +553,9 @@ void x86_cleanup_bootmem(void)
 }
 
 /* Walks len bytes from start, executing 'callback' on every PTE, passing it a
- * specific VA and whatever arg is passed in.  Note, this cannot handle jumbo
- * pages.
+ * specific VA and whatever arg is passed in.  2MB jumbo PTEs are passed once,
+ * with their base VA.  Callers that might see a jumbo straddling either end of
+ * the range need to split it first.
  *
  * This is just a clumsy wrapper around the more powerful pml_for_each, which
  * can handle jumbo and intermediate pages. */
@@ -532,9 +572,10 @@ int env_user_mem_walk(struct proc *p, void *start, size_t len,
 	{
 		struct tramp_package *tp = (struct tramp_package*)data;
 		assert(tp->cb);
-		/* memwalk CBs don't know how to handle intermediates or jumbos
-		 */
-		if (shift != PML1_SHIFT)
+		/* memwalk CBs don't know how to handle intermediates.  They
+		 * get 2MB jumbos at their base va, and can tell by the PTE. */
+		if (shift != PML1_SHIFT &&
+		    !(shift == PML2_SHIFT && kpte_is_jumbo(kpte)))
 			return 0;
 		return tp->cb(tp->p, kpte, (void*)kva, tp->cb_arg);
 	}
@@ -364,8 +364,8 @@ void __abandon_core(void)
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct proc *old_proc;
 
-	lcr3(boot_cr3);
 	old_proc = pcpui->cur_proc;
+	__load_addr_space(old_proc, NULL);
 	pcpui->cur_proc = NULL;
 	proc_decref(old_proc);
 }
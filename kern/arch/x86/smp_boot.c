@@ -337,6 +337,13 @@ void __arch_pcpu_init(uint32_t coreid)
 	// area.
 	init_fp_state();
 
+	/* Our default node for kpages and kmalloc.  Cores in a node with no
+	 * memory of its own use node 0. */
+	pcpui->numa_node = cpu_topology_info.core_list[coreid].numa_id;
+	if (pcpui->numa_node < 0 || pcpui->numa_node >= nr_mem_nodes ||
+	    !kpages_arenas[pcpui->numa_node])
+		pcpui->numa_node = 0;
+
 	/* core 0 set up earlier in idt_init() */
 	if (coreid) {
 		my_stack_bot = kstack_bottom_addr(ROUNDUP(read_sp() - 1,
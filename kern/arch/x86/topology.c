@@ -236,6 +236,8 @@ static void init_core_list(uint32_t core_bits, uint32_t cpu_bits)
 
 			core_list[os_coreid].numa_id =
 				find_numa_domain(apic_id);
+			core_list[os_coreid].raw_numa_id =
+				core_list[os_coreid].numa_id;
 			core_list[os_coreid].raw_socket_id = raw_socket_id;
 			core_list[os_coreid].socket_id = -1;
 			core_list[os_coreid].cpu_id = cpu_id;
@@ -380,6 +382,19 @@ void topology_init(void)
 		build_flat_topology();
 }
 
+/* Returns the numa_id for the SRAT proximity domain dom, or -1 if no cores are
+ * in that domain (e.g. memory-only domains). */
+int numa_dom_to_id(int dom)
+{
+	if (!core_list)
+		return -1;
+	for (int i = 0; i < num_cores; i++) {
+		if (core_list[i].raw_numa_id == dom)
+			return core_list[i].numa_id;
+	}
+	return -1;
+}
+
 void print_cpu_topology(void)
 {
 	printk("num_numa: %d, num_sockets: %d, num_cpus: %d, num_cores: %d\n",
@@ -10,6 +10,7 @@
 
 struct core_info {
 	int numa_id;
+	int raw_numa_id;
 	int socket_id;
 	int cpu_id;
 	int core_id;
@@ -38,6 +39,7 @@ extern int *os_coreid_lookup;
 
 void topology_init();
 void print_cpu_topology();
+int numa_dom_to_id(int dom);
 
 static inline int get_hw_coreid(uint32_t coreid)
 {
@@ -18,6 +18,7 @@
 #include <kdebug.h>
 #include <kmalloc.h>
 #include <ex_table.h>
+#include <rcu.h>
 #include <arch/mptables.h>
 #include <ros/procinfo.h>
 
@@ -678,6 +679,9 @@ void trap(struct hw_trapframe *hw_tf)
 		set_current_ctx_hw(pcpui, hw_tf);
 		/* ignoring state for nested kernel traps.  should be rare. */
 		__set_cpu_state(pcpui, CPU_STATE_KERNEL);
+		/* Coming from userspace is a QS.  Cores that stay in userspace
+		 * have no tick to report one; RCU checks their cpu_state. */
+		rcu_report_qs();
 	} else {
 		inc_ktrap_depth(pcpui);
 	}
@@ -710,6 +714,8 @@ static void irq_dispatch(struct hw_trapframe *hw_tf)
 
 	if (!in_irq_ctx(pcpui))
 		__set_cpu_state(pcpui, CPU_STATE_IRQ);
+	/* Handlers may touch user memory; catch up on deferred shootdowns. */
+	tlb_lazy_exit();
 	inc_irq_depth(pcpui);
 	//if (core_id())
 	if (hw_tf->tf_trapno != IdtLAPIC_TIMER)	/* timer irq */
@@ -868,6 +874,7 @@ void sysenter_callwrapper(struct syscall *sysc, unsigned long count,
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	set_current_ctx_sw(pcpui, sw_tf);
 	__set_cpu_state(pcpui, CPU_STATE_KERNEL);
+	rcu_report_qs();
 	/* Once we've set_current_ctx, we can enable interrupts.  This used to
 	 * be mandatory (we had immediate KMSGs that would muck with cur_ctx).
 	 * Now it should only help for sanity/debugging. */
@@ -1182,6 +1189,7 @@ void handle_vmexit(struct vm_trapframe *tf)
 
 	set_current_ctx_vm(pcpui, tf);
 	__set_cpu_state(pcpui, CPU_STATE_KERNEL);
+	rcu_report_qs();
 	tf = &pcpui->cur_ctx->tf.vm_tf;
 	vmexit_dispatch(tf);
 	/* We're either restarting a partial VM ctx (vmcs was launched, loaded
@@ -26,6 +26,7 @@ static char *devname(void)
 struct gtfs {
 	struct tree_filesystem		tfs;
 	struct kref			users;
+	struct pm_wb_client		wb;
 };
 
 /* Blob hanging off the fs_file->priv.  The backend chans are only accessed,
@@ -191,10 +192,20 @@ static void purge_cb(struct tree_file *tf)
 	poperror();
 }
 
+/* Called by the writeback ktask */
+static void gtfs_wb_cb(struct pm_wb_client *wbc)
+{
+	struct gtfs *gtfs = container_of(wbc, struct gtfs, wb);
+
+	tfs_frontend_for_each(&gtfs->tfs, purge_cb);
+}
+
 static void gtfs_release(struct kref *kref)
 {
 	struct gtfs *gtfs = container_of(kref, struct gtfs, users);
 
+	/* Waits out a writeback in progress, which relies on our tfs */
+	pm_wb_unregister(&gtfs->wb);
 	tfs_frontend_purge(&gtfs->tfs, purge_cb);
 	/* this is the ref from attach */
 	assert(kref_refcnt(&gtfs->tfs.root->kref) == 1);
@@ -376,6 +387,7 @@ static size_t gtfs_read(struct chan *c, void *ubuf, size_t n, off64_t off)
 
 	if (tree_file_is_dir(tf))
 		return gtfs_fsf_read(&tf->file, ubuf, n, off);
+	fs_file_readahead(c, &tf->file, off, n);
 	return fs_file_read(&tf->file, ubuf, n, off);
 }
 
@@ -616,6 +628,48 @@ static int gtfs_pm_writepage(struct page_map *pm, struct page *pg)
 	return 0;
 }
 
+/* Writes back pages with consecutive indexes as one backend write, instead of
+ * one 9p round trip per page.  We copy them into a bounce buffer, since the
+ * pages aren't contiguous.  If we can't get one, we write the pages one at a
+ * time. */
+static int gtfs_pm_writepages(struct page_map *pm, struct page **pgs,
+                              unsigned long nr_pgs)
+{
+	ERRSTACK(1);
+	struct fs_file *f = pm->pm_file;
+	off64_t offset = pgs[0]->pg_index << PGSHIFT;
+	size_t amt;
+	void *buf;
+
+	buf = kpages_alloc(nr_pgs * PGSIZE, MEM_ATOMIC);
+	if (!buf) {
+		for (unsigned long i = 0; i < nr_pgs; i++)
+			gtfs_pm_writepage(pm, pgs[i]);
+		return 0;
+	}
+	qlock(&f->qlock);
+	if (waserror()) {
+		qunlock(&f->qlock);
+		kpages_free(buf, nr_pgs * PGSIZE);
+		poperror();
+		return -get_errno();
+	}
+	if (offset >= fs_file_get_length(f)) {
+		qunlock(&f->qlock);
+		kpages_free(buf, nr_pgs * PGSIZE);
+		poperror();
+		return 0;
+	}
+	amt = MIN(nr_pgs * PGSIZE, fs_file_get_length(f) - offset);
+	for (unsigned long i = 0; i < nr_pgs; i++)
+		memcpy(buf + i * PGSIZE, page2kva(pgs[i]), PGSIZE);
+	__gtfs_fsf_write(f, buf, amt, offset);
+	qunlock(&f->qlock);
+	poperror();
+	kpages_free(buf, nr_pgs * PGSIZE);
+	return 0;
+}
+
 /* Caller holds the file's qlock */
 static void __trunc_to(struct fs_file *f, off64_t begin)
 {
@@ -700,6 +754,7 @@ static bool gtfs_fs_can_grow_to(struct fs_file *f, size_t len)
 struct fs_file_ops gtfs_fs_ops = {
 	.readpage = gtfs_pm_readpage,
 	.writepage = gtfs_pm_writepage,
+	.writepages = gtfs_pm_writepages,
 	.punch_hole = gtfs_fs_punch_hole,
 	.can_grow_to = gtfs_fs_can_grow_to,
 };
@@ -772,6 +827,8 @@ static struct chan *gtfs_attach(char *arg)
 	/* need another ref on root for the frontend chan */
 	tf_kref_get(tfs->root);
 	chan_set_tree_file(frontend, tfs->root);
+	gtfs->wb.writeback = gtfs_wb_cb;
+	pm_wb_register(&gtfs->wb);
 	poperror();
 	return frontend;
 }
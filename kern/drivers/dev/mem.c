@@ -13,6 +13,7 @@
 #include <error.h>
 #include <syscall.h>
 #include <sys/queue.h>
+#include <page_alloc.h>
 
 struct dev mem_devtab;
 
@@ -28,6 +29,8 @@ enum {
 	Qfree,
 	Qkmemstat,
 	Qslab_trace,
+	Qnuma,
+	Qkmalloc_trace,
 };
 
 static struct dirtab mem_dir[] = {
@@ -37,6 +40,8 @@ static struct dirtab mem_dir[] = {
 	{"free", {Qfree, 0, QTFILE}, 0, 0444},
 	{"kmemstat", {Qkmemstat, 0, QTFILE}, 0, 0444},
 	{"slab_trace", {Qslab_trace, 0, QTFILE}, 0, 0444},
+	{"numa", {Qnuma, 0, QTFILE}, 0, 0444},
+	{"kmalloc_trace", {Qkmalloc_trace, 0, QTFILE}, 0, 0644},
 };
 
 /* Protected by the arenas_and_slabs_lock */
@@ -174,6 +179,9 @@ static void fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza)
 		nr_unalloc_objs += s_i->num_total_obj - s_i->num_busy_obj;
 	sza_printf(sza, "Nr unallocated in slab layer: %lu\n", nr_unalloc_objs);
 	sza_printf(sza, "Nr allocated from slab layer: %d\n", kc->nr_cur_alloc);
+	sza_printf(sza, "Nr empty slabs: %lu, working set min: %lu\n",
+	           kc->nr_empty_slabs, kc->min_empty_slabs);
+	sza_printf(sza, "Bytes reaped: %lu\n", kc->nr_reaped_bytes);
 	for (int i = 0; i < kc->hh.nr_hash_lists; i++) {
 		int j = 0;
 
@@ -192,6 +200,8 @@ static void fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza)
 	sza_printf(sza, "Depot magsize: %d\n", kc->depot.magsize);
 	sza_printf(sza, "Nr empty mags: %d\n", kc->depot.nr_empty);
 	sza_printf(sza, "Nr non-empty mags: %d\n", kc->depot.nr_not_empty);
+	sza_printf(sza, "Working set min empty: %d, non-empty: %d\n",
+	           kc->depot.min_empty, kc->depot.min_not_empty);
 	spin_unlock_irqsave(&kc->depot.lock);
 }
 
@@ -233,6 +243,32 @@ static struct sized_alloc *build_free(void)
 	return sza;
 }
 
+/* Per-node memory: the node's base arena tracks all of its memory, and the
+ * kpages arena tracks what the kernel pulled from the node via kpages/kmalloc.
+ * */
+static struct sized_alloc *build_numa(void)
+{
+	struct sized_alloc *sza;
+	struct arena *base, *kpages;
+
+	sza = sized_kzmalloc(100 + 100 * nr_mem_nodes, MEM_WAIT);
+	sza_printf(sza, "%4s %15s %15s %15s\n", "Node", "Total Memory",
+	           "Free Memory", "Kpages Alloc");
+	qlock(&arenas_and_slabs_lock);
+	for (int i = 0; i < nr_mem_nodes; i++) {
+		base = base_arenas[i];
+		kpages = kpages_arenas[i];
+		if (!base)
+			continue;
+		sza_printf(sza, "%4d %15llu %15llu %15llu\n", i,
+		           base->amt_total_segs,
+		           base->amt_total_segs - base->amt_alloc_segs,
+		           kpages ? kpages->amt_alloc_segs : 0);
+	}
+	qunlock(&arenas_and_slabs_lock);
+	return sza;
+}
+
 #define KMEMSTAT_NAME			30
 #define KMEMSTAT_OBJSIZE		8
 #define KMEMSTAT_TOTAL			15
@@ -354,6 +390,12 @@ static struct chan *mem_open(struct chan *c, int omode)
 	case Qkmemstat:
 		c->synth_buf = build_kmemstat();
 		break;
+	case Qnuma:
+		c->synth_buf = build_numa();
+		break;
+	case Qkmalloc_trace:
+		c->synth_buf = kmalloc_trace_report();
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -370,6 +412,8 @@ static void mem_close(struct chan *c)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qnuma:
+	case Qkmalloc_trace:
 		kfree(c->synth_buf);
 		c->synth_buf = NULL;
 		break;
@@ -400,6 +444,8 @@ static size_t mem_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qnuma:
+	case Qkmalloc_trace:
 		sza = c->synth_buf;
 		return readstr(offset, ubuf, n, sza->buf);
 	case Qslab_trace:
@@ -455,6 +501,23 @@ static void slab_trace_cmd(struct chan *c, struct cmdbuf *cb)
 	kfree(old_sza);
 }
 
+/* Record kmalloc sizes, then read the file for the fragmentation report. */
+#define KMALLOC_TRACE_USAGE "start|stop|reset"
+
+static void kmalloc_trace_cmd(struct chan *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 1)
+		error(EFAIL, KMALLOC_TRACE_USAGE);
+	if (!strcmp(cb->f[0], "start"))
+		kmalloc_trace_start();
+	else if (!strcmp(cb->f[0], "stop"))
+		kmalloc_trace_stop();
+	else if (!strcmp(cb->f[0], "reset"))
+		kmalloc_trace_reset();
+	else
+		error(EFAIL, KMALLOC_TRACE_USAGE);
+}
+
 static size_t mem_write(struct chan *c, void *ubuf, size_t n, off64_t unused)
 {
 	ERRSTACK(1);
@@ -468,6 +531,9 @@ static size_t mem_write(struct chan *c, void *ubuf, size_t n, off64_t unused)
 	case Qslab_trace:
 		slab_trace_cmd(c, cb);
 		break;
+	case Qkmalloc_trace:
+		kmalloc_trace_cmd(c, cb);
+		break;
 	default:
 		error(EFAIL, "Unable to write to %s", devname());
 	}
@@ -8,8 +8,9 @@
  * is a function pointer which runs in interrupt context when the alarm goes off
  * (picture running the ksched then).
  *
- * Like with most systems, you won't wake up til after the time you specify (for
- * now).  This might change, esp if we tweak things to coalesce alarms.
+ * Like with most systems, you won't wake up til after the time you specify.
+ * Alarms can also have some slack: an alarm may fire up to 'slack' after its
+ * time, which lets nearby alarms share a timer interrupt.
  *
  * All tchains come with locks.  Originally, I left these out, since the pcpu
  * tchains didn't need them (disable_irq was sufficient).  However, disabling
@@ -51,6 +52,9 @@
  * or:
  * 	reset_alarm_rel(tchain, waiter, USEC);
  *
+ * If you don't care exactly when it fires, let it share an interrupt:
+ * 	set_awaiter_slack(waiter, SLACK_USEC);
+ *
  * Don't forget to manage your memory at some (safe) point:
  * 	kfree(waiter);
  * In the future, we might have a slab for these.  You can get it from wherever
@@ -63,28 +67,41 @@
 #include <kthread.h>
 
 /* These structures allow code to defer work for a certain amount of time.
- * Timer chains (like off a per-core timer) are made of lists/trees of these. */
+ * Timer chains (like off a per-core timer) are made of heaps of these. */
 struct alarm_waiter {
 	uint64_t 			wake_up_time;
+	uint64_t			slack;		/* TSC ticks */
+	uint64_t			deadline;	/* wake_up_time + slack */
 	void (*func) (struct alarm_waiter *waiter);
 	void				*data;
-	TAILQ_ENTRY(alarm_waiter)	next;
+	/* Pairing heap links.  prev is the parent for the leftmost child. */
+	struct alarm_waiter		*ph_child;
+	struct alarm_waiter		*ph_next;
+	struct alarm_waiter		*ph_prev;
+	/* The tchain we're on, or last ran on.  Can change if migrated. */
+	struct timer_chain		*tchain;
 	bool				on_tchain;
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
 /* One of these per alarm source, such as a per-core timer.  All tchains come
  * with a lock, even if its rarely needed (like the pcpu tchains).
- * set_interrupt() is a method for setting the interrupt source. */
+ * set_interrupt() is a method for setting the interrupt source.
+ *
+ * Waiters are in a pairing heap, ordered by deadline: O(1) to set, O(log n)
+ * amortized to run or unset.  The interrupt goes off at the earliest deadline,
+ * and then runs every waiter at the top of the heap whose wake_up_time has
+ * passed. */
 struct timer_chain {
 	spinlock_t			lock;
-	struct awaiters_tailq		waiters;
+	struct alarm_waiter		*heap;
+	size_t				nr_waiters;
 	struct alarm_waiter		*running;
 	uint64_t			earliest_time;
-	uint64_t			latest_time;
 	struct cond_var			cv;
+	/* If set, new alarms go to this tchain instead (isolated cores) */
+	struct timer_chain		*redirect;
 	void (*set_interrupt)(struct timer_chain *);
 };
 
@@ -98,10 +115,13 @@ void init_awaiter(struct alarm_waiter *waiter,
 void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
+/* How late the alarm may fire, so that it can share an interrupt */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec);
 /* Arms/disarms the alarm.  Can be called from within a handler.*/
 void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
 /* Unset and reset may block if the alarm is not IRQ.  Do not call from within a
- * handler.  Returns TRUE if you stopped the alarm from firing. */
+ * handler.  Returns TRUE if you stopped the alarm from firing.  Pass the tchain
+ * you set the alarm on; we'll follow the alarm if it was migrated. */
 bool unset_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
 /* Convenience wrappers for unset, then set.  Slower, but easier than just
  * setting, since you don't need to know if it fired.  Returns TRUE if the alarm
@@ -111,6 +131,11 @@ bool reset_alarm_abs(struct timer_chain *tchain, struct alarm_waiter *waiter,
 bool reset_alarm_rel(struct timer_chain *tchain, struct alarm_waiter *waiter,
                      uint64_t usleep);
 
+/* Moves all of tchain's alarms to 'to', and sends any new ones there, until
+ * unisolated.  'to' must never be isolated itself. */
+void tchain_isolate(struct timer_chain *tchain, struct timer_chain *to);
+void tchain_unisolate(struct timer_chain *tchain);
+
 /* Interrupt handlers need to call this.  Don't call it directly. */
 void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf);
 /* Sets the timer chain interrupt according to the next timer in the chain. */
@@ -121,6 +146,9 @@ static inline bool alarm_expired(struct alarm_waiter *awaiter)
 	return awaiter->wake_up_time <= read_tsc();
 }
 
+/* Upper bound on the slack for sleeps that don't ask for any (rendez). */
+extern unsigned long alarm_slack_usec;
+
 /* Debugging */
 #define ALARM_POISON_TIME 12345		/* could use some work */
 void print_chain(struct timer_chain *tchain);
@@ -31,6 +31,18 @@ static inline void core_set_clearcpu(struct core_set *cset, unsigned int cpuno)
 	__clear_bit(cpuno, cset->cpus);
 }
 
+static inline void core_set_setcpu_atomic(struct core_set *cset,
+                                          unsigned int cpuno)
+{
+	set_bit(cpuno, cset->cpus);
+}
+
+static inline void core_set_clearcpu_atomic(struct core_set *cset,
+                                            unsigned int cpuno)
+{
+	clear_bit(cpuno, cset->cpus);
+}
+
 static inline bool core_set_getcpu(const struct core_set *cset,
 				   unsigned int cpuno)
 {
@@ -16,6 +16,7 @@
 #include <arch/arch.h>
 #include <sys/queue.h>
 #include <atomic.h>
+#include <core_set.h>
 #include <mm.h>
 #include <schedule.h>
 #include <devalarm.h>
@@ -81,7 +82,9 @@ struct proc {
 	physaddr_t env_cr3;		// Physical address of page dir
 	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt) */
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
+	struct core_set tlb_cpus;	/* cores with env_cr3 loaded */
 	struct vmr_tailq vm_regions;
+	struct rb_root vmr_tree;	/* same VMRs, indexed by addr */
 	int vmr_history;
 
 	// Per process info and data pages
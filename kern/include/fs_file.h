@@ -108,6 +108,9 @@ static inline size_t fs_file_get_length(struct fs_file *f)
 }
 
 void fs_file_init(struct fs_file *f, const char *name, struct fs_file_ops *ops);
+void fs_file_readahead(struct chan *c, struct fs_file *f, off64_t offset,
+                       size_t count);
+unsigned long fs_file_ra_chan_ctl(struct chan *c, int op, unsigned long a1);
 void fs_file_set_basename(struct fs_file *f, const char *name);
 void fs_file_change_basename(struct fs_file *f, const char *name);
 void fs_file_init_dir(struct fs_file *f, int dir_type, int dir_dev,
@@ -129,6 +132,8 @@ size_t fs_file_stat(struct fs_file *f, uint8_t *m_buf, size_t m_buf_sz);
 void fs_file_truncate(struct fs_file *f, off64_t to);
 size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
                     off64_t offset);
+struct block *fs_file_read_block(struct fs_file *f, size_t count,
+                                 off64_t offset);
 size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
                      off64_t offset);
 size_t fs_file_wstat(struct fs_file *f, uint8_t *m_buf, size_t m_buf_sz);
@@ -0,0 +1,113 @@
+/* jhash.h: Jenkins hash support.
+ *
+ * Copyright (C) 2006. Bob Jenkins (bob_jenkins@burtleburtle.net)
+ *
+ * http://burtleburtle.net/bob/hash/
+ *
+ * These are the credits from Bob's sources:
+ *
+ * lookup3.c, by Bob Jenkins, May 2006, Public Domain.
+ *
+ * These are functions for producing 32-bit hashes for hash table lookup.
+ * hashword(), hashlittle(), hashlittle2(), hashbig(), mix(), and final()
+ * are externally useful functions.  Routines to test the hash are included
+ * if SELF_TEST is defined.  You can use this free for any purpose.  It's in
+ * the public domain.  It has no warranty.
+ *
+ * Copyright (C) 2009-2010 Jozsef Kadlecsik (kadlec@blackhole.kfki.hu)
+ *
+ * This file came from Linux, 4.6, trimmed down to the word-based hashes.
+ * This source code is licensed under the GNU General Public License
+ * Version 2. See the file COPYING for more details. */
+
+#pragma once
+
+#include <arch/types.h>
+#include <compiler.h>
+
+static inline uint32_t __jhash_rol32(uint32_t word, unsigned int shift)
+{
+	return (word << shift) | (word >> ((-shift) & 31));
+}
+
+/* __jhash_mix -- mix 3 32-bit values reversibly. */
+#define __jhash_mix(a, b, c)						\
+{									\
+	a -= c;  a ^= __jhash_rol32(c, 4);  c += b;			\
+	b -= a;  b ^= __jhash_rol32(a, 6);  a += c;			\
+	c -= b;  c ^= __jhash_rol32(b, 8);  b += a;			\
+	a -= c;  a ^= __jhash_rol32(c, 16); c += b;			\
+	b -= a;  b ^= __jhash_rol32(a, 19); a += c;			\
+	c -= b;  c ^= __jhash_rol32(b, 4);  b += a;			\
+}
+
+/* __jhash_final - final mixing of 3 32-bit values (a,b,c) into c */
+#define __jhash_final(a, b, c)						\
+{									\
+	c ^= b; c -= __jhash_rol32(b, 14);				\
+	a ^= c; a -= __jhash_rol32(c, 11);				\
+	b ^= a; b -= __jhash_rol32(a, 25);				\
+	c ^= b; c -= __jhash_rol32(b, 16);				\
+	a ^= c; a -= __jhash_rol32(c, 4);				\
+	b ^= a; b -= __jhash_rol32(a, 14);				\
+	c ^= b; c -= __jhash_rol32(b, 24);				\
+}
+
+/* An arbitrary initial parameter */
+#define JHASH_INITVAL		0xdeadbeef
+
+/* jhash2 - hash an array of uint32_t's
+ * @k: the key which must be an array of uint32_t's
+ * @length: the number of uint32_t's in the key
+ * @initval: the previous hash, or an arbitray value
+ *
+ * Returns the hash value of the key. */
+static inline uint32_t jhash2(const uint32_t *k, uint32_t length,
+                              uint32_t initval)
+{
+	uint32_t a, b, c;
+
+	/* Set up the internal state */
+	a = b = c = JHASH_INITVAL + (length << 2) + initval;
+
+	/* Handle most of the key */
+	while (length > 3) {
+		a += k[0];
+		b += k[1];
+		c += k[2];
+		__jhash_mix(a, b, c);
+		length -= 3;
+		k += 3;
+	}
+
+	/* Handle the last 3 uint32_t's: all the case statements fall through */
+	switch (length) {
+	case 3: c += k[2];
+	case 2: b += k[1];
+	case 1: a += k[0];
+		__jhash_final(a, b, c);
+	case 0:	/* Nothing left to add */
+		break;
+	}
+
+	return c;
+}
+
+/* __jhash_nwords - hash exactly 3, 2 or 1 word(s) */
+static inline uint32_t __jhash_nwords(uint32_t a, uint32_t b, uint32_t c,
+                                      uint32_t initval)
+{
+	a += initval;
+	b += initval;
+	c += initval;
+
+	__jhash_final(a, b, c);
+
+	return c;
+}
+
+static inline uint32_t jhash_3words(uint32_t a, uint32_t b, uint32_t c,
+                                    uint32_t initval)
+{
+	return __jhash_nwords(a, b, c, initval + JHASH_INITVAL + (3 << 2));
+}
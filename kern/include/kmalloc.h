@@ -10,10 +10,20 @@
 #include <ros/common.h>
 #include <kref.h>
 
-#define NUM_KMALLOC_CACHES 6
+/* Size classes: multiples of KMALLOC_ALIGNMENT up to KMALLOC_LINEAR_MAX, then
+ * KMALLOC_CLASSES_PER_PWR2 classes per doubling up to KMALLOC_LARGEST.  Bigger
+ * requests get whole pages.  There is no in-band header, so power-of-two and
+ * page-sized requests fit exactly. */
 #define KMALLOC_ALIGNMENT 16
-#define KMALLOC_SMALLEST (sizeof(struct kmalloc_tag) << 1)
-#define KMALLOC_LARGEST KMALLOC_SMALLEST << NUM_KMALLOC_CACHES
+#define KMALLOC_SMALLEST KMALLOC_ALIGNMENT
+#define KMALLOC_LINEAR_SHIFT 7
+#define KMALLOC_LINEAR_MAX (1 << KMALLOC_LINEAR_SHIFT)
+#define KMALLOC_NR_LINEAR (KMALLOC_LINEAR_MAX / KMALLOC_ALIGNMENT)
+#define KMALLOC_CLASSES_PER_PWR2 4
+#define KMALLOC_LARGEST_SHIFT 14
+#define KMALLOC_LARGEST (1 << KMALLOC_LARGEST_SHIFT)
+#define NUM_KMALLOC_CACHES (KMALLOC_NR_LINEAR + KMALLOC_CLASSES_PER_PWR2 * \
+                            (KMALLOC_LARGEST_SHIFT - KMALLOC_LINEAR_SHIFT))
 
 void kmalloc_init(void);
 void *kmalloc(size_t size, int flags);
@@ -25,6 +35,7 @@ void *krealloc(void *buf, size_t size, int flags);
 void *kreallocarray(void *buf, size_t nmemb, size_t size, int flags);
 int kmalloc_refcnt(void *buf);
 void kmalloc_incref(void *buf);
+size_t kmalloc_size(void *buf);
 void kfree(void *buf);
 void kmalloc_canary_check(char *str);
 void *debug_canary;
@@ -34,32 +45,10 @@ void *debug_canary;
 #define MEM_ERROR		(1 << 3)
 #define MEM_FLAGS (MEM_ATOMIC | MEM_WAIT | MEM_ERROR)
 
-/* Kmalloc tag flags looks like this:
- *
- * +--------------28---------------+-----4------+
- * |       Flag specific data      |    Flags   |
- * +-------------------------------+------------+
- */
-#define KMALLOC_TAG_CACHE	1 /* memory came from slabs */
-#define KMALLOC_TAG_PAGES	2 /* memory came from page allocator */
-#define KMALLOC_TAG_UNALIGN	3 /* not a real tag, jump back by offset */
-#define KMALLOC_ALIGN_SHIFT	4 /* max flag is 16 */
-#define KMALLOC_FLAG_MASK	((1 << KMALLOC_ALIGN_SHIFT) - 1)
-
-#define KMALLOC_CANARY 0xdeadbabe
-
-/* The kmalloc align/free paths require that flags is at the end of this
- * struct, and that it is not padded. */
-struct kmalloc_tag {
-	union {
-		struct kmem_cache *my_cache;
-		size_t amt_alloc;
-		uint64_t unused_force_align;
-	};
-	struct kref kref;
-	uint32_t canary;
-	int flags;
-};
+/* kmalloc keeps no header in the buffer.  The struct page of an object's
+ * memory says where it came from: pg_private is either the owning kmalloc
+ * cache, or for page allocations, the size with KMALLOC_TAG_PAGES set. */
+#define KMALLOC_TAG_PAGES	1
 
 /* This is aligned so that the buf is aligned to the usual kmalloc alignment. */
 struct sized_alloc {
@@ -71,3 +60,9 @@ struct sized_alloc {
 /* Allocate a sized_alloc, big enough to hold size bytes.  Free with kfree. */
 struct sized_alloc *sized_kzmalloc(size_t size, int flags);
 void sza_printf(struct sized_alloc *sza, const char *fmt, ...);
+
+/* Records request sizes to measure fragmentation across the size classes */
+void kmalloc_trace_start(void);
+void kmalloc_trace_stop(void);
+void kmalloc_trace_reset(void);
+struct sized_alloc *kmalloc_trace_report(void);
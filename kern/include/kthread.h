@@ -45,6 +45,8 @@ struct kthread {
 	uintptr_t			stacktop;
 	struct proc			*proc;
 	struct syscall			*sysc;
+	struct syscall			*sysc_batch;	/* rest of the batch */
+	unsigned int			nr_sysc_batch;
 	struct errbuf			*errbuf;
 	TAILQ_ENTRY(kthread)		link;
 	/* ID, other shit, etc */
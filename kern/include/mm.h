@@ -14,6 +14,7 @@
 #include <slab.h>
 #include <kref.h>
 #include <rcu.h>
+#include <rbtree.h>
 
 struct chan;
 struct fd_table;
@@ -46,6 +47,9 @@ size_t foc_get_len(struct file_or_chan *foc);
  * VMRs. */
 struct vm_region {
 	TAILQ_ENTRY(vm_region)		vm_link;
+	struct rb_node			vm_rb;
+	uintptr_t			vm_gap;	/* free space below us */
+	uintptr_t			vm_gap_max; /* max vm_gap in subtree */
 	TAILQ_ENTRY(vm_region)		vm_pm_link;
 	struct proc			*vm_proc;
 	uintptr_t			vm_base;
@@ -70,6 +74,9 @@ static inline char *vmr_to_filename(struct vm_region *vmr)
 	return foc_to_name(vmr->__vm_foc);
 }
 
+/* If set, aligned anonymous memory is faulted in with jumbo pages. */
+extern bool mm_anon_jumbos;
+
 void vmr_init(void);
 void unmap_and_destroy_vmrs(struct proc *p);
 int duplicate_vmrs(struct proc *p, struct proc *new_p);
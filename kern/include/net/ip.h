@@ -29,13 +29,12 @@
 
 #pragma once
 #include <ns.h>
+#include <rcupdate.h>
 
 enum {
 	Addrlen = 64,
 	Maxproto = 20,
-	Nhash = 64,
 	Maxincall = 500,
-	Nchans = 256,
 	MAClen = 16,	/* longest mac address */
 
 	MAXTTL = 255,
@@ -131,7 +130,11 @@ struct conv {
 
 	struct route *r;	/* last route used */
 	uint32_t rgen;		/* routetable generation for *r */
+
+	TAILQ_ENTRY(conv) free_link;	/* on p->freeconvs */
+	bool free_queued;
 };
+TAILQ_HEAD(conv_tailq, conv);
 
 struct Ipifc;
 struct Fs;
@@ -266,7 +269,8 @@ struct Ipmulti {
  *  hash table for 2 ip addresses + 2 ports
  */
 enum {
-	Nipht = 521,		/* convenient prime */
+	Nipht = 256,		/* initial buckets, power of two */
+	Niphtmax = 1 << 20,	/* the table stops growing here */
 
 	IPmatchexact = 0,	/* match on 4 tuple */
 	IPmatchany,	/* *!* */
@@ -274,17 +278,38 @@ enum {
 	IPmatchaddr,	/* addr!* */
 	IPmatchpa,	/* addr!port */
 };
+/* Lookups are lock-free, under RCU.  Writers lock the bucket they change.
+ *
+ * When the table gets too full, a resizer (serialized by Ipht.resize) freezes
+ * it, builds a twice-as-large copy on the side with a fresh seed, and swaps it
+ * in.  Readers on the old table keep seeing complete chains; writers that find
+ * the table frozen wait for the resize and retry on the new one. */
 struct Iphash {
 	struct Iphash *next;
 	struct conv *c;
 	int match;
+	struct rcu_head rcu;
 };
 
-struct Iphash;
-struct Ipht {
+struct Iphbucket {
 	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	struct Iphash *head;
+};
+
+struct Iphtab {
+	uint32_t mask;
+	uint32_t seed;
+	bool frozen;
+	struct rcu_head rcu;
+	struct Iphbucket b[];
+};
+
+struct Ipht {
+	qlock_t resize;
+	atomic_t nents;
+	struct Iphtab *tab;
 };
+void iphtinit(struct Ipht *);
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
@@ -321,8 +346,12 @@ struct Proto {
 	struct Fs *f;		/* file system this proto is part of */
 	struct conv **conv;	/* array of conversations */
 	int ptclsize;		/* size of per protocol ctl block */
-	int nc;			/* number of conversations */
-	int ac;
+	int nc;			/* max number of conversations */
+	int ac;			/* conversations allocated, conv[0, ac) */
+	/* Released convs that can probably be reused.  Protected by freelock,
+	 * not qlock, since convs are released with only their own qlock. */
+	spinlock_t freelock;
+	struct conv_tailq freeconvs;
 	struct qid qid;		/* qid for protocol directory */
 	uint16_t nextport;
 	uint16_t nextrport;
@@ -399,13 +428,13 @@ int Fspcolstats(char *unused_char_p_t, int);
 int Fsproto(struct Fs *, struct Proto *);
 int Fsbuiltinproto(struct Fs *, uint8_t unused_uint8_t);
 struct conv *Fsprotoclone(struct Proto *, char *unused_char_p_t);
+void Fsreleaseconv(struct conv *);
 struct Proto *Fsrcvpcol(struct Fs *, uint8_t unused_uint8_t);
 struct Proto *Fsrcvpcolx(struct Fs *, uint8_t unused_uint8_t);
 void Fsstdconnect(struct conv *, char **, int);
 void Fsstdannounce(struct conv *, char **, int);
 void Fsstdbypass(struct conv *, char **, int);
 void Fsstdbind(struct conv *, char **, int);
-uint32_t scalednconv(void);
 void bypass_or_drop(struct conv *cv, struct block *bp);
 
 /*
@@ -658,6 +687,28 @@ extern void ipsendra6(struct Fs *f, int on);
 /*
  *  ip.c
  */
+
+/* Receive coalescing.  A medium that pulls frames off its device in batches
+ * runs each one through ipgro_input4() instead of ipiput4(), and calls
+ * ipgro_flush() at the end of the batch.  In-order TCP segments of the same
+ * flow are merged into one large segment, so TCP runs once per batch instead
+ * of once per frame.  The medium owns the struct; it isn't locked. */
+enum {
+	IPGRO_FLOWS = 8,	/* flows we hold segments for at once */
+	IPGRO_MAX_SEGS = 32,	/* segments merged into one */
+};
+
+struct ipgro {
+	struct block *held[IPGRO_FLOWS];
+	struct block *tail[IPGRO_FLOWS];	/* last block of held[i] */
+	unsigned int nr_segs[IPGRO_FLOWS];
+	unsigned int nr_held;
+};
+
+extern void ipgro_init(struct ipgro *g);
+extern void ipgro_input4(struct Fs *f, struct Ipifc *ifc, struct ipgro *g,
+			 struct block *bp);
+extern void ipgro_flush(struct Fs *f, struct Ipifc *ifc, struct ipgro *g);
 extern void iprouting(struct Fs *, int);
 extern void icmpnoconv(struct Fs *, struct block *);
 extern void icmpcantfrag(struct Fs *, struct block *, int);
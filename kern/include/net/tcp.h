@@ -29,6 +29,8 @@
 #pragma once
 
 #include <net/ip.h>
+#include <timer_wheel.h>
+#include <rbtree.h>
 
 enum {
 	QMAX = 64 * 1024 - 1,
@@ -92,6 +94,7 @@ enum {
 	FAST_RETRANS_RECOVERY = 2,
 	RTO_RETRANS_RECOVERY = 3,
 	CWIND_SCALE = 10,	/* initial CWIND will be MSS * this */
+	TCP_CC_PRIV_WORDS = 8,	/* uint64_ts of per-conv congestion state */
 
 	FORCE			= 1 << 0,
 	CLONE			= 1 << 1,
@@ -114,20 +117,38 @@ enum {
 	Time_wait,
 
 	Maxlimbo = 1000,/* maximum procs waiting for response to SYN ACK */
-	NLHT = 256,	/* hash table size, must be a power of 2 */
+	NLHT = 64,	/* hash table size, must be a power of 2 */
 	LHTMASK = NLHT - 1,
+	LIMBO_RXMAX = 5,	/* SYN ACK retransmits before we give up */
+	LIMBO_ATTACK = 100,	/* more than this in limbo, don't retransmit */
+
+	/* SYN cookies: the top bits of the cookie are a coarse clock, the
+	 * rest carry a MAC of the connection and the peer's MSS. */
+	SYNCOOKIE_BITS = 24,
+	SYNCOOKIE_MASK = (1 << SYNCOOKIE_BITS) - 1,
+	SYNCOOKIE_PERIOD = 64 * 1000,	/* ms per tick of the cookie clock */
+	SYNCOOKIE_MAXAGE = 2,	/* cookie clock ticks a cookie is good for */
 
 	HaveWS = 1 << 8,
 };
 
+/* TCP timers live on one of the per-core timing wheels in the tcppriv.  A
+ * conversation's timers always go on the same wheel, whose lock protects the
+ * timers' state.  The wheels tick once per MSPTICK. */
+typedef struct tcpwheel Tcpwheel;
+struct tcpwheel {
+	spinlock_t lock;
+	struct timer_wheel tw;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 typedef struct tcptimer Tcptimer;
 struct tcptimer {
-	Tcptimer *next;
-	Tcptimer *prev;
+	struct tw_timer tw;
+	Tcpwheel *wheel;
 	Tcptimer *readynext;
 	int state;
 	uint64_t start;
-	uint64_t count;
+	uint64_t count;		/* ticks left, as of the last halt or expiry */
 	void (*func) (void *);
 	void *arg;
 };
@@ -209,12 +230,13 @@ struct tcp {
 };
 
 /*
- *  this header is malloc'd to thread together fragments
- *  waiting to be coalesced
+ *  out-of-order segments waiting to be coalesced.  They are kept in an rbtree
+ *  sorted by seq, and back-to-back segments are merged into one, so the tree
+ *  is roughly one node per hole in the sequence space.
  */
 typedef struct reseq Reseq;
 struct reseq {
-	Reseq *next;
+	struct rb_node node;
 	Tcp seg;
 	struct block *bp;
 	uint16_t length;
@@ -224,6 +246,7 @@ struct reseq {
  *  the qlock in the Conv locks this structure
  */
 typedef struct tcpctl Tcpctl;
+struct tcp_cc_ops;
 struct tcpctl {
 	uint8_t state;		/* Connection state */
 	uint8_t type;		/* Listening or active connection */
@@ -260,6 +283,8 @@ struct tcpctl {
 	uint32_t cwind;		/* Congestion window */
 	int scale;		/* desired snd.scale */
 	uint32_t ssthresh;	/* Slow start threshold */
+	struct tcp_cc_ops *cc;	/* Congestion control algorithm */
+	uint64_t cc_priv[TCP_CC_PRIV_WORDS];	/* and its per-conv state */
 	int irs;		/* Initial received squence */
 	uint16_t mss;		/* Max segment size */
 	uint16_t typical_mss;	/* MSS for most packets (< MSS for some opts) */
@@ -268,7 +293,8 @@ struct tcpctl {
 	uint8_t backoff;	/* Exponential backoff counter */
 	int backedoff;		/* ms we've backed off for rexmits */
 	uint8_t flags;		/* State flags */
-	Reseq *reseq;		/* Resequencing queue */
+	struct rb_root reseq;	/* Resequencing queue */
+	uint32_t reseq_len;	/* bytes in reseq */
 	Tcptimer timer;		/* Activity timer */
 	Tcptimer acktimer;	/* Acknowledge timer */
 	Tcptimer rtt_timer;	/* Round trip timer */
@@ -292,21 +318,53 @@ struct tcpctl {
 	} protohdr;		/* prototype header */
 };
 
+/* Congestion control.  Each conversation picks an algorithm with the "cong"
+ * ctl message; accepted calls inherit the listener's.  The algorithm owns cwind
+ * and ssthresh:
+ * - init: (re)starts the algorithm on tcb, e.g. at connect time or when the
+ *   algorithm is changed.
+ * - on_ack: 'acked' new bytes were acked outside of loss recovery.  The caller
+ *   clamps cwind to the send window afterwards.
+ * - on_loss: a loss was detected by dupacks or SACKs.
+ * - on_rto: the retransmit timer fired.
+ * All are called with the conv qlocked, and may use tcb->cc_priv as they
+ * please. */
+struct tcp_cc_ops {
+	char *name;
+	void (*init)(Tcpctl *tcb);
+	void (*on_ack)(Tcpctl *tcb, uint32_t acked);
+	void (*on_loss)(Tcpctl *tcb);
+	void (*on_rto)(Tcpctl *tcb);
+};
+
+extern struct tcp_cc_ops tcp_reno_ops;
+extern struct tcp_cc_ops tcp_cubic_ops;
+extern struct tcp_cc_ops tcp_vegas_ops;
+
+struct tcp_cc_ops *tcp_cc_lookup(const char *name);
+
 /* New calls are put in limbo rather than having a conversation structure
  *  allocated.  Thus, a SYN attack results in lots of limbo'd calls but not any
  *  real Conv structures mucking things up.  Calls in limbo rexmit their SYN ACK
- *  every SYNACK_RXTIMER ms up to 4 times, i.e., they disappear after 1 second.
+ *  with a linear backoff of SYNACK_RXTIMER ms, up to LIMBO_RXMAX times.
  *
  *  In particular they aren't on a listener's queue so that they don't figure in
  *  the input queue limit.
  *
- *  If 1/2 of a T3 was attacking SYN packets, we'ld have a permanent queue of
- *  70000 limbo'd calls.  Not great for a linear list but doable.  Therefore
- *  there is no hashing of this list.
+ *  Once Maxlimbo calls are waiting, we stop keeping state for new ones and
+ *  answer with SYN cookies instead: the ISS of the SYN ACK encodes the call,
+ *  and the final ACK of the handshake brings it back.
+ *
+ *  Limbo is hashed into NLHT buckets.  Each has its own lock and a timer wheel
+ *  for the retransmits of its calls, so neither lookups nor retransmits need the
+ *  protocol lock, and each tick only touches the calls that are due.
  */
 typedef struct limbo Limbo;
+BSD_LIST_HEAD(limbo_list, limbo);
 struct limbo {
-	Limbo *next;
+	BSD_LIST_ENTRY(limbo) link;
+	struct tw_timer tw;		/* next retransmit */
+	Limbo *duenext;			/* chain of calls due this tick */
 
 	uint8_t laddr[IPaddrlen];
 	uint8_t raddr[IPaddrlen];
@@ -325,6 +383,13 @@ struct limbo {
 	struct Ipifc *ifc;		/* Uncounted ref */
 };
 
+typedef struct limbobucket Limbobucket;
+struct limbobucket {
+	qlock_t lock;
+	struct limbo_list calls;
+	struct timer_wheel tw;		/* in MSPTICKs since boot */
+};
+
 enum {
 	/* MIB stats */
 	MaxConn,
@@ -344,22 +409,35 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	CurrLimbo,
+	LimboTimeouts,
+	SynCookiesSent,
+	SynCookiesRecv,
+	SynCookiesFailed,
 
 	Nstats
 };
 
 typedef struct tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
-	qlock_t tl;
-	Tcptimer *timers;
+	/* Timing wheels for active timers, one per core */
+	Tcpwheel *wheels;
+	int nr_wheels;
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
 
 	/* calls in limbo waiting for an ACK to our SYN ACK */
-	int nlimbo;
-	Limbo *lht[NLHT];
+	atomic_t nlimbo;
+	uint32_t limbo_seed;
+	Limbobucket lht[NLHT];
+
+	/* keys for SYN cookies, and when we last handed one out */
+	uint32_t cookie_secret[2];
+	uint64_t last_cookie;
+
+	/* congestion control for convs that don't pick one */
+	struct tcp_cc_ops *cc_default;
 
 	/* for keeping track of tcpackproc */
 	qlock_t apl;
@@ -419,11 +419,15 @@ enum {
 #define BLOCK_TRANS_TX_CSUM (Budpck | Btcpck)
 #define BLOCK_RX_CSUM (Bipck | Budpck | Btcpck)
 
+/* extra_bdata flags */
+#define EBD_PM_PAGE		(1 << 0)	/* pinned page cache page */
+
 struct extra_bdata {
 	uintptr_t base;
 	/* using u32s for packing reasons.  this means no extras > 4GB */
 	uint32_t off;
 	uint32_t len;
+	uint32_t flags;
 };
 
 struct block {
@@ -448,6 +452,20 @@ struct block {
 #define BHLEN(s) ((s)->wp - (s)->rp)
 #define BALLOC(s) ((s)->lim - (s)->base + (s)->extra_len)
 
+/* Per-open-file readahead state, for files with a page cache.  Reads on a chan
+ * update it without a lock; it's just a hint.  See fs_file_readahead(). */
+struct file_ra {
+	unsigned long next_idx;	/* page after the last read */
+	unsigned long ra_idx;	/* first page we haven't prefetched */
+	unsigned long win;	/* pages to prefetch ahead of the reader */
+	unsigned long max_win;	/* 0 means no readahead */
+	unsigned long nr_seq_reads;
+	unsigned long nr_rand_reads;
+	unsigned long nr_ra_pgs;
+};
+
+extern unsigned long file_ra_default_pgs;
+
 struct chan {
 	spinlock_t lock;
 	struct kref ref;
@@ -488,6 +506,7 @@ struct chan {
 	 * the user can read from (including offsets) while the underlying file
 	 * changes.  Hang that buffer here. */
 	void *synth_buf;
+	struct file_ra ra;
 };
 
 extern struct chan *kern_slash;
@@ -768,9 +787,11 @@ void addprog(struct proc *);
 void addrootfile(char *unused_char_p_t, uint8_t * unused_uint8_p_t, uint32_t);
 struct block *adjustblock(struct block *, int);
 struct block *block_alloc(size_t, int);
+void extra_bdata_incref(struct extra_bdata *ebd);
+void extra_bdata_decref(struct extra_bdata *ebd);
 int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags);
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
-                       uint32_t len, int mem_flags);
+                       uint32_t len, uint32_t ebd_flags, int mem_flags);
 void block_copy_metadata(struct block *new_b, struct block *old_b);
 void block_reset_metadata(struct block *b);
 int anyhigher(void);
@@ -1098,6 +1119,7 @@ int sysstat(char *path, uint8_t*, int n);
 int syslstat(char *path, uint8_t*, int n);
 int sysstatakaros(char *path, struct kstat *, int flags);
 long syswrite(int fd, void *va, long n);
+long syssendfile(int out_fd, int in_fd, int64_t *offp, long n);
 long syspwrite(int fd, void *va, long n, int64_t off);
 int syswstat(char *path, uint8_t * buf, int n);
 struct dir *chandirstat(struct chan *c);
@@ -32,6 +32,8 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_KMREFS		0x040	/* kmalloc objects here have extra refs */
+#define PG_JUMBO		0x080	/* part of a user jumbo page */
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -41,7 +43,14 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 struct page {
 	BSD_LIST_ENTRY(page)		pg_link;
 	atomic_t			pg_flags;
-	struct page_map			*pg_mapping;	/* for debugging... */
+	atomic_t			pg_pins;	/* see pm_pin_page, upage_incref */
+	struct page_map			*pg_mapping;	/* PM pages only */
+	/* For page map pages, pg_index is the file index.  For kernel pages
+	 * owned by a slab or by a large kmalloc, pg_private is the kmem_cache
+	 * or kmalloc's size tag, and pg_index is the page's byte offset into
+	 * the slab's import / the allocation.  For user jumbo pages, pg_index
+	 * is the offset into the jumbo, and the first page's pg_private is an
+	 * atomic count of the pages still in use. */
 	unsigned long			pg_index;
 	void				**pg_tree_slot;
 	void				*pg_private;
@@ -49,16 +58,47 @@ struct page {
 	uint64_t			gpa;	/* physical address in guest */
 
 	bool				pg_is_free;	/* TODO: will remove */
+	uint8_t				pg_node;	/* NUMA node of the memory */
 };
 
+/* Each NUMA node gets its own base arena and kpages arena.  Node 0 uses the
+ * original base_arena and kpages_arena, and it owns any memory we don't
+ * attribute to another node. */
+#define MAX_NUMA_NODES		8
+
+extern struct arena *base_arenas[MAX_NUMA_NODES];
+extern struct arena *kpages_arenas[MAX_NUMA_NODES];
+extern int nr_mem_nodes;
+
 /******** Externally visible global variables ************/
 extern spinlock_t page_list_lock;
 extern page_list_t page_free_list;
 
 /*************** Functional Interface *******************/
 void base_arena_init(struct multiboot_info *mbi);
+void numa_mem_init(void);
+void mem_node_add(int node, void *base, size_t size);
+int local_mem_node(void);
 
 error_t upage_alloc(struct proc *p, page_t **page, bool zero);
+void upage_incref(struct page *page);
+void upage_decref(struct page *page);
+
+/* User jumbo pages are one PML2 PTE's worth of 4K pages, each refcounted like
+ * a regular upage.  A jumbo PTE holds a ref on all of them, and splitting it
+ * hands one ref to each 4K PTE.  The memory goes back when the last page does.
+ * These take the first page of the jumbo. */
+#define UJUMBO_SIZE		PML2_PTE_REACH
+#define UJUMBO_NR_PGS		(UJUMBO_SIZE >> PGSHIFT)
+
+error_t upage_alloc_jumbo(struct proc *p, struct page **page, bool zero);
+void upage_incref_jumbo(struct page *page);
+void upage_decref_jumbo(struct page *page);
+bool upage_jumbo_is_shared(struct page *page);
+
+void jumbo_arena_init(void);
+void *jumbo_page_alloc(size_t nr, int flags);
+void jumbo_page_free(void *buf, size_t nr);
 error_t kpage_alloc(page_t **page);
 void *kpage_alloc_addr(void);
 void *kpage_zalloc_addr(void);
@@ -68,8 +108,11 @@ void *kpage_zalloc_addr(void);
 void *kpages_alloc(size_t size, int flags);
 void *kpages_zalloc(size_t size, int flags);
 void kpages_free(void *addr, size_t size);
+void *kpages_alloc_node(size_t size, int flags, int node);
+void *kpages_zalloc_node(size_t size, int flags, int node);
 
 void *get_cont_pages(size_t order, int flags);
+void *get_cont_pages_node(size_t order, int flags, int node);
 void free_cont_pages(void *buf, size_t order);
 
 void page_decref(page_t *page);
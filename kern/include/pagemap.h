@@ -29,6 +29,9 @@ struct page_map {
 	struct page_map_operations	*pm_op;
 	spinlock_t			pm_lock;	/* for the VMR list */
 	struct vmr_tailq		pm_vmrs;
+	atomic_t			pm_nr_dirty;	/* dirty pages */
+	unsigned long			pm_nr_written;	/* pages written back */
+	unsigned long			pm_nr_wb_ops;	/* writepage(s) calls */
 };
 
 /* Operations performed on a page_map.  These are usually FS specific, which
@@ -37,9 +40,12 @@ struct page_map {
 struct page_map_operations {
 	int (*readpage) (struct page_map *, struct page *);
 	int (*writepage) (struct page_map *, struct page *);
+	/* Optional: writes pages with consecutive indexes in one op.  Only PMs
+	 * with writepages count toward the dirty limits; we take it to mean the
+	 * PM has a backing store worth writing to. */
+	int (*writepages) (struct page_map *, struct page **, unsigned long);
 /*	readpages: read a list of pages
 	writepage: write from a page to its backing store
-	writepages: write a list of pages
 	sync_page: start the IO of already scheduled ops
 	set_page_dirty: mark the given page dirty
 	prepare_write: prepare to write (disk backed pages)
@@ -50,12 +56,35 @@ struct page_map_operations {
 	direct_io: bypass the page cache */
 };
 
+/* Filesystems with a backing store register with the writeback ktask, which
+ * periodically (or when there are too many dirty pages) calls writeback() to
+ * write back their dirty files.  Unregistering waits for any writeback in
+ * progress. */
+struct pm_wb_client {
+	void (*writeback)(struct pm_wb_client *wbc);
+	TAILQ_ENTRY(pm_wb_client)	link;
+};
+
+extern unsigned long pm_wb_period_usec;
+extern unsigned int pm_dirty_background_pct;
+extern unsigned int pm_dirty_throttle_pct;
+extern unsigned long pm_dirty_throttle_usec;
+
+void pm_wb_register(struct pm_wb_client *wbc);
+void pm_wb_unregister(struct pm_wb_client *wbc);
+void pm_page_set_dirty(struct page *page);
+void pm_dirty_throttle(struct page_map *pm);
+
 /* Page cache functions */
 void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
+struct page *pm_start_load_page(struct page_map *pm, unsigned long index);
+void pm_finish_load_page(struct page_map *pm, struct page *page);
 void pm_put_page(struct page *page);
+void pm_pin_page(struct page *page);
+void pm_unpin_page(struct page *page);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_or_zero_pages(struct page_map *pm, unsigned long start_idx,
@@ -169,7 +169,35 @@ uintptr_t switch_to(struct proc *new_p);
 void switch_back(struct proc *new_p, uintptr_t old_ret);
 bool abandon_core(void);
 void clear_owning_proc(uint32_t coreid);
+/* If set, cores owned by MCPs get no alarm interrupts; their alarms run on core
+ * 0 instead. */
+extern bool nohz_mcp_cores;
+void __load_addr_space(struct proc *old_p, struct proc *new_p);
+
+/* TLB shootdowns.  Ranges larger than tlb_shootdown_max_pages get a full flush.
+ *
+ * Idle cores are TLB_LAZY: instead of an IPI, they get TLB_LAZY_FLUSH and flush
+ * when they wake up, before they can touch user memory. */
+#define TLB_LAZY			(1 << 0)
+#define TLB_LAZY_FLUSH			(1 << 1)
+
+extern unsigned long tlb_shootdown_max_pages;
+
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end);
+void tlb_lazy_enter(void);
+void tlb_lazy_exit(void);
+
+/* Gathers the ranges of several PTE changes in one address space, so they can
+ * share a single shootdown. */
+struct tlb_batch {
+	struct proc			*p;
+	uintptr_t			start;
+	uintptr_t			end;
+};
+
+void tlb_batch_init(struct tlb_batch *tb, struct proc *p);
+void tlb_batch_add(struct tlb_batch *tb, uintptr_t start, uintptr_t end);
+void tlb_batch_flush(struct tlb_batch *tb);
 
 /* Kernel message handlers for process management */
 void __startcore(uint32_t srcid, long a0, long a1, long a2);
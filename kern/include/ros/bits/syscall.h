@@ -73,6 +73,7 @@
 #define SYS_fchdir		124
 #define SYS_dup_fds_to		125
 #define SYS_tap_fds		126
+#define SYS_sendfile		127
 
 /* Misc syscalls */
 /* was #define SYS_gettimeofday	140 */
@@ -81,6 +81,18 @@ struct kstat {
 #define CCTL_SET_FL		(F_CHANCTL_BASE + 0)
 #define CCTL_SYNC		(F_CHANCTL_BASE + 1)
 #define CCTL_DEBUG		(F_CHANCTL_BASE + 2)
+#define CCTL_SET_RA		(F_CHANCTL_BASE + 3)
+#define CCTL_GET_RA_STATS	(F_CHANCTL_BASE + 4)
+
+/* For CCTL_GET_RA_STATS: readahead on an open file, for files with a page
+ * cache.  CCTL_SET_RA sets max_win, in pages; 0 turns readahead off. */
+struct file_ra_stats {
+	unsigned long		max_win;	/* pages */
+	unsigned long		win;		/* current window, pages */
+	unsigned long		nr_seq_reads;
+	unsigned long		nr_rand_reads;
+	unsigned long		nr_ra_pgs;	/* pages we prefetched */
+};
 
 /* For F_[GET|SET]FD */
 #define FD_CLOEXEC		1
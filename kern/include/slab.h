@@ -74,6 +74,9 @@ struct kmem_depot {
 	unsigned int			nr_not_empty;
 	unsigned int			busy_count;
 	uint64_t			busy_start;
+	/* Working set: the fewest mags on each list since the last reap */
+	unsigned int			min_empty;
+	unsigned int			min_not_empty;
 };
 
 struct kmem_slab;
@@ -135,6 +138,9 @@ struct kmem_cache {
 	void *priv;
 	unsigned long nr_cur_alloc;
 	unsigned long nr_direct_allocs_ever;
+	unsigned long nr_empty_slabs;
+	unsigned long min_empty_slabs;	/* working set, like the depot's */
+	size_t nr_reaped_bytes;
 	struct hash_helper hh;
 	struct kmem_bufctl_list *alloc_hash;
 	struct kmem_bufctl_list static_hash[HASH_INIT_SZ];
@@ -158,7 +164,8 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
 /* Back end: internal functions */
 void kmem_cache_init(void);
-void kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_reap_all(void);
 unsigned int kmc_nr_pcpu_caches(void);
 /* Low-level interface for initializing a cache. */
 void __kmem_cache_create(struct kmem_cache *kc, const char *name,
@@ -60,16 +60,17 @@ struct per_cpu_info {
 	int cpu_state;
 	uint64_t last_tick_cnt;
 	uint64_t state_ticks[NR_CPU_STATES];
+	int numa_node;			/* for local_mem_node() */
+	atomic_t tlb_lazy;		/* TLB_LAZY flags, for shootdowns */
 	/* TODO: 64b (not sure if we'll need these at all */
 #ifdef CONFIG_X86
 	taskstate_t *tss;
 	segdesc_t *gdt;
 #endif
 	/* KMSGs */
-	spinlock_t immed_amsg_lock;
-	struct kernel_msg_list immed_amsgs;
-	spinlock_t routine_amsg_lock;
-	struct kernel_msg_list routine_amsgs;
+	struct kmsg_ring *immed_kmsgs;
+	struct kmsg_ring *routine_kmsgs;
+	bool kmsg_polling;		/* senders can skip RKM IPIs */
 	/* profiling -- opaque to all but the profiling code. */
 	void *profiling;
 }__attribute__((aligned(ARCH_CL_SIZE)));
@@ -70,6 +70,7 @@ extern const int max_syscall;
 /* Syscall invocation */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_calls);
 void run_local_syscall(struct syscall *sysc);
+void __hand_off_sysc_batch(struct kthread *kth);
 intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
                  uintreg_t a2, uintreg_t a3, uintreg_t a4, uintreg_t a5);
 void set_errno(int errno);
@@ -0,0 +1,80 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * Hierarchical timing wheels (Varghese and Lauck), in the cascading style.
+ *
+ * A timer wheel tracks timers in units of abstract 'ticks'.  The owner decides
+ * what a tick means (e.g. TCP uses MSPTICK) and drives the wheel forward with
+ * timer_wheel_advance().  Arming and cancelling a timer are O(1), and advancing
+ * the wheel only touches the slots that are due, plus an occasional cascade of
+ * one slot from a higher level down to the level below it.
+ *
+ * There are TW_NR_LVLS levels of TW_LVL_SIZE slots each.  Level 0 has a
+ * granularity of one tick, level 1 of TW_LVL_SIZE ticks, etc.  Timers that are
+ * further out than the wheel covers are parked in the last level and get
+ * re-placed each time their slot cascades, so there is no limit on how far out
+ * a timer can be.
+ *
+ * The wheel has no lock of its own: the owner provides synchronization.
+ * Expired timers are handed to a callback, one at a time, while the owner's
+ * lock is still held.  The timer is already off the wheel at that point, so the
+ * callback can rearm it, but it should not do much more than mark the timer and
+ * chain it somewhere for processing after the owner drops its lock. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <sys/queue.h>
+
+#define TW_LVL_BITS		6
+#define TW_LVL_SIZE		(1 << TW_LVL_BITS)
+#define TW_LVL_MASK		(TW_LVL_SIZE - 1)
+#define TW_NR_LVLS		4
+/* Ticks covered by the wheel.  Farther-out timers cascade more than once. */
+#define TW_MAX_DELTA		((1ULL << (TW_LVL_BITS * TW_NR_LVLS)) - 1)
+
+struct tw_timer {
+	BSD_LIST_ENTRY(tw_timer)	link;
+	uint64_t			expire;
+	bool				pending;
+};
+BSD_LIST_HEAD(tw_timer_list, tw_timer);
+
+struct timer_wheel {
+	uint64_t			now;
+	size_t				nr_pending;
+	struct tw_timer_list		slots[TW_NR_LVLS][TW_LVL_SIZE];
+};
+
+typedef void (*tw_expire_fn)(struct tw_timer *t, void *arg);
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now);
+void timer_wheel_add(struct timer_wheel *tw, struct tw_timer *t,
+                     uint64_t expire);
+void timer_wheel_del(struct timer_wheel *tw, struct tw_timer *t);
+void timer_wheel_advance(struct timer_wheel *tw, uint64_t now,
+                         tw_expire_fn fn, void *arg);
+
+static inline void tw_timer_init(struct tw_timer *t)
+{
+	t->expire = 0;
+	t->pending = FALSE;
+}
+
+static inline bool tw_timer_pending(struct tw_timer *t)
+{
+	return t->pending;
+}
+
+/* Ticks until t expires, 0 if it is not pending.  Racy without the owner's
+ * lock, but it never returns garbage for a pending timer. */
+static inline uint64_t tw_timer_remaining(struct timer_wheel *tw,
+                                          struct tw_timer *t)
+{
+	uint64_t expire = READ_ONCE(t->expire);
+	uint64_t now = READ_ONCE(tw->now);
+
+	if (!READ_ONCE(t->pending) || expire <= now)
+		return 0;
+	return expire - now;
+}
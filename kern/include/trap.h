@@ -9,6 +9,7 @@
 #include <arch/mmu.h>
 #include <sys/queue.h>
 #include <arch/trap.h>
+#include <atomic.h>
 
 // func ptr for interrupt service routines
 typedef void (*isr_t)(struct hw_trapframe *hw_tf, void *data);
@@ -111,14 +112,55 @@ struct kernel_message
 STAILQ_HEAD(kernel_msg_list, kernel_message);
 typedef struct kernel_message kernel_message_t;
 
+/* Each core has one ring per message type.  Any core can send (multiple
+ * producers), and only the owning core receives (single consumer).  Senders
+ * claim a slot by CASing prod, copy the message in, then publish it by setting
+ * the slot's seq.  The receiver only spins on a claimed slot for the length of
+ * that copy, since senders keep IRQs off in between.
+ *
+ * If the ring fills, messages spill into the overflow list: the old kmem_cache
+ * and spinlock scheme.  While anything is in the overflow, all senders use it,
+ * so that messages from any one core arrive in the order they were sent. */
+#define KMSG_RING_SZ			64
+
+struct kmsg_slot {
+	unsigned long			seq;
+	struct kernel_message		msg;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct kmsg_ring {
+	atomic_t			prod __attribute__((aligned(ARCH_CL_SIZE)));
+	unsigned long			cons __attribute__((aligned(ARCH_CL_SIZE)));
+	spinlock_t			overflow_lock;
+	struct kernel_msg_list		overflow;
+	unsigned long			nr_overflowed;
+	struct kmsg_slot		slots[KMSG_RING_SZ];
+};
+
+/* Lockless peek, only reliable on the ring's own core. */
+static inline bool kmsg_ring_empty(struct kmsg_ring *ring)
+{
+	return ring->cons == atomic_read(&ring->prod) &&
+	       STAILQ_EMPTY(&ring->overflow);
+}
+
+struct core_set;
+struct per_cpu_info;
+
 void kernel_msg_init(void);
+void kmsg_percpu_init(struct per_cpu_info *pcpui);
 uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
                              long arg2, int type);
+void send_kernel_message_cset(const struct core_set *cset, amr_t pc, long arg0,
+                              long arg1, long arg2, int type);
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data);
 bool has_routine_kmsg(void);
 void process_routine_kmsg(void);
+bool kmsg_idle_poll(void);
 void print_kmsgs(uint32_t coreid);
 
+extern unsigned long kmsg_idle_poll_usec;
+
 /* Runs a function with up to two arguments as a routine kernel message.  Kernel
  * messages can have three arguments, but the deferred function pointer counts
  * as one.  Note the arguments to the function will be treated as longs. */
@@ -7,11 +7,13 @@
  * per-core, global or whatever.  Like with most systems, you won't wake up til
  * after the time you specify. (for now, this might change).
  *
+ * Alarms with slack are coalesced: the tchain interrupt is set for the earliest
+ * deadline (wake_up_time + slack), and when it goes off, it runs everyone whose
+ * wake_up_time has passed.
+ *
  * TODO:
  * - have a kernel sense of time, instead of just the TSC or whatever timer the
- *   chain uses...
- * - coalesce or otherwise deal with alarms that are close to cut down on
- *   interrupt overhead. */
+ *   chain uses... */
 
 #include <ros/common.h>
 #include <sys/queue.h>
@@ -21,20 +23,115 @@
 #include <smp.h>
 #include <kmalloc.h>
 
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
-static void reset_tchain_times(struct timer_chain *tchain)
+unsigned long alarm_slack_usec = 50;
+
+/* Pairing heap helpers.  Callers hold the tchain lock.
+ *
+ * Melds two heaps, returning the new root.  The loser becomes the leftmost
+ * child of the winner.  The root's sibling links are left for the caller. */
+static struct alarm_waiter *__ph_meld(struct alarm_waiter *a,
+                                      struct alarm_waiter *b)
 {
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = ALARM_POISON_TIME;
-		tchain->latest_time = ALARM_POISON_TIME;
+	struct alarm_waiter *temp;
+
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (b->deadline < a->deadline) {
+		temp = a;
+		a = b;
+		b = temp;
+	}
+	b->ph_prev = a;
+	b->ph_next = a->ph_child;
+	if (a->ph_child)
+		a->ph_child->ph_prev = b;
+	a->ph_child = b;
+	return a;
+}
+
+/* Melds a list of siblings into one heap, using the standard two passes: pair
+ * them up left to right, then meld the pairs right to left.  The first pass
+ * leaves the pairs on a stack, linked through ph_next. */
+static struct alarm_waiter *__ph_merge_pairs(struct alarm_waiter *first)
+{
+	struct alarm_waiter *a, *b, *next, *stack = NULL, *ret = NULL;
+
+	while (first) {
+		a = first;
+		b = a->ph_next;
+		next = b ? b->ph_next : NULL;
+		a = __ph_meld(a, b);
+		a->ph_next = stack;
+		stack = a;
+		first = next;
+	}
+	while (stack) {
+		next = stack->ph_next;
+		ret = __ph_meld(ret, stack);
+		stack = next;
+	}
+	if (ret) {
+		ret->ph_next = NULL;
+		ret->ph_prev = NULL;
+	}
+	return ret;
+}
+
+static void __ph_insert(struct timer_chain *tchain, struct alarm_waiter *waiter)
+{
+	waiter->ph_child = NULL;
+	waiter->ph_next = NULL;
+	waiter->ph_prev = NULL;
+	tchain->heap = __ph_meld(tchain->heap, waiter);
+	tchain->nr_waiters++;
+}
+
+static void __ph_remove(struct timer_chain *tchain, struct alarm_waiter *waiter)
+{
+	struct alarm_waiter *sub;
+
+	sub = __ph_merge_pairs(waiter->ph_child);
+	if (waiter == tchain->heap) {
+		tchain->heap = sub;
 	} else {
-		tchain->earliest_time =
-		    TAILQ_FIRST(&tchain->waiters)->wake_up_time;
-		tchain->latest_time =
-		    TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
+		if (waiter->ph_prev->ph_child == waiter)
+			waiter->ph_prev->ph_child = waiter->ph_next;
+		else
+			waiter->ph_prev->ph_next = waiter->ph_next;
+		if (waiter->ph_next)
+			waiter->ph_next->ph_prev = waiter->ph_prev;
+		tchain->heap = __ph_meld(tchain->heap, sub);
+	}
+	tchain->nr_waiters--;
+}
+
+/* Pre-order walk of the heap, for debugging.  Not sorted. */
+static struct alarm_waiter *__ph_walk_next(struct alarm_waiter *waiter)
+{
+	if (waiter->ph_child)
+		return waiter->ph_child;
+	while (waiter) {
+		if (waiter->ph_next)
+			return waiter->ph_next;
+		/* Find our parent: the prev of our leftmost sibling */
+		while (waiter->ph_prev && waiter->ph_prev->ph_child != waiter)
+			waiter = waiter->ph_prev;
+		waiter = waiter->ph_prev;
 	}
+	return NULL;
+}
+
+/* Helper, resets the earliest time, based on the top of the heap.  If the heap
+ * is empty, we set the time to be the 12345 poison time.  Since the heap is
+ * empty, the alarm shouldn't be going off. */
+static void reset_tchain_times(struct timer_chain *tchain)
+{
+	if (!tchain->heap)
+		tchain->earliest_time = ALARM_POISON_TIME;
+	else
+		tchain->earliest_time = tchain->heap->deadline;
 }
 
 /* One time set up of a tchain, currently called in per_cpu_init() */
@@ -42,7 +139,10 @@ void init_timer_chain(struct timer_chain *tchain,
                       void (*set_interrupt)(struct timer_chain *))
 {
 	spinlock_init_irqsave(&tchain->lock);
-	TAILQ_INIT(&tchain->waiters);
+	tchain->heap = NULL;
+	tchain->nr_waiters = 0;
+	tchain->running = NULL;
+	tchain->redirect = NULL;
 	tchain->set_interrupt = set_interrupt;
 	reset_tchain_times(tchain);
 	cv_init_irqsave_with_lock(&tchain->cv, &tchain->lock);
@@ -54,6 +154,8 @@ void init_awaiter(struct alarm_waiter *waiter,
 	assert(func);
 	waiter->func = func;
 	waiter->wake_up_time = ALARM_POISON_TIME;
+	waiter->slack = 0;
+	waiter->tchain = NULL;
 	waiter->on_tchain = false;
 }
 
@@ -87,12 +189,19 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 	waiter->wake_up_time += usec2tsc(usleep);
 }
 
+/* The alarm may go off up to usec after its wake up time.  This sticks across
+ * set_alarm() calls. */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec)
+{
+	waiter->slack = usec2tsc(usec);
+}
+
 /* Helper, makes sure the interrupt is turned on at the right time.  Most of the
  * heavy lifting is in the timer-source specific function pointer. */
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
 	assert(!irq_is_enabled());
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (!tchain->heap) {
 		/* Turn it off */
 		printd("Turning alarm off\n");
 		tchain->set_interrupt(tchain);
@@ -119,17 +228,17 @@ static void __run_tchain(uint32_t srcid, long a0, long a1, long a2)
 		spin_unlock_irqsave(&tchain->lock);
 		return;
 	}
-	while ((i = TAILQ_FIRST(&tchain->waiters))) {
-		/* TODO: Could also do something in cases where it's close to
-		 * expiring. */
+	while ((i = tchain->heap)) {
+		/* The top has the earliest deadline, not necessarily the
+		 * earliest wake_up_time.  Waiters below it that are ready will
+		 * run by their deadlines, no later than the top's. */
 		if (i->wake_up_time > read_tsc())
 			break;
-		TAILQ_REMOVE(&tchain->waiters, i, next);
+		__ph_remove(tchain, i);
 		i->on_tchain = false;
 		tchain->running = i;
 
-		/* Need the tchain times (earliest/latest) in sync when
-		 * unlocked. */
+		/* Need the tchain time (earliest) in sync when unlocked. */
 		reset_tchain_times(tchain);
 
 		spin_unlock_irqsave(&tchain->lock);
@@ -165,44 +274,32 @@ void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 static bool __insert_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *i, *temp;
-
 	waiter->on_tchain = TRUE;
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
-		return TRUE;
-	}
-	/* If not, either we're first, last, or in the middle.  Reset the
-	 * interrupt and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Changed the first entry; we'll need to reset the interrupt
-		 * later */
-		return TRUE;
-	}
-	/* If there is a tie for last, the newer one will really go last.  We
-	 * need to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
+	waiter->tchain = tchain;
+	waiter->deadline = waiter->wake_up_time + waiter->slack;
+	/* Saturate, rather than wrap, for huge slacks */
+	if (waiter->deadline < waiter->wake_up_time)
+		waiter->deadline = UINT64_MAX;
+	__ph_insert(tchain, waiter);
+	if (tchain->heap != waiter)
 		return FALSE;
+	/* We're the new earliest; we'll need to reset the interrupt later */
+	tchain->earliest_time = waiter->deadline;
+	return TRUE;
+}
+
+/* Helper, locks tchain, or whichever tchain it redirects to. */
+static struct timer_chain *__lock_tchain_redirect(struct timer_chain *tchain)
+{
+	struct timer_chain *next;
+
+	spin_lock_irqsave(&tchain->lock);
+	while ((next = tchain->redirect)) {
+		spin_unlock_irqsave(&tchain->lock);
+		tchain = next;
+		spin_lock_irqsave(&tchain->lock);
 	}
-	/* Insert before the first one you are earlier than.  This won't scale
-	 * well (TODO) if we have a lot of inserts.  The proactive insert_tail
-	 * up above will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			return FALSE;
-		}
-	}
-	panic("Could not find a spot for awaiter %p\n", waiter);
+	return tchain;
 }
 
 /* Sets the alarm.  If it is a kthread-style alarm (func == 0), sleep on it
@@ -212,39 +309,45 @@ void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 	assert(waiter->wake_up_time != ALARM_POISON_TIME);
 	assert(!waiter->on_tchain);
 
-	spin_lock_irqsave(&tchain->lock);
+	tchain = __lock_tchain_redirect(tchain);
 	if (__insert_awaiter(tchain, waiter))
 		reset_tchain_interrupt(tchain);
 	spin_unlock_irqsave(&tchain->lock);
 }
 
-/* Helper, rips the waiter from the tchain, knowing that it is on the list.
+/* Helper, rips the waiter from the tchain, knowing that it is on the heap.
  * Returns TRUE if the tchain interrupt needs to be reset.  Callers hold the
  * lock. */
 static bool __remove_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *temp;
-	bool reset_int = FALSE;	/* whether or not to reset the interrupt */
-
-	/* Need to make sure earliest and latest are set, in case we're mucking
-	 * with the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time
-					       : ALARM_POISON_TIME;
-		reset_int = TRUE; /* we'll need to reset the timer later */
-	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time
-				             : ALARM_POISON_TIME;
-	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
+	bool reset_int = tchain->heap == waiter;
+
+	__ph_remove(tchain, waiter);
 	waiter->on_tchain = FALSE;
+	if (reset_int)
+		reset_tchain_times(tchain);
 	return reset_int;
 }
 
+/* Helper, locks the tchain the waiter is on or last ran on.  The waiter can be
+ * migrated, or rearm itself on another tchain, while we aren't holding that
+ * tchain's lock, so we check again once we have it.  Waiters that were never
+ * set use the caller's tchain. */
+static struct timer_chain *__lock_waiter_tchain(struct timer_chain *tchain,
+                                                struct alarm_waiter *waiter)
+{
+	struct timer_chain *actual;
+
+	for (;;) {
+		actual = READ_ONCE(waiter->tchain) ?: tchain;
+		spin_lock_irqsave(&actual->lock);
+		if (actual == (waiter->tchain ?: tchain))
+			return actual;
+		spin_unlock_irqsave(&actual->lock);
+	}
+}
+
 /* Removes waiter from the tchain before it goes off.  Returns TRUE if we
  * disarmed before the alarm went off, FALSE if it already fired.  May block,
  * since the handler may be running asynchronously. */
@@ -252,28 +355,34 @@ bool unset_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 {
 	int8_t irq_state = 0;
 
-	spin_lock_irqsave(&tchain->lock);
+	tchain = __lock_waiter_tchain(tchain, waiter);
 	for (;;) {
+		/* Check running first: a running handler can rearm itself on
+		 * another tchain without holding our lock. */
+		if (tchain->running == waiter) {
+			/* It's running.  We'll need to try again.  Note the
+			 * alarm could have resubmitted itself, so ideally the
+			 * caller can tell it to not resubmit.
+			 *
+			 * Arguably by using a CV we're slowing down the common
+			 * case for run_tchain (no race on unset) ever so
+			 * slightly.  The alternative here would be to busy-wait
+			 * with unlock/yield/lock (more of a cv_spin). */
+			cv_wait(&tchain->cv);
+			if (waiter->tchain != tchain) {
+				spin_unlock_irqsave(&tchain->lock);
+				tchain = __lock_waiter_tchain(tchain, waiter);
+			}
+			continue;
+		}
 		if (waiter->on_tchain) {
 			if (__remove_awaiter(tchain, waiter))
 				reset_tchain_interrupt(tchain);
 			spin_unlock_irqsave(&tchain->lock);
 			return true;
 		}
-		if (tchain->running != waiter) {
-			spin_unlock_irqsave(&tchain->lock);
-			return false;
-		}
-		/* It's running.  We'll need to try again.  Note the alarm could
-		 * have resubmitted itself, so ideally the caller can tell it to
-		 * not resubmit.
-		 *
-		 *
-		 * Arguably by using a CV we're slowing down the common case for
-		 * run_tchain (no race on unset) ever so slightly.  The
-		 * alternative here would be to busy-wait with unlock/yield/lock
-		 * (more of a cv_spin). */
-		cv_wait(&tchain->cv);
+		spin_unlock_irqsave(&tchain->lock);
+		return false;
 	}
 }
 
@@ -299,6 +408,51 @@ bool reset_alarm_rel(struct timer_chain *tchain, struct alarm_waiter *waiter,
 	return ret;
 }
 
+/* Moves every alarm on tchain to 'to', and sends future set_alarms there too.
+ * Used to keep alarms from interrupting isolated cores.  Lock order is tchain,
+ * then to, which is safe since 'to' is never isolated.
+ *
+ * A waiter that is running stays with its tchain until it finishes; if it
+ * rearms itself, it'll follow the redirect. */
+void tchain_isolate(struct timer_chain *tchain, struct timer_chain *to)
+{
+	struct alarm_waiter *i;
+	bool reset_to;
+
+	assert(tchain != to && !to->redirect);
+	spin_lock_irqsave(&tchain->lock);
+	tchain->redirect = to;
+	if (!tchain->heap) {
+		spin_unlock_irqsave(&tchain->lock);
+		return;
+	}
+	/* Hold both locks while we retarget: once a waiter points at 'to',
+	 * unset_alarm() can lock 'to' and remove it. */
+	spin_lock_irqsave(&to->lock);
+	for (i = tchain->heap; i; i = __ph_walk_next(i))
+		i->tchain = to;
+	to->heap = __ph_meld(to->heap, tchain->heap);
+	to->nr_waiters += tchain->nr_waiters;
+	reset_to = to->earliest_time != to->heap->deadline;
+	reset_tchain_times(to);
+	if (reset_to)
+		reset_tchain_interrupt(to);
+	spin_unlock_irqsave(&to->lock);
+	tchain->heap = NULL;
+	tchain->nr_waiters = 0;
+	reset_tchain_times(tchain);
+	reset_tchain_interrupt(tchain);
+	spin_unlock_irqsave(&tchain->lock);
+}
+
+/* Lets tchain take alarms again.  Alarms that were moved stay where they are. */
+void tchain_unisolate(struct timer_chain *tchain)
+{
+	spin_lock_irqsave(&tchain->lock);
+	tchain->redirect = NULL;
+	spin_unlock_irqsave(&tchain->lock);
+}
+
 /* Sets the timer interrupt for the timer chain passed as parameter.
  * The next interrupt will be scheduled at the nearest timer available in the
  * chain.
@@ -337,7 +491,7 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 		send_ipi(rem_pcpui - &per_cpu_info[0], IdtLAPIC_TIMER);
 		return;
 	}
-	time = TAILQ_EMPTY(&tchain->waiters) ? 0 : tchain->earliest_time;
+	time = tchain->heap ? tchain->earliest_time : 0;
 	if (time) {
 		/* Arm the alarm.  For times in the past, we just need to make
 		 * sure it goes off. */
@@ -364,22 +518,23 @@ void print_chain(struct timer_chain *tchain)
 	struct timespec x = {0}, y = {0};
 
 	spin_lock_irqsave(&tchain->lock);
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (!tchain->heap) {
 		printk("Chain %p is empty\n", tchain);
 		spin_unlock_irqsave(&tchain->lock);
 		return;
 	}
 	x = tsc2timespec(tchain->earliest_time);
-	y = tsc2timespec(tchain->latest_time);
-	printk("Chain %p:  earliest: [%7d.%09d] latest: [%7d.%09d]\n",
-	       tchain, x.tv_sec, x.tv_nsec, y.tv_sec, y.tv_nsec);
-	TAILQ_FOREACH(i, &tchain->waiters, next) {
+	printk("Chain %p:  earliest deadline: [%7d.%09d], %lu waiters\n",
+	       tchain, x.tv_sec, x.tv_nsec, tchain->nr_waiters);
+	/* Heap order, not sorted */
+	for (i = tchain->heap; i; i = __ph_walk_next(i)) {
 		uintptr_t f = (uintptr_t)i->func;
 
 		x = tsc2timespec(i->wake_up_time);
-		printk("\tWaiter %p, time [%7d.%09d] (%p), func %p (%s)\n",
-		       i, x.tv_sec, x.tv_nsec, i->wake_up_time, f,
-		       get_fn_name(f));
+		y = tsc2timespec(i->slack);
+		printk("\tWaiter %p, time [%7d.%09d] (%p), slack %d.%09d, "
+		       "func %p (%s)\n", i, x.tv_sec, x.tv_nsec,
+		       i->wake_up_time, y.tv_sec, y.tv_nsec, f, get_fn_name(f));
 	}
 	spin_unlock_irqsave(&tchain->lock);
 }
@@ -21,19 +21,17 @@
  * the base arena using an aligned allocation helper for its afunc.  I think,
  * without a lot of thought, that the fragmentation would be equivalent.
  *
- * In the future, we can set up N base_arenas, one for each NUMA domain, each of
- * which is a source for other NUMA allocators, e.g. kpages_i_arena.  Higher
- * level allocators (kmalloc()) will need to choose a NUMA domain and call into
- * the correct allocator.  Each NUMA base arena is self-sufficient: they have no
- * qcaches and their BTs come from their own free page list.  This just
- * replicates the default memory allocator across each NUMA node, and at some
- * point, some generic allocator software needs to pick which node to pull from.
- * I tried to keep assumptions about a single base_arena to a minimum, but
- * you'll see some places where the arena code needs to find some base arena for
- * its BT allocations.  Also note that the base setup happens before we know
- * about NUMA domains.  The plan is to do a small part of domain 0 during
- * pmem_init(), then once we know the full memory layout, add in the rest of
- * domain 0's memory and bootstrap the other domains.
+ * There are N base_arenas, one for each NUMA node, each of which is a source
+ * for that node's kpages arena (base_arenas[] and kpages_arenas[]).  Higher
+ * level allocators (kpages_alloc(), and kmalloc() and the slab imports on top
+ * of it) pick the calling core's node, and frees go back to the node recorded
+ * in the page's struct page.  Each NUMA base arena is self-sufficient: they
+ * have no qcaches and their BTs come from their own free page list.  Arenas
+ * that need a base arena for their BTs walk down their sources to find one.
+ * Note that the base setup happens before we know about NUMA domains.  All of
+ * memory starts in base_arena, which is node 0.  Once we've parsed the SRAT,
+ * numa_mem_init() carves the free memory of the other nodes out of base_arena
+ * and bootstraps those nodes' arenas.
  *
  * When it comes to importing spans, it's not clear whether or not we should
  * import exactly the current allocation request or to bring in more.  If we
@@ -101,10 +99,13 @@ void print_arena_stats(struct arena *arena, bool verbose);
  * arena. */
 static struct arena *find_my_base(struct arena *arena)
 {
-	/* TODO: could walk down sources until is_base is set.  But barring
-	 * that, we'd still need a way to find a base arena for some other
-	 * allocator that just wants a page.  arena may be NULL, so handle that.
-	 * */
+	/* Walk down the sources; the per-node kpages arenas end up at their
+	 * node's base.  Arenas with no base below them (e.g. source-less
+	 * address allocators) and NULL arenas use base_arena. */
+	for (struct arena *a_i = arena; a_i; a_i = a_i->source) {
+		if (a_i->is_base)
+			return a_i;
+	}
 	return base_arena;
 }
 
@@ -697,10 +698,14 @@ static bool get_more_resources(struct arena *arena, size_t size, int flags)
 			return FALSE;
 		}
 	} else {
+		if (flags & MEM_ATOMIC)
+			return FALSE;
+		/* Last chance: have the slab layer give back whatever it is
+		 * caching.  If that freed anything, the caller will retry. */
+		if (kmem_reap_all())
+			return TRUE;
 		/* TODO: allow blocking */
-		if (!(flags & MEM_ATOMIC))
-			panic("OOM!");
-		return FALSE;
+		panic("OOM!");
 	}
 	return TRUE;
 }
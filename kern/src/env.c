@@ -106,8 +106,13 @@ void env_user_mem_free(env_t* e, void* start, size_t len)
 		if (!pte_is_mapped(pte))
 			return 0;
 		page_t *page = pa2page(pte_get_paddr(pte));
+		bool jumbo = pte_is_jumbo(pte);
+
 		pte_clear(pte);
-		page_decref(page);
+		if (jumbo)
+			upage_decref_jumbo(page);
+		else
+			page_decref(page);
 		/* TODO: consider other states here (like !P, yet still tracking
 		 * a page, for VM tricks, page map stuff, etc.  Should be okay:
 		 * once we're freeing, everything else about this proc is dead.
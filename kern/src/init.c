@@ -139,6 +139,8 @@ void kernel_init(multiboot_info_t *mboot_info)
 	radix_init();
 	acpiinit();
 	topology_init();
+	numa_mem_init();
+	jumbo_arena_init();
 	percpu_init();
 	kthread_init();		/* might need to tweak when this happens */
 	vmr_init();
@@ -12,78 +12,155 @@
 #include <stdio.h>
 #include <slab.h>
 #include <assert.h>
+#include <hash.h>
 
 #define kmallocdebug(args...)  //printk(args)
 
-//List of physical pages used by kmalloc
-static spinlock_t pages_list_lock = SPINLOCK_INITIALIZER;
-static page_list_t pages_list;
-
 struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
 
-static void __kfree_release(struct kref *kref);
+/* Extra references on kmalloc'd buffers, from kmalloc_incref().  Most buffers
+ * never get one, so we keep them out of line, in a hash keyed by object.  The
+ * object's page has PG_KMREFS set if any object on it might be in the hash,
+ * so kfree() only looks when it has to. */
+struct kmalloc_ref {
+	BSD_LIST_ENTRY(kmalloc_ref)	link;
+	void				*obj;
+	unsigned long			nr_extra;
+};
+BSD_LIST_HEAD(kmalloc_ref_list, kmalloc_ref);
+
+#define KMALLOC_REF_HASH_BITS 8
+
+static struct kmalloc_ref_bucket {
+	spinlock_t			lock;
+	struct kmalloc_ref_list		refs;
+} kmalloc_refs[1 << KMALLOC_REF_HASH_BITS];
+static struct kmem_cache *kmalloc_ref_cache;
+
+/* Tracing, for kmalloc_trace_report() */
+struct kmalloc_trace_class {
+	atomic_t			nr;
+	atomic_t			amt_req;
+	atomic_t			amt_alloc;
+	atomic_t			amt_alloc_old;
+};
+static bool kmalloc_tracing;
+/* One per size class, plus one for page allocations */
+static struct kmalloc_trace_class kmalloc_trace[NUM_KMALLOC_CACHES + 1];
+
+static size_t kmalloc_class_size(int idx)
+{
+	size_t base;
+
+	if (idx < KMALLOC_NR_LINEAR)
+		return (idx + 1) * KMALLOC_ALIGNMENT;
+	idx -= KMALLOC_NR_LINEAR;
+	base = KMALLOC_LINEAR_MAX << (idx / KMALLOC_CLASSES_PER_PWR2);
+	return base + (idx % KMALLOC_CLASSES_PER_PWR2 + 1) * base /
+	              KMALLOC_CLASSES_PER_PWR2;
+}
+
+/* Returns the smallest size class that holds size.  Callers make sure size <=
+ * KMALLOC_LARGEST. */
+static int kmalloc_class(size_t size)
+{
+	unsigned int lg;
+	size_t base, step;
+
+	if (size <= KMALLOC_LINEAR_MAX)
+		return size ? (size - 1) / KMALLOC_ALIGNMENT : 0;
+	lg = LOG2_UP(size);
+	base = 1UL << (lg - 1);
+	step = base / KMALLOC_CLASSES_PER_PWR2;
+	return KMALLOC_NR_LINEAR +
+	       (lg - 1 - KMALLOC_LINEAR_SHIFT) * KMALLOC_CLASSES_PER_PWR2 +
+	       (ROUNDUP(size, step) - base) / step - 1;
+}
 
 void kmalloc_init(void)
 {
 	char kc_name[KMC_NAME_SZ];
-
-	/* we want at least a 16 byte alignment of the tag so that the bufs
-	 * kmalloc returns are 16 byte aligned.  we used to check the actual
-	 * size == 16, since we adjusted the KMALLOC_SMALLEST based on that. */
-	static_assert(ALIGNED(sizeof(struct kmalloc_tag), 16));
-	/* build caches of common sizes.  this size will later include the tag
-	 * and the actual returned buffer. */
-	size_t ksize = KMALLOC_SMALLEST;
+	size_t ksize;
 
 	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
+		ksize = kmalloc_class_size(i);
+		assert(kmalloc_class(ksize) == i);
 		snprintf(kc_name, KMC_NAME_SZ, "kmalloc_%d", ksize);
 		kmalloc_caches[i] = kmem_cache_create(kc_name, ksize,
 						      KMALLOC_ALIGNMENT, 0,
 						      NULL, 0, 0, NULL);
-		ksize <<= 1;
 	}
+	assert(kmalloc_class_size(NUM_KMALLOC_CACHES - 1) == KMALLOC_LARGEST);
+	for (int i = 0; i < ARRAY_SIZE(kmalloc_refs); i++) {
+		spinlock_init_irqsave(&kmalloc_refs[i].lock);
+		BSD_LIST_INIT(&kmalloc_refs[i].refs);
+	}
+	kmalloc_ref_cache = kmem_cache_create("kmalloc_refs",
+					      sizeof(struct kmalloc_ref),
+					      __alignof__(struct kmalloc_ref),
+					      0, NULL, 0, 0, NULL);
+}
+
+/* What the old allocator used: a 16 byte in-band tag, power-of-two caches from
+ * 32 to 1024 bytes, then whole pages. */
+static size_t kmalloc_old_amt(size_t size)
+{
+	size_t ksize = size + 16;
+
+	if (ksize <= 32)
+		return 32;
+	if (ksize <= 1024)
+		return ROUNDUPPWR2(ksize);
+	return ROUNDUP(ksize, PGSIZE);
+}
+
+static void kmalloc_trace_alloc(int idx, size_t size, size_t amt)
+{
+	struct kmalloc_trace_class *tc = &kmalloc_trace[idx];
+
+	atomic_inc(&tc->nr);
+	atomic_add(&tc->amt_req, size);
+	atomic_add(&tc->amt_alloc, amt);
+	atomic_add(&tc->amt_alloc_old, kmalloc_old_amt(size));
+}
+
+static void *kmalloc_pages(size_t size, int flags)
+{
+	size_t amt_alloc = ROUNDUP(size, PGSIZE);
+	struct page *pg;
+	void *buf;
+
+	buf = kpages_alloc(amt_alloc, flags);
+	if (!buf)
+		return NULL;
+	pg = kva2page(buf);
+	for (size_t off = 0; off < amt_alloc; off += PGSIZE, pg++) {
+		pg->pg_private = (void*)(amt_alloc | KMALLOC_TAG_PAGES);
+		pg->pg_index = off;
+		atomic_and(&pg->pg_flags, ~PG_KMREFS);
+	}
+	if (kmalloc_tracing)
+		kmalloc_trace_alloc(NUM_KMALLOC_CACHES, size, amt_alloc);
+	return buf;
 }
 
 void *kmalloc(size_t size, int flags)
 {
-	// reserve space for bookkeeping and preserve alignment
-	size_t ksize = size + sizeof(struct kmalloc_tag);
 	void *buf;
 	int cache_id;
-	// determine cache to pull from
-	if (ksize <= KMALLOC_SMALLEST)
-		cache_id = 0;
-	else
-		cache_id = LOG2_UP(ksize) - LOG2_UP(KMALLOC_SMALLEST);
-	// if we don't have a cache to handle it, alloc cont pages
-	if (cache_id >= NUM_KMALLOC_CACHES) {
-		/* The arena allocator will round up too, but we want to know in
-		 * advance so that krealloc can avoid extra allocations. */
-		size_t amt_alloc = ROUNDUP(size + sizeof(struct kmalloc_tag),
-					   PGSIZE);
-
-		buf = kpages_alloc(amt_alloc, flags);
-		if (!buf)
-			panic("Kmalloc failed!  Handle me!");
-		// fill in the kmalloc tag
-		struct kmalloc_tag *tag = buf;
-		tag->flags = KMALLOC_TAG_PAGES;
-		tag->amt_alloc = amt_alloc;
-		tag->canary = KMALLOC_CANARY;
-		kref_init(&tag->kref, __kfree_release, 1);
-		return buf + sizeof(struct kmalloc_tag);
+
+	if (size > KMALLOC_LARGEST) {
+		buf = kmalloc_pages(size, flags);
+	} else {
+		cache_id = kmalloc_class(size);
+		buf = kmem_cache_alloc(kmalloc_caches[cache_id], flags);
+		if (kmalloc_tracing && buf)
+			kmalloc_trace_alloc(cache_id, size,
+			                    kmalloc_caches[cache_id]->obj_size);
 	}
-	// else, alloc from the appropriate cache
-	buf = kmem_cache_alloc(kmalloc_caches[cache_id], flags);
 	if (!buf)
 		panic("Kmalloc failed!  Handle me!");
-	// store a pointer to the buffers kmem_cache in it's bookkeeping space
-	struct kmalloc_tag *tag = buf;
-	tag->flags = KMALLOC_TAG_CACHE;
-	tag->my_cache = kmalloc_caches[cache_id];
-	tag->canary = KMALLOC_CANARY;
-	kref_init(&tag->kref, __kfree_release, 1);
-	return buf + sizeof(struct kmalloc_tag);
+	return buf;
 }
 
 void *kzmalloc(size_t size, int flags)
@@ -98,29 +175,20 @@ void *kzmalloc(size_t size, int flags)
 
 void *kmalloc_align(size_t size, int flags, size_t align)
 {
-	void *addr, *retaddr;
-	int *tag_flags, offset;
+	void *addr;
 
 	/* alignment requests must be a multiple of long, even though we only
 	 * need int in the current code. */
 	assert(ALIGNED(align, sizeof(long)));
-	/* must fit in the space reserved for the offset amount, which is at
-	 * most 'align'. */
-	assert(align < (1 << (32 - KMALLOC_ALIGN_SHIFT)));
 	assert(IS_PWR2(align));
+	if (align <= KMALLOC_ALIGNMENT)
+		return kmalloc(size, flags);
+	/* kfree() and friends find the object from any address within it, so
+	 * we can return an address in the middle. */
 	addr = kmalloc(size + align, flags);
 	if (!addr)
 		return 0;
-	if (ALIGNED(addr, align))
-		return addr;
-	retaddr = ROUNDUP(addr, align);
-	offset = retaddr - addr;
-	assert(offset < align);
-	/* we might not have room for a full tag.  we might have only 8 bytes.
-	 * but we'll at least have room for the flags part. */
-	tag_flags = (int*)(retaddr - sizeof(int));
-	*tag_flags = (offset << KMALLOC_ALIGN_SHIFT) | KMALLOC_TAG_UNALIGN;
-	return retaddr;
+	return ROUNDUP(addr, align);
 }
 
 void *kzmalloc_align(size_t size, int flags, size_t align)
@@ -133,55 +201,108 @@ void *kzmalloc_align(size_t size, int flags, size_t align)
 	return v;
 }
 
-static struct kmalloc_tag *__get_km_tag(void *buf)
+/* Finds the object that buf is in: either a slab object from one of our caches,
+ * or a run of pages.  Sets *obj_size, and *kc if it was a slab object. */
+static void *__get_km_obj(void *buf, size_t *obj_size, struct kmem_cache **kc)
 {
-	struct kmalloc_tag *tag =
-		(struct kmalloc_tag*)(buf - sizeof(struct kmalloc_tag));
-	if (tag->canary != KMALLOC_CANARY){
-		printk("kmalloc bad canary: %08lx@%p, buf %p, expected %08lx\n",
-		       tag->canary, &tag->canary, buf, KMALLOC_CANARY);
-		hexdump((void *)(buf - sizeof(struct kmalloc_tag)), 256);
-		panic("Bad canary");
+	struct page *pg = kva2page(buf);
+	uintptr_t tag = (uintptr_t)pg->pg_private;
+	void *start = page2kva(pg) - pg->pg_index;
+	struct kmem_cache *cache;
+
+	if (tag & KMALLOC_TAG_PAGES) {
+		*obj_size = tag & ~KMALLOC_TAG_PAGES;
+		*kc = NULL;
+		return start;
+	}
+	cache = (struct kmem_cache*)tag;
+	if (!cache || cache->obj_size > KMALLOC_LARGEST ||
+	    kmalloc_caches[kmalloc_class(cache->obj_size)] != cache) {
+		printk("kmalloc bad buf %p, page tag %p\n", buf, tag);
+		panic("Not a kmalloc buffer");
 	}
-	return tag;
+	*obj_size = cache->obj_size;
+	*kc = cache;
+	return buf - (buf - start) % cache->obj_size;
 }
 
-/* If we kmalloc_aligned, the buf we got back (and are now trying to perform
- * some operation on) might not be the original, underlying, unaligned buf.
- *
- * This returns the underlying, unaligned buf, or 0 if the buf was not realigned
- * in the first place. */
-static void *__get_unaligned_orig_buf(void *buf)
+static struct kmalloc_ref_bucket *__get_ref_bucket(void *obj)
 {
-	int *tag_flags = (int*)(buf - sizeof(int));
+	return &kmalloc_refs[hash_ptr(obj, KMALLOC_REF_HASH_BITS)];
+}
 
-	if ((*tag_flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_UNALIGN)
-		return (buf - (*tag_flags >> KMALLOC_ALIGN_SHIFT));
-	else
+static struct kmalloc_ref *__find_ref(struct kmalloc_ref_bucket *b, void *obj)
+{
+	struct kmalloc_ref *ref;
+
+	BSD_LIST_FOREACH(ref, &b->refs, link) {
+		if (ref->obj == obj)
+			return ref;
+	}
+	return NULL;
+}
+
+/* Returns the number of references beyond the first on obj */
+static unsigned long __get_extra_refs(void *obj)
+{
+	struct kmalloc_ref_bucket *b;
+	struct kmalloc_ref *ref;
+	unsigned long ret = 0;
+
+	if (!(atomic_read(&kva2page(obj)->pg_flags) & PG_KMREFS))
 		return 0;
+	b = __get_ref_bucket(obj);
+	spin_lock_irqsave(&b->lock);
+	ref = __find_ref(b, obj);
+	if (ref)
+		ret = ref->nr_extra;
+	spin_unlock_irqsave(&b->lock);
+	return ret;
+}
+
+/* Drops an extra ref, if there is one.  Returns TRUE if we did. */
+static bool __put_extra_ref(void *obj)
+{
+	struct kmalloc_ref_bucket *b;
+	struct kmalloc_ref *ref;
+
+	if (!(atomic_read(&kva2page(obj)->pg_flags) & PG_KMREFS))
+		return FALSE;
+	b = __get_ref_bucket(obj);
+	spin_lock_irqsave(&b->lock);
+	ref = __find_ref(b, obj);
+	if (!ref) {
+		spin_unlock_irqsave(&b->lock);
+		return FALSE;
+	}
+	if (--ref->nr_extra == 0)
+		BSD_LIST_REMOVE(ref, link);
+	else
+		ref = NULL;
+	spin_unlock_irqsave(&b->lock);
+	if (ref)
+		kmem_cache_free(kmalloc_ref_cache, ref);
+	return TRUE;
+}
+
+size_t kmalloc_size(void *buf)
+{
+	struct kmem_cache *kc;
+	size_t obj_size;
+	void *obj = __get_km_obj(buf, &obj_size, &kc);
+
+	return obj + obj_size - buf;
 }
 
 void *krealloc(void* buf, size_t size, int flags)
 {
 	void *nbuf;
 	size_t osize = 0;
-	struct kmalloc_tag *tag;
+	struct kmem_cache *kc;
 
 	if (buf){
-		if (__get_unaligned_orig_buf(buf))
+		if (__get_km_obj(buf, &osize, &kc) != buf)
 			panic("krealloc of a kmalloc_align not supported");
-		tag = __get_km_tag(buf);
-		/* whatever we got from either a slab or the page allocator is
-		 * meant for both the buf+size as well as the kmalloc tag */
-		if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE) {
-			osize = tag->my_cache->obj_size
-				- sizeof(struct kmalloc_tag);
-		} else if ((tag->flags & KMALLOC_FLAG_MASK)
-			   == KMALLOC_TAG_PAGES) {
-			osize = tag->amt_alloc - sizeof(struct kmalloc_tag);
-		} else {
-			panic("Probably a bad tag, flags %p\n", tag->flags);
-		}
 		if (osize >= size)
 			return buf;
 	}
@@ -210,53 +331,142 @@ void *krealloc(void* buf, size_t size, int flags)
  * original ref > 1. */
 void kmalloc_incref(void *buf)
 {
-	void *orig_buf = __get_unaligned_orig_buf(buf);
-
-	buf = orig_buf ? orig_buf : buf;
-	/* if we want a smaller tag, we can extract the code from kref and
-	 * manually set the release method in kfree. */
-	kref_get(&__get_km_tag(buf)->kref, 1);
+	struct kmem_cache *kc;
+	struct kmalloc_ref_bucket *b;
+	struct kmalloc_ref *ref, *new_ref = NULL;
+	size_t obj_size;
+	void *obj = __get_km_obj(buf, &obj_size, &kc);
+
+	b = __get_ref_bucket(obj);
+	/* Set the flag before the ref is findable.  Anyone who could kfree
+	 * concurrently already holds a ref, and they'll see the flag. */
+	atomic_or(&kva2page(obj)->pg_flags, PG_KMREFS);
+	while (1) {
+		spin_lock_irqsave(&b->lock);
+		ref = __find_ref(b, obj);
+		if (ref) {
+			ref->nr_extra++;
+			break;
+		}
+		if (new_ref) {
+			new_ref->obj = obj;
+			new_ref->nr_extra = 1;
+			BSD_LIST_INSERT_HEAD(&b->refs, new_ref, link);
+			new_ref = NULL;
+			break;
+		}
+		spin_unlock_irqsave(&b->lock);
+		new_ref = kmem_cache_alloc(kmalloc_ref_cache, MEM_ATOMIC);
+		if (!new_ref)
+			panic("Unable to track kmalloc ref on %p", obj);
+	}
+	spin_unlock_irqsave(&b->lock);
+	if (new_ref)
+		kmem_cache_free(kmalloc_ref_cache, new_ref);
 }
 
 int kmalloc_refcnt(void *buf)
 {
-	void *orig_buf = __get_unaligned_orig_buf(buf);
-
-	buf = orig_buf ? orig_buf : buf;
-	return kref_refcnt(&__get_km_tag(buf)->kref);
-}
-
-static void __kfree_release(struct kref *kref)
-{
-	struct kmalloc_tag *tag = container_of(kref, struct kmalloc_tag, kref);
+	struct kmem_cache *kc;
+	size_t obj_size;
+	void *obj = __get_km_obj(buf, &obj_size, &kc);
 
-	if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE)
-		kmem_cache_free(tag->my_cache, tag);
-	else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_PAGES)
-		kpages_free(tag, tag->amt_alloc);
-	else
-		panic("Bad flag 0x%x in %s", tag->flags, __FUNCTION__);
+	return 1 + __get_extra_refs(obj);
 }
 
 void kfree(void *buf)
 {
-	void *orig_buf;
+	struct kmem_cache *kc;
+	size_t obj_size;
+	void *obj;
+
 	if (buf == NULL)
 		return;
-	orig_buf = __get_unaligned_orig_buf(buf);
-	buf = orig_buf ? orig_buf : buf;
-	kref_put(&__get_km_tag(buf)->kref);
+	obj = __get_km_obj(buf, &obj_size, &kc);
+	if (__put_extra_ref(obj))
+		return;
+	if (kc)
+		kmem_cache_free(kc, obj);
+	else
+		kpages_free(obj, obj_size);
 }
 
 void kmalloc_canary_check(char *str)
 {
-	struct kmalloc_tag *tag;
+	struct kmem_cache *kc;
+	size_t obj_size;
 
 	if (!debug_canary)
 		return;
-	tag = (struct kmalloc_tag*)(debug_canary - sizeof(struct kmalloc_tag));
-	if (tag->canary != KMALLOC_CANARY)
-		panic("\t\t KMALLOC CANARY CHECK FAILED %s\n", str);
+	/* There's no canary anymore, but this will panic if the buffer's
+	 * memory no longer belongs to kmalloc. */
+	__get_km_obj(debug_canary, &obj_size, &kc);
+}
+
+void kmalloc_trace_start(void)
+{
+	kmalloc_tracing = TRUE;
+}
+
+void kmalloc_trace_stop(void)
+{
+	kmalloc_tracing = FALSE;
+}
+
+void kmalloc_trace_reset(void)
+{
+	struct kmalloc_trace_class *tc;
+
+	for (int i = 0; i < ARRAY_SIZE(kmalloc_trace); i++) {
+		tc = &kmalloc_trace[i];
+		atomic_set(&tc->nr, 0);
+		atomic_set(&tc->amt_req, 0);
+		atomic_set(&tc->amt_alloc, 0);
+		atomic_set(&tc->amt_alloc_old, 0);
+	}
+}
+
+static unsigned long waste_pct(unsigned long req, unsigned long alloc)
+{
+	return alloc ? (alloc - req) * 100 / alloc : 0;
+}
+
+/* Internal fragmentation for the recorded requests, per size class, compared
+ * to what the old power-of-two allocator would have used. */
+struct sized_alloc *kmalloc_trace_report(void)
+{
+	struct sized_alloc *sza;
+	struct kmalloc_trace_class *tc;
+	unsigned long nr, req, alloc, old;
+	unsigned long tot_req = 0, tot_alloc = 0, tot_old = 0;
+
+	sza = sized_kzmalloc(100 * (ARRAY_SIZE(kmalloc_trace) + 4), MEM_WAIT);
+	sza_printf(sza, "%-10s %12s %15s %15s %6s %6s\n", "Class", "Nr allocs",
+	           "Requested", "Allocated", "Waste%", "Old%");
+	for (int i = 0; i < ARRAY_SIZE(kmalloc_trace); i++) {
+		tc = &kmalloc_trace[i];
+		nr = atomic_read(&tc->nr);
+		if (!nr)
+			continue;
+		req = atomic_read(&tc->amt_req);
+		alloc = atomic_read(&tc->amt_alloc);
+		old = atomic_read(&tc->amt_alloc_old);
+		if (i < NUM_KMALLOC_CACHES)
+			sza_printf(sza, "%-10lu ", kmalloc_class_size(i));
+		else
+			sza_printf(sza, "%-10s ", "pages");
+		sza_printf(sza, "%12lu %15lu %15lu %6lu %6lu\n", nr, req, alloc,
+		           waste_pct(req, alloc), waste_pct(req, old));
+		tot_req += req;
+		tot_alloc += alloc;
+		tot_old += old;
+	}
+	sza_printf(sza, "\nTotal requested: %lu\n", tot_req);
+	sza_printf(sza, "Size classes:    %lu allocated, %lu%% waste\n",
+	           tot_alloc, waste_pct(tot_req, tot_alloc));
+	sza_printf(sza, "Old allocator:   %lu allocated, %lu%% waste\n",
+	           tot_old, waste_pct(tot_req, tot_old));
+	return sza;
 }
 
 struct sized_alloc *sized_kzmalloc(size_t size, int flags)
@@ -80,10 +80,55 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+/* Adds enough convs to make the table grow a few times, then makes sure they
+ * (and only they) can still be found. */
+bool test_ipht(void)
+{
+	const int nr_convs = Nipht * 8;
+	struct Ipht ht;
+	struct conv *convs, *c;
+
+	convs = kzmalloc(sizeof(struct conv) * nr_convs, MEM_WAIT);
+	iphtinit(&ht);
+	for (int i = 0; i < nr_convs; i++) {
+		c = &convs[i];
+		v4tov6(c->laddr, (uint8_t[]){10, 0, 0, 1});
+		v4tov6(c->raddr, (uint8_t[]){10, 1, i >> 8, i & 0xff});
+		c->lport = 80;
+		c->rport = 1024 + (i % 7);
+		iphtadd(&ht, c);
+	}
+	KT_ASSERT_M("Table should have grown",
+		    ht.tab->mask + 1 > Nipht);
+	for (int i = 0; i < nr_convs; i++) {
+		c = &convs[i];
+		KT_ASSERT_M("Lookup should find the exact conv",
+			    iphtlook(&ht, c->raddr, c->rport, c->laddr,
+				     c->lport) == c);
+	}
+	for (int i = 0; i < nr_convs; i += 2)
+		iphtrem(&ht, &convs[i]);
+	for (int i = 0; i < nr_convs; i++) {
+		c = &convs[i];
+		KT_ASSERT_M("Only removed convs should be missing",
+			    iphtlook(&ht, c->raddr, c->rport, c->laddr,
+				     c->lport) == (i % 2 ? c : NULL));
+	}
+	for (int i = 1; i < nr_convs; i += 2)
+		iphtrem(&ht, &convs[i]);
+	KT_ASSERT_M("Table should be empty", atomic_read(&ht.nents) == 0);
+	/* The entries went out with kfree_rcu; the chains are all empty. */
+	synchronize_rcu();
+	kfree(ht.tab);
+	kfree(convs);
+	return true;
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,		CONFIG_TEST_ptclbsum),
 	KTEST_REG(simplesum_bench,	CONFIG_TEST_simplesum_bench),
 	KTEST_REG(ptclbsum_bench,	CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(ipht,			CONFIG_TEST_ipht),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
@@ -47,6 +47,7 @@
 #include <rendez.h>
 #include <ktest.h>
 #include <smallidpool.h>
+#include <timer_wheel.h>
 #include <linker_func.h>
 
 KTEST_SUITE("POSTBOOT")
@@ -1617,52 +1618,164 @@ bool test_alarm(void)
 	return true;
 }
 
-bool test_kmalloc_incref(void)
+struct alarm_heap_test {
+	uint64_t			last_wake;
+	unsigned long			nr_run;
+	bool				out_of_order;
+};
+
+static void __alarm_heap_set_int(struct timer_chain *tchain)
 {
-	/* this test is a bit invasive of the kmalloc internals */
-	void *__get_unaligned_orig_buf(void *buf)
-	{
-		int *tag_flags = (int*)(buf - sizeof(int));
-		if ((*tag_flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_UNALIGN)
-			return (buf - (*tag_flags >> KMALLOC_ALIGN_SHIFT));
-		else
-			return 0;
+}
+
+static void __alarm_heap_handler(struct alarm_waiter *waiter)
+{
+	struct alarm_heap_test *aht = waiter->data;
+
+	if (waiter->wake_up_time < aht->last_wake)
+		aht->out_of_order = TRUE;
+	aht->last_wake = waiter->wake_up_time;
+	aht->nr_run++;
+}
+
+/* Times set and unset with 100k outstanding alarms on a private tchain, then
+ * makes sure they run in order. */
+static bool test_alarm_heap(void)
+{
+	#define NR_HEAP_ALARMS 100000
+	struct timer_chain *tchain = kmalloc(sizeof(struct timer_chain),
+	                                     MEM_WAIT);
+	struct alarm_waiter *ws = kzmalloc(sizeof(struct alarm_waiter) *
+	                                   NR_HEAP_ALARMS, MEM_WAIT);
+	struct alarm_heap_test aht = {0};
+	struct alarm_waiter a1, a2;
+	uint64_t now = read_tsc(), min_wake = UINT64_MAX, start, wake;
+	unsigned long nr_left = NR_HEAP_ALARMS / 2;
+	int i;
+
+	init_timer_chain(tchain, __alarm_heap_set_int);
+	/* Slack: the earliest deadline wins, not the earliest wake time */
+	init_awaiter(&a1, __alarm_heap_handler);
+	set_awaiter_abs(&a1, now + 1000);
+	set_awaiter_slack(&a1, 1000000);
+	set_alarm(tchain, &a1);
+	init_awaiter(&a2, __alarm_heap_handler);
+	set_awaiter_abs(&a2, now + 5000);
+	set_alarm(tchain, &a2);
+	KT_ASSERT_M("Wrong earliest deadline with slack",
+		    tchain->earliest_time == now + 5000);
+	unset_alarm(tchain, &a2);
+	KT_ASSERT_M("Wrong earliest deadline after unset",
+		    tchain->earliest_time == a1.deadline);
+	unset_alarm(tchain, &a1);
+	KT_ASSERT(!tchain->heap && !tchain->nr_waiters);
+
+	start = read_tsc();
+	for (i = 0; i < NR_HEAP_ALARMS; i++) {
+		init_awaiter(&ws[i], __alarm_heap_handler);
+		ws[i].data = &aht;
+		/* Far out, in no particular order */
+		wake = now + usec2tsc(1000000) +
+		       ((uint64_t)i * 7919 % NR_HEAP_ALARMS) * 1000;
+		min_wake = MIN(min_wake, wake);
+		set_awaiter_abs(&ws[i], wake);
+		set_alarm(tchain, &ws[i]);
 	}
+	printk("alarm heap: set %d alarms, %llu nsec each\n", NR_HEAP_ALARMS,
+	       tsc2nsec(read_tsc() - start) / NR_HEAP_ALARMS);
+	KT_ASSERT(tchain->nr_waiters == NR_HEAP_ALARMS);
+	KT_ASSERT_M("Wrong earliest time", tchain->earliest_time == min_wake);
+
+	start = read_tsc();
+	for (i = 0; i < NR_HEAP_ALARMS; i += 2)
+		KT_ASSERT(unset_alarm(tchain, &ws[i]));
+	printk("alarm heap: unset %d alarms, %llu nsec each\n",
+	       NR_HEAP_ALARMS / 2,
+	       tsc2nsec(read_tsc() - start) / (NR_HEAP_ALARMS / 2));
+	KT_ASSERT(tchain->nr_waiters == nr_left);
+
+	/* Move the rest into the past, shuffled, and let the tchain run them */
+	for (i = 1; i < NR_HEAP_ALARMS; i += 2)
+		reset_alarm_abs(tchain, &ws[i],
+		                1000000 + (uint64_t)i * 7919 % NR_HEAP_ALARMS);
+	start = read_tsc();
+	__trigger_tchain(tchain, NULL);
+	for (i = 0; i < 1000 && aht.nr_run != nr_left; i++)
+		kthread_usleep(1000);
+	printk("alarm heap: ran %lu alarms in %llu usec\n", aht.nr_run,
+	       tsc2usec(read_tsc() - start));
+	KT_ASSERT_M("Not every alarm ran", aht.nr_run == nr_left);
+	KT_ASSERT_M("Alarms ran out of order", !aht.out_of_order);
+	KT_ASSERT(!tchain->heap);
+	kfree(ws);
+	kfree(tchain);
+	return true;
+}
 
-	bool test_buftag(void *b, struct kmalloc_tag *btag, char *str)
+bool test_kmalloc_incref(void)
+{
+	bool test_buftag(void *b, char *str)
 	{
-		KT_ASSERT_M(str, kref_refcnt(&btag->kref) == 1);
+		KT_ASSERT_M(str, kmalloc_refcnt(b) == 1);
+		kmalloc_incref(b);
+		KT_ASSERT_M(str, kmalloc_refcnt(b) == 2);
 		kmalloc_incref(b);
-		KT_ASSERT_M(str, kref_refcnt(&btag->kref) == 2);
+		KT_ASSERT_M(str, kmalloc_refcnt(b) == 3);
 		kfree(b);
-		KT_ASSERT_M(str, kref_refcnt(&btag->kref) == 1);
+		KT_ASSERT_M(str, kmalloc_refcnt(b) == 2);
+		kfree(b);
+		KT_ASSERT_M(str, kmalloc_refcnt(b) == 1);
 		kfree(b);
-		/* dangerous read, it's been freed */
-		KT_ASSERT_M(str, kref_refcnt(&btag->kref) == 0);
 		return TRUE;
 	}
 
-	void *b1, *b2, *b2o;
-	struct kmalloc_tag *b1tag, *b2tag;
+	void *b1, *b2, *b3;
 
 	/* no realigned case */
 	b1 = kmalloc(55, 0);
-	KT_ASSERT(!__get_unaligned_orig_buf(b1));
-	b1tag = (struct kmalloc_tag*)(b1 - sizeof(struct kmalloc_tag));
-
-	/* realigned case.  alloc'd before b1's test, so we know we get
-	 * different buffers. */
+	/* realigned case: any address in the object finds its refs */
 	b2 = kmalloc_align(55, 0, 64);
-	b2o = __get_unaligned_orig_buf(b2);
-	KT_ASSERT(b2o);
-	b2tag = (struct kmalloc_tag*)(b2o - sizeof(struct kmalloc_tag));
+	KT_ASSERT(ALIGNED(b2, 64));
+	/* page allocation */
+	b3 = kmalloc(KMALLOC_LARGEST + 1, 0);
 
-	test_buftag(b1, b1tag, "b1, no realign");
-	test_buftag(b2, b2tag, "b2, realigned");
+	test_buftag(b1, "b1, no realign");
+	test_buftag(b2, "b2, realigned");
+	test_buftag(b3, "b3, pages");
 
 	return TRUE;
 }
 
+/* Power-of-two and page-sized requests fit exactly, and every request gets a
+ * size class within 25% of it, or within the alignment for small requests. */
+bool test_kmalloc_sizes(void)
+{
+	void *b;
+	size_t sz;
+
+	for (sz = KMALLOC_ALIGNMENT; sz <= 4 * PGSIZE; sz <<= 1) {
+		b = kmalloc(sz, 0);
+		KT_ASSERT_M("Power of two size should be exact",
+		            kmalloc_size(b) == sz);
+		KT_ASSERT_M("Buffers must be aligned",
+		            ALIGNED(b, KMALLOC_ALIGNMENT));
+		kfree(b);
+	}
+	b = kmalloc(3 * PGSIZE, 0);
+	KT_ASSERT_M("Page multiple should be exact",
+	            kmalloc_size(b) == 3 * PGSIZE);
+	kfree(b);
+	for (sz = 1; sz <= KMALLOC_LARGEST; sz += 7) {
+		b = kmalloc(sz, 0);
+		KT_ASSERT_M("Class too small", kmalloc_size(b) >= sz);
+		KT_ASSERT_M("Class too large",
+		            kmalloc_size(b) <= MAX(ROUNDUP(sz, KMALLOC_ALIGNMENT),
+		                                   sz + sz / 4 + 1));
+		kfree(b);
+	}
+	return TRUE;
+}
+
 /* Some ghetto things:
  * - ASSERT_M only lets you have a string, not a format string.
  * - put doesn't return, so we have a "loud" test for that.  alternatively, we
@@ -2059,6 +2172,186 @@ static bool test_percpu_increment(void)
 	return true;
 }
 
+struct tw_test_timer {
+	struct tw_timer			tw;
+	uint64_t			want;
+	int				nr_fired;
+	bool				bad;
+};
+
+static void __tw_test_expired(struct tw_timer *t, void *arg)
+{
+	struct tw_test_timer *tt = container_of(t, struct tw_test_timer, tw);
+	struct timer_wheel *tw = arg;
+
+	if (tw->now != tt->want)
+		tt->bad = TRUE;
+	tt->nr_fired++;
+}
+
+static bool test_timer_wheel(void)
+{
+	#define NR_TW_TIMERS 512
+	struct timer_wheel *tw = kmalloc(sizeof(struct timer_wheel), MEM_WAIT);
+	struct tw_test_timer *tts = kzmalloc(sizeof(struct tw_test_timer) *
+	                                     NR_TW_TIMERS, MEM_WAIT);
+	uint64_t start = 1000, now, delta;
+
+	timer_wheel_init(tw, start);
+	for (int i = 0; i < NR_TW_TIMERS; i++) {
+		tw_timer_init(&tts[i].tw);
+		/* Spread them across all levels, including some that are
+		 * beyond the range of the wheel. */
+		delta = 1 + ((uint64_t)i * i * i * 131) % (TW_MAX_DELTA * 2);
+		tts[i].want = start + delta;
+		timer_wheel_add(tw, &tts[i].tw, tts[i].want);
+	}
+	KT_ASSERT(tw->nr_pending == NR_TW_TIMERS);
+	/* Cancel every third timer, and move every fifth */
+	for (int i = 0; i < NR_TW_TIMERS; i += 3) {
+		timer_wheel_del(tw, &tts[i].tw);
+		tts[i].want = 0;
+	}
+	for (int i = 1; i < NR_TW_TIMERS; i += 5) {
+		tts[i].want = start + i;
+		timer_wheel_add(tw, &tts[i].tw, tts[i].want);
+	}
+	/* Advance in uneven jumps, so we cross cascade boundaries mid-step */
+	now = start;
+	while (tw->nr_pending) {
+		now += 1 + (now % 4099);
+		timer_wheel_advance(tw, now, __tw_test_expired, tw);
+		for (int i = 0; i < NR_TW_TIMERS; i++)
+			KT_ASSERT_M("Timer missed its deadline",
+				    !tw_timer_pending(&tts[i].tw) ||
+				    tts[i].want > now);
+	}
+	for (int i = 0; i < NR_TW_TIMERS; i++) {
+		KT_ASSERT_M("Timer fired at the wrong time", !tts[i].bad);
+		KT_ASSERT_M("Timer fired the wrong number of times",
+			    tts[i].nr_fired == (tts[i].want ? 1 : 0));
+	}
+	kfree(tts);
+	kfree(tw);
+	return true;
+}
+
+static void __kmsg_rt_pong(uint32_t srcid, long a0, long a1, long a2)
+{
+	atomic_inc((atomic_t*)a0);
+}
+
+static void __kmsg_rt_ping(uint32_t srcid, long a0, long a1, long a2)
+{
+	send_kernel_message(srcid, __kmsg_rt_pong, a0, 0, 0, KMSG_IMMEDIATE);
+}
+
+/* Returns the average round trip in nsec.  The reply is always immediate, since
+ * we're spinning and won't look for routine messages. */
+static uint64_t __kmsg_roundtrip(uint32_t dst, int type, int nr)
+{
+	atomic_t pongs;
+	uint64_t start;
+
+	atomic_init(&pongs, 0);
+	start = read_tsc();
+	for (int i = 0; i < nr; i++) {
+		send_kernel_message(dst, __kmsg_rt_ping, (long)&pongs, 0, 0,
+		                    type);
+		while (atomic_read(&pongs) != i + 1)
+			cpu_relax();
+	}
+	return tsc2nsec(read_tsc() - start) / nr;
+}
+
+static bool test_kmsg_roundtrip(void)
+{
+	#define NR_KMSG_ROUNDTRIPS 10000
+	uint32_t dst = (core_id() + 1) % num_cores;
+	unsigned long old_poll = kmsg_idle_poll_usec;
+
+	if (num_cores < 2)
+		return true;
+	printk("kmsg round trip to core %d, immediate: %llu nsec\n", dst,
+	       __kmsg_roundtrip(dst, KMSG_IMMEDIATE, NR_KMSG_ROUNDTRIPS));
+	printk("kmsg round trip to core %d, routine, polling: %llu nsec\n", dst,
+	       __kmsg_roundtrip(dst, KMSG_ROUTINE, NR_KMSG_ROUNDTRIPS));
+	/* With no idle polling, every routine message needs an IPI */
+	kmsg_idle_poll_usec = 0;
+	printk("kmsg round trip to core %d, routine, halting: %llu nsec\n", dst,
+	       __kmsg_roundtrip(dst, KMSG_ROUTINE, NR_KMSG_ROUNDTRIPS));
+	kmsg_idle_poll_usec = old_poll;
+	return true;
+}
+
+struct kmsg_tp_test {
+	atomic_t			nr_done;
+	long				next;
+	bool				out_of_order;
+};
+
+static void __kmsg_tp_handler(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kmsg_tp_test *kt = (struct kmsg_tp_test*)a0;
+
+	if (a1 != kt->next)
+		kt->out_of_order = TRUE;
+	kt->next = a1 + 1;
+	atomic_inc(&kt->nr_done);
+}
+
+static void __kmsg_mc_handler(uint32_t srcid, long a0, long a1, long a2)
+{
+	atomic_inc((atomic_t*)a0);
+}
+
+/* Floods one core with more messages than its ring holds, so some of them go
+ * through the overflow list, and checks they arrive in order.  Then multicasts
+ * to every other core. */
+static bool test_kmsg_throughput(void)
+{
+	#define NR_KMSG_TP 100000
+	#define NR_KMSG_MC 10000
+	uint32_t dst = (core_id() + 1) % num_cores;
+	struct kmsg_tp_test kt = {0};
+	struct core_set others;
+	atomic_t nr_mc;
+	uint64_t start;
+	int types[] = {KMSG_IMMEDIATE, KMSG_ROUTINE};
+
+	if (num_cores < 2)
+		return true;
+	for (int t = 0; t < ARRAY_SIZE(types); t++) {
+		atomic_init(&kt.nr_done, 0);
+		kt.next = 0;
+		start = read_tsc();
+		for (long i = 0; i < NR_KMSG_TP; i++)
+			send_kernel_message(dst, __kmsg_tp_handler, (long)&kt,
+			                    i, 0, types[t]);
+		while (atomic_read(&kt.nr_done) != NR_KMSG_TP)
+			cpu_relax();
+		printk("kmsg throughput to core %d, %s: %llu nsec/msg\n", dst,
+		       types[t] == KMSG_ROUTINE ? "routine" : "immediate",
+		       tsc2nsec(read_tsc() - start) / NR_KMSG_TP);
+		KT_ASSERT_M("Kernel messages arrived out of order",
+			    !kt.out_of_order);
+	}
+
+	core_set_init(&others);
+	core_set_fill_available(&others);
+	core_set_clearcpu(&others, core_id());
+	atomic_init(&nr_mc, 0);
+	start = read_tsc();
+	for (int i = 0; i < NR_KMSG_MC; i++)
+		send_kernel_message_cset(&others, __kmsg_mc_handler,
+		                         (long)&nr_mc, 0, 0, KMSG_ROUTINE);
+	while (atomic_read(&nr_mc) != NR_KMSG_MC * (num_cores - 1))
+		cpu_relax();
+	printk("kmsg multicast to %d cores: %llu nsec/send\n", num_cores - 1,
+	       tsc2nsec(read_tsc() - start) / NR_KMSG_MC);
+	return true;
+}
+
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
@@ -2088,13 +2381,18 @@ static struct ktest ktests[] = {
 	KTEST_REG(rwlock,             CONFIG_TEST_rwlock),
 	KTEST_REG(rv,                 CONFIG_TEST_rv),
 	KTEST_REG(alarm,              CONFIG_TEST_alarm),
+	KTEST_REG(alarm_heap,         CONFIG_TEST_alarm_heap),
 	KTEST_REG(kmalloc_incref,     CONFIG_TEST_kmalloc_incref),
+	KTEST_REG(kmalloc_sizes,      CONFIG_TEST_kmalloc_sizes),
 	KTEST_REG(u16pool,            CONFIG_TEST_u16pool),
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
 	KTEST_REG(sort,               CONFIG_TEST_sort),
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
 	KTEST_REG(percpu_zalloc,      CONFIG_TEST_percpu_zalloc),
 	KTEST_REG(percpu_increment,   CONFIG_TEST_percpu_increment),
+	KTEST_REG(timer_wheel,        CONFIG_TEST_timer_wheel),
+	KTEST_REG(kmsg_roundtrip,     CONFIG_TEST_kmsg_roundtrip),
+	KTEST_REG(kmsg_throughput,    CONFIG_TEST_kmsg_throughput),
 };
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
 linker_func_1(register_pb_ktests)
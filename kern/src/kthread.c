@@ -13,6 +13,7 @@
 #include <schedule.h>
 #include <kstack.h>
 #include <kmalloc.h>
+#include <syscall.h>
 #include <arch/uaccess.h>
 
 #define KSTACK_NR_GUARD_PGS		1
@@ -168,7 +169,7 @@ void restart_kthread(struct kthread *kthread)
 			 * without first removing the old GPC, which ultimately
 			 * will result in a flushed EPT (on x86, this actually
 			 * happens when we clear_owning_proc()). */
-			lcr3(kthread->proc->env_cr3);
+			__load_addr_space(pcpui->cur_proc, kthread->proc);
 			/* Might have to clear out an existing current.  If they
 			 * need to be set later (like in restartcore), it'll be
 			 * done on demand. */
@@ -384,6 +385,8 @@ static struct kthread *save_kthread_ctx(void)
 	/* We're probably going to sleep, so get ready.  We'll check again
 	 * later. */
 	kthread = pcpui->cur_kthread;
+	/* The rest of a syscall batch shouldn't wait on us. */
+	__hand_off_sysc_batch(kthread);
 	/* We need to have a spare slot for restart, so we also use it when
 	 * sleeping.  Right now, we need a new kthread to take over if/when our
 	 * current kthread sleeps.  Use the spare, and if not, get a new one.
@@ -402,6 +405,8 @@ static struct kthread *save_kthread_ctx(void)
 		new_kthread->flags = KTH_DEFAULT_FLAGS;
 		new_kthread->proc = 0;
 		new_kthread->name = 0;
+		new_kthread->sysc_batch = 0;
+		new_kthread->nr_sysc_batch = 0;
 	} else {
 		new_kthread = __kthread_zalloc();
 		new_kthread->flags = KTH_DEFAULT_FLAGS;
@@ -26,13 +26,20 @@
 #include <umem.h>
 #include <ns.h>
 #include <tree_file.h>
+#include <rbtree_augmented.h>
 
 /* These are the only mmap flags that are saved in the VMR.  If we implement
  * more of the mmap interface, we may need to grow this. */
 #define MAP_PERSIST_FLAGS	(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)
+/* These are also saved in the VMR, but not passed to devices.  The kernel
+ * writes to populated memory (e.g. UCQs) from places where it can't fault, so
+ * fork() copies those pages eagerly instead of sharing them CoW. */
+#define MAP_VMR_FLAGS		(MAP_PERSIST_FLAGS | MAP_POPULATE | MAP_LOCKED)
 
 struct kmem_cache *vmr_kcache;
 
+bool mm_anon_jumbos = TRUE;
+
 static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg);
 static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                           int pte_prot, struct page_map *pm, size_t offset,
@@ -258,61 +265,178 @@ static void vmr_free(struct vm_region *vmr)
 	kmem_cache_free(vmr_kcache, vmr);
 }
 
+/* VMRs are kept twice: on p->vm_regions, sorted, for in-order walks, and in
+ * p->vmr_tree, an rbtree keyed on vm_base, for lookups.  The tree is augmented
+ * with the free space below each VMR (vm_gap, the distance from the previous
+ * VMR's end, or 0 for the first VMR), and each node tracks the largest gap in
+ * its subtree, so we can find a hole for mmap without walking the list.
+ *
+ * Anything that changes a VMR's vm_end or the set of VMRs needs to go through
+ * the helpers below to keep the gaps up to date. */
+static uintptr_t vmr_compute_gap_max(struct vm_region *vmr)
+{
+	uintptr_t max = vmr->vm_gap;
+	struct vm_region *child;
+
+	if (vmr->vm_rb.rb_left) {
+		child = container_of(vmr->vm_rb.rb_left, struct vm_region,
+		                     vm_rb);
+		max = MAX(max, child->vm_gap_max);
+	}
+	if (vmr->vm_rb.rb_right) {
+		child = container_of(vmr->vm_rb.rb_right, struct vm_region,
+		                     vm_rb);
+		max = MAX(max, child->vm_gap_max);
+	}
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, vmr_gap_cb, struct vm_region, vm_rb, uintptr_t,
+                     vm_gap_max, vmr_compute_gap_max)
+
+static uintptr_t vmr_gap_below(struct vm_region *vmr)
+{
+	struct vm_region *prev = TAILQ_PREV(vmr, vmr_tailq, vm_link);
+
+	return prev ? vmr->vm_base - prev->vm_end : 0;
+}
+
+/* vmr's predecessor changed; recompute its gap. */
+static void vmr_update_gap(struct vm_region *vmr)
+{
+	if (!vmr)
+		return;
+	vmr->vm_gap = vmr_gap_below(vmr);
+	vmr_gap_cb_propagate(&vmr->vm_rb, NULL);
+}
+
+/* Links vmr, which has its base and end set, into p's list (after prev, or at
+ * the head) and tree. */
+static void vmr_link(struct proc *p, struct vm_region *vmr,
+                     struct vm_region *prev)
+{
+	struct rb_node **link = &p->vmr_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct vm_region *vm_i;
+
+	if (prev)
+		TAILQ_INSERT_AFTER(&p->vm_regions, prev, vmr, vm_link);
+	else
+		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
+	vmr->vm_gap = vmr_gap_below(vmr);
+	vmr->vm_gap_max = vmr->vm_gap;
+	while (*link) {
+		parent = *link;
+		vm_i = container_of(parent, struct vm_region, vm_rb);
+		/* Propagating down as we go, like rb_insert_augmented wants */
+		if (vm_i->vm_gap_max < vmr->vm_gap)
+			vm_i->vm_gap_max = vmr->vm_gap;
+		if (vmr->vm_base < vm_i->vm_base)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&vmr->vm_rb, parent, link);
+	rb_insert_augmented(&vmr->vm_rb, &p->vmr_tree, &vmr_gap_cb);
+	vmr_update_gap(TAILQ_NEXT(vmr, vm_link));
+}
+
+static void vmr_unlink(struct proc *p, struct vm_region *vmr)
+{
+	struct vm_region *next = TAILQ_NEXT(vmr, vm_link);
+
+	rb_erase_augmented(&vmr->vm_rb, &p->vmr_tree, &vmr_gap_cb);
+	TAILQ_REMOVE(&p->vm_regions, vmr, vm_link);
+	vmr_update_gap(next);
+}
+
+static void vmr_set_end(struct vm_region *vmr, uintptr_t end)
+{
+	vmr->vm_end = end;
+	vmr_update_gap(TAILQ_NEXT(vmr, vm_link));
+}
+
+/* Finds the lowest VMR in the subtree at rb that starts above va and has at
+ * least len bytes free below it.  Each level either finds the answer in a
+ * subtree with a big enough gap or moves on, so this is O(log n). */
+static struct vm_region *__find_gap_above(struct rb_node *rb, uintptr_t va,
+                                          size_t len)
+{
+	struct vm_region *vmr, *ret;
+
+	while (rb) {
+		vmr = container_of(rb, struct vm_region, vm_rb);
+		if (vmr->vm_gap_max < len)
+			return NULL;
+		if (vmr->vm_base > va) {
+			ret = __find_gap_above(rb->rb_left, va, len);
+			if (ret)
+				return ret;
+			if (vmr->vm_gap >= len)
+				return vmr;
+		}
+		rb = rb->rb_right;
+	}
+	return NULL;
+}
+
 /* The caller will set the prot, flags, file, and offset.  We find a spot for it
  * in p's address space, set proc, base, and end.  Caller holds p's vmr_lock.
  *
- * TODO: take a look at solari's vmem alloc.  And consider keeping these in a
- * tree of some sort for easier lookups. */
+ * We take the first hole at or above va that fits, putting the VMR at va if
+ * possible, o/w at the bottom of the hole.  The base will be a multiple of
+ * align, which is a power of two. */
 static bool vmr_insert(struct vm_region *vmr, struct proc *p, uintptr_t va,
-                       size_t len)
+                       size_t len, size_t align)
 {
-	struct vm_region *vm_i, *vm_next;
+	struct vm_region *first, *next, *prev;
 	uintptr_t gap_end;
-	bool ret = false;
 
 	assert(!PGOFF(va));
 	assert(!PGOFF(len));
+	assert(!PGOFF(align));
+	va = ROUNDUP(va, align);
 	assert(__is_user_addr((void*)va, len, UMAPTOP));
 	/* Is there room before the first one: */
-	vm_i = TAILQ_FIRST(&p->vm_regions);
+	first = TAILQ_FIRST(&p->vm_regions);
 	/* This works for now, but if all we have is BRK_END ones, we'll start
 	 * growing backwards (TODO) */
-	if (!vm_i || (va + len <= vm_i->vm_base)) {
+	if (!first || (va + len <= first->vm_base)) {
 		vmr->vm_base = va;
-		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
-		ret = true;
+		prev = NULL;
+		goto found;
+	}
+	/* A hole this big fits len no matter where the hole is aligned */
+	next = __find_gap_above(p->vmr_tree.rb_node, va, len + align - PGSIZE);
+	if (next) {
+		prev = TAILQ_PREV(next, vmr_tailq, vm_link);
+		gap_end = next->vm_base;
 	} else {
-		TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
-			vm_next = TAILQ_NEXT(vm_i, vm_link);
-			gap_end = vm_next ? vm_next->vm_base : UMAPTOP;
-			/* skip til we get past the 'hint' va */
-			if (va >= gap_end)
-				continue;
-			/* Find a gap that is big enough */
-			if (gap_end - vm_i->vm_end >= len) {
-				/* if we can put it at va, let's do that.  o/w,
-				 * put it so it fits */
-				if ((gap_end >= va + len) &&
-				    (va >= vm_i->vm_end))
-					vmr->vm_base = va;
-				else
-					vmr->vm_base = vm_i->vm_end;
-				TAILQ_INSERT_AFTER(&p->vm_regions, vm_i, vmr,
-						   vm_link);
-				ret = true;
-				break;
-			}
+		/* The hole between the last VMR and UMAPTOP isn't in the
+		 * tree. */
+		prev = TAILQ_LAST(&p->vm_regions, vmr_tailq);
+		gap_end = UMAPTOP;
+		if (gap_end < ROUNDUP(prev->vm_end, align) ||
+		    gap_end - ROUNDUP(prev->vm_end, align) < len) {
+			/* Callers fall back to PGSIZE when a bigger alignment
+			 * doesn't fit, so only that failure is worth a warning.
+			 */
+			if (align == PGSIZE)
+				warn("Not making a VMR, wanted %p, + %p = %p",
+				     va, len, va + len);
+			return false;
 		}
 	}
-	/* Finalize the creation, if we got one */
-	if (ret) {
-		vmr->vm_proc = p;
-		vmr->vm_end = vmr->vm_base + len;
-	}
-	if (!ret)
-		warn("Not making a VMR, wanted %p, + %p = %p", va, len, va +
-		     len);
-	return ret;
+	/* if we can put it at va, let's do that.  o/w, put it so it fits */
+	if ((gap_end >= va + len) && (va >= prev->vm_end))
+		vmr->vm_base = va;
+	else
+		vmr->vm_base = ROUNDUP(prev->vm_end, align);
+found:
+	vmr->vm_proc = p;
+	vmr->vm_end = vmr->vm_base + len;
+	vmr_link(p, vmr, prev);
+	return true;
 }
 
 /* Split a VMR at va, returning the new VMR.  It is set up the same way, with
@@ -327,12 +451,11 @@ static struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 		return 0;
 	new_vmr = kmem_cache_alloc(vmr_kcache, 0);
 	assert(new_vmr);
-	TAILQ_INSERT_AFTER(&old_vmr->vm_proc->vm_regions, old_vmr, new_vmr,
-	                   vm_link);
 	new_vmr->vm_proc = old_vmr->vm_proc;
 	new_vmr->vm_base = va;
 	new_vmr->vm_end = old_vmr->vm_end;
 	old_vmr->vm_end = va;
+	vmr_link(old_vmr->vm_proc, new_vmr, old_vmr);
 	new_vmr->vm_prot = old_vmr->vm_prot;
 	new_vmr->vm_flags = old_vmr->vm_flags;
 	if (vmr_has_file(old_vmr)) {
@@ -356,7 +479,7 @@ static void destroy_vmr(struct vm_region *vmr)
 		pm_remove_vmr(vmr_to_pm(vmr), vmr);
 		foc_decref(vmr->__vm_foc);
 	}
-	TAILQ_REMOVE(&vmr->vm_proc->vm_regions, vmr, vm_link);
+	vmr_unlink(vmr->vm_proc, vmr);
 	vmr_free(vmr);
 }
 
@@ -373,7 +496,7 @@ static int merge_vmr(struct vm_region *first, struct vm_region *second)
 	if (vmr_has_file(first) && (second->vm_foff != first->vm_foff +
 	                            first->vm_end - first->vm_base))
 		return -1;
-	first->vm_end = second->vm_end;
+	vmr_set_end(first, second->vm_end);
 	destroy_vmr(second);
 	return 0;
 }
@@ -407,7 +530,7 @@ static int grow_vmr(struct vm_region *vmr, uintptr_t va)
 		return -1;
 	if (va <= vmr->vm_end)
 		return -1;
-	vmr->vm_end = va;
+	vmr_set_end(vmr, va);
 	return 0;
 }
 
@@ -418,7 +541,7 @@ static int shrink_vmr(struct vm_region *vmr, uintptr_t va)
 	assert(!PGOFF(va));
 	if ((va < vmr->vm_base) || (va > vmr->vm_end))
 		return -1;
-	vmr->vm_end = va;
+	vmr_set_end(vmr, va);
 	return 0;
 }
 
@@ -426,11 +549,16 @@ static int shrink_vmr(struct vm_region *vmr, uintptr_t va)
  * if there is none. */
 static struct vm_region *find_vmr(struct proc *p, uintptr_t va)
 {
+	struct rb_node *rb = p->vmr_tree.rb_node;
 	struct vm_region *vmr;
 
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
+	while (rb) {
+		vmr = container_of(rb, struct vm_region, vm_rb);
+		if (va < vmr->vm_base)
+			rb = rb->rb_left;
+		else if (va >= vmr->vm_end)
+			rb = rb->rb_right;
+		else
 			return vmr;
 	}
 	return 0;
@@ -440,28 +568,56 @@ static struct vm_region *find_vmr(struct proc *p, uintptr_t va)
  * none. */
 static struct vm_region *find_first_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
+	struct rb_node *rb = p->vmr_tree.rb_node;
+	struct vm_region *vmr, *ret = 0;
 
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
-		if (vmr->vm_base > va)
-			return vmr;
+	while (rb) {
+		vmr = container_of(rb, struct vm_region, vm_rb);
+		if (vmr->vm_end > va) {
+			ret = vmr;
+			if (vmr->vm_base <= va)
+				break;
+			rb = rb->rb_left;
+		} else {
+			rb = rb->rb_right;
+		}
 	}
-	return 0;
+	return ret;
+}
+
+/* Splits the user jumbo around va, if va is in the middle of one.  The 4K PTEs
+ * map the same memory, so the old TLB entry stays correct until whoever changes
+ * the PTEs flushes it.  Returns 0 or -ENOMEM. */
+static int __split_jumbo_at(struct proc *p, uintptr_t va)
+{
+	int ret;
+
+	if (!(va % UJUMBO_SIZE))
+		return 0;
+	spin_lock(&p->pte_lock);
+	ret = pgdir_split_jumbo(p->env_pgdir, (void*)va);
+	spin_unlock(&p->pte_lock);
+	return ret;
 }
 
 /* Makes sure that no VMRs cross either the start or end of the given region
- * [va, va + len), splitting any VMRs that are on the endpoints. */
-static void isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
+ * [va, va + len), splitting any VMRs that are on the endpoints.  Also splits
+ * any jumbos on the endpoints, since they are all or nothing for the PTE
+ * walkers.  That needs a page table, so this can fail with -ENOMEM.  The VMRs
+ * are split either way, which is harmless. */
+static int isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
 {
 	struct vm_region *vmr;
+	int ret;
+
 	if ((vmr = find_vmr(p, va)))
 		split_vmr(vmr, va);
-	/* TODO: don't want to do another find (linear search) */
 	if ((vmr = find_vmr(p, va + len)))
 		split_vmr(vmr, va + len);
+	ret = __split_jumbo_at(p, va);
+	if (ret)
+		return ret;
+	return __split_jumbo_at(p, va + len);
 }
 
 void unmap_and_destroy_vmrs(struct proc *p)
@@ -488,12 +644,91 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	spin_unlock(&p->vmr_lock);
 }
 
-/* Helper: copies the contents of pages from p to new p.  For pages that aren't
- * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+struct copy_pages_arg {
+	struct proc			*new_p;
+	bool				eager;
+	bool				shootdown_needed;
+};
+
+/* copy_page() for a user jumbo.  These are only anonymous memory. */
+static int copy_jumbo(pte_t pte, void *va, struct copy_pages_arg *cpa)
+{
+	struct page *pp = pa2page(pte_get_paddr(pte));
+	pte_t new_pte;
+
+	new_pte = pgdir_walk_jumbo(cpa->new_p->env_pgdir, va, TRUE);
+	if (!pte_walk_okay(new_pte))
+		return -ENOMEM;
+	assert(pte_is_unmapped(new_pte));
+	if (cpa->eager) {
+		if (upage_alloc_jumbo(cpa->new_p, &pp, FALSE))
+			return -ENOMEM;
+		memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), UJUMBO_SIZE);
+		pte_write(new_pte, page2pa(pp), pte_get_settings(pte));
+		return 0;
+	}
+	if (pte_has_perm_urw(pte)) {
+		pte_replace_perm(pte, PTE_USER_RO);
+		cpa->shootdown_needed = TRUE;
+	}
+	pte_write(new_pte, page2pa(pp), pte_get_settings(pte));
+	upage_incref_jumbo(pp);
+	return 0;
+}
+
+static int copy_page(struct proc *p, pte_t pte, void *va, void *arg)
+{
+	struct copy_pages_arg *cpa = arg;
+	struct page *pp;
+
+	if (pte_is_unmapped(pte))
+		return 0;
+	if (pte_is_paged_out(pte)) {
+		/* TODO: (SWAP) will need to either make a copy or CoW/refcnt
+		 * the backend store.  For now, this PTE will be the same as the
+		 * original PTE */
+		panic("Swapping not supported!");
+	}
+	/* pages could be !P, but right now that's only for file backed VMRs
+	 * undergoing page removal, which isn't the caller of copy_pages. */
+	if (!pte_is_mapped(pte))
+		panic("Weird PTE %p in %s!", pte_print(pte), __FUNCTION__);
+	if (pte_is_jumbo(pte))
+		return copy_jumbo(pte, va, cpa);
+	pp = pa2page(pte_get_paddr(pte));
+	if (cpa->eager || page_is_pagemap(pp)) {
+		if (upage_alloc(cpa->new_p, &pp, 0))
+			return -ENOMEM;
+		memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
+		if (page_insert(cpa->new_p->env_pgdir, pp, va,
+				pte_get_settings(pte))) {
+			upage_decref(pp);
+			return -ENOMEM;
+		}
+		return 0;
+	}
+	/* Share the page read-only.  Whoever writes first gets a copy, see
+	 * __hpf_cow(). */
+	if (pte_has_perm_urw(pte)) {
+		pte_replace_perm(pte, PTE_USER_RO);
+		cpa->shootdown_needed = TRUE;
+	}
+	if (page_insert(cpa->new_p->env_pgdir, pp, va, pte_get_settings(pte)))
+		return -ENOMEM;
+	upage_incref(pp);
+	return 0;
+}
+
+/* Helper: gives new_p the contents of p's pages in [va_start, va_end).  Pages
+ * are shared copy-on-write, unless eager, in which case we copy them now.  0 on
+ * success, -ERROR on failure.
+ *
+ * Jumbos are shared or copied whole.  VMRs never split a jumbo, so none of them
+ * straddle the range. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
-                      uintptr_t va_end)
+                      uintptr_t va_end, bool eager, struct tlb_batch *tb)
 {
+	struct copy_pages_arg cpa = {.new_p = new_p, .eager = eager};
 	int ret;
 
 	/* Sanity checks.  If these fail, we had a screwed up VMR.
@@ -506,51 +741,28 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		     va_end);
 		return -EINVAL;
 	}
-	int copy_page(struct proc *p, pte_t pte, void *va, void *arg) {
-		struct proc *new_p = (struct proc*)arg;
-		struct page *pp;
-
-		if (pte_is_unmapped(pte))
-			return 0;
-		/* pages could be !P, but right now that's only for file backed
-		 * VMRs undergoing page removal, which isn't the caller of
-		 * copy_pages. */
-		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
-			if (upage_alloc(new_p, &pp, 0))
-				return -ENOMEM;
-			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
-			if (page_insert(new_p->env_pgdir, pp, va,
-					pte_get_settings(pte))) {
-				page_decref(pp);
-				return -ENOMEM;
-			}
-		} else if (pte_is_paged_out(pte)) {
-			/* TODO: (SWAP) will need to either make a copy or
-			 * CoW/refcnt the backend store.  For now, this PTE will
-			 * be the same as the original PTE */
-			panic("Swapping not supported!");
-		} else {
-			panic("Weird PTE %p in %s!", pte_print(pte),
-			      __FUNCTION__);
-		}
-		return 0;
-	}
 	spin_lock(&p->pte_lock);	/* walking and changing PTEs */
 	ret = env_user_mem_walk(p, (void*)va_start, va_end - va_start,
-				&copy_page, new_p);
+				&copy_page, &cpa);
 	spin_unlock(&p->pte_lock);
+	/* Even on failure, some of p's PTEs might have been downgraded. */
+	if (cpa.shootdown_needed)
+		tlb_batch_add(tb, va_start, va_end);
 	return ret;
 }
 
-static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
+static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr,
+                    struct tlb_batch *tb)
 {
 	int ret = 0;
 
 	if (!vmr_has_file(vmr) || (vmr->vm_flags & MAP_PRIVATE)) {
 		/* We don't support ANON + SHARED yet */
 		assert(!(vmr->vm_flags & MAP_SHARED));
-		ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end);
+		ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end,
+		                 (vmr->vm_prot & PROT_WRITE) &&
+		                 (vmr->vm_flags & (MAP_POPULATE | MAP_LOCKED)),
+		                 tb);
 	} else {
 		/* non-private file, i.e. page cacheable.  we have to honor
 		 * MAP_LOCKED, (but we might be able to ignore MAP_POPULATE). */
@@ -573,7 +785,7 @@ static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
 }
 
 /* This will make new_p have the same VMRs as p, and it will make sure all
- * physical pages are copied over, with the exception of MAP_SHARED files.
+ * physical pages are copied over (CoW), with the exception of MAP_SHARED files.
  * MAP_SHARED files that are also MAP_LOCKED will be attached to the process -
  * presumably they are in the page cache since the parent locked them.  This is
  * all pretty nasty.
@@ -581,16 +793,23 @@ static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
  * This is used by fork().
  *
  * Note that if you are working on a VMR that is a file, you'll want to be
- * careful about how it is mapped (SHARED, PRIVATE, etc). */
+ * careful about how it is mapped (SHARED, PRIVATE, etc).
+ *
+ * The parent's CoW downgrades across all of the VMRs share one TLB shootdown,
+ * which happens before we return, even on failure. */
 int duplicate_vmrs(struct proc *p, struct proc *new_p)
 {
 	int ret = 0;
 	struct vm_region *vmr, *vm_i;
+	struct tlb_batch tb;
 
+	tlb_batch_init(&tb, p);
 	TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
 		vmr = kmem_cache_alloc(vmr_kcache, 0);
-		if (!vmr)
-			return -ENOMEM;
+		if (!vmr) {
+			ret = -ENOMEM;
+			break;
+		}
 		vmr->vm_proc = new_p;
 		vmr->vm_base = vm_i->vm_base;
 		vmr->vm_end = vm_i->vm_end;
@@ -602,18 +821,20 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 			foc_incref(vm_i->__vm_foc);
 			pm_add_vmr(vmr_to_pm(vm_i), vmr);
 		}
-		ret = fill_vmr(p, new_p, vmr);
+		ret = fill_vmr(p, new_p, vmr, &tb);
 		if (ret) {
 			if (vmr_has_file(vm_i)) {
 				pm_remove_vmr(vmr_to_pm(vm_i), vmr);
 				foc_decref(vm_i->__vm_foc);
 			}
 			vmr_free(vmr);
-			return ret;
+			break;
 		}
-		TAILQ_INSERT_TAIL(&new_p->vm_regions, vmr, vm_link);
+		vmr_link(new_p, vmr, TAILQ_LAST(&new_p->vm_regions,
+		                                vmr_tailq));
 	}
-	return 0;
+	tlb_batch_flush(&tb);
+	return ret;
 }
 
 void print_vmrs(struct proc *p)
@@ -758,7 +979,7 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	if (!pte_walk_okay(pte)) {
 		spin_unlock(&p->pte_lock);
 		if (!page_is_pagemap(page))
-			page_decref(page);
+			upage_decref(page);
 		return -ENOMEM;
 	}
 	/* a spurious, valid PF is possible due to a legit race: the page might
@@ -767,7 +988,7 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	if (pte_is_present(pte)) {
 		spin_unlock(&p->pte_lock);
 		if (!page_is_pagemap(page))
-			page_decref(page);
+			upage_decref(page);
 		return 0;
 	}
 	/* I used to allow clobbering an old entry (contrary to the
@@ -782,6 +1003,47 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	return 0;
 }
 
+/* Can anonymous memory at [va, va + UJUMBO_SIZE) be a jumbo?  It needs to be
+ * aligned and within the VMR. */
+static bool vmr_jumbo_ok(struct vm_region *vmr, uintptr_t va)
+{
+	return mm_anon_jumbos && !vmr_has_file(vmr) && !(va % UJUMBO_SIZE) &&
+	       (va >= vmr->vm_base) && (vmr->vm_end - va >= UJUMBO_SIZE);
+}
+
+/* Maps a zeroed jumbo at va, which the caller checked with vmr_jumbo_ok().
+ * Returns 0 on success, -EEXIST if any part of [va, va + UJUMBO_SIZE) is
+ * already mapped (by a jumbo or a page table), or -ENOMEM.  Either way, the
+ * caller can fall back to 4K pages.
+ *
+ * We check before we allocate, since zeroing 2MB isn't cheap, and again after,
+ * since we dropped the lock. */
+static int map_jumbo_at_addr(struct proc *p, uintptr_t va, int pte_prot)
+{
+	struct page *page;
+	pte_t pte;
+	bool free_pml2;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, TRUE);
+	free_pml2 = pte_walk_okay(pte) && pte_is_unmapped(pte);
+	spin_unlock(&p->pte_lock);
+	if (!free_pml2)
+		return -EEXIST;
+	if (upage_alloc_jumbo(p, &page, TRUE))
+		return -ENOMEM;
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, TRUE);
+	if (!pte_walk_okay(pte) || !pte_is_unmapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		upage_decref_jumbo(page);
+		return -EEXIST;
+	}
+	pte_write(pte, page2pa(page), pte_prot | PTE_PS);
+	spin_unlock(&p->pte_lock);
+	return 0;
+}
+
 /* Helper: copies *pp's contents to a new page, replacing your page pointer.  If
  * this succeeds, you'll have a non-PM page, which matters for how you put it.*/
 static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
@@ -796,21 +1058,108 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 	return 0;
 }
 
+/* Helper: is pte a user page that is shared with another address space? */
+static bool pte_is_cow_shared(pte_t pte)
+{
+	struct page *page = pa2page(pte_get_paddr(pte));
+
+	if (page_is_pagemap(page))
+		return FALSE;
+	if (pte_is_jumbo(pte))
+		return upage_jumbo_is_shared(page);
+	return atomic_read(&page->pg_pins) > 1;
+}
+
+/* Handles a write fault on a CoW page at va, giving p its own copy.  If we're
+ * the last one using the page, we just take it.  Returns -ENOENT if this isn't
+ * a CoW fault.  Hold the VMR lock. */
+static int __hpf_cow(struct proc *p, uintptr_t va)
+{
+	struct page *old_page, *new_page;
+	pte_t pte;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+	if (!pte_walk_okay(pte) || !pte_is_present(pte) ||
+	    pte_has_perm_urw(pte)) {
+		spin_unlock(&p->pte_lock);
+		return -ENOENT;
+	}
+	if (pte_is_jumbo(pte)) {
+		/* Jumbos are anonymous; they're ours if no one shares them */
+		old_page = pa2page(pte_get_paddr(pte));
+		if (!upage_jumbo_is_shared(old_page)) {
+			pte_replace_perm(pte, PTE_USER_RW);
+			spin_unlock(&p->pte_lock);
+			return 0;
+		}
+		if (!upage_alloc_jumbo(p, &new_page, FALSE)) {
+			memcpy(page2kva(new_page), page2kva(old_page),
+			       UJUMBO_SIZE);
+			pte_write(pte, page2pa(new_page), PTE_USER_RW | PTE_PS);
+			spin_unlock(&p->pte_lock);
+			va = ROUNDDOWN(va, UJUMBO_SIZE);
+			proc_tlbshootdown(p, va, va + UJUMBO_SIZE);
+			upage_decref_jumbo(old_page);
+			return 0;
+		}
+		/* No jumbo to copy into.  Split it and CoW just this page; our
+		 * shootdown below flushes the old jumbo's TLB entry. */
+		if (pgdir_split_jumbo(p->env_pgdir, (void*)va)) {
+			spin_unlock(&p->pte_lock);
+			return -ENOMEM;
+		}
+		pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+	}
+	old_page = pa2page(pte_get_paddr(pte));
+	if (page_is_pagemap(old_page)) {
+		spin_unlock(&p->pte_lock);
+		return -ENOENT;
+	}
+	/* Only fork() shares pages, and it holds our VMR lock.  If we see one
+	 * ref, the page is ours for good. */
+	if (atomic_read(&old_page->pg_pins) == 1) {
+		pte_replace_perm(pte, PTE_USER_RW);
+		spin_unlock(&p->pte_lock);
+		return 0;
+	}
+	if (upage_alloc(p, &new_page, FALSE)) {
+		spin_unlock(&p->pte_lock);
+		return -ENOMEM;
+	}
+	memcpy(page2kva(new_page), page2kva(old_page), PGSIZE);
+	pte_write(pte, page2pa(new_page), PTE_USER_RW);
+	spin_unlock(&p->pte_lock);
+	/* Other cores could still be reading the old page. */
+	proc_tlbshootdown(p, va, va + PGSIZE);
+	upage_decref(old_page);
+	return 0;
+}
+
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
- * mappable, which isn't true if there are concurrent changes to the VMRs. */
-static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
-                            int pte_prot)
+ * mappable, which isn't true if there are concurrent changes to the VMRs.
+ *
+ * Aligned chunks of vmr that we cover completely get jumbos, if we can. */
+static int populate_anon_va(struct proc *p, struct vm_region *vmr,
+                            uintptr_t va, unsigned long nr_pgs, int pte_prot)
 {
+	uintptr_t end = va + (nr_pgs << PGSHIFT);
 	struct page *page;
 	int ret;
 
-	for (long i = 0; i < nr_pgs; i++) {
+	while (va < end) {
+		if (vmr_jumbo_ok(vmr, va) && (end - va >= UJUMBO_SIZE) &&
+		    !map_jumbo_at_addr(p, va, pte_prot)) {
+			va += UJUMBO_SIZE;
+			continue;
+		}
 		if (upage_alloc(p, &page, TRUE))
 			return -ENOMEM;
 		/* could imagine doing a memwalk instead of a for loop */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot);
+		ret = map_page_at_addr(p, page, va, pte_prot);
 		if (ret)
 			return ret;
+		va += PGSIZE;
 	}
 	return 0;
 }
@@ -875,11 +1224,25 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 	return ret;
 }
 
+/* Anonymous mappings that can hold a jumbo get a jumbo-aligned address, unless
+ * the user asked for a specific one. */
+static size_t mmap_align(uintptr_t addr, size_t len, int flags,
+                         struct file_or_chan *file)
+{
+	if (!mm_anon_jumbos || file || (flags & MAP_FIXED) ||
+	    (len < UJUMBO_SIZE))
+		return PGSIZE;
+	if (ROUNDUP(addr, UJUMBO_SIZE) + len > UMAPTOP)
+		return PGSIZE;
+	return UJUMBO_SIZE;
+}
+
 void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
               struct file_or_chan *file, size_t offset)
 {
 	len = ROUNDUP(len, PGSIZE);
 	struct vm_region *vmr, *vmr_temp;
+	size_t align;
 
 	assert(mmap_flags_priv_ok(flags));
 	assert(prot_is_valid(prot));
@@ -903,7 +1266,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		flags |= MAP_POPULATE | MAP_LOCKED;
 	vmr->vm_prot = prot;
 	vmr->vm_foff = offset;
-	vmr->vm_flags = flags & MAP_PERSIST_FLAGS;
+	vmr->vm_flags = flags & MAP_VMR_FLAGS;
 	/* We grab the file early, so we can block.  This is all hokey.  The VMR
 	 * isn't ready yet, so the PM code will ignore it. */
 	if (file) {
@@ -940,19 +1303,15 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 	 * and then remove everything in between.  __do_munmap() will do this.
 	 * Careful, this means an mmap can be an implied munmap() (not my
 	 * call...). */
-	if (flags & MAP_FIXED)
-		__do_munmap(p, addr, len);
-	if (!vmr_insert(vmr, p, addr, len)) {
-		spin_unlock(&p->vmr_lock);
-		if (vmr_has_file(vmr)) {
-			pm_remove_vmr(vmr_to_pm(vmr), vmr);
-			foc_decref(vmr->__vm_foc);
-		}
-		vmr_free(vmr);
+	if ((flags & MAP_FIXED) && __do_munmap(p, addr, len)) {
+		/* __do_munmap() set errno */
+		goto out_insert_fail;
+	}
+	align = mmap_align(addr, len, flags, file);
+	if (!vmr_insert(vmr, p, addr, len, align) &&
+	    (align == PGSIZE || !vmr_insert(vmr, p, addr, len, PGSIZE))) {
 		set_error(ENOMEM, "probably tried to mmap beyond UMAPTOP");
-		/* Slightly weird semantics: if we fail and had munmapped the
-		 * space, they will have a hole in their VM now. */
-		return MAP_FAILED;
+		goto out_insert_fail;
 	}
 	addr = vmr->vm_base;
 	vmr->vm_ready = true;
@@ -965,7 +1324,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		unsigned long nr_pgs = len >> PGSHIFT;
 		int ret = 0;
 		if (!file) {
-			ret = populate_anon_va(p, addr, nr_pgs, pte_prot);
+			ret = populate_anon_va(p, vmr, addr, nr_pgs, pte_prot);
 		} else {
 			/* Note: this will unlock if it blocks.  our refcnt on
 			 * the file keeps the pm alive when we unlock */
@@ -986,6 +1345,17 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 	profiler_notify_mmap(p, addr, len, prot, flags, file, offset);
 
 	return (void*)addr;
+
+out_insert_fail:
+	spin_unlock(&p->vmr_lock);
+	if (vmr_has_file(vmr)) {
+		pm_remove_vmr(vmr_to_pm(vmr), vmr);
+		foc_decref(vmr->__vm_foc);
+	}
+	vmr_free(vmr);
+	/* Slightly weird semantics: if we fail and had munmapped the space,
+	 * they will have a hole in their VM now. */
+	return MAP_FAILED;
 }
 
 int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
@@ -1031,9 +1401,11 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 
 	assert(prot_is_valid(prot));
 	/* TODO: this is aggressively splitting, when we might not need to if
-	 * the prots are the same as the previous.  Plus, there are three
-	 * excessive scans. */
-	isolate_vmrs(p, addr, len);
+	 * the prots are the same as the previous. */
+	if (isolate_vmrs(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
 	vmr = find_first_vmr(p, addr);
 	while (vmr && vmr->vm_base < addr + len) {
 		if (vmr->vm_prot == prot)
@@ -1054,10 +1426,22 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 		for (uintptr_t va = vmr->vm_base; va < vmr->vm_end;
 		     va += PGSIZE) {
 			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
-			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
-				pte_replace_perm(pte, pte_prot);
+			if (!pte_walk_okay(pte))
+				continue;
+			if (pte_is_mapped(pte)) {
+				/* CoW pages stay RO until someone writes */
+				if (pte_prot == PTE_USER_RW &&
+				    pte_is_cow_shared(pte))
+					pte_replace_perm(pte, PTE_USER_RO);
+				else
+					pte_replace_perm(pte, pte_prot);
 				shootdown_needed = TRUE;
 			}
+			/* isolate_vmrs() split any jumbo on our edges, so
+			 * this one is entirely in the VMR. */
+			if (pte_is_jumbo(pte))
+				va = ROUNDDOWN(va, UJUMBO_SIZE) + UJUMBO_SIZE -
+				     PGSIZE;
 		}
 		spin_unlock(&p->pte_lock);
 next_vmr:
@@ -1113,7 +1497,10 @@ static int __munmap_pte(struct proc *p, pte_t pte, void *va, void *arg)
 		return 0;
 	if (pte_is_dirty(pte)) {
 		page = pa2page(pte_get_paddr(pte));
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		if (page_is_pagemap(page))
+			pm_page_set_dirty(page);
+		else
+			atomic_or(&page->pg_flags, PG_DIRTY);
 	}
 	pte_clear_present(pte);
 	*shootdown_needed = TRUE;
@@ -1136,12 +1523,17 @@ static int __munmap_pte(struct proc *p, pte_t pte, void *va, void *arg)
 static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 {
 	struct page *page;
+	bool jumbo;
+
 	if (pte_is_unmapped(pte))
 		return 0;
 	page = pa2page(pte_get_paddr(pte));
+	jumbo = pte_is_jumbo(pte);
 	pte_clear(pte);
-	if (!page_is_pagemap(page))
-		page_decref(page);
+	if (jumbo)
+		upage_decref_jumbo(page);
+	else if (!page_is_pagemap(page))
+		upage_decref(page);
 	return 0;
 }
 
@@ -1150,9 +1542,10 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 	struct vm_region *vmr, *next_vmr, *first_vmr;
 	bool shootdown_needed = FALSE;
 
-	/* TODO: this will be a bit slow, since we end up doing three linear
-	 * searches (two in isolate, one in find_first). */
-	isolate_vmrs(p, addr, len);
+	if (isolate_vmrs(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
 	first_vmr = find_first_vmr(p, addr);
 	vmr = first_vmr;
 	spin_lock(&p->pte_lock);	/* changing PTEs */
@@ -1194,7 +1587,7 @@ static void __put_page(struct page *page)
 	if (page_is_pagemap(page))
 		pm_put_page(page);
 	else
-		page_decref(page);
+		upage_decref(page);
 }
 
 static int __hpf_load_page(struct proc *p, struct page_map *pm,
@@ -1265,6 +1658,7 @@ static int __hpf(struct proc *p, uintptr_t va, int prot, bool file_ok)
 	struct file_or_chan *file;
 	struct page *a_page;
 	unsigned int f_idx;	/* index of the missing page in the file */
+	int pte_prot;
 	int ret = 0;
 	bool first = TRUE;
 	va = ROUNDDOWN(va,PGSIZE);
@@ -1283,8 +1677,20 @@ refault:
 		ret = -EPERM;
 		goto out;
 	}
+	if ((prot & PROT_WRITE) && !(vmr->vm_flags & MAP_SHARED)) {
+		ret = __hpf_cow(p, va);
+		if (ret != -ENOENT)
+			goto out;
+		ret = 0;
+	}
+	pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	if (!vmr_has_file(vmr)) {
-		/* No file - just want anonymous memory */
+		/* No file - just want anonymous memory.  Try for a jumbo. */
+		if (vmr_jumbo_ok(vmr, ROUNDDOWN(va, UJUMBO_SIZE)) &&
+		    !map_jumbo_at_addr(p, ROUNDDOWN(va, UJUMBO_SIZE),
+		                       pte_prot))
+			goto out;
 		if (upage_alloc(p, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
@@ -1345,8 +1751,6 @@ refault:
 	}
 	/* update the page table TODO: careful with MAP_PRIVATE etc.  might do
 	 * this separately (file, no file) */
-	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
-	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	ret = map_page_at_addr(p, a_page, va, pte_prot);
 	/* fall through, even for errors */
 out_put_pg:
@@ -1398,7 +1802,8 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 			                                          : 0;
 		nr_pgs_this_vmr = MIN(nr_pgs, (vmr->vm_end - va) >> PGSHIFT);
 		if (!vmr_has_file(vmr)) {
-			if (populate_anon_va(p, va, nr_pgs_this_vmr, pte_prot))
+			if (populate_anon_va(p, vmr, va, nr_pgs_this_vmr,
+			                     pte_prot))
 			{
 				/* on any error, we can just bail.  we might be
 				 * underestimating nr_filled. */
@@ -73,7 +73,7 @@ enum {
 
 	Logtype = 5,
 	Masktype = (1 << Logtype) - 1,
-	Logconv = 12,
+	Logconv = 20,
 	Maskconv = (1 << Logconv) - 1,
 	Shiftconv = Logtype,
 	Logproto = 8,
@@ -84,10 +84,11 @@ enum {
 	BYPASS_QMAX = 64 * MiB,
 	IPROUTE_LEN = 2 * PGSIZE,
 };
-#define TYPE(x) 	( ((uint32_t)(x).path) & Masktype )
-#define CONV(x) 	( (((uint32_t)(x).path) >> Shiftconv) & Maskconv )
-#define PROTO(x) 	( (((uint32_t)(x).path) >> Shiftproto) & Maskproto )
-#define QID(p, c, y) 	( ((p)<<(Shiftproto)) | ((c)<<Shiftconv) | (y))
+#define TYPE(x) 	( ((uint64_t)(x).path) & Masktype )
+#define CONV(x) 	( (((uint64_t)(x).path) >> Shiftconv) & Maskconv )
+#define PROTO(x) 	( (((uint64_t)(x).path) >> Shiftproto) & Maskproto )
+#define QID(p, c, y) 	( ((uint64_t)(p) << Shiftproto) | \
+			  ((uint64_t)(c) << Shiftconv) | (y))
 static char network[] = "network";
 
 qlock_t fslock;
@@ -266,12 +267,16 @@ static int ip1gen(struct chan *c, int i, struct dir *dp)
 	return 1;
 }
 
-static int ipgen(struct chan *c, char *unused_char_p_t, struct dirtab *d,
+static int ipgen(struct chan *c, char *name, struct dirtab *d,
 		 int unused_int, int s, struct dir *dp)
 {
 	struct qid q;
 	struct conv *cv;
 	struct Fs *f;
+	struct Proto *p;
+	char *ename;
+	long x;
+	int ac;
 
 	f = ipfs[c->dev];
 
@@ -299,14 +304,29 @@ static int ipgen(struct chan *c, char *unused_char_p_t, struct dirtab *d,
 	case Qprotodir:
 		if (s == DEVDOTDOT)
 			return topdirgen(c, dp);
-		else if (s < f->p[PROTO(c->qid)]->ac) {
-			cv = f->p[PROTO(c->qid)]->conv[s];
+		p = f->p[PROTO(c->qid)];
+		/* ac only grows, and conv[0, ac) are always there. */
+		ac = READ_ONCE(p->ac);
+		if (name != NULL) {
+			/* Walks go straight to what they're looking for, instead
+			 * of generating every conv until the name matches. */
+			x = strtol(name, &ename, 10);
+			if (ename != name && *ename == '\0') {
+				if (s > 0 || x < 0 || x >= ac)
+					return -1;
+				s = x;
+			} else {
+				s += ac;
+			}
+		}
+		if (s < ac) {
+			cv = p->conv[s];
 			snprintf(get_cur_genbuf(), GENBUF_SZ, "%d", s);
 			mkqid(&q, QID(PROTO(c->qid), s, Qconvdir), 0, QTDIR);
 			return founddevdir(c, q, get_cur_genbuf(), 0, cv->owner,
 					   0555, dp);
 		}
-		s -= f->p[PROTO(c->qid)]->ac;
+		s -= ac;
 		return ip2gen(c, s + Qprotobase, dp);
 	case Qclone:
 	case Qstats:
@@ -748,6 +768,7 @@ static void closeconv(struct conv *cv)
 		undo_proto_qio_bypass(cv);
 	cv->p->close(cv);
 	cv->state = Idle;
+	Fsreleaseconv(cv);
 	qunlock(&cv->qlock);
 	poperror();
 }
@@ -1708,9 +1729,12 @@ int Fsproto(struct Fs *f, struct Proto *p)
 
 	p->qid.type = QTDIR;
 	p->qid.path = QID(f->np, 0, Qprotodir);
+	assert(p->nc <= Maskconv + 1);
 	p->conv = kzmalloc(sizeof(struct conv *) * (p->nc + 1), 0);
 	if (p->conv == NULL)
 		panic("Fsproto");
+	spinlock_init(&p->freelock);
+	TAILQ_INIT(&p->freeconvs);
 
 	p->x = f->np;
 	p->nextport = 0;
@@ -1729,68 +1753,126 @@ int Fsbuiltinproto(struct Fs *f, uint8_t proto)
 	return f->t2p[proto] != NULL;
 }
 
+static bool conv_is_free(struct Proto *p, struct conv *c)
+{
+	/* make sure both processes and protocol are done with this Conv */
+	return c->inuse == 0 && (p->inuse == NULL || (*p->inuse)(c) == 0);
+}
+
+/* Tells the protocol that c might be reusable.  This gets called when the last
+ * user closes c and when the protocol itself is done with it (e.g. TCP going
+ * to Closed), with c locked.  Only the second of those actually queues c. */
+void Fsreleaseconv(struct conv *c)
+{
+	struct Proto *p = c->p;
+
+	if (!conv_is_free(p, c))
+		return;
+	spin_lock(&p->freelock);
+	if (!c->free_queued) {
+		c->free_queued = TRUE;
+		TAILQ_INSERT_TAIL(&p->freeconvs, c, free_link);
+	}
+	spin_unlock(&p->freelock);
+}
+
+/* Returns a released conv, locked, or NULL if there aren't any.  Convs that got
+ * reused since they were queued are dropped; they'll come back when they're
+ * released again.  Called with the protocol locked. */
+static struct conv *Fsfreeconv(struct Proto *p)
+{
+	struct conv_tailq busy = TAILQ_HEAD_INITIALIZER(busy);
+	struct conv *c;
+
+	spin_lock(&p->freelock);
+	while ((c = TAILQ_FIRST(&p->freeconvs))) {
+		TAILQ_REMOVE(&p->freeconvs, c, free_link);
+		/* Someone is briefly looking at c (e.g. a lookup that lost a
+		 * race).  We can't block on it with the protocol locked. */
+		if (!canqlock(&c->qlock)) {
+			TAILQ_INSERT_TAIL(&busy, c, free_link);
+			continue;
+		}
+		c->free_queued = FALSE;
+		if (conv_is_free(p, c))
+			break;
+		qunlock(&c->qlock);
+	}
+	TAILQ_CONCAT(&p->freeconvs, &busy, free_link);
+	spin_unlock(&p->freelock);
+	return c;
+}
+
+/* Makes conv number x, which is the next unused slot.  Returns it locked. */
+static struct conv *Fsnewconv(struct Proto *p, int x)
+{
+	struct conv *c;
+
+	c = kzmalloc(sizeof(struct conv), 0);
+	if (c == NULL)
+		error(ENOMEM, "conv kzmalloc(%d, 0) failed in Fsprotoclone",
+		      sizeof(struct conv));
+	qlock_init(&c->qlock);
+	qlock_init(&c->listenq);
+	rendez_init(&c->cr);
+	rendez_init(&c->listenr);
+	/* already = 0; set to be futureproof */
+	SLIST_INIT(&c->data_taps);
+	SLIST_INIT(&c->listen_taps);
+	spinlock_init(&c->tap_lock);
+	qlock(&c->qlock);
+	c->p = p;
+	c->x = x;
+	if (p->ptclsize != 0) {
+		c->ptcl = kzmalloc(p->ptclsize, 0);
+		if (c->ptcl == NULL) {
+			kfree(c);
+			error(ENOMEM, "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
+			      p->ptclsize);
+		}
+	}
+	c->eq = qopen(1024, Qmsg, 0, 0);
+	(*p->create) (c);
+	assert(c->rq && c->wq);
+	p->conv[x] = c;
+	/* ipgen() looks at conv[0, ac) without the protocol lock */
+	wmb();
+	WRITE_ONCE(p->ac, x + 1);
+	return c;
+}
+
 /*
  *  called with protocol locked
+ *
+ *  Convs are handed out from the free queue, then from the unused slots.
+ *  Only when both are empty do we scan every conv, for ones that were freed
+ *  without being released (or were briefly busy), and then ask the protocol
+ *  to garbage collect.
  */
 struct conv *Fsprotoclone(struct Proto *p, char *user)
 {
 	struct conv *c, **pp, **ep;
 
 retry:
-	c = NULL;
-	ep = &p->conv[p->nc];
-	for (pp = p->conv; pp < ep; pp++) {
-		c = *pp;
-		if (c == NULL) {
-			c = kzmalloc(sizeof(struct conv), 0);
-			if (c == NULL)
-				error(ENOMEM,
-				      "conv kzmalloc(%d, 0) failed in Fsprotoclone",
-				      sizeof(struct conv));
-			qlock_init(&c->qlock);
-			qlock_init(&c->listenq);
-			rendez_init(&c->cr);
-			rendez_init(&c->listenr);
-			/* already = 0; set to be futureproof */
-			SLIST_INIT(&c->data_taps);
-			SLIST_INIT(&c->listen_taps);
-			spinlock_init(&c->tap_lock);
-			qlock(&c->qlock);
-			c->p = p;
-			c->x = pp - p->conv;
-			if (p->ptclsize != 0) {
-				c->ptcl = kzmalloc(p->ptclsize, 0);
-				if (c->ptcl == NULL) {
-					kfree(c);
-					error(ENOMEM,
-					      "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
-					      p->ptclsize);
-				}
+	c = Fsfreeconv(p);
+	if (c == NULL && p->ac < p->nc)
+		c = Fsnewconv(p, p->ac);
+	if (c == NULL) {
+		ep = &p->conv[p->ac];
+		for (pp = p->conv; pp < ep; pp++) {
+			c = *pp;
+			if (canqlock(&c->qlock)) {
+				if (conv_is_free(p, c))
+					break;
+				qunlock(&c->qlock);
 			}
-			*pp = c;
-			p->ac++;
-			c->eq = qopen(1024, Qmsg, 0, 0);
-			(*p->create) (c);
-			assert(c->rq && c->wq);
-			break;
 		}
-		if (canqlock(&c->qlock)) {
-			/*
-			 *  make sure both processes and protocol
-			 *  are done with this Conv
-			 */
-			if (c->inuse == 0 && (p->inuse == NULL ||
-					      (*p->inuse)(c) == 0))
-				break;
-
-			qunlock(&c->qlock);
+		if (pp >= ep) {
+			if (p->gc != NULL && (*p->gc) (p))
+				goto retry;
+			return NULL;
 		}
 	}
-	if (pp >= ep) {
-		if (p->gc != NULL && (*p->gc) (p))
-			goto retry;
-		return NULL;
-	}
 
 	c->inuse = 1;
 	kstrdup(&c->owner, user);
@@ -1912,10 +1994,3 @@ static long ndbwrite(struct Fs *f, char *a, uint32_t off, int n)
 	f->ndbmtime = seconds();
 	return n;
 }
-
-uint32_t scalednconv(void)
-{
-	//if(conf.npage*BY2PG >= 128*MB)
-	return Nchans * 4;
-	//  return Nchans;
-}
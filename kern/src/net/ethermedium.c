@@ -125,6 +125,8 @@ enum {
 	ETIP6 = 0x86DD,
 	ARPREQUEST = 1,
 	ARPREPLY = 2,
+
+	ETHER_RX_BATCH = 64,	/* most v4 frames read at once */
 };
 
 typedef struct Etherarp Etherarp;
@@ -422,11 +424,32 @@ static void etherbwrite(struct Ipifc *ifc, struct block *bp, int version,
 /*
  *  process to read from the ethernet
  */
+/* Returns the next frame if one is already queued on c, NULL o/w. */
+static struct block *etherread_nonblock(struct chan *c)
+{
+	ERRSTACK(1);
+	struct block *bp;
+
+	c->flag |= O_NONBLOCK;
+	if (waserror()) {
+		c->flag &= ~O_NONBLOCK;
+		if (get_errno() != EAGAIN)
+			nexterror();
+		poperror();
+		return NULL;
+	}
+	bp = devtab[c->type].bread(c, 128 * 1024, 0);
+	c->flag &= ~O_NONBLOCK;
+	poperror();
+	return bp;
+}
+
 static void etherread4(void *a)
 {
 	ERRSTACK(2);
 	struct Ipifc *ifc;
 	struct block *bp;
+	struct ipgro gro;
 	Etherrock *er;
 
 	ifc = a;
@@ -438,6 +461,7 @@ static void etherread4(void *a)
 		warn("etherread4 returns, probably unexpectedly\n");
 		return;
 	}
+	ipgro_init(&gro);
 	for (;;) {
 		bp = devtab[er->mchan4->type].bread(er->mchan4, 128 * 1024, 0);
 		if (!canrlock(&ifc->rwlock)) {
@@ -448,14 +472,22 @@ static void etherread4(void *a)
 			runlock(&ifc->rwlock);
 			nexterror();
 		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(er->f, ifc, bp);
+		/* Take whatever else has already arrived, so that we can
+		 * coalesce TCP segments across the batch. */
+		for (int i = 1; bp; i++) {
+			ifc->in++;
+			bp->rp += ifc->m->hsize;
+			if (ifc->lifc == NULL) {
+				freeb(bp);
+			} else {
+				ipifc_trace_block(ifc, bp);
+				ipgro_input4(er->f, ifc, &gro, bp);
+			}
+			if (i == ETHER_RX_BATCH)
+				break;
+			bp = etherread_nonblock(er->mchan4);
 		}
+		ipgro_flush(er->f, ifc, &gro);
 		runlock(&ifc->rwlock);
 		poperror();
 	}
@@ -37,6 +37,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <net/ip.h>
+#include <net/tcp.h>
 
 typedef struct IP IP;
 typedef struct Fragment4 Fragment4;
@@ -77,8 +78,10 @@ enum {
 	FragOKs,
 	FragFails,
 	FragCreates,
+	GsoSegs,
+	GroMerges,
 
-	Nstats,
+	Nipstats,
 };
 
 struct fragment4 {
@@ -106,7 +109,7 @@ struct Ipfrag {
 
 /* an instance of IP */
 struct IP {
-	uint32_t stats[Nstats];
+	uint32_t stats[Nipstats];
 
 	qlock_t fraglock4;
 	struct fragment4 *flisthead4;
@@ -141,6 +144,8 @@ static char *statnames[] = {
 	[FragOKs] "FragOKs",
 	[FragFails] "FragFails",
 	[FragCreates] "FragCreates",
+	[GsoSegs] "GsoSegs",
+	[GroMerges] "GroMerges",
 };
 
 #define BLKIP(xp)	((struct Ip4hdr*)((xp)->rp))
@@ -230,6 +235,98 @@ void iprouting(struct Fs *f, int on)
 		f->ip->stats[Forwarding] = 1;
 }
 
+/* Segmentation offload in software, for interfaces that can't do TSO.  TCP hands
+ * us one large segment (Btso, bp->mss), and we cut it into mss-sized segments,
+ * each with a copy of the IP and TCP headers.  The payload isn't copied; the
+ * segments point into bp's buffers, like the fragments in ipoput4().
+ *
+ * Called with ifc rlocked.  Consumes bp. */
+static void ipgso4(struct IP *ip, struct Ipifc *ifc, struct block *bp, int len,
+		   uint8_t *gate)
+{
+	/* A TCP header with options is at most 60 bytes. */
+	uint8_t hdr[TCP4_PKT + 60], ph[TCP4_PHDRSIZE];
+	struct block *xp, *nb;
+	struct Ip4hdr *eh;
+	Tcp4hdr *h;
+	int hlen, dlen, seglen, offset, mss;
+	uint32_t seq, off;
+	uint8_t flags;
+
+	mss = bp->mss;
+	/* pullupblock() doesn't free bp if the blist is too short, only if it
+	 * runs out partway, so check the lengths first (len <= blocklen(bp)). */
+	if (len < TCP4_PKT + TCP4_HDRSIZE)
+		goto drop;
+	bp = pullupblock(bp, TCP4_PKT + TCP4_HDRSIZE);
+	if (bp == NULL)
+		goto dropped;
+	h = (Tcp4hdr *)bp->rp;
+	hlen = TCP4_PKT + (h->tcpflag[0] >> 4) * 4;
+	if (hlen < TCP4_PKT + TCP4_HDRSIZE || hlen > len)
+		goto drop;
+	bp = pullupblock(bp, hlen);
+	if (bp == NULL)
+		goto dropped;
+	memmove(hdr, bp->rp, hlen);
+	h = (Tcp4hdr *)hdr;
+	seq = nhgetl(h->tcpseq);
+	flags = h->tcpflag[1];
+	dlen = len - hlen;
+
+	/* Skip the headers; the payload usually starts in the first block. */
+	xp = bp;
+	offset = hlen;
+	while (xp != NULL && offset && offset >= BLEN(xp)) {
+		offset -= BLEN(xp);
+		xp = xp->next;
+	}
+	xp->rp += offset;
+
+	for (off = 0; off < dlen; off += seglen) {
+		seglen = MIN(mss, dlen - off);
+		nb = blist_clone(xp, hlen, seglen, off);
+		memmove(nb->wp, hdr, hlen);
+		nb->wp += hlen;
+		eh = (struct Ip4hdr *)nb->rp;
+		h = (Tcp4hdr *)nb->rp;
+
+		hnputl(h->tcpseq, seq + off);
+		/* Only the last segment carries the FIN and PSH. */
+		if (off + seglen < dlen)
+			h->tcpflag[1] = flags & ~(FIN | PSH);
+		/* The checksum field holds the pseudo-header sum, which covers
+		 * the length.  The NIC or etheroq() finishes it. */
+		if (bp->flag & Btcpck) {
+			ph[0] = 0;
+			ph[1] = IP_TCPPROTO;
+			hnputs(ph + 2, hlen - TCP4_PKT + seglen);
+			memmove(ph + 4, h->tcpsrc, 2 * IPv4addrlen);
+			hnputs(h->tcpcksum, ptclbsum(ph, TCP4_PHDRSIZE));
+			nb->flag |= Btcpck;
+			nb->network_offset = 0;
+			nb->transport_offset = bp->transport_offset;
+			nb->tx_csum_offset = bp->tx_csum_offset;
+		}
+
+		hnputs(eh->length, hlen + seglen);
+		hnputs(eh->id, NEXT_ID(ip->id4));
+		eh->frag[0] = IP_DF >> 8;
+		eh->frag[1] = 0;
+		eh->cksum[0] = 0;
+		eh->cksum[1] = 0;
+		hnputs(eh->cksum, ipcsum(&eh->vihl));
+		ifc->m->bwrite(ifc, nb, V4, gate);
+		ip->stats[GsoSegs]++;
+	}
+	freeblist(bp);
+	return;
+drop:
+	freeblist(bp);
+dropped:
+	ip->stats[OutDiscards]++;
+}
+
 int ipoput4(struct Fs *f, struct block *bp, int gating, int ttl, int tos, struct
 	    conv *c)
 {
@@ -307,8 +404,16 @@ int ipoput4(struct Fs *f, struct block *bp, int gating, int ttl, int tos, struct
 	if (ifc->m == NULL)
 		goto raise;
 
-	/* If we dont need to fragment just send it */
 	medialen = ifc->maxtu - ifc->m->hsize;
+	/* TCP wants TSO, but the NIC can't do it */
+	if (bp->flag & Btso && len > medialen && !(ifc->feat & NETF_TSO)) {
+		ipgso4(ip, ifc, bp, len, gate);
+		runlock(&ifc->rwlock);
+		poperror();
+		return 0;
+	}
+
+	/* If we dont need to fragment just send it */
 	if (bp->flag & Btso || len <= medialen) {
 		if (!gating)
 			hnputs(eh->id, NEXT_ID(ip->id4));
@@ -548,6 +653,186 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	freeblist(bp);
 }
 
+void ipgro_init(struct ipgro *g)
+{
+	memset(g, 0, sizeof(struct ipgro));
+}
+
+/* Returns bp's TCP header if bp is a segment we can merge: IPv4 without
+ * options or fragmentation, to one of our unicast addresses, just data and an
+ * ACK, and headers in the first block.  We verify the checksums here, once,
+ * since the merged segment's checksum fields won't mean anything. */
+static Tcp4hdr *ipgro_tcp4(struct Fs *f, struct block *bp)
+{
+	Tcp4hdr *h = (Tcp4hdr *)bp->rp;
+	uint8_t v6dst[IPaddrlen], ipck[2];
+	uint8_t ttl;
+	int len, hlen;
+	bool bad;
+
+	if (BHLEN(bp) < TCP4_PKT + TCP4_HDRSIZE)
+		return NULL;
+	if (h->vihl != (IP_VER4 | IP_HLEN4) || h->proto != IP_TCPPROTO)
+		return NULL;
+	if (nhgets(h->frag) & ~IP_DF)
+		return NULL;
+	if ((h->tcpflag[1] & ~PSH) != ACK)
+		return NULL;
+	len = nhgets(h->length);
+	hlen = TCP4_PKT + (h->tcpflag[0] >> 4) * 4;
+	/* Frames with padding are too small to be worth it. */
+	if (len != blocklen(bp))
+		return NULL;
+	if (hlen < TCP4_PKT + TCP4_HDRSIZE || hlen >= len || hlen > BHLEN(bp))
+		return NULL;
+	v4tov6(v6dst, h->tcpdst);
+	if (!(ipforme(f, v6dst) & Runi))
+		return NULL;
+
+	if (!(bp->flag & Bipck)) {
+		if (ipcsum(&h->vihl))
+			return NULL;
+		bp->flag |= Bipck;
+	}
+	if (!(bp->flag & Btcpck) && (h->tcpcksum[0] || h->tcpcksum[1])) {
+		/* Like tcpiput(), lay the pseudo header over the end of the IP
+		 * header. */
+		ttl = h->Unused;
+		memmove(ipck, h->tcplen, sizeof(ipck));
+		h->Unused = 0;
+		hnputs(h->tcplen, len - TCP4_PKT);
+		bad = ptclcsum(bp, TCP4_IPLEN, len - TCP4_IPLEN) != 0;
+		h->Unused = ttl;
+		memmove(h->tcplen, ipck, sizeof(ipck));
+		if (bad)
+			return NULL;
+		bp->flag |= Btcpck;
+	}
+	return h;
+}
+
+/* Returns the slot holding a segment for h's flow, or -1. */
+static int ipgro_lookup(struct ipgro *g, Tcp4hdr *h)
+{
+	Tcp4hdr *hh;
+
+	if (!g->nr_held)
+		return -1;
+	for (int i = 0; i < IPGRO_FLOWS; i++) {
+		if (!g->held[i])
+			continue;
+		hh = (Tcp4hdr *)g->held[i]->rp;
+		/* Addresses and ports are contiguous. */
+		if (!memcmp(h->tcpsrc, hh->tcpsrc, 2 * IPv4addrlen) &&
+		    !memcmp(h->tcpsport, hh->tcpsport, 4))
+			return i;
+	}
+	return -1;
+}
+
+/* Whether h, with dlen bytes of data, picks up where slot i's segment leaves
+ * off.  Everything but the sequence number has to match, so the merged
+ * segment tells TCP the same thing the pieces would have. */
+static bool ipgro_can_merge(struct ipgro *g, int i, Tcp4hdr *h, int dlen)
+{
+	Tcp4hdr *hh = (Tcp4hdr *)g->held[i]->rp;
+	int len = nhgets(hh->length);
+	int hlen = TCP4_PKT + (hh->tcpflag[0] >> 4) * 4;
+
+	if (g->nr_segs[i] >= IPGRO_MAX_SEGS || len + dlen >= IP_MAX)
+		return FALSE;
+	if (nhgetl(h->tcpseq) != nhgetl(hh->tcpseq) + len - hlen)
+		return FALSE;
+	return h->tcpflag[0] == hh->tcpflag[0] &&
+	       !memcmp(h->tcpack, hh->tcpack, sizeof(h->tcpack)) &&
+	       !memcmp(h->tcpwin, hh->tcpwin, sizeof(h->tcpwin)) &&
+	       !memcmp(h->tcpopt, hh->tcpopt, hlen - TCP4_PKT - TCP4_HDRSIZE);
+}
+
+static void ipgro_flush_one(struct Fs *f, struct Ipifc *ifc, struct ipgro *g,
+			    int i)
+{
+	struct block *bp = g->held[i];
+
+	g->held[i] = NULL;
+	g->tail[i] = NULL;
+	g->nr_held--;
+	ipiput4(f, ifc, bp);
+}
+
+static void ipgro_hold(struct ipgro *g, int i, struct block *bp)
+{
+	g->held[i] = bp;
+	g->nr_segs[i] = 1;
+	g->nr_held++;
+	while (bp->next)
+		bp = bp->next;
+	g->tail[i] = bp;
+}
+
+/* Passes everything we're holding up the stack. */
+void ipgro_flush(struct Fs *f, struct Ipifc *ifc, struct ipgro *g)
+{
+	for (int i = 0; g->nr_held && i < IPGRO_FLOWS; i++) {
+		if (g->held[i])
+			ipgro_flush_one(f, ifc, g, i);
+	}
+}
+
+/* Takes a frame from the medium, like ipiput4().  TCP segments may be held
+ * until a later frame or ipgro_flush() sends them up.  Called with ifc
+ * rlocked. */
+void ipgro_input4(struct Fs *f, struct Ipifc *ifc, struct ipgro *g,
+		  struct block *bp)
+{
+	Tcp4hdr *h, *hh;
+	struct block *tail;
+	int i, dlen, hlen;
+	uint8_t flags;
+
+	h = ipgro_tcp4(f, bp);
+	if (!h) {
+		/* Don't let it get ahead of what we hold for its flow. */
+		if (g->nr_held && BHLEN(bp) >= TCP4_PKT + TCP4_HDRSIZE) {
+			i = ipgro_lookup(g, (Tcp4hdr *)bp->rp);
+			if (i >= 0)
+				ipgro_flush_one(f, ifc, g, i);
+		}
+		ipiput4(f, ifc, bp);
+		return;
+	}
+	flags = h->tcpflag[1];
+	hlen = TCP4_PKT + (h->tcpflag[0] >> 4) * 4;
+	dlen = nhgets(h->length) - hlen;
+
+	i = ipgro_lookup(g, h);
+	if (i >= 0 && ipgro_can_merge(g, i, h, dlen)) {
+		hh = (Tcp4hdr *)g->held[i]->rp;
+		hnputs(hh->length, nhgets(hh->length) + dlen);
+		hh->tcpflag[1] |= flags & PSH;
+		bp->rp += hlen;
+		for (tail = bp; tail->next; tail = tail->next)
+			;
+		g->tail[i]->next = bp;
+		g->tail[i] = tail;
+		g->nr_segs[i]++;
+		f->ip->stats[GroMerges]++;
+	} else {
+		if (i >= 0) {
+			ipgro_flush_one(f, ifc, g, i);
+		} else {
+			if (g->nr_held == IPGRO_FLOWS)
+				ipgro_flush(f, ifc, g);
+			for (i = 0; g->held[i]; i++)
+				;
+		}
+		ipgro_hold(g, i, bp);
+	}
+	/* The sender wants this delivered; don't sit on it. */
+	if (flags & PSH)
+		ipgro_flush_one(f, ifc, g, i);
+}
+
 int ipstats(struct Fs *f, char *buf, int len)
 {
 	struct IP *ip;
@@ -559,7 +844,7 @@ int ipstats(struct Fs *f, char *buf, int len)
 
 	p = buf;
 	e = p + len;
-	for (i = 0; i < Nstats; i++)
+	for (i = 0; i < Nipstats; i++)
 		p = seprintf(p, e, "%s: %u\n", statnames[i], ip->stats[i]);
 	return p - buf;
 }
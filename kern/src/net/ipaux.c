@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <endian.h>
+#include <jhash.h>
 
 /*
  *  well known IP addresses
@@ -592,26 +593,128 @@ int parsemac(uint8_t * to, char *from, int len)
 	return i;
 }
 
-/*
- *  hashing tcp, udp, ... connections
- *  gcc weirdness: it gave a bogus result until ron split the %= out.
- */
-uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
+/* Hashes tcp, udp, ... connections on their full 4-tuple.  Each table gets its
+ * own random seed, so remote peers can't aim their flows at one bucket. */
+static uint32_t iphash(struct Iphtab *t, uint8_t *sa, uint16_t sp, uint8_t *da,
+                       uint16_t dp)
+{
+	uint32_t k[2 * IPaddrlen / sizeof(uint32_t) + 1];
+
+	memcpy(k, sa, IPaddrlen);
+	memcpy(k + IPaddrlen / sizeof(uint32_t), da, IPaddrlen);
+	k[COUNT_OF(k) - 1] = (sp << 16) | dp;
+	return jhash2(k, COUNT_OF(k), t->seed) & t->mask;
+}
+
+static struct Iphtab *iphtab_alloc(uint32_t nbuckets)
+{
+	struct Iphtab *t;
+
+	t = kzmalloc(sizeof(struct Iphtab) +
+		     nbuckets * sizeof(struct Iphbucket), MEM_WAIT);
+	t->mask = nbuckets - 1;
+	urandom_read(&t->seed, sizeof(t->seed));
+	for (int i = 0; i < nbuckets; i++)
+		spinlock_init(&t->b[i].lock);
+	return t;
+}
+
+static void iphtab_free_rcu(struct rcu_head *head)
+{
+	struct Iphtab *t = container_of(head, struct Iphtab, rcu);
+	struct Iphash *h, *next;
+
+	for (int i = 0; i <= t->mask; i++) {
+		for (h = t->b[i].head; h != NULL; h = next) {
+			next = h->next;
+			kfree(h);
+		}
+	}
+	kfree(t);
+}
+
+void iphtinit(struct Ipht *ht)
+{
+	qlock_init(&ht->resize);
+	atomic_init(&ht->nents, 0);
+	ht->tab = iphtab_alloc(Nipht);
+}
+
+/* Doubles the table, if it still needs it and no one else is already at it.
+ *
+ * We freeze the old table, then lock and unlock every bucket, after which no
+ * writer can be changing it.  Readers might still be on the old chains, so we
+ * don't relink them; the new table gets its own copies of the entries, and the
+ * old table and its entries go away after a grace period. */
+static void iphtgrow(struct Ipht *ht)
 {
-	uint32_t ret;
+	struct Iphtab *old, *new;
+	struct Iphash *h, *nh;
+	struct Iphbucket *nb;
+
+	if (!canqlock(&ht->resize))
+		return;
+	/* Only resizers change ht->tab, and we hold the resize qlock. */
+	old = ht->tab;
+	if (old->mask + 1 >= Niphtmax ||
+	    atomic_read(&ht->nents) <= old->mask + 1) {
+		qunlock(&ht->resize);
+		return;
+	}
+	new = iphtab_alloc((old->mask + 1) * 2);
+	WRITE_ONCE(old->frozen, TRUE);
+	for (int i = 0; i <= old->mask; i++) {
+		spin_lock(&old->b[i].lock);
+		spin_unlock(&old->b[i].lock);
+	}
+	for (int i = 0; i <= old->mask; i++) {
+		for (h = old->b[i].head; h != NULL; h = h->next) {
+			nh = kmalloc(sizeof(struct Iphash), MEM_WAIT);
+			nh->c = h->c;
+			nh->match = h->match;
+			nb = &new->b[iphash(new, h->c->raddr, h->c->rport,
+					    h->c->laddr, h->c->lport)];
+			nh->next = nb->head;
+			nb->head = nh;
+		}
+	}
+	rcu_assign_pointer(ht->tab, new);
+	qunlock(&ht->resize);
+	call_rcu(&old->rcu, iphtab_free_rcu);
+}
 
-	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
-		^ dp;
-	ret %= Nhash;
-	return ret;
+/* Returns c's bucket in the current table, locked.  If the table is being
+ * resized, we wait it out and use the new one.
+ *
+ * We can drop the RCU read lock once we hold an unfrozen bucket: a resizer
+ * freezes the table and then needs our bucket lock before it can retire it. */
+static struct Iphbucket *iphtlockbucket(struct Ipht *ht, struct conv *c)
+{
+	struct Iphtab *t;
+	struct Iphbucket *b;
+
+	for (;;) {
+		rcu_read_lock();
+		t = rcu_dereference(ht->tab);
+		b = &t->b[iphash(t, c->raddr, c->rport, c->laddr, c->lport)];
+		spin_lock(&b->lock);
+		if (!t->frozen) {
+			rcu_read_unlock();
+			return b;
+		}
+		spin_unlock(&b->lock);
+		rcu_read_unlock();
+		qlock(&ht->resize);
+		qunlock(&ht->resize);
+	}
 }
 
 void iphtadd(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
 	struct Iphash *h;
+	struct Iphbucket *b;
+	long nents;
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
 	h = kzmalloc(sizeof(*h), 0);
 	if (ipcmp(c->raddr, IPnoaddr) != 0)
 		h->match = IPmatchexact;
@@ -630,27 +733,38 @@ void iphtadd(struct Ipht *ht, struct conv *c)
 	}
 	h->c = c;
 
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+	b = iphtlockbucket(ht, c);
+	h->next = b->head;
+	rcu_assign_pointer(b->head, h);
+	spin_unlock(&b->lock);
+
+	nents = atomic_fetch_and_add(&ht->nents, 1) + 1;
+	if (nents > READ_ONCE(ht->tab)->mask + 1)
+		iphtgrow(ht);
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
 	struct Iphash **l, *h;
+	struct Iphbucket *b;
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
+	b = iphtlockbucket(ht, c);
+	for (l = &b->head; (*l) != NULL; l = &(*l)->next)
 		if ((*l)->c == c) {
 			h = *l;
-			(*l) = h->next;
-			kfree(h);
+			/* Readers might be on h; it still points onward. */
+			WRITE_ONCE(*l, h->next);
+			kfree_rcu(h, rcu);
+			atomic_dec(&ht->nents);
 			break;
 		}
-	spin_unlock(&ht->lock);
+	spin_unlock(&b->lock);
+}
+
+static struct Iphash *iphtchain(struct Iphtab *t, uint8_t *sa, uint16_t sp,
+                                uint8_t *da, uint16_t dp)
+{
+	return rcu_dereference(t->b[iphash(t, sa, sp, da, dp)].head);
 }
 
 /* look for a matching conversation with the following precedence
@@ -659,90 +773,99 @@ void iphtrem(struct Ipht *ht, struct conv *c)
  *	announced && *,lport
  *	announced && laddr,*
  *	announced && *,*
- */
+ *
+ * Convs are never freed, so the returned conv is always safe to touch.  It is
+ * not locked, though, and by the time the caller locks it, it might have been
+ * closed or reused.  Callers need to check. */
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp)
 {
-	uint32_t hv;
+	struct Iphtab *t;
 	struct Iphash *h;
 	struct conv *c;
 
+	rcu_read_lock();
+	t = rcu_dereference(ht->tab);
 	/* exact 4 pair match (connection) */
-	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	for (h = iphtchain(t, sa, sp, da, dp); h != NULL;
+	     h = rcu_dereference(h->next)) {
 		if (h->match != IPmatchexact)
 			continue;
 		c = h->c;
 		if (sp == c->rport && dp == c->lport
 		    && ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
+			rcu_read_unlock();
 			return c;
 		}
 	}
 
 	/* match local address and port */
-	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	for (h = iphtchain(t, IPnoaddr, 0, da, dp); h != NULL;
+	     h = rcu_dereference(h->next)) {
 		if (h->match != IPmatchpa)
 			continue;
 		c = h->c;
 		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
+			rcu_read_unlock();
 			return c;
 		}
 	}
 
 	/* match just port */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	for (h = iphtchain(t, IPnoaddr, 0, IPnoaddr, dp); h != NULL;
+	     h = rcu_dereference(h->next)) {
 		if (h->match != IPmatchport)
 			continue;
 		c = h->c;
 		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
+			rcu_read_unlock();
 			return c;
 		}
 	}
 
 	/* match local address */
-	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	for (h = iphtchain(t, IPnoaddr, 0, da, 0); h != NULL;
+	     h = rcu_dereference(h->next)) {
 		if (h->match != IPmatchaddr)
 			continue;
 		c = h->c;
 		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
+			rcu_read_unlock();
 			return c;
 		}
 	}
 
 	/* look for something that matches anything */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	for (h = iphtchain(t, IPnoaddr, 0, IPnoaddr, 0); h != NULL;
+	     h = rcu_dereference(h->next)) {
 		if (h->match != IPmatchany)
 			continue;
 		c = h->c;
-		spin_unlock(&ht->lock);
+		rcu_read_unlock();
 		return c;
 	}
-	spin_unlock(&ht->lock);
+	rcu_read_unlock();
 	return NULL;
 }
 
 void dump_ipht(struct Ipht *ht)
 {
+	struct Iphtab *t;
 	struct Iphash *h;
 	struct conv *c;
 
-	spin_lock(&ht->lock);
-	for (int i = 0; i < Nipht; i++) {
-		for (h = ht->tab[i]; h != NULL; h = h->next) {
+	rcu_read_lock();
+	t = rcu_dereference(ht->tab);
+	printk("%ld entries, %u buckets\n", atomic_read(&ht->nents),
+	       t->mask + 1);
+	for (int i = 0; i <= t->mask; i++) {
+		for (h = rcu_dereference(t->b[i].head); h != NULL;
+		     h = rcu_dereference(h->next)) {
 			c = h->c;
 			printk("Conv proto %s, idx %d: local %I:%d, remote %I:%d\n",
 			       c->p->name, c->x, c->laddr, c->lport, c->raddr,
 			       c->rport);
 		}
 	}
-	spin_unlock(&ht->lock);
+	rcu_read_unlock();
 }
@@ -365,6 +365,8 @@ struct block *netifbread(struct ether *nif, struct chan *c, long n,
 	if ((c->qid.type & QTDIR) || NETTYPE(c->qid.path) != Ndataqid)
 		return devbread(c, n, offset);
 
+	if (c->flag & O_NONBLOCK)
+		return qbread_nonblock(nif->f[NETID(c->qid.path)]->in, n);
 	return qbread(nif->f[NETID(c->qid.path)]->in, n);
 }
 
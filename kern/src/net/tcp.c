@@ -36,6 +36,7 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <jhash.h>
 #include <net/ip.h>
 #include <net/tcp.h>
 
@@ -66,6 +67,11 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[CurrLimbo] "CurrLimbo",
+	[LimboTimeouts] "LimboTimeouts",
+	[SynCookiesSent] "SynCookiesSent",
+	[SynCookiesRecv] "SynCookiesRecv",
+	[SynCookiesFailed] "SynCookiesFailed",
 };
 
 /*
@@ -82,6 +88,8 @@ static int tcpporthogdefense = 0;
 static int addreseq(Tcpctl *, struct tcppriv *, Tcp *, struct block *,
                     uint16_t);
 static void getreseq(Tcpctl *, Tcp *, struct block **, uint16_t *);
+static Reseq *reseq_first(Tcpctl *);
+static void reseq_flush(Tcpctl *);
 static void localclose(struct conv *, char *unused_char_p_t);
 static void procsyn(struct conv *, Tcp *);
 static void tcpiput(struct Proto *, struct Ipifc *, struct block *);
@@ -96,9 +104,10 @@ static void tcpkeepalive(void *);
 static void tcpsetkacounter(Tcpctl *);
 static void tcprxmit(struct conv *);
 static void tcpsettimer(Tcpctl *);
+static uint64_t tcptimercount(Tcptimer *);
 static void tcpsynackrtt(struct conv *);
 static void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb);
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto);
 static uint16_t derive_payload_mss(Tcpctl *tcb);
 static void set_in_flight(Tcpctl *tcb);
 
@@ -146,6 +155,8 @@ static void tcpsetstate(struct conv *s, uint8_t newstate)
 
 	if (oldstate == Syn_sent && newstate != Closed)
 		Fsconnected(s, NULL);
+	if (newstate == Closed)
+		Fsreleaseconv(s);
 }
 
 static void tcpconnect(struct conv *c, char **argv, int argc)
@@ -161,14 +172,16 @@ static int tcpstate(struct conv *c, char *state, int n)
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-			"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+			"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d cong %s\n",
 			tcpstates[s->state],
 			c->rq ? qlen(c->rq) : 0,
 			c->wq ? qlen(c->wq) : 0,
 			s->srtt, s->mdev,
 			s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-			s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-			s->katimer.start, s->katimer.count);
+			s->snd.scale, s->timer.start, tcptimercount(&s->timer),
+			s->rerecv, s->katimer.start,
+			tcptimercount(&s->katimer),
+			s->cc ? s->cc->name : "none");
 }
 
 static int tcpinuse(struct conv *c)
@@ -348,44 +361,68 @@ static void tcpcreate(struct conv *c)
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
-static void timerstate(struct tcppriv *priv, Tcptimer *t, int newstate)
+/* Sets up t for conversation s.  All of a conversation's timers go on the same
+ * wheel, so that the wheel lock covers any interaction between them. */
+static void tcptimerinit(struct conv *s, Tcptimer *t, void (*func)(void *))
 {
+	struct tcppriv *priv = s->p->priv;
+
+	tw_timer_init(&t->tw);
+	t->wheel = &priv->wheels[s->x % priv->nr_wheels];
+	t->readynext = NULL;
+	t->state = TcptimerOFF;
+	t->count = 0;
+	t->func = func;
+	t->arg = s;
+}
+
+/* Ticks left before t fires.  For halted timers, this is what was left when
+ * they were halted. */
+static uint64_t tcptimercount(Tcptimer *t)
+{
+	if (t->state == TcptimerON)
+		return tw_timer_remaining(&t->wheel->tw, &t->tw);
+	return t->count;
+}
+
+/* Called with t's wheel locked. */
+static void timerstate(Tcptimer *t, int newstate)
+{
+	struct timer_wheel *tw = &t->wheel->tw;
+
 	if (newstate != TcptimerON) {
 		if (t->state == TcptimerON) {
-			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
-				if (t->prev != NULL)
-					panic("timerstate1");
-			}
-			if (t->next)
-				t->next->prev = t->prev;
-			if (t->prev)
-				t->prev->next = t->next;
-			t->next = t->prev = NULL;
+			t->count = tw_timer_remaining(tw, &t->tw);
+			timer_wheel_del(tw, &t->tw);
 		}
 	} else {
-		if (t->state != TcptimerON) {
-			// chain
-			if (t->prev != NULL || t->next != NULL)
-				panic("timerstate2");
-			t->prev = NULL;
-			t->next = priv->timers;
-			if (t->next)
-				t->next->prev = t;
-			priv->timers = t;
-		}
+		/* (Re)arming a timer restarts its count */
+		t->count = t->start;
+		timer_wheel_add(tw, &t->tw, tw->now + t->start);
 	}
 	t->state = newstate;
 }
 
+/* Called by the wheel, with the wheel locked, for each expired timer.  We just
+ * collect them; the handlers run after we unlock. */
+static void tcptimerexpired(struct tw_timer *tw_t, void *arg)
+{
+	Tcptimer *t = container_of(tw_t, Tcptimer, tw);
+	Tcptimer **timeo = arg;
+
+	t->state = TcptimerDONE;
+	t->count = 0;
+	t->readynext = *timeo;
+	*timeo = t;
+}
+
 static void tcpackproc(void *a)
 {
 	ERRSTACK(1);
-	Tcptimer *t, *tp, *timeo;
+	Tcptimer *t, *timeo;
+	Tcpwheel *w;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
 
 	tcp = a;
 	priv = tcp->priv;
@@ -393,35 +430,27 @@ static void tcpackproc(void *a)
 	for (;;) {
 		kthread_usleep(MSPTICK * 1000);
 
-		qlock(&priv->tl);
-		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
-			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
+		for (int i = 0; i < priv->nr_wheels; i++) {
+			w = &priv->wheels[i];
+			timeo = NULL;
+			spin_lock(&w->lock);
+			timer_wheel_advance(&w->tw, w->tw.now + 1,
+					    tcptimerexpired, &timeo);
+			spin_unlock(&w->lock);
+
+			/* readynext is only touched by us, in the wheel
+			 * callback, so someone rearming t won't break the
+			 * chain.  They do change its state, though. */
+			for (t = timeo; t != NULL; t = t->readynext) {
+				if (t->state == TcptimerDONE &&
+				    t->func != NULL) {
+					/* discard error style */
+					if (!waserror())
+						(*t->func) (t->arg);
+					poperror();
 				}
 			}
 		}
-		qunlock(&priv->tl);
-
-		loop = 0;
-		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
-			if (t->state == TcptimerDONE && t->func != NULL) {
-				/* discard error style */
-				if (!waserror())
-					(*t->func) (t->arg);
-				poperror();
-			}
-		}
 
 		limborexmit(tcp);
 	}
@@ -432,10 +461,9 @@ static void tcpgo(struct tcppriv *priv, Tcptimer *t)
 	if (t == NULL || t->start == 0)
 		return;
 
-	qlock(&priv->tl);
-	t->count = t->start;
-	timerstate(priv, t, TcptimerON);
-	qunlock(&priv->tl);
+	spin_lock(&t->wheel->lock);
+	timerstate(t, TcptimerON);
+	spin_unlock(&t->wheel->lock);
 }
 
 static void tcphalt(struct tcppriv *priv, Tcptimer *t)
@@ -443,9 +471,9 @@ static void tcphalt(struct tcppriv *priv, Tcptimer *t)
 	if (t == NULL)
 		return;
 
-	qlock(&priv->tl);
-	timerstate(priv, t, TcptimerOFF);
-	qunlock(&priv->tl);
+	spin_lock(&t->wheel->lock);
+	timerstate(t, TcptimerOFF);
+	spin_unlock(&t->wheel->lock);
 }
 
 static int backoff(int n)
@@ -457,7 +485,6 @@ static void localclose(struct conv *s, char *reason)
 {
 	/* called with tcb locked */
 	Tcpctl *tcb;
-	Reseq *rp, *rp1;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
@@ -471,12 +498,10 @@ static void localclose(struct conv *s, char *reason)
 	tcphalt(tpriv, &tcb->katimer);
 
 	/* Flush reassembly queue; nothing more can arrive */
-	for (rp = tcb->reseq; rp != NULL; rp = rp1) {
-		rp1 = rp->next;
-		freeblist(rp->bp);
-		kfree(rp);
-	}
-	tcb->reseq = NULL;
+	reseq_flush(tcb);
+
+	/* The next user of s gets the default algorithm */
+	tcb->cc = NULL;
 
 	if (tcb->state == Syn_sent)
 		Fsconnected(s, reason);
@@ -516,12 +541,13 @@ static int tcpmtu(struct Ipifc *ifc, int version, int *scale)
 	return mtu;
 }
 
-static void tcb_check_tso(Tcpctl *tcb)
+static void tcb_check_tso(struct conv *s, Tcpctl *tcb)
 {
 	/* This can happen if the netdev isn't up yet. */
 	if (!tcb->ifc)
 		return;
-	if (tcb->ifc->feat & NETF_TSO)
+	/* ipoput4() segments in software if the NIC can't. */
+	if (tcb->ifc->feat & NETF_TSO || s->ipversion == V4)
 		tcb->flags |= TSO;
 	else
 		tcb->flags &= ~TSO;
@@ -533,26 +559,29 @@ static void inittcpctl(struct conv *s, int mode)
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
 	int mss;
+	struct tcp_cc_ops *cc;
+	struct tcppriv *tpriv = s->p->priv;
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	/* Keep any algorithm chosen before the connect or announce. */
+	cc = tcb->cc;
 	memset(tcb, 0, sizeof(Tcpctl));
+	tcb->cc = cc ? cc : tpriv->cc_default;
 
 	tcb->ssthresh = UINT32_MAX;
 	tcb->srtt = tcp_irtt;
 	tcb->mdev = 0;
 
 	/* setup timers */
+	tcptimerinit(s, &tcb->timer, tcptimeout);
 	tcb->timer.start = tcp_irtt / MSPTICK;
-	tcb->timer.func = tcptimeout;
-	tcb->timer.arg = s;
+	tcptimerinit(s, &tcb->rtt_timer, NULL);
 	tcb->rtt_timer.start = MAX_TIME;
+	tcptimerinit(s, &tcb->acktimer, tcpacktimer);
 	tcb->acktimer.start = TCP_ACK / MSPTICK;
-	tcb->acktimer.func = tcpacktimer;
-	tcb->acktimer.arg = s;
+	tcptimerinit(s, &tcb->katimer, tcpkeepalive);
 	tcb->katimer.start = DEF_KAT / MSPTICK;
-	tcb->katimer.func = tcpkeepalive;
-	tcb->katimer.arg = s;
 
 	mss = DEF_MSS;
 
@@ -590,13 +619,14 @@ static void inittcpctl(struct conv *s, int mode)
 	tcb->mss = mss;
 	tcb->typical_mss = mss;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
+	tcb->cc->init(tcb);
 
 	/* default is no window scaling */
 	tcb->window = QMAX;
 	tcb->rcv.wnd = QMAX;
 	tcb->rcv.scale = 0;
 	tcb->snd.scale = 0;
-	tcb_check_tso(tcb);
+	tcb_check_tso(s, tcb);
 }
 
 /*
@@ -1251,7 +1281,139 @@ static int sndsynack(struct Proto *tcp, Limbo *lp)
 	return 0;
 }
 
-#define hashipa(a, p) ( ( (a)[IPaddrlen-2] + (a)[IPaddrlen-1] + p )&LHTMASK )
+static Limbobucket *limbobucket(struct tcppriv *tpriv, uint8_t *raddr,
+                                 uint16_t rport, uint16_t lport)
+{
+	uint32_t k[IPaddrlen / sizeof(uint32_t) + 1];
+
+	memcpy(k, raddr, IPaddrlen);
+	k[COUNT_OF(k) - 1] = (rport << 16) | lport;
+	return &tpriv->lht[jhash2(k, COUNT_OF(k), tpriv->limbo_seed) & LHTMASK];
+}
+
+/* Finds the call in limbo for a segment.  Called with b locked. */
+static Limbo *limbolook(Limbobucket *b, Tcp *segp, uint8_t *src, uint8_t *dst,
+                        uint8_t version)
+{
+	Limbo *lp;
+
+	BSD_LIST_FOREACH(lp, &b->calls, link) {
+		if (lp->lport != segp->dest || lp->rport != segp->source
+			|| lp->version != version)
+			continue;
+		if (ipcmp(lp->raddr, src) != 0)
+			continue;
+		if (ipcmp(lp->laddr, dst) != 0)
+			continue;
+		return lp;
+	}
+	return NULL;
+}
+
+/* Takes lp out of limbo.  The caller owns it after this.  Called with b
+ * locked. */
+static void limboremove(struct tcppriv *tpriv, Limbobucket *b, Limbo *lp)
+{
+	BSD_LIST_REMOVE(lp, link);
+	timer_wheel_del(&b->tw, &lp->tw);
+	atomic_dec(&tpriv->nlimbo);
+}
+
+/* Schedules lp's next SYN ACK retransmit.  Called with b locked. */
+static void limboarm(Limbobucket *b, Limbo *lp)
+{
+	uint64_t now = NOW / MSPTICK;
+
+	/* An idle wheel isn't advanced; catch it up before adding to it.  This
+	 * doesn't run any timers, since there aren't any. */
+	if (!b->tw.nr_pending)
+		timer_wheel_advance(&b->tw, now, NULL, NULL);
+	timer_wheel_add(&b->tw, &lp->tw,
+			now + (lp->rexmits + 1) * SYNACK_RXTIMER / MSPTICK);
+}
+
+/* The MSSs a SYN cookie can encode.  We pick the largest that doesn't exceed
+ * the peer's. */
+static const uint16_t syncookie_msstab[] = {536, 1300, 1440, 1460};
+
+static uint32_t syncookie_hash(struct tcppriv *tpriv, uint8_t *raddr,
+                               uint16_t rport, uint8_t *laddr, uint16_t lport,
+                               uint32_t count, int which)
+{
+	uint32_t k[2 * IPaddrlen / sizeof(uint32_t) + 2];
+
+	memcpy(k, raddr, IPaddrlen);
+	memcpy(k + IPaddrlen / sizeof(uint32_t), laddr, IPaddrlen);
+	k[COUNT_OF(k) - 2] = (rport << 16) | lport;
+	k[COUNT_OF(k) - 1] = count;
+	return jhash2(k, COUNT_OF(k), tpriv->cookie_secret[which]);
+}
+
+/* Builds the ISS for a SYN cookie, the same way Linux does:
+ *
+ *	H(tuple, k0) + irs + (count << SYNCOOKIE_BITS) +
+ *		((H(tuple, count, k1) + mssidx) & SYNCOOKIE_MASK)
+ *
+ * where count is the cookie clock. */
+static uint32_t syncookie_make(struct tcppriv *tpriv, uint8_t *raddr,
+                               uint16_t rport, uint8_t *laddr, uint16_t lport,
+                               uint32_t irs, uint16_t mss)
+{
+	uint32_t count = NOW / SYNCOOKIE_PERIOD;
+	int mssidx;
+
+	for (mssidx = COUNT_OF(syncookie_msstab) - 1; mssidx > 0; mssidx--)
+		if (syncookie_msstab[mssidx] <= mss)
+			break;
+	return syncookie_hash(tpriv, raddr, rport, laddr, lport, 0, 0) + irs +
+	       (count << SYNCOOKIE_BITS) +
+	       ((syncookie_hash(tpriv, raddr, rport, laddr, lport, count, 1) +
+		 mssidx) & SYNCOOKIE_MASK);
+}
+
+/* Checks the ISS the peer acked against what we would have sent.  Returns the
+ * MSS it encodes, or 0 if it isn't one of our cookies or is too old. */
+static uint16_t syncookie_check(struct tcppriv *tpriv, uint8_t *raddr,
+                                uint16_t rport, uint8_t *laddr, uint16_t lport,
+                                uint32_t irs, uint32_t iss)
+{
+	uint32_t count = NOW / SYNCOOKIE_PERIOD;
+	uint32_t cookie, diff, mssidx;
+
+	cookie = iss - syncookie_hash(tpriv, raddr, rport, laddr, lport, 0, 0) -
+		 irs;
+	diff = (count - (cookie >> SYNCOOKIE_BITS)) &
+	       ((uint32_t)-1 >> SYNCOOKIE_BITS);
+	if (diff >= SYNCOOKIE_MAXAGE)
+		return 0;
+	mssidx = (cookie - syncookie_hash(tpriv, raddr, rport, laddr, lport,
+					  count - diff, 1)) & SYNCOOKIE_MASK;
+	if (mssidx >= COUNT_OF(syncookie_msstab))
+		return 0;
+	return syncookie_msstab[mssidx];
+}
+
+/* Answers a SYN with a cookie, without keeping any state. */
+static void syncookie_send(struct conv *s, uint8_t *source, uint8_t *dest,
+                           Tcp *seg, int version)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	Limbo lp = {0};
+
+	lp.version = version;
+	ipmove(lp.laddr, dest);
+	ipmove(lp.raddr, source);
+	lp.lport = seg->dest;
+	lp.rport = seg->source;
+	lp.irs = seg->seq;
+	/* We can't remember options, so we don't agree to any but the MSS. */
+	lp.iss = syncookie_make(tpriv, source, seg->source, dest, seg->dest,
+				seg->seq, seg->mss);
+	if (sndsynack(s->p, &lp) < 0)
+		return;
+	tpriv->last_cookie = NOW;
+	tpriv->stats[SynCookiesSent]++;
+}
 
 /*
  *  put a call into limbo and respond with a SYN ACK
@@ -1261,40 +1423,32 @@ static int sndsynack(struct Proto *tcp, Limbo *lp)
 static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
                   int version)
 {
-	Limbo *lp, **l;
+	Limbo *lp;
+	Limbobucket *b;
 	struct tcppriv *tpriv;
-	int h;
 
 	tpriv = s->p->priv;
-	h = hashipa(source, seg->source);
-
-	for (l = &tpriv->lht[h]; *l != NULL; l = &lp->next) {
-		lp = *l;
-		if (lp->lport != seg->dest || lp->rport != seg->source
-			|| lp->version != version)
-			continue;
-		if (ipcmp(lp->raddr, source) != 0)
-			continue;
-		if (ipcmp(lp->laddr, dest) != 0)
-			continue;
+	b = limbobucket(tpriv, source, seg->source, seg->dest);
 
+	qlock(&b->lock);
+	lp = limbolook(b, seg, source, dest, version);
+	if (lp != NULL) {
 		/* each new SYN restarts the retransmits */
 		lp->irs = seg->seq;
-		break;
-	}
-	lp = *l;
-	if (lp == NULL) {
-		if (tpriv->nlimbo >= Maxlimbo && tpriv->lht[h]) {
-			lp = tpriv->lht[h];
-			tpriv->lht[h] = lp->next;
-			lp->next = NULL;
-		} else {
-			lp = kzmalloc(sizeof(*lp), 0);
-			if (lp == NULL)
-				return;
-			tpriv->nlimbo++;
+	} else {
+		if (atomic_read(&tpriv->nlimbo) >= Maxlimbo) {
+			qunlock(&b->lock);
+			syncookie_send(s, source, dest, seg, version);
+			return;
+		}
+		lp = kzmalloc(sizeof(*lp), 0);
+		if (lp == NULL) {
+			qunlock(&b->lock);
+			return;
 		}
-		*l = lp;
+		atomic_inc(&tpriv->nlimbo);
+		BSD_LIST_INSERT_HEAD(&b->calls, lp, link);
+		tw_timer_init(&lp->tw);
 		lp->version = version;
 		ipmove(lp->laddr, dest);
 		ipmove(lp->raddr, source);
@@ -1309,61 +1463,67 @@ static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
 	}
 
 	if (sndsynack(s->p, lp) < 0) {
-		*l = lp->next;
-		tpriv->nlimbo--;
+		limboremove(tpriv, b, lp);
 		kfree(lp);
+	} else {
+		limboarm(b, lp);
 	}
+	qunlock(&b->lock);
+}
+
+/* Called by a limbo bucket's wheel for each call that is due. */
+static void limboexpired(struct tw_timer *tw_t, void *arg)
+{
+	Limbo *lp = container_of(tw_t, Limbo, tw);
+	Limbo **due = arg;
+
+	lp->duenext = *due;
+	*due = lp;
 }
 
 /*
  *  resend SYN ACK's once every SYNACK_RXTIMER ms.
+ *
+ *  Called every tick.  We only look at buckets with calls that could be due, and
+ *  a bucket that is busy will get its turn next tick.
  */
 static void limborexmit(struct Proto *tcp)
 {
 	struct tcppriv *tpriv;
-	Limbo **l, *lp;
-	int h;
-	int seen;
+	Limbobucket *b;
+	Limbo *lp, *due;
 	uint64_t now;
 
 	tpriv = tcp->priv;
-
-	if (!canqlock(&tcp->qlock))
-		return;
-	seen = 0;
-	now = NOW;
-	for (h = 0; h < NLHT && seen < tpriv->nlimbo; h++) {
-		for (l = &tpriv->lht[h]; *l != NULL && seen < tpriv->nlimbo;) {
-			lp = *l;
-			seen++;
-			if (now - lp->lastsend <
-			    (lp->rexmits + 1) * SYNACK_RXTIMER)
-				continue;
-
-			/* time it out after 1 second */
-			if (++(lp->rexmits) > 5) {
-				tpriv->nlimbo--;
-				*l = lp->next;
+	now = NOW / MSPTICK;
+	for (int h = 0; h < NLHT; h++) {
+		b = &tpriv->lht[h];
+		if (!READ_ONCE(b->tw.nr_pending))
+			continue;
+		if (!canqlock(&b->lock))
+			continue;
+		due = NULL;
+		timer_wheel_advance(&b->tw, now, limboexpired, &due);
+		while ((lp = due) != NULL) {
+			due = lp->duenext;
+			if (++(lp->rexmits) > LIMBO_RXMAX) {
+				limboremove(tpriv, b, lp);
 				kfree(lp);
+				tpriv->stats[LimboTimeouts]++;
 				continue;
 			}
-
 			/* if we're being attacked, don't bother resending SYN
 			 * ACK's */
-			if (tpriv->nlimbo > 100)
-				continue;
-
-			if (sndsynack(tcp, lp) < 0) {
-				tpriv->nlimbo--;
-				*l = lp->next;
+			if (atomic_read(&tpriv->nlimbo) <= LIMBO_ATTACK &&
+			    sndsynack(tcp, lp) < 0) {
+				limboremove(tpriv, b, lp);
 				kfree(lp);
 				continue;
 			}
-
-			l = &lp->next;
+			limboarm(b, lp);
 		}
+		qunlock(&b->lock);
 	}
-	qunlock(&tcp->qlock);
 }
 
 /*
@@ -1374,32 +1534,22 @@ static void limborexmit(struct Proto *tcp)
 static void limborst(struct conv *s, Tcp *segp, uint8_t *src, uint8_t *dst,
                      uint8_t version)
 {
-	Limbo *lp, **l;
-	int h;
+	Limbo *lp;
+	Limbobucket *b;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
 
 	/* find a call in limbo */
-	h = hashipa(src, segp->source);
-	for (l = &tpriv->lht[h]; *l != NULL; l = &lp->next) {
-		lp = *l;
-		if (lp->lport != segp->dest || lp->rport != segp->source
-			|| lp->version != version)
-			continue;
-		if (ipcmp(lp->laddr, dst) != 0)
-			continue;
-		if (ipcmp(lp->raddr, src) != 0)
-			continue;
-
-		/* RST can only follow the SYN */
-		if (segp->seq == lp->irs + 1) {
-			tpriv->nlimbo--;
-			*l = lp->next;
-			kfree(lp);
-		}
-		break;
+	b = limbobucket(tpriv, src, segp->source, segp->dest);
+	qlock(&b->lock);
+	lp = limbolook(b, segp, src, dst, version);
+	/* RST can only follow the SYN */
+	if (lp != NULL && segp->seq == lp->irs + 1) {
+		limboremove(tpriv, b, lp);
+		kfree(lp);
 	}
+	qunlock(&b->lock);
 }
 
 /* The advertised MSS (e.g. 1460) includes any per-packet TCP options, such as
@@ -1416,6 +1566,39 @@ static void adjust_typical_mss_for_opts(Tcp *tcph, Tcpctl *tcb)
 	tcb->typical_mss -= opt_size;
 }
 
+/* Checks whether an ACK that didn't match anything in limbo completes a
+ * handshake we answered with a SYN cookie.  If so, fills in lp as if the call
+ * had been in limbo all along, and returns it. */
+static Limbo *tcpcookiecall(struct conv *s, Tcp *segp, uint8_t *src,
+                            uint8_t *dst, uint8_t version, Limbo *lp)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	uint16_t mss;
+
+	/* Don't bother unless we've been handing them out. */
+	if (!tpriv->last_cookie ||
+	    NOW - tpriv->last_cookie > SYNCOOKIE_MAXAGE * SYNCOOKIE_PERIOD)
+		return NULL;
+	mss = syncookie_check(tpriv, src, segp->source, dst, segp->dest,
+			      segp->seq - 1, segp->ack - 1);
+	if (!mss) {
+		tpriv->stats[SynCookiesFailed]++;
+		return NULL;
+	}
+	tpriv->stats[SynCookiesRecv]++;
+	memset(lp, 0, sizeof(Limbo));
+	lp->version = version;
+	ipmove(lp->laddr, dst);
+	ipmove(lp->raddr, src);
+	lp->lport = segp->dest;
+	lp->rport = segp->source;
+	lp->irs = segp->seq - 1;
+	lp->iss = segp->ack - 1;
+	lp->mss = mss;
+	lp->ifc = findipifc(s->p->f, dst, 0);
+	return lp;
+}
+
 /*
  *  come here when we finally get an ACK to our SYN-ACK.
  *  lookup call in limbo.  if found, create a new conversation
@@ -1430,8 +1613,8 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	struct tcppriv *tpriv;
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
-	Limbo *lp, **l;
-	int h;
+	Limbo *lp, cookie_lp;
+	Limbobucket *b;
 
 	/* unless it's just an ack, it can't be someone coming out of limbo */
 	if ((segp->flags & SYN) || (segp->flags & ACK) == 0)
@@ -1440,22 +1623,15 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	tpriv = s->p->priv;
 
 	/* find a call in limbo */
-	h = hashipa(src, segp->source);
-	for (l = &tpriv->lht[h]; (lp = *l) != NULL; l = &lp->next) {
+	b = limbobucket(tpriv, src, segp->source, segp->dest);
+	qlock(&b->lock);
+	lp = limbolook(b, segp, src, dst, version);
+	if (lp != NULL) {
 		netlog(s->p->f, Logtcp,
 			   "tcpincoming s %I!%d/%I!%d d %I!%d/%I!%d v %d/%d\n",
 			   src, segp->source, lp->raddr, lp->rport, dst,
 			   segp->dest, lp->laddr, lp->lport, version,
 			   lp->version);
-
-		if (lp->lport != segp->dest || lp->rport != segp->source
-			|| lp->version != version)
-			continue;
-		if (ipcmp(lp->laddr, dst) != 0)
-			continue;
-		if (ipcmp(lp->raddr, src) != 0)
-			continue;
-
 		/* we're assuming no data with the initial SYN */
 		if (segp->seq != lp->irs + 1 || segp->ack != lp->iss + 1) {
 			netlog(s->p->f, Logtcp,
@@ -1463,29 +1639,32 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 			       segp->seq, lp->irs + 1, segp->ack, lp->iss + 1);
 			lp = NULL;
 		} else {
-			tpriv->nlimbo--;
-			*l = lp->next;
+			limboremove(tpriv, b, lp);
 		}
-		break;
+		qunlock(&b->lock);
+	} else {
+		qunlock(&b->lock);
+		lp = tcpcookiecall(s, segp, src, dst, version, &cookie_lp);
 	}
 	if (lp == NULL)
 		return NULL;
 
 	new = Fsnewcall(s, src, segp->source, dst, segp->dest, version);
-	if (new == NULL)
+	if (new == NULL) {
+		if (lp != &cookie_lp)
+			kfree(lp);
 		return NULL;
+	}
 
 	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
 	tcb->flags &= ~CLONE;
-	tcb->timer.arg = new;
-	tcb->timer.state = TcptimerOFF;
-	tcb->acktimer.arg = new;
-	tcb->acktimer.state = TcptimerOFF;
-	tcb->katimer.arg = new;
-	tcb->katimer.state = TcptimerOFF;
-	tcb->rtt_timer.arg = new;
-	tcb->rtt_timer.state = TcptimerOFF;
+	/* The copied timers still point at the listener (and maybe its wheel
+	 * linkage).  Keep their settings, but start them fresh and halted. */
+	tcptimerinit(new, &tcb->timer, tcb->timer.func);
+	tcptimerinit(new, &tcb->acktimer, tcb->acktimer.func);
+	tcptimerinit(new, &tcb->katimer, tcb->katimer.func);
+	tcptimerinit(new, &tcb->rtt_timer, tcb->rtt_timer.func);
 
 	tcb->irs = lp->irs;
 	tcb->rcv.nxt = tcb->irs + 1;
@@ -1516,16 +1695,20 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	tcb->sack_ok = lp->sack_ok;
 	/* window scaling */
 	tcpsetscale(new, tcb, lp->rcvscale, lp->sndscale);
-	tcb_check_tso(tcb);
+	tcb_check_tso(new, tcb);
 
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
-
-	/* set initial round trip time */
-	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
-	tcpsynackrtt(new);
-
-	kfree(lp);
+	/* The listener's algorithm, with fresh state. */
+	tcb->cc->init(tcb);
+
+	/* set initial round trip time.  We didn't keep track of when we sent a
+	 * cookie, so those calls keep the default. */
+	if (lp != &cookie_lp) {
+		tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
+		tcpsynackrtt(new);
+		kfree(lp);
+	}
 
 	/* set up proto header */
 	switch (version) {
@@ -1705,7 +1888,7 @@ static void sack_has_changed(struct conv *s, Tcpctl *tcb,
 			       tcb->snd.rtx, tcb_sack->left, tcb_sack->right,
 			       tcb->snd.una, tcb->snd.recovery_pt);
 			/* Redo retrans, but keep the sacks and recovery point*/
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.rtx = tcb->snd.una;
 			tcb->snd.sack_loss_hint = 0;
 			/* Act like an RTO.  We just detected it earlier.  This
@@ -1975,7 +2158,7 @@ static void update(struct conv *s, Tcp *seg)
 {
 	int rtt;
 	Tcpctl *tcb;
-	uint32_t acked, expand;
+	uint32_t acked;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
@@ -2004,7 +2187,7 @@ static void update(struct conv *s, Tcp *seg)
 			       s->laddr, s->lport, s->raddr, s->rport,
 			       tcb->snd.nr_sacks, tcb->snd.nxt, tcb->snd.una,
 			       tcb->cwind);
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.recovery_pt = tcb->snd.nxt;
 			if (tcb->snd.nr_sacks) {
 				tcb->snd.recovery = SACK_RETRANS_RECOVERY;
@@ -2053,36 +2236,6 @@ static void update(struct conv *s, Tcp *seg)
 		goto done;
 	}
 
-	/* slow start as long as we're not recovering from lost packets */
-	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			/* We increase the cwind by every byte we receive.  We
-			 * want to increase the cwind by one MSS for every MSS
-			 * that gets ACKed.  Note that multiple MSSs can be
-			 * ACKed in a single ACK.  If we had a remainder of
-			 * acked / MSS, we'd add just that remainder - not 0 or
-			 * 1 MSS. */
-			expand = acked;
-		} else {
-			/* Every RTT, which consists of CWND bytes, we're
-			 * supposed to expand by MSS bytes.  The classic
-			 * algorithm was
-			 * 	expand = (tcb->mss * tcb->mss) / tcb->cwind;
-			 * which assumes the ACK was for MSS bytes.  Instead,
-			 * for every 'acked' bytes, we increase the window by
-			 * acked / CWND (in units of MSS). */
-			expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
-			         / tcb->cwind;
-		}
-
-		if (tcb->cwind + expand < tcb->cwind)
-			expand = tcb->snd.wnd - tcb->cwind;
-		if (tcb->cwind + expand > tcb->snd.wnd)
-			expand = tcb->snd.wnd - tcb->cwind;
-		tcb->cwind += expand;
-	}
-	adjust_tx_qio_limit(s);
-
 	if (tcb->ts_recent) {
 		update_rtt(tcb, abs(milliseconds() - seg->ts_ecr),
 		           expected_samples_ts(tcb, acked));
@@ -2101,6 +2254,13 @@ static void update(struct conv *s, Tcp *seg)
 		}
 	}
 
+	/* grow the window as long as we're not recovering from lost packets */
+	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
+		tcb->cc->on_ack(tcb, acked);
+		tcb->cwind = MIN(tcb->cwind, tcb->snd.wnd);
+	}
+	adjust_tx_qio_limit(s);
+
 done:
 	if (qdiscard(s->wq, acked) < acked) {
 		tcb->flgcnt--;
@@ -2136,59 +2296,6 @@ static void update_tcb_ts(Tcpctl *tcb, Tcp *seg)
 		tcb->ts_recent = seg->ts_val;
 }
 
-/* Overlap happens when one sack's left edge is inside another sack. */
-static bool sacks_overlap(struct sack_block *x, struct sack_block *y)
-{
-	return (seq_le(x->left, y->left) && seq_le(y->left, x->right)) ||
-	       (seq_le(y->left, x->left) && seq_le(x->left, y->right));
-}
-
-static void make_sack_first(Tcpctl *tcb, struct sack_block *tcb_sack)
-{
-	struct sack_block temp;
-
-	if (tcb_sack == &tcb->rcv.sacks[0])
-		return;
-	temp = tcb->rcv.sacks[0];
-	tcb->rcv.sacks[0] = *tcb_sack;
-	*tcb_sack = temp;
-}
-
-/* Track sack in our tcb for a block of data we received.  This handles all the
- * stuff: making sure sack is first (since it's the most recent sack change),
- * updating or merging sacks, and dropping excess sacks (we only need to
- * maintain 3).  Unlike on the snd side, our tcb sacks are *not* sorted. */
-static void track_rcv_sack(Tcpctl *tcb, uint32_t left, uint32_t right)
-{
-	struct sack_block *tcb_sack;
-	struct sack_block sack[1];
-
-	if (!tcb->sack_ok)
-		return;
-	if (left == right)
-		return;
-	assert(seq_lt(left, right));
-	sack->left = left;
-	sack->right = right;
-	/* We can reuse an existing sack if we're merging or overlapping. */
-	for (int i = 0; i < tcb->rcv.nr_sacks; i++) {
-		tcb_sack = &tcb->rcv.sacks[i];
-		if (sacks_overlap(tcb_sack, sack)) {
-			tcb_sack->left = seq_min(tcb_sack->left, sack->left);
-			tcb_sack->right = seq_max(tcb_sack->right, sack->right);
-			make_sack_first(tcb, tcb_sack);
-			return;
-		}
-	}
-	/* We can discard the last sack (right shift) - we should have sent it
-	 * at least once by now.  If not, oh well. */
-	memmove(tcb->rcv.sacks + 1, tcb->rcv.sacks, sizeof(struct sack_block) *
-	        MIN(MAX_NR_RCV_SACKS - 1, tcb->rcv.nr_sacks));
-	tcb->rcv.sacks[0] = *sack;
-	if (tcb->rcv.nr_sacks < MAX_NR_RCV_SACKS)
-		tcb->rcv.nr_sacks++;
-}
-
 /* Once we receive everything and move rcv.nxt past a sack, we don't need to
  * track it.  I've seen Linux report sacks in the past, but we probably
  * shouldn't. */
@@ -2209,6 +2316,15 @@ static void drop_old_rcv_sacks(Tcpctl *tcb)
 	}
 }
 
+/* Returns TRUE if s is the connection for a segment from sa!sp to da!dp.
+ * Called with s qlocked. */
+static bool tcpconvmatch(struct conv *s, uint8_t *sa, uint16_t sp,
+                         uint8_t *da, uint16_t dp)
+{
+	return s->rport == sp && s->lport == dp && ipcmp(s->raddr, sa) == 0 &&
+	       ipcmp(s->laddr, da) == 0;
+}
+
 static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 {
 	ERRSTACK(1);
@@ -2217,6 +2333,7 @@ static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 	Tcp6hdr *h6;
 	int hdrlen;
 	Tcpctl *tcb;
+	Reseq *rp;
 	uint16_t length;
 	uint8_t source[IPaddrlen], dest[IPaddrlen];
 	struct conv *s;
@@ -2339,35 +2456,68 @@ reset:
 		return;
 	}
 
-	/* lock protocol for unstate Plan 9 invariants.  funcs like limbo or
-	 * incoming might rely on it. */
-	qlock(&tcp->qlock);
-
-	/* if it's a listener, look for the right flags and get a new conv */
+	/* Segments for an existing connection only need that conv's lock, so
+	 * input for different conversations can run in parallel.  The protocol
+	 * lock is only needed for listeners: limbo and creating new convs.
+	 *
+	 * We found s without locking it, so it could have been closed and
+	 * recycled for another connection since then.  Once we hold its qlock,
+	 * it can't change, so make sure it is still the conv for this segment.
+	 * If not, or if it's a listener, take the slow path. */
 	tcb = (Tcpctl *) s->ptcl;
-	if (tcb->state == Listen) {
-		if (seg.flags & RST) {
-			limborst(s, &seg, source, dest, version);
-			qunlock(&tcp->qlock);
-			freeblist(bp);
-			return;
+	if (READ_ONCE(tcb->state) != Listen) {
+		qlock(&s->qlock);
+		if (tcb->state == Listen ||
+		    !tcpconvmatch(s, source, seg.source, dest, seg.dest)) {
+			qunlock(&s->qlock);
+			s = NULL;
 		}
-
-		/* if this is a new SYN, put the call into limbo */
-		if ((seg.flags & SYN) && (seg.flags & ACK) == 0) {
-			limbo(s, source, dest, &seg, version);
+	} else {
+		s = NULL;
+	}
+	if (s == NULL) {
+		/* lock protocol for unstate Plan 9 invariants.  funcs like
+		 * limbo or incoming might rely on it. */
+		qlock(&tcp->qlock);
+		s = iphtlook(&tpriv->ht, source, seg.source, dest, seg.dest);
+		if (s == NULL || s->state == Bypass) {
+			/* s became a bypass conv while we weren't looking.
+			 * We already trimmed the headers, so just drop. */
 			qunlock(&tcp->qlock);
+			if (s == NULL)
+				goto reset;
 			freeblist(bp);
 			return;
 		}
+		/* if it's a listener, look for the right flags and get a new
+		 * conv */
+		tcb = (Tcpctl *) s->ptcl;
+		if (tcb->state == Listen) {
+			if (seg.flags & RST) {
+				limborst(s, &seg, source, dest, version);
+				qunlock(&tcp->qlock);
+				freeblist(bp);
+				return;
+			}
 
-		/* if there's a matching call in limbo, tcpincoming will return
-		 * it */
-		s = tcpincoming(s, &seg, source, dest, version);
-		if (s == NULL) {
-			qunlock(&tcp->qlock);
-			goto reset;
+			/* if this is a new SYN, put the call into limbo */
+			if ((seg.flags & SYN) && (seg.flags & ACK) == 0) {
+				limbo(s, source, dest, &seg, version);
+				qunlock(&tcp->qlock);
+				freeblist(bp);
+				return;
+			}
+
+			/* if there's a matching call in limbo, tcpincoming will
+			 * return it */
+			s = tcpincoming(s, &seg, source, dest, version);
+			if (s == NULL) {
+				qunlock(&tcp->qlock);
+				goto reset;
+			}
 		}
+		qlock(&s->qlock);
+		qunlock(&tcp->qlock);
 	}
 
 	/* The rest of the input state machine is run with the control block
@@ -2379,8 +2529,6 @@ reset:
 		qunlock(&s->qlock);
 		nexterror();
 	}
-	qlock(&s->qlock);
-	qunlock(&tcp->qlock);
 
 	update_tcb_ts(tcb, &seg);
 	/* fix up window */
@@ -2683,10 +2831,11 @@ reset:
 		 *  dump/trim any overlapping segments
 		 */
 		for (;;) {
-			if (tcb->reseq == NULL)
+			rp = reseq_first(tcb);
+			if (rp == NULL)
 				goto output;
 
-			if (seq_ge(tcb->rcv.nxt, tcb->reseq->seg.seq) == 0)
+			if (seq_ge(tcb->rcv.nxt, rp->seg.seq) == 0)
 				goto output;
 
 			getreseq(tcb, &seg, &bp, &length);
@@ -3273,17 +3422,34 @@ static void tcpsetchecksum(struct conv *s, char **f, int unused)
 	tcb->nochecksum = !atoi(f[1]);
 }
 
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb)
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto)
 {
 	uint32_t old_cwnd = tcb->cwind;
 
-	/* Reno */
-	tcb->ssthresh = tcb->cwind / 2;
-	tcb->cwind = tcb->ssthresh;
+	if (rto)
+		tcb->cc->on_rto(tcb);
+	else
+		tcb->cc->on_loss(tcb);
 	netlog(s->p->f, Logtcprxmt,
-	       "%I.%d -> %I.%d: loss event, cwnd was %d, now %d\n",
-	       s->laddr, s->lport, s->raddr, s->rport,
-	       old_cwnd, tcb->cwind);
+	       "%I.%d -> %I.%d: %s %s, cwnd was %d, now %d\n",
+	       s->laddr, s->lport, s->raddr, s->rport, tcb->cc->name,
+	       rto ? "timeout" : "loss event", old_cwnd, tcb->cwind);
+}
+
+/* Switches s to another congestion control algorithm.  It starts over from the
+ * current cwind and ssthresh. */
+static void tcpsetcong(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	struct tcp_cc_ops *cc;
+
+	if (n < 2)
+		error(EINVAL, "usage: cong reno|cubic|vegas");
+	cc = tcp_cc_lookup(f[1]);
+	if (!cc)
+		error(EINVAL, "unknown congestion control %s", f[1]);
+	tcb->cc = cc;
+	cc->init(tcb);
 }
 
 /* Called when we need to retrans the entire outstanding window (everything
@@ -3369,7 +3535,7 @@ static void tcptimeout(void *arg)
 		       tcb->snd.una, tcb->snd.rtx, tcb->snd.nxt,
 		       tcb->snd.in_flight, tcb->timer.start);
 		tcpsettimer(tcb);
-		tcp_loss_event(s, tcb);
+		tcp_loss_event(s, tcb, TRUE);
 		/* Advance the recovery point.  Any dupacks/sacks below this
 		 * won't trigger a new loss, since we won't reset_recovery()
 		 * until we ack past recovery_pt. */
@@ -3420,13 +3586,157 @@ static void procsyn(struct conv *s, Tcp *seg)
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
 }
 
+static struct kmem_cache *reseq_kcache;
+
+static void reseq_kcache_init(void)
+{
+	reseq_kcache = kmem_cache_create("tcp_reseq", sizeof(Reseq),
+	                                 __alignof__(Reseq), 0, NULL, 0, 0,
+	                                 NULL);
+}
+
+static Reseq *reseq_entry(struct rb_node *node)
+{
+	return node ? rb_entry(node, Reseq, node) : NULL;
+}
+
+static Reseq *reseq_first(Tcpctl *tcb)
+{
+	return reseq_entry(rb_first(&tcb->reseq));
+}
+
+static uint32_t reseq_end(Reseq *rp)
+{
+	return rp->seg.seq + rp->length;
+}
+
+/* Returns the segment with the highest seq at or before seq, if any. */
+static Reseq *reseq_lookup(Tcpctl *tcb, uint32_t seq)
+{
+	struct rb_node *node = tcb->reseq.rb_node;
+	Reseq *rp, *ret = NULL;
+
+	while (node) {
+		rp = reseq_entry(node);
+		if (seq_lt(seq, rp->seg.seq)) {
+			node = node->rb_left;
+		} else {
+			ret = rp;
+			node = node->rb_right;
+		}
+	}
+	return ret;
+}
+
+static void reseq_flush(Tcpctl *tcb)
+{
+	struct rb_node *node, *next;
+	Reseq *rp;
+
+	for (node = rb_first_postorder(&tcb->reseq); node; node = next) {
+		next = rb_next_postorder(node);
+		rp = reseq_entry(node);
+		freeblist(rp->bp);
+		kmem_cache_free(reseq_kcache, rp);
+	}
+	tcb->reseq = RB_ROOT;
+	tcb->reseq_len = 0;
+}
+
+/* Plain data segments that are back to back can be glued together.  Anything
+ * with flags that refer to a particular spot in the sequence space stays on its
+ * own, and the result has to fit in a segment's length. */
+static bool reseq_mergeable(Reseq *a, Reseq *b)
+{
+	return a->length && b->length &&
+	       !((a->seg.flags | b->seg.flags) & (SYN | FIN | URG)) &&
+	       reseq_end(a) == b->seg.seq &&
+	       a->length + b->length <= UINT16_MAX;
+}
+
+/* Appends b's data to a and frees b.  The merged segment gets the header of the
+ * one that arrived last, since its ack and window are the freshest. */
+static void reseq_merge(Tcpctl *tcb, Reseq *a, Reseq *b, bool b_is_newer)
+{
+	struct block *bp;
+	uint32_t seq = a->seg.seq;
+
+	if (b_is_newer) {
+		a->seg = b->seg;
+		a->seg.seq = seq;
+	}
+	for (bp = a->bp; bp->next; bp = bp->next)
+		;
+	bp->next = b->bp;
+	a->length += b->length;
+	a->seg.len = a->length;
+	rb_erase(&b->node, &tcb->reseq);
+	kmem_cache_free(reseq_kcache, b);
+}
+
+/* Returns the sack for the run of contiguous data around rp. */
+static struct sack_block reseq_run(Reseq *rp)
+{
+	struct sack_block sack = {rp->seg.seq, reseq_end(rp)};
+	Reseq *i;
+
+	for (i = reseq_entry(rb_prev(&rp->node)); i;
+	     i = reseq_entry(rb_prev(&i->node))) {
+		if (seq_lt(reseq_end(i), sack.left))
+			break;
+		sack.left = i->seg.seq;
+	}
+	for (i = reseq_entry(rb_next(&rp->node)); i;
+	     i = reseq_entry(rb_next(&i->node))) {
+		if (seq_gt(i->seg.seq, sack.right))
+			break;
+		sack.right = seq_max(sack.right, reseq_end(i));
+	}
+	return sack;
+}
+
+/* Rebuilds the sacks we send from the reassembly queue, after rp arrived.  The
+ * first sack is the run holding rp, since it's the most recent change, and the
+ * rest are the runs of the sacks we reported before.  Those may have grown or
+ * merged with each other since. */
+static void update_rcv_sacks(Tcpctl *tcb, Reseq *rp)
+{
+	struct sack_block sacks[MAX_NR_RCV_SACKS];
+	struct sack_block run;
+	int nr_sacks = 0;
+	Reseq *old;
+
+	if (!tcb->sack_ok || !rp->length)
+		return;
+	sacks[nr_sacks++] = reseq_run(rp);
+	for (int i = 0; i < tcb->rcv.nr_sacks; i++) {
+		if (nr_sacks == MAX_NR_RCV_SACKS)
+			break;
+		old = reseq_lookup(tcb, tcb->rcv.sacks[i].left);
+		if (!old)
+			continue;
+		run = reseq_run(old);
+		for (int j = 0; j < nr_sacks; j++) {
+			if (sacks[j].left == run.left) {
+				run.left = run.right;
+				break;
+			}
+		}
+		if (run.left != run.right)
+			sacks[nr_sacks++] = run;
+	}
+	memcpy(tcb->rcv.sacks, sacks, nr_sacks * sizeof(struct sack_block));
+	tcb->rcv.nr_sacks = nr_sacks;
+}
+
 static int addreseq(Tcpctl *tcb, struct tcppriv *tpriv, Tcp *seg,
                     struct block *bp, uint16_t length)
 {
-	Reseq *rp, *rp1;
-	int i, rqlen, qmax;
+	struct rb_node **link = &tcb->reseq.rb_node, *parent = NULL;
+	Reseq *rp, *prev, *next;
+	int qmax;
 
-	rp = kzmalloc(sizeof(Reseq), 0);
+	rp = kmem_cache_alloc(reseq_kcache, 0);
 	if (rp == NULL) {
 		freeblist(bp);	/* bp always consumed by add_reseq */
 		return 0;
@@ -3436,51 +3746,38 @@ static int addreseq(Tcpctl *tcb, struct tcppriv *tpriv, Tcp *seg,
 	rp->bp = bp;
 	rp->length = length;
 
-	track_rcv_sack(tcb, seg->seq, seg->seq + length);
-	/* Place on reassembly list sorting by starting seq number */
-	rp1 = tcb->reseq;
-	if (rp1 == NULL || seq_lt(seg->seq, rp1->seg.seq)) {
-		rp->next = rp1;
-		tcb->reseq = rp;
-		if (rp->next != NULL)
-			tpriv->stats[OutOfOrder]++;
-		return 0;
+	/* Place in the reassembly tree sorting by starting seq number */
+	while (*link) {
+		parent = *link;
+		if (seq_lt(seg->seq, reseq_entry(parent)->seg.seq))
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
 	}
+	rb_link_node(&rp->node, parent, link);
+	rb_insert_color(&rp->node, &tcb->reseq);
+	tcb->reseq_len += length;
 
-	rqlen = 0;
-	for (i = 0;; i++) {
-		rqlen += rp1->length;
-		if (rp1->next == NULL || seq_lt(seg->seq, rp1->next->seg.seq)) {
-			rp->next = rp1->next;
-			rp1->next = rp;
-			if (rp->next != NULL)
-				tpriv->stats[OutOfOrder]++;
-			break;
-		}
-		rp1 = rp1->next;
+	next = reseq_entry(rb_next(&rp->node));
+	if (next)
+		tpriv->stats[OutOfOrder]++;
+	prev = reseq_entry(rb_prev(&rp->node));
+	if (prev && reseq_mergeable(prev, rp)) {
+		reseq_merge(tcb, prev, rp, TRUE);
+		rp = prev;
 	}
+	if (next && reseq_mergeable(rp, next))
+		reseq_merge(tcb, rp, next, FALSE);
+	update_rcv_sacks(tcb, rp);
+
 	qmax = QMAX << tcb->rcv.scale;
 	/* Here's where we're reneging on previously reported sacks. */
-	if (rqlen > qmax) {
-		printd("resequence queue > window: %d > %d\n", rqlen, qmax);
-		i = 0;
-		for (rp1 = tcb->reseq; rp1 != NULL; rp1 = rp1->next) {
-			printd("0x%#lx 0x%#lx 0x%#x\n", rp1->seg.seq,
-				   rp1->seg.ack, rp1->seg.flags);
-			if (i++ > 10) {
-				printd("...\n");
-				break;
-			}
-		}
-
+	if (tcb->reseq_len > qmax) {
+		printd("resequence queue > window: %u > %d\n", tcb->reseq_len,
+		       qmax);
 		// delete entire reassembly queue; wait for retransmit.
 		// - should we be smarter and only delete the tail?
-		for (rp = tcb->reseq; rp != NULL; rp = rp1) {
-			rp1 = rp->next;
-			freeblist(rp->bp);
-			kfree(rp);
-		}
-		tcb->reseq = NULL;
+		reseq_flush(tcb);
 		tcb->rcv.nr_sacks = 0;
 
 		return -1;
@@ -3492,17 +3789,18 @@ static void getreseq(Tcpctl *tcb, Tcp *seg, struct block **bp, uint16_t *length)
 {
 	Reseq *rp;
 
-	rp = tcb->reseq;
+	rp = reseq_first(tcb);
 	if (rp == NULL)
 		return;
 
-	tcb->reseq = rp->next;
+	rb_erase(&rp->node, &tcb->reseq);
+	tcb->reseq_len -= rp->length;
 
 	*seg = rp->seg;
 	*bp = rp->bp;
 	*length = rp->length;
 
-	kfree(rp);
+	kmem_cache_free(reseq_kcache, rp);
 }
 
 static int tcptrim(Tcpctl *tcb, Tcp *seg, struct block **bp, uint16_t *length)
@@ -3641,6 +3939,8 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpsetchecksum(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n >= 1 && strcmp(f[0], "cong") == 0)
+		tcpsetcong(c, f, n);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3654,6 +3954,7 @@ static int tcpstats(struct Proto *tcp, char *buf, int len)
 	priv = tcp->priv;
 	p = buf;
 	e = p + len;
+	priv->stats[CurrLimbo] = atomic_read(&priv->nlimbo);
 	for (i = 0; i < Nstats; i++)
 		p = seprintf(p, e, "%s: %u\n", statnames[i], priv->stats[i]);
 	return p - buf;
@@ -3730,8 +4031,25 @@ void tcpinit(struct Fs *fs)
 	tcp = kzmalloc(sizeof(struct Proto), 0);
 	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
 	debug_priv = tpriv;
-	qlock_init(&tpriv->tl);
+	tpriv->nr_wheels = num_cores;
+	tpriv->wheels = kzmalloc(sizeof(Tcpwheel) * tpriv->nr_wheels, MEM_WAIT);
+	for (int i = 0; i < tpriv->nr_wheels; i++) {
+		spinlock_init(&tpriv->wheels[i].lock);
+		timer_wheel_init(&tpriv->wheels[i].tw, 0);
+	}
 	qlock_init(&tpriv->apl);
+	iphtinit(&tpriv->ht);
+	atomic_init(&tpriv->nlimbo, 0);
+	urandom_read(&tpriv->limbo_seed, sizeof(tpriv->limbo_seed));
+	urandom_read(tpriv->cookie_secret, sizeof(tpriv->cookie_secret));
+	for (int i = 0; i < NLHT; i++) {
+		qlock_init(&tpriv->lht[i].lock);
+		BSD_LIST_INIT(&tpriv->lht[i].calls);
+		timer_wheel_init(&tpriv->lht[i].tw, NOW / MSPTICK);
+	}
+	tpriv->cc_default = tcp_cc_lookup(CONFIG_NET_TCP_CC_DEFAULT);
+	assert(tpriv->cc_default);
+	run_once_racy(reseq_kcache_init());
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
@@ -3747,7 +4065,7 @@ void tcpinit(struct Fs *fs)
 	tcp->inuse = tcpinuse;
 	tcp->gc = tcpgc;
 	tcp->ipproto = IP_TCPPROTO;
-	tcp->nc = 4096;
+	tcp->nc = CONFIG_NET_TCP_MAX_CONVS;
 	tcp->ptclsize = sizeof(Tcpctl);
 	tpriv->stats[MaxConn] = tcp->nc;
 
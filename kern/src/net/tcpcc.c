@@ -0,0 +1,309 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * TCP congestion control algorithms.  See struct tcp_cc_ops in tcp.h for how
+ * they plug into the stack.
+ *
+ * reno: the classic AIMD, and what TCP did before it had a choice.
+ *
+ * cubic: RFC 8312.  After a loss, the window grows along a cubic in the time
+ * since the loss, centered on the window we had when we lost.  It gets back to
+ * that window quickly and carefully probes past it, independent of the RTT.
+ *
+ * vegas: delay-based.  Once an RTT, compare the rate we'd get with an empty
+ * queue (cwind / base RTT) to the rate we're getting, and nudge cwind so that we
+ * keep a few segments queued in the network, but not more. */
+
+#include <string.h>
+#include <assert.h>
+#include <smp.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+/* Grows cwind by 'expand' bytes, without wrapping. */
+static void tcp_cc_grow(Tcpctl *tcb, uint64_t expand)
+{
+	tcb->cwind = MIN((uint64_t)tcb->cwind + expand, UINT32_MAX);
+}
+
+static void reno_init(Tcpctl *tcb)
+{
+}
+
+static void reno_on_ack(Tcpctl *tcb, uint32_t acked)
+{
+	if (tcb->cwind < tcb->ssthresh) {
+		/* We increase the cwind by every byte we receive.  We want to
+		 * increase the cwind by one MSS for every MSS that gets ACKed.
+		 * Note that multiple MSSs can be ACKed in a single ACK.  If we
+		 * had a remainder of acked / MSS, we'd add just that remainder
+		 * - not 0 or 1 MSS. */
+		tcp_cc_grow(tcb, acked);
+	} else {
+		/* Every RTT, which consists of CWND bytes, we're supposed to
+		 * expand by MSS bytes.  The classic algorithm was
+		 * 	expand = (tcb->mss * tcb->mss) / tcb->cwind;
+		 * which assumes the ACK was for MSS bytes.  Instead, for every
+		 * 'acked' bytes, we increase the window by acked / CWND (in
+		 * units of MSS). */
+		tcp_cc_grow(tcb, MAX(acked, tcb->typical_mss) *
+		                 tcb->typical_mss / tcb->cwind);
+	}
+}
+
+static void reno_on_loss(Tcpctl *tcb)
+{
+	tcb->ssthresh = tcb->cwind / 2;
+	tcb->cwind = tcb->ssthresh;
+}
+
+struct tcp_cc_ops tcp_reno_ops = {
+	.name = "reno",
+	.init = reno_init,
+	.on_ack = reno_on_ack,
+	.on_loss = reno_on_loss,
+	.on_rto = reno_on_loss,
+};
+
+/* CUBIC's constants are the RFC's: we back off to BETA/1024 of cwind, and C is
+ * 0.4 segments / sec^3.  We keep time in msec, so C is 1 segment per
+ * CUBIC_SCALE msec^3.  The TCP-friendly estimate grows by 3 * (1 - beta) /
+ * (1 + beta), about 9/17, segments per RTT. */
+#define CUBIC_BETA		717
+#define CUBIC_SCALE		2500000000ULL
+#define CUBIC_EST_NUM		9
+#define CUBIC_EST_DEN		17
+/* Keeps (t - K)^3 from overflowing; about 35 minutes. */
+#define CUBIC_MAX_OFFS		(1ULL << 21)
+
+struct cubic {
+	uint32_t w_max;		/* cwind before the last loss */
+	uint32_t origin;	/* the window at the curve's plateau */
+	uint32_t w_est;		/* what reno would have by now */
+	uint64_t est_acc;	/* leftover of w_est's growth */
+	uint64_t epoch_start;	/* msec; when this curve started, 0 for none */
+	uint64_t k;		/* msec from epoch_start to the plateau */
+};
+
+static struct cubic *tcb_cubic(Tcpctl *tcb)
+{
+	static_assert(sizeof(struct cubic) <= sizeof(tcb->cc_priv));
+	return (struct cubic *)tcb->cc_priv;
+}
+
+/* Integer cube root, from Hacker's Delight. */
+static uint64_t cubic_cbrt(uint64_t x)
+{
+	uint64_t y = 0, b;
+
+	for (int s = 63; s >= 0; s -= 3) {
+		y <<= 1;
+		b = 3 * y * (y + 1) + 1;
+		if ((x >> s) >= b) {
+			x -= b << s;
+			y++;
+		}
+	}
+	return y;
+}
+
+static void cubic_init(Tcpctl *tcb)
+{
+	memset(tcb_cubic(tcb), 0, sizeof(struct cubic));
+}
+
+/* Starts a new curve at time 'now'.  K is when the curve gets back to w_max:
+ * cbrt((w_max - cwind) / C). */
+static void cubic_start_epoch(Tcpctl *tcb, struct cubic *c, uint64_t now)
+{
+	uint64_t diff;
+	uint32_t mss = tcb->typical_mss;
+
+	c->epoch_start = now;
+	if (tcb->cwind < c->w_max) {
+		diff = c->w_max - tcb->cwind;
+		c->k = cubic_cbrt(diff / mss * CUBIC_SCALE +
+		                  diff % mss * CUBIC_SCALE / mss);
+		c->origin = c->w_max;
+	} else {
+		c->k = 0;
+		c->origin = tcb->cwind;
+	}
+	c->w_est = tcb->cwind;
+	c->est_acc = 0;
+}
+
+static void cubic_on_ack(Tcpctl *tcb, uint32_t acked)
+{
+	struct cubic *c = tcb_cubic(tcb);
+	uint64_t now = NOW;
+	uint64_t t, offs, delta, target, expand, est_den;
+	uint32_t mss = tcb->typical_mss;
+	uint32_t cwind = tcb->cwind;
+
+	if (cwind < tcb->ssthresh) {
+		tcp_cc_grow(tcb, acked);
+		return;
+	}
+	if (!c->epoch_start)
+		cubic_start_epoch(tcb, c, now);
+
+	/* Aim for where the curve will be an RTT from now. */
+	t = now - c->epoch_start + tcb->srtt;
+	offs = MIN(t > c->k ? t - c->k : c->k - t, CUBIC_MAX_OFFS);
+	delta = offs * offs * offs / (CUBIC_SCALE / mss);
+	if (t > c->k)
+		target = c->origin + delta;
+	else
+		target = c->origin > delta ? c->origin - delta : 0;
+
+	/* Spread the growth to the target over the next cwind of acks, but grow
+	 * by at most half of what was acked.  At or past the target, probe very
+	 * gently: one segment every 100 RTTs. */
+	if (target > cwind)
+		expand = MIN((target - cwind) * acked / cwind, acked / 2);
+	else
+		expand = (uint64_t)acked * mss / (100 * (uint64_t)cwind);
+
+	/* Never grow slower than reno would have, had it taken the same loss. */
+	est_den = CUBIC_EST_DEN * (uint64_t)cwind;
+	c->est_acc += (uint64_t)acked * mss * CUBIC_EST_NUM;
+	c->w_est = MIN(c->w_est + c->est_acc / est_den, UINT32_MAX);
+	c->est_acc %= est_den;
+	if (c->w_est > cwind)
+		expand = MAX(expand,
+		             (uint64_t)(c->w_est - cwind) * acked / cwind);
+
+	tcp_cc_grow(tcb, expand);
+}
+
+static void cubic_on_loss(Tcpctl *tcb)
+{
+	struct cubic *c = tcb_cubic(tcb);
+
+	c->epoch_start = 0;
+	/* Fast convergence: if we lost below the old plateau, someone else is
+	 * taking more of the link.  Give up some of ours, too. */
+	if (tcb->cwind < c->w_max)
+		c->w_max = (uint64_t)tcb->cwind * (1024 + CUBIC_BETA) / 2048;
+	else
+		c->w_max = tcb->cwind;
+	tcb->ssthresh = MAX((uint64_t)tcb->cwind * CUBIC_BETA / 1024,
+	                    2 * tcb->typical_mss);
+	tcb->cwind = tcb->ssthresh;
+}
+
+static void cubic_on_rto(Tcpctl *tcb)
+{
+	cubic_on_loss(tcb);
+	/* After a timeout, the old plateau says nothing about the path. */
+	tcb_cubic(tcb)->w_max = 0;
+}
+
+struct tcp_cc_ops tcp_cubic_ops = {
+	.name = "cubic",
+	.init = cubic_init,
+	.on_ack = cubic_on_ack,
+	.on_loss = cubic_on_loss,
+	.on_rto = cubic_on_rto,
+};
+
+/* Vegas keeps between ALPHA and BETA segments queued in the network, and leaves
+ * slow start once more than GAMMA are. */
+#define VEGAS_ALPHA		2
+#define VEGAS_BETA		4
+#define VEGAS_GAMMA		1
+
+/* Once a round, we note snd.nxt and the time.  The ack that covers it ends the
+ * round and gives us an RTT sample. */
+struct vegas {
+	uint64_t base_rtt;	/* usec, the smallest RTT seen */
+	uint64_t mark_time;	/* usec, when the round started, 0 for none */
+	uint32_t mark_seq;	/* snd.nxt at the start of the round */
+};
+
+static struct vegas *tcb_vegas(Tcpctl *tcb)
+{
+	static_assert(sizeof(struct vegas) <= sizeof(tcb->cc_priv));
+	return (struct vegas *)tcb->cc_priv;
+}
+
+static void vegas_init(Tcpctl *tcb)
+{
+	struct vegas *v = tcb_vegas(tcb);
+
+	v->base_rtt = UINT64_MAX;
+	v->mark_time = 0;
+}
+
+static void vegas_start_round(Tcpctl *tcb, struct vegas *v, uint64_t now)
+{
+	v->mark_seq = tcb->snd.nxt;
+	v->mark_time = now;
+}
+
+static void vegas_on_ack(Tcpctl *tcb, uint32_t acked)
+{
+	struct vegas *v = tcb_vegas(tcb);
+	uint64_t now = tsc2usec(read_tsc());
+	uint64_t rtt, target, diff;
+	uint32_t mss = tcb->typical_mss;
+
+	if (!v->mark_time || seq_lt(tcb->snd.una, v->mark_seq)) {
+		/* Mid-round, only slow start grows the window. */
+		if (tcb->cwind < tcb->ssthresh)
+			tcp_cc_grow(tcb, acked);
+		if (!v->mark_time)
+			vegas_start_round(tcb, v, now);
+		return;
+	}
+	rtt = MAX(now - v->mark_time, 1);
+	v->base_rtt = MIN(v->base_rtt, rtt);
+	/* What cwind would be in flight with nothing queued, and how many
+	 * segments we have queued beyond that. */
+	target = (uint64_t)tcb->cwind * v->base_rtt / rtt;
+	diff = (tcb->cwind - target) / mss;
+	if (tcb->cwind < tcb->ssthresh) {
+		if (diff > VEGAS_GAMMA) {
+			tcb->cwind = MIN(tcb->cwind, target + mss);
+			tcb->ssthresh = tcb->cwind;
+		} else {
+			tcp_cc_grow(tcb, acked);
+		}
+	} else if (diff > VEGAS_BETA) {
+		tcb->cwind = MAX(tcb->cwind - mss, 2 * mss);
+	} else if (diff < VEGAS_ALPHA) {
+		tcp_cc_grow(tcb, mss);
+	}
+	vegas_start_round(tcb, v, now);
+}
+
+static void vegas_on_loss(Tcpctl *tcb)
+{
+	reno_on_loss(tcb);
+	/* The round's sample would include the recovery. */
+	tcb_vegas(tcb)->mark_time = 0;
+}
+
+struct tcp_cc_ops tcp_vegas_ops = {
+	.name = "vegas",
+	.init = vegas_init,
+	.on_ack = vegas_on_ack,
+	.on_loss = vegas_on_loss,
+	.on_rto = vegas_on_loss,
+};
+
+static struct tcp_cc_ops *tcp_cc_algs[] = {
+	&tcp_reno_ops,
+	&tcp_cubic_ops,
+	&tcp_vegas_ops,
+};
+
+struct tcp_cc_ops *tcp_cc_lookup(const char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(tcp_cc_algs); i++) {
+		if (!strcmp(tcp_cc_algs[i]->name, name))
+			return tcp_cc_algs[i];
+	}
+	return NULL;
+}
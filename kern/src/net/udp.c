@@ -676,6 +676,7 @@ void udpinit(struct Fs *fs)
 
 	udp = kzmalloc(sizeof(struct Proto), 0);
 	udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	iphtinit(&((Udppriv *)udp->priv)->ht);
 	udp->name = "udp";
 	udp->connect = udpconnect;
 	udp->bind = udpbind;
@@ -689,7 +690,7 @@ void udpinit(struct Fs *fs)
 	udp->advise = udpadvise;
 	udp->stats = udpstats;
 	udp->ipproto = IP_UDPPROTO;
-	udp->nc = 4096;
+	udp->nc = CONFIG_NET_UDP_MAX_CONVS;
 	udp->ptclsize = sizeof(Udpcb);
 
 	Fsproto(fs, udp);
@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <process.h>
+#include <pagemap.h>
 
 /* Note that Hdrspc is only available via padblock (to the 'left' of the rp). */
 enum {
@@ -152,10 +153,11 @@ static struct extra_bdata *next_unused_slot(struct block *b)
 }
 
 /* Append an extra data buffer @base with offset @off of length @len to block
- * @b.  Reuse an unused extra data slot if there's any.
+ * @b.  @ebd_flags says what kind of buffer it is (EBD_*).  Reuse an unused
+ * extra data slot if there's any.
  * Return 0 on success or -1 on error. */
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
-                       uint32_t len, int mem_flags)
+                       uint32_t len, uint32_t ebd_flags, int mem_flags)
 {
 	unsigned int nr_bufs = b->nr_extra_bufs + 1;
 	struct extra_bdata *ebd;
@@ -170,6 +172,7 @@ int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
 	ebd->base = base;
 	ebd->off = off;
 	ebd->len = len;
+	ebd->flags = ebd_flags;
 	b->extra_len += ebd->len;
 	return 0;
 }
@@ -196,16 +199,34 @@ void block_reset_metadata(struct block *b)
 	b->transport_offset = 0;
 }
 
+/* Extra data buffers are either kmalloc'd, and refcounted by kmalloc, or page
+ * cache pages (EBD_PM_PAGE), refcounted with pm_pin_page().  We go by the
+ * ebd's flags, not the page's: a pinned page can leave its PM, which clears
+ * PG_PAGEMAP. */
+void extra_bdata_incref(struct extra_bdata *ebd)
+{
+	if (ebd->flags & EBD_PM_PAGE)
+		pm_pin_page(kva2page((void*)ebd->base));
+	else
+		kmalloc_incref((void*)ebd->base);
+}
+
+void extra_bdata_decref(struct extra_bdata *ebd)
+{
+	if (ebd->flags & EBD_PM_PAGE)
+		pm_unpin_page(kva2page((void*)ebd->base));
+	else
+		kfree((void*)ebd->base);
+}
+
 void free_block_extra(struct block *b)
 {
 	struct extra_bdata *ebd;
 
-	/* assuming our release method is kfree, which will change when we
-	 * support user buffers */
 	for (int i = 0; i < b->nr_extra_bufs; i++) {
 		ebd = &b->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			extra_bdata_decref(ebd);
 	}
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -290,7 +311,8 @@ void checkb(struct block *b, char *msg)
 			panic("checkb %s: ebd %d has no base, but has off %d and len %d",
 			      msg, i, ebd->off, ebd->len);
 		if (ebd->base) {
-			if (!kmalloc_refcnt((void*)ebd->base))
+			if (!(ebd->flags & EBD_PM_PAGE) &&
+			    !kmalloc_refcnt((void*)ebd->base))
 				panic("checkb %s: buf %d, base %p has no refcnt!\n",
 				      msg, i, ebd->base);
 			extra_len += ebd->len;
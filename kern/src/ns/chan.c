@@ -223,6 +223,8 @@ struct chan *newchan(void)
 	c->name = 0;
 	c->buf = NULL;
 	c->mountpoint = NULL;
+	memset(&c->ra, 0, sizeof(c->ra));
+	c->ra.max_win = file_ra_default_pgs;
 	return c;
 }
 
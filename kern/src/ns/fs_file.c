@@ -13,6 +13,14 @@
 #include <error.h>
 #include <umem.h>
 #include <pmap.h>
+#include <kthread.h>
+
+/* Default readahead window limit for new chans, in pages.  CCTL_SET_RA changes
+ * it per chan, up to FILE_RA_MAX_PGS. */
+unsigned long file_ra_default_pgs = 64;
+
+#define FILE_RA_INIT_PGS	4
+#define FILE_RA_MAX_PGS		1024
 
 /* Initializes a zalloced fs_file.  The caller is responsible for filling in
  * dir, except for name.  Most fields are fine with being zeroed.  Note the kref
@@ -300,7 +308,7 @@ static void fs_file_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 			error(-error, "punch_hole pm_load_page failed");
 		zero_amt = MIN(PGSIZE - PGOFF(begin), end - begin);
 		memset(page2kva(page) + PGOFF(begin), 0, zero_amt);
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_page_set_dirty(page);
 		pm_put_page(page);
 		first_pg_idx++;
 		nr_pages--;
@@ -314,7 +322,7 @@ static void fs_file_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 		if (error)
 			error(-error, "punch_hole pm_load_page failed");
 		memset(page2kva(page), 0, PGOFF(end));
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_page_set_dirty(page);
 		pm_put_page(page);
 		last_pg_idx--;
 		nr_pages--;
@@ -346,6 +354,129 @@ void fs_file_truncate(struct fs_file *f, off64_t to)
 	}
 }
 
+struct fs_file_ra_work {
+	struct chan			*c;
+	struct fs_file			*f;
+	unsigned long			nr_pgs;
+	struct page			*pages[];
+};
+
+/* Ktask: fills the pages that fs_file_readahead() put in the PM.  Readers that
+ * get there first wait on the page lock. */
+static void __fs_file_ra_fill(void *arg)
+{
+	struct fs_file_ra_work *work = arg;
+
+	for (unsigned long i = 0; i < work->nr_pgs; i++)
+		pm_finish_load_page(work->f->pm, work->pages[i]);
+	cclose(work->c);
+	kfree(work);
+}
+
+/* Starts loading [start, start + nr_pgs) of f, without waiting.  Pages already
+ * in the PM are skipped.  The ktask holds a ref on c, which keeps f alive. */
+static void fs_file_ra_issue(struct chan *c, struct fs_file *f,
+                             unsigned long start, unsigned long nr_pgs)
+{
+	struct fs_file_ra_work *work;
+	struct page *page;
+
+	work = kmalloc(sizeof(struct fs_file_ra_work) +
+	               nr_pgs * sizeof(struct page*), MEM_ATOMIC);
+	if (!work)
+		return;
+	work->c = c;
+	work->f = f;
+	work->nr_pgs = 0;
+	for (unsigned long i = start; i < start + nr_pgs; i++) {
+		page = pm_start_load_page(f->pm, i);
+		if (page)
+			work->pages[work->nr_pgs++] = page;
+	}
+	if (!work->nr_pgs) {
+		kfree(work);
+		return;
+	}
+	c->ra.nr_ra_pgs += work->nr_pgs;
+	chan_incref(c);
+	ktask("fs_file_ra", __fs_file_ra_fill, work);
+}
+
+/* Readahead for reads of [offset, offset + count) of f through c.  Call this
+ * before the read, so the prefetches overlap with it.
+ *
+ * A read that starts where the last one left off (or in its last page) is
+ * sequential.  The first sequential read opens a window of FILE_RA_INIT_PGS, or
+ * twice the read, and we prefetch that far past the read.  Each time the reader
+ * gets within half a window of the prefetched pages, we double the window, up to
+ * the chan's max_win, and prefetch the next batch.  Any other read closes the
+ * window. */
+void fs_file_readahead(struct chan *c, struct fs_file *f, off64_t offset,
+                       size_t count)
+{
+	struct file_ra *ra = &c->ra;
+	unsigned long first, end, eof, ra_end;
+
+	if (!ra->max_win || !count)
+		return;
+	first = LA2PPN(offset);
+	end = LA2PPN(offset + count - 1) + 1;
+	eof = LA2PPN(ROUNDUP(fs_file_get_length(f), PGSIZE));
+	if ((first != ra->next_idx) && (first + 1 != ra->next_idx)) {
+		ra->nr_rand_reads++;
+		ra->next_idx = end;
+		ra->ra_idx = end;
+		ra->win = 0;
+		return;
+	}
+	ra->nr_seq_reads++;
+	ra->next_idx = end;
+	if (!ra->win) {
+		ra->win = MIN(MAX(FILE_RA_INIT_PGS, 2 * (end - first)),
+		              ra->max_win);
+		ra->ra_idx = end;
+	} else if (end + ra->win / 2 >= ra->ra_idx) {
+		ra->win = MIN(ra->win * 2, ra->max_win);
+	} else {
+		return;
+	}
+	ra->ra_idx = MAX(ra->ra_idx, end);
+	ra_end = MIN(end + ra->win, eof);
+	if (ra_end <= ra->ra_idx)
+		return;
+	fs_file_ra_issue(c, f, ra->ra_idx, ra_end - ra->ra_idx);
+	ra->ra_idx = ra_end;
+}
+
+/* Handles the readahead chan_ctls, for devices whose files use fs_file_read().
+ */
+unsigned long fs_file_ra_chan_ctl(struct chan *c, int op, unsigned long a1)
+{
+	struct file_ra_stats stats;
+
+	switch (op) {
+	case CCTL_SET_RA:
+		if (a1 > FILE_RA_MAX_PGS)
+			error(EINVAL, "readahead window %lu is over %d pages",
+			      a1, FILE_RA_MAX_PGS);
+		c->ra.max_win = a1;
+		c->ra.win = MIN(c->ra.win, a1);
+		return 0;
+	case CCTL_GET_RA_STATS:
+		stats.max_win = c->ra.max_win;
+		stats.win = c->ra.win;
+		stats.nr_seq_reads = c->ra.nr_seq_reads;
+		stats.nr_rand_reads = c->ra.nr_rand_reads;
+		stats.nr_ra_pgs = c->ra.nr_ra_pgs;
+		if (memcpy_to_user(current, (void*)a1, &stats, sizeof(stats)))
+			error(EFAULT, "bad stats pointer %p", a1);
+		return 0;
+	default:
+		error(EINVAL, "%s does not support chanctl %d",
+		      chan_dev_name(c), op);
+	}
+}
+
 /* Standard read.  We sync with write, in that once the length is set, we'll
  * attempt to read those bytes. */
 size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
@@ -400,6 +531,49 @@ size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
 	return so_far;
 }
 
+/* Like fs_file_read(), but without the copy: returns a block whose extra data
+ * points into the file's page cache pages, each pinned for as long as the block
+ * (or anything cloned from it) needs it.  The block has no room for headers.
+ * Returns a block with less than count bytes at EOF, possibly none. */
+struct block *fs_file_read_block(struct fs_file *f, size_t count,
+                                 off64_t offset)
+{
+	ERRSTACK(1);
+	struct page *page;
+	struct block *bp;
+	size_t copy_amt, pg_off, pg_idx, total_remaining;
+	int error;
+
+	if (offset + count < offset)
+		panic("Bad offset %p + count %p", offset, count);
+	bp = block_alloc(0, MEM_WAIT);
+	if (waserror()) {
+		freeb(bp);
+		nexterror();
+	}
+	while (BLEN(bp) < count) {
+		if (offset + BLEN(bp) >= fs_file_get_length(f))
+			break;
+		pg_off = PGOFF(offset + BLEN(bp));
+		pg_idx = LA2PPN(offset + BLEN(bp));
+		error = pm_load_page(f->pm, pg_idx, &page);
+		if (error)
+			error(-error, "read pm_load_page failed");
+		copy_amt = MIN(PGSIZE - pg_off, count - BLEN(bp));
+		total_remaining = fs_file_get_length(f) - (offset + BLEN(bp));
+		copy_amt = MIN(copy_amt, total_remaining);
+		/* The block's ref is a pin, which outlives our PM ref. */
+		pm_pin_page(page);
+		pm_put_page(page);
+		block_append_extra(bp, (uintptr_t)page2kva(page), pg_off,
+		                   copy_amt, EBD_PM_PAGE, MEM_WAIT);
+	}
+	if (BLEN(bp))
+		set_acmtime_noperm(f, FSF_ATIME);
+	poperror();
+	return bp;
+}
+
 size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
                      off64_t offset)
 {
@@ -451,7 +625,7 @@ size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
 			memset(page2kva(page) + pg_off, 0, copy_amt);
 		buf += copy_amt;
 		so_far += copy_amt;
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_page_set_dirty(page);
 		pm_put_page(page);
 	}
 	assert(buf == buf_end);
@@ -462,6 +636,7 @@ size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
 	 * instead of what we added. */
 	write_metadata(f, offset + so_far, false);
 	poperror();
+	pm_dirty_throttle(f->pm);
 	return so_far;
 }
 
@@ -323,7 +323,7 @@ struct block *pullupblock(struct block *bp, int n)
 			ebd->off += seglen;
 			bp->extra_len -= seglen;
 			if (ebd->len == 0) {
-				kfree((void *)ebd->base);
+				extra_bdata_decref(ebd);
 				ebd->off = 0;
 				ebd->base = 0;
 			}
@@ -411,7 +411,7 @@ static int pullext(struct block *bp, int count)
 		ed->off += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			extra_bdata_decref(ed);
 			ed->base = 0;
 			ed->off = 0;
 		}
@@ -437,7 +437,7 @@ static int dropext(struct block *bp, int count)
 		bytes += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			extra_bdata_decref(ed);
 			ed->base = 0;
 			ed->off = 0;
 		}
@@ -558,7 +558,7 @@ struct block *adjustblock(struct block *bp, int len)
 		}
 		/* Grow with extra data buffers. */
 		buf = kzmalloc(len - BLEN(bp), MEM_WAIT);
-		block_append_extra(bp, (uintptr_t)buf, 0, len - BLEN(bp),
+		block_append_extra(bp, (uintptr_t)buf, 0, len - BLEN(bp), 0,
 				   MEM_WAIT);
 		QDEBUG checkb(bp, "adjustblock 3");
 		return bp;
@@ -587,8 +587,8 @@ struct block *adjustblock(struct block *bp, int len)
 	for (; i < bp->nr_extra_bufs; i++) {
 		ebd = &bp->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
-		ebd->base = ebd->off = ebd->len = 0;
+			extra_bdata_decref(ebd);
+		ebd->base = ebd->off = ebd->len = ebd->flags = 0;
 	}
 	QDEBUG checkb(bp, "adjustblock 4");
 	return bp;
@@ -632,10 +632,11 @@ static size_t move_ebd(struct extra_bdata *ebd, struct block *to,
 {
 	size_t ret = ebd->len;
 
-	if (block_append_extra(to, ebd->base, ebd->off, ebd->len, MEM_ATOMIC))
+	if (block_append_extra(to, ebd->base, ebd->off, ebd->len, ebd->flags,
+	                       MEM_ATOMIC))
 		return 0;
 	block_and_q_lost_extra(from, from_q, ebd->len);
-	ebd->base = ebd->len = ebd->off = 0;
+	ebd->base = ebd->len = ebd->off = ebd->flags = 0;
 	return ret;
 }
 
@@ -976,6 +977,7 @@ static size_t point_to_body(struct block *b, uint8_t *body_rp,
 	ebd->base = (uintptr_t)b;
 	ebd->off = (uint32_t)(body_rp - (uint8_t*)b);
 	ebd->len = MIN(b->wp - body_rp, len);	/* think of body_rp as b->rp */
+	ebd->flags = 0;
 	assert((int)ebd->len >= 0);
 	newb->extra_len += ebd->len;
 	return ebd->len;
@@ -996,10 +998,11 @@ static size_t point_to_buf(struct block *b, unsigned int b_idx, uint32_t b_off,
 	assert(b_idx < b->nr_extra_bufs);
 	assert(newb_idx < newb->nr_extra_bufs);
 
-	kmalloc_incref((void*)b_ebd->base);
+	extra_bdata_incref(b_ebd);
 	n_ebd->base = b_ebd->base;
 	n_ebd->off = b_ebd->off + b_off;
 	n_ebd->len = MIN(b_ebd->len - b_off, len);
+	n_ebd->flags = b_ebd->flags;
 	newb->extra_len += n_ebd->len;
 	return n_ebd->len;
 }
@@ -1335,7 +1338,7 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 			/* we don't actually have to decref here.  it's also
 			 * done in freeb().  this is the earliest we can free.
 			 */
-			kfree((void*)ebd->base);
+			extra_bdata_decref(ebd);
 			ebd->base = ebd->off = 0;
 		}
 		to += copy_amt;
@@ -1656,6 +1659,7 @@ static struct block *build_block(void *from, size_t len, int mem_flags)
 	b->extra_data[0].base = (uintptr_t)ext_buf;
 	b->extra_data[0].off = 0;
 	b->extra_data[0].len = len;
+	b->extra_data[0].flags = 0;
 	b->extra_len += len;
 #else
 	b = block_alloc(len, mem_flags);
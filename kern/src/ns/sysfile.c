@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <rcu.h>
+#include <fs_file.h>
 
 /* TODO: these sizes are hokey.  DIRSIZE is used in chandirstat, and it looks
  * like it's the size of a common-case stat. */
@@ -51,6 +52,10 @@ enum {
 	 * very expensive. At the same time, let's not yet exceed a common
 	 * MSIZE. */
 	DIRREADSIZE = 8192,
+
+	/* Most sendfile puts in one block.  TCP only takes what fits in its
+	 * queue anyway, and this is enough pages to amortize the write. */
+	SENDFILE_CHUNK = 64 * 1024,
 };
 
 int newfd(struct chan *c, int low_fd, int oflags, bool must_use_low)
@@ -1165,6 +1170,98 @@ long syspwrite(int fd, void *va, long n, int64_t off)
 	return rwrite(fd, va, n, &off);
 }
 
+/* Sends up to n bytes of in_fd, starting at *offp (or in_fd's offset if offp is
+ * NULL), to out_fd, without copying them.  in_fd has to be a file with a page
+ * cache, i.e. its device can mmap it, and we write out_fd blocks that point
+ * into the cache's pages.  Devices with their own bwrite, like #ip
+ * conversations, queue those blocks as they are; others get a copy.
+ *
+ * Returns the amount sent and advances the offset we used, or -1 on error. */
+long syssendfile(int out_fd, int in_fd, int64_t *offp, long n)
+{
+	ERRSTACK(4);
+	struct chan *in, *out;
+	struct fs_file *f;
+	struct block *bp;
+	int64_t off;
+	volatile long sent = 0;		/* volatile for waserror */
+	long amt;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	in = fdtochan(&current->open_files, in_fd, O_READ, 1, 1);
+	if (waserror()) {
+		cclose(in);
+		nexterror();
+	}
+	out = fdtochan(&current->open_files, out_fd, O_WRITE, 1, 1);
+	if (waserror()) {
+		cclose(out);
+		nexterror();
+	}
+	if (n < 0)
+		error(EINVAL, "bad count %d", n);
+	if (in->qid.type & QTDIR)
+		error(EISDIR, "can't sendfile a directory");
+	if (!devtab[in->type].mmap)
+		error(ENOTSUP, "%s has no page cache", chan_dev_name(in));
+	/* We don't want a mapping, just the file behind the chan. */
+	f = devtab[in->type].mmap(in, NULL, PROT_READ, MAP_PRIVATE);
+
+	if (offp == NULL) {
+		spin_lock(&in->lock);
+		off = in->offset;
+		spin_unlock(&in->lock);
+	} else {
+		off = *offp;
+	}
+	if (off < 0)
+		error(EINVAL, "bad offset %d", off);
+
+	/* Once anything went out, report that instead of the error. */
+	if (waserror()) {
+		if (!sent)
+			nexterror();
+	} else {
+		while (sent < n) {
+			fs_file_readahead(in, f, off + sent,
+			                  MIN(n - sent, SENDFILE_CHUNK));
+			bp = fs_file_read_block(f, MIN(n - sent, SENDFILE_CHUNK),
+			                        off + sent);
+			amt = BLEN(bp);
+			if (!amt) {
+				freeb(bp);
+				break;
+			}
+			if (devtab[out->type].bwrite == devbwrite)
+				bp = linearizeblock(bp);
+			devtab[out->type].bwrite(out, bp, out->offset);
+			spin_lock(&out->lock);
+			out->offset += amt;
+			spin_unlock(&out->lock);
+			sent += amt;
+		}
+	}
+	poperror();
+
+	if (offp == NULL) {
+		spin_lock(&in->lock);
+		in->offset += sent;
+		spin_unlock(&in->lock);
+	} else {
+		*offp += sent;
+	}
+
+	poperror();
+	cclose(out);
+	poperror();
+	cclose(in);
+	poperror();
+	return sent;
+}
+
 int syswstat(char *path, uint8_t * buf, int n)
 {
 	ERRSTACK(2);
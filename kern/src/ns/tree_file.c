@@ -1027,6 +1027,7 @@ size_t tree_chan_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 
 	if (tree_file_is_dir(tf))
 		return tree_file_readdir(tf, ubuf, n, offset, &c->dri);
+	fs_file_readahead(c, &tf->file, offset, n);
 	return fs_file_read(&tf->file, ubuf, n, offset);
 }
 
@@ -1081,6 +1082,11 @@ unsigned long tree_chan_ctl(struct chan *c, int op, unsigned long a1,
 		__tfs_dump_tf(chan_to_tree_file(c));
 		print_unlock();
 		return 0;
+	case CCTL_SET_RA:
+	case CCTL_GET_RA_STATS:
+		if (tree_file_is_dir(chan_to_tree_file(c)))
+			error(EISDIR, "no readahead on directories");
+		return fs_file_ra_chan_ctl(c, op, a1);
 	default:
 		error(EINVAL, "%s does not support chanctl %d",
 		      chan_dev_name(c), op);
@@ -1233,7 +1239,7 @@ static void print_tf(struct tree_file *tf)
 		printk("%-10s: Negative\n", tree_file_to_name(tf));
 		return;
 	}
-	printk("%-10s: Q: %5d, R: %2d, U %s, %c%o %s\n",
+	printk("%-10s: Q: %5d, R: %2d, U %s, %c%o %s",
 		   tree_file_to_name(tf),
 		   tf->file.dir.qid.path,
 		   kref_refcnt(&tf->kref),
@@ -1244,6 +1250,12 @@ static void print_tf(struct tree_file *tf)
 		   tf->file.dir.mode & S_PMASK,
 		   tf->file.dir.mode & DMSYMLINK ? tf->file.dir.ext : ""
 		   );
+	if (qid_is_file(tf->file.dir.qid))
+		printk(" PM: %lu pgs, %lu dirty, %lu written in %lu ops",
+		       tf->file.pm->pm_num_pages,
+		       atomic_read(&tf->file.pm->pm_nr_dirty),
+		       tf->file.pm->pm_nr_written, tf->file.pm->pm_nr_wb_ops);
+	printk("\n");
 }
 
 static void dump_tf(struct tree_file *tf, int tabs)
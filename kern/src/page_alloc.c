@@ -9,6 +9,8 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <arena.h>
+#include <smp.h>
+#include <stdio.h>
 
 /* Helper, allocates a free page. */
 static struct page *get_a_free_page(void)
@@ -39,11 +41,90 @@ error_t upage_alloc(struct proc *p, page_t **page, bool zero)
 	if (!pg)
 		return -ENOMEM;
 	*page = pg;
+	atomic_set(&pg->pg_pins, 1);
 	if (zero)
 		memset(page2kva(*page), 0, PGSIZE);
 	return 0;
 }
 
+/* User pages can be mapped by more than one address space, after a CoW fork.
+ * Each PTE holds a ref, and the page is freed when the last one goes away. */
+void upage_incref(struct page *page)
+{
+	atomic_inc(&page->pg_pins);
+}
+
+static void __jumbo_subpage_free(struct page *page);
+
+void upage_decref(struct page *page)
+{
+	if (!atomic_sub_and_test(&page->pg_pins, 1))
+		return;
+	if (atomic_read(&page->pg_flags) & PG_JUMBO)
+		__jumbo_subpage_free(page);
+	else
+		page_decref(page);
+}
+
+error_t upage_alloc_jumbo(struct proc *p, struct page **page, bool zero)
+{
+	void *addr = jumbo_page_alloc(1, MEM_ATOMIC);
+	struct page *pg;
+
+	if (!addr)
+		return -ENOMEM;
+	pg = kva2page(addr);
+	for (int i = 0; i < UJUMBO_NR_PGS; i++) {
+		atomic_set(&pg[i].pg_pins, 1);
+		atomic_set(&pg[i].pg_flags, PG_JUMBO);
+		pg[i].pg_index = i << PGSHIFT;
+	}
+	atomic_set((atomic_t*)&pg->pg_private, UJUMBO_NR_PGS);
+	if (zero)
+		memset(addr, 0, UJUMBO_SIZE);
+	*page = pg;
+	return 0;
+}
+
+void upage_incref_jumbo(struct page *page)
+{
+	for (int i = 0; i < UJUMBO_NR_PGS; i++)
+		upage_incref(&page[i]);
+}
+
+void upage_decref_jumbo(struct page *page)
+{
+	for (int i = 0; i < UJUMBO_NR_PGS; i++)
+		upage_decref(&page[i]);
+}
+
+/* Whether any of the jumbo's pages are mapped by someone else, e.g. a child
+ * after a CoW fork. */
+bool upage_jumbo_is_shared(struct page *page)
+{
+	for (int i = 0; i < UJUMBO_NR_PGS; i++) {
+		if (atomic_read(&page[i].pg_pins) > 1)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* One of the jumbo's pages has no more users.  The last one out frees the
+ * jumbo. */
+static void __jumbo_subpage_free(struct page *page)
+{
+	struct page *first = kva2page(page2kva(page) - page->pg_index);
+
+	if (!atomic_sub_and_test((atomic_t*)&first->pg_private, 1))
+		return;
+	for (int i = 0; i < UJUMBO_NR_PGS; i++) {
+		atomic_set(&first[i].pg_flags, 0);
+		first[i].pg_index = 0;
+	}
+	first->pg_private = NULL;
+	jumbo_page_free(page2kva(first), 1);
+}
+
 error_t kpage_alloc(page_t **page)
 {
 	struct page *pg = get_a_free_page();
@@ -73,16 +154,76 @@ void *kpage_zalloc_addr(void)
 	return retval;
 }
 
-/* Helper function for allocating from the kpages_arena.  This may be useful
- * later since we might send the caller to a different NUMA domain. */
-void *kpages_alloc(size_t size, int flags)
+struct arena *base_arenas[MAX_NUMA_NODES];
+struct arena *kpages_arenas[MAX_NUMA_NODES];
+int nr_mem_nodes = 1;
+
+/* Builds node's base and kpages arenas, using the first page of [base, base +
+ * size) for the base arena itself. */
+static void mem_node_build(int node, void *base, size_t size)
 {
-	return arena_alloc(kpages_arena, size, flags);
+	char name[ARENA_NAME_SZ];
+	void *kpages_pg;
+
+	snprintf(name, sizeof(name), "base-%d", node);
+	base_arenas[node] = arena_builder(base, name, PGSIZE, NULL, NULL, NULL,
+	                                  0);
+	base += PGSIZE;
+	size -= PGSIZE;
+	if (size)
+		arena_add(base_arenas[node], base, size, MEM_WAIT);
+	kpages_pg = arena_alloc(base_arenas[node], PGSIZE, MEM_WAIT);
+	snprintf(name, sizeof(name), "kpages-%d", node);
+	kpages_arenas[node] = arena_builder(kpages_pg, name, PGSIZE,
+	                                    arena_alloc, arena_free,
+	                                    base_arenas[node], 8 * PGSIZE);
+	nr_mem_nodes = MAX(nr_mem_nodes, node + 1);
 }
 
-void *kpages_zalloc(size_t size, int flags)
+/* Hands [base, base + size) to NUMA node 'node'.  The memory must not be in
+ * any other arena; arch code carves it out of base_arena after it learns the
+ * memory layout.  Node 0 is base_arena, and it already has its memory. */
+void mem_node_add(int node, void *base, size_t size)
 {
-	void *ret = arena_alloc(kpages_arena, size, flags);
+	struct page *pg = kva2page(base);
+
+	assert(node > 0 && node < MAX_NUMA_NODES);
+	assert(PGOFF(base) == 0 && PGOFF(size) == 0 && size);
+	for (size_t i = 0; i < size / PGSIZE; i++)
+		pg[i].pg_node = node;
+	if (!base_arenas[node])
+		mem_node_build(node, base, size);
+	else
+		arena_add(base_arenas[node], base, size, MEM_WAIT);
+}
+
+/* Returns the node we allocate from by default on this core. */
+int local_mem_node(void)
+{
+	if (nr_mem_nodes == 1)
+		return 0;
+	return per_cpu_info[core_id_early()].numa_node;
+}
+
+static struct arena *node_kpages_arena(int node)
+{
+	if (node < 0 || node >= nr_mem_nodes || !kpages_arenas[node])
+		return kpages_arena;
+	return kpages_arenas[node];
+}
+
+/* Helpers for allocating from the kpages arenas.  The default is the calling
+ * core's NUMA node; the _node variants let the caller pick.  If the node has
+ * no memory of its own, we fall back to node 0.  Frees go back to whichever
+ * node the memory came from. */
+void *kpages_alloc_node(size_t size, int flags, int node)
+{
+	return arena_alloc(node_kpages_arena(node), size, flags);
+}
+
+void *kpages_zalloc_node(size_t size, int flags, int node)
+{
+	void *ret = kpages_alloc_node(size, flags, node);
 
 	if (!ret)
 		return NULL;
@@ -90,23 +231,39 @@ void *kpages_zalloc(size_t size, int flags)
 	return ret;
 }
 
+void *kpages_alloc(size_t size, int flags)
+{
+	return kpages_alloc_node(size, flags, local_mem_node());
+}
+
+void *kpages_zalloc(size_t size, int flags)
+{
+	return kpages_zalloc_node(size, flags, local_mem_node());
+}
+
 void kpages_free(void *addr, size_t size)
 {
-	arena_free(kpages_arena, addr, size);
+	arena_free(kpages_arenas[kva2page(addr)->pg_node], addr, size);
 }
 
 /* Returns naturally aligned, contiguous pages of amount PGSIZE << order.  Linux
  * code might assume its allocations are aligned. (see dma_alloc_coherent and
  * bnx2x). */
+void *get_cont_pages_node(size_t order, int flags, int node)
+{
+	return arena_xalloc(node_kpages_arena(node), PGSIZE << order,
+	                    PGSIZE << order, 0, 0, NULL, NULL, flags);
+}
+
 void *get_cont_pages(size_t order, int flags)
 {
-	return arena_xalloc(kpages_arena, PGSIZE << order, PGSIZE << order,
-	                    0, 0, NULL, NULL, flags);
+	return get_cont_pages_node(order, flags, local_mem_node());
 }
 
 void free_cont_pages(void *buf, size_t order)
 {
-	arena_xfree(kpages_arena, buf, PGSIZE << order);
+	arena_xfree(kpages_arenas[kva2page(buf)->pg_node], buf,
+	            PGSIZE << order);
 }
 
 /* Frees the page */
@@ -142,7 +299,7 @@ static void *__jumbo_pml2_alloc(struct arena *a, size_t size, int flags)
 
 static struct arena *jumbo_pml2_arena;
 
-/* Just for example; we could add qcaches too.  Do this after kmalloc_init(). */
+/* Backs user jumbo pages.  Do this after kmalloc_init(). */
 void jumbo_arena_init(void)
 {
 	jumbo_pml2_arena = arena_create("jumbo_pml2", NULL, 0, PML2_PTE_REACH,
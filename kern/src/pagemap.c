@@ -13,6 +13,28 @@
 #include <stdio.h>
 #include <pagemap.h>
 #include <rcu.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <err.h>
+
+/* Writeback tunables.  The writeback ktask runs every pm_wb_period_usec, or
+ * sooner once dirty pages pass pm_dirty_background_pct of memory.  Writers that
+ * push it past pm_dirty_throttle_pct wait for writeback, up to
+ * pm_dirty_throttle_usec per write. */
+unsigned long pm_wb_period_usec = 5000000;
+unsigned int pm_dirty_background_pct = 10;
+unsigned int pm_dirty_throttle_pct = 20;
+unsigned long pm_dirty_throttle_usec = 100000;
+
+/* Dirty pages in PMs that count (see pm_counts_dirty()) */
+static atomic_t pm_nr_dirty_pages;
+
+static qlock_t pm_wb_clients_qlock = QLOCK_INITIALIZER(pm_wb_clients_qlock);
+static TAILQ_HEAD(, pm_wb_client) pm_wb_clients =
+	TAILQ_HEAD_INITIALIZER(pm_wb_clients);
+static struct rendez pm_wb_rv;		/* the ktask waits for a kick */
+static struct rendez pm_wb_throttle_rv;	/* throttled writers wait */
+static bool pm_wb_kicked;
 
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
@@ -96,6 +118,48 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	qlock_init(&pm->pm_qlock);
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
+	atomic_init(&pm->pm_nr_dirty, 0);
+	pm->pm_nr_written = 0;
+	pm->pm_nr_wb_ops = 0;
+}
+
+static bool pm_counts_dirty(struct page_map *pm)
+{
+	return pm->pm_op->writepages != NULL;
+}
+
+/* Marks a page cache page dirty, so the next writeback writes it. */
+void pm_page_set_dirty(struct page *page)
+{
+	struct page_map *pm = page->pg_mapping;
+	long old_flags;
+
+	do {
+		old_flags = atomic_read(&page->pg_flags);
+		if (old_flags & PG_DIRTY)
+			return;
+	} while (!atomic_cas(&page->pg_flags, old_flags,
+	                     old_flags | PG_DIRTY));
+	atomic_inc(&pm->pm_nr_dirty);
+	if (pm_counts_dirty(pm))
+		atomic_inc(&pm_nr_dirty_pages);
+}
+
+/* Clears the page's dirty bit, returning TRUE if it was set. */
+static bool pm_page_clear_dirty(struct page_map *pm, struct page *page)
+{
+	long old_flags;
+
+	do {
+		old_flags = atomic_read(&page->pg_flags);
+		if (!(old_flags & PG_DIRTY))
+			return FALSE;
+	} while (!atomic_cas(&page->pg_flags, old_flags,
+	                     old_flags & ~PG_DIRTY));
+	atomic_dec(&pm->pm_nr_dirty);
+	if (pm_counts_dirty(pm))
+		atomic_dec(&pm_nr_dirty_pages);
+	return TRUE;
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
@@ -150,7 +214,7 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	void **tree_slot;
 	void *slot_val = 0;
 
-	page->pg_mapping = pm;	/* debugging */
+	page->pg_mapping = pm;	/* for pm_page_set_dirty() */
 	page->pg_index = index;
 	/* no one should be looking at the tree slot til we stop write locking.
 	 * the only other one who looks is removal, who requires a PM write
@@ -183,6 +247,51 @@ void pm_put_page(struct page *page)
 	atomic_add((atomic_t*)tree_slot, -(1UL << PM_REFCNT_SHIFT));
 }
 
+/* Drops one of the page's pins.  The PM holds one for as long as the page is
+ * in the PM, so the page gets freed when both the PM and every pinner are done
+ * with it. */
+static void pm_release_page(struct page *page)
+{
+	if (atomic_sub_and_test(&page->pg_pins, 1))
+		page_decref(page);
+}
+
+/* Pins a page for I/O that can outlive the caller's PM ref, such as a network
+ * block whose extra data points into the page.  The caller needs a ref on the
+ * page already, either a PM ref (pm_load_page()) or a pin.
+ *
+ * A pinned page can still be removed from its PM, e.g. when the PM prunes its
+ * unused pages or is destroyed.  It just isn't freed until the last pin goes
+ * away.  The data stays what it was when the page left the PM. */
+void pm_pin_page(struct page *page)
+{
+	atomic_inc(&page->pg_pins);
+}
+
+void pm_unpin_page(struct page *page)
+{
+	pm_release_page(page);
+}
+
+/* Helper: allocs a page that is ready to insert into a PM and then fill. */
+static int pm_alloc_locked_page(struct page **pp)
+{
+	struct page *page;
+
+	if (kpage_alloc(&page))
+		return -ENOMEM;
+	/* important that UP_TO_DATE is not set.  once we put it in the PM,
+	 * others can find it, and we still need to fill it. */
+	atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP);
+	atomic_set(&page->pg_pins, 1);
+	/* The sem needs to be initted before anyone can try to lock it, meaning
+	 * before it is in the page cache.  We also want it locked preemptively,
+	 * by setting signals = 0. */
+	sem_init(&page->pg_sem, 0);
+	*pp = page;
+	return 0;
+}
+
 /* Makes sure the index'th page of the mapped object is loaded in the page cache
  * and returns its location via **pp.
  *
@@ -194,15 +303,8 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 
 	page = pm_find_page(pm, index);
 	while (!page) {
-		if (kpage_alloc(&page))
+		if (pm_alloc_locked_page(&page))
 			return -ENOMEM;
-		/* important that UP_TO_DATE is not set.  once we put it in the
-		 * PM, others can find it, and we still need to fill it. */
-		atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP);
-		/* The sem needs to be initted before anyone can try to lock it,
-		 * meaning before it is in the page cache.  We also want it
-		 * locked preemptively, by setting signals = 0. */
-		sem_init(&page->pg_sem, 0);
 		error = pm_insert_page(pm, index, page);
 		switch (error) {
 		case 0:
@@ -268,6 +370,43 @@ int pm_load_page_nowait(struct page_map *pm, unsigned long index,
 	return 0;
 }
 
+/* The first half of loading the index'th page, for callers that want to fill
+ * pages without waiting for them, such as readahead.  Inserts a locked page
+ * that is not PG_UPTODATE, so that pm_load_page() callers wait for it instead
+ * of reading it themselves.  Returns the page with a PM slot ref, or 0 if the
+ * page is already in the PM (loaded or not) or we're out of memory.
+ *
+ * The caller must pm_finish_load_page() the page, which can block. */
+struct page *pm_start_load_page(struct page_map *pm, unsigned long index)
+{
+	struct page *page = pm_find_page(pm, index);
+
+	if (page) {
+		pm_put_page(page);
+		return 0;
+	}
+	if (pm_alloc_locked_page(&page))
+		return 0;
+	if (pm_insert_page(pm, index, page)) {
+		atomic_set(&page->pg_flags, 0);
+		page_decref(page);
+		return 0;
+	}
+	return page;
+}
+
+/* Reads in a page from pm_start_load_page() and drops its PM slot ref. */
+void pm_finish_load_page(struct page_map *pm, struct page *page)
+{
+	int error;
+
+	error = pm->pm_op->readpage(pm, page);
+	assert(!error);
+	assert(atomic_read(&page->pg_flags) & PG_UPTODATE);
+	unlock_page(page);
+	pm_put_page(page);
+}
+
 static bool vmr_has_page_idx(struct vm_region *vmr, unsigned long pg_idx)
 {
 	unsigned long nr_pgs = (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
@@ -351,8 +490,9 @@ static bool __remove_or_zero_cb(void **slot, unsigned long tree_idx, void *arg)
 	 * return true, but this is fine.  Future lock-free lookups will now
 	 * fail (since the page is 0), and insertions will block on the write
 	 * lock. */
+	pm_page_clear_dirty(pm, page);
 	atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
-	page_decref(page);
+	pm_release_page(page);
 	return true;
 }
 
@@ -376,8 +516,7 @@ static int __pm_mark_and_clear_dirty(struct proc *p, pte_t pte, void *va,
 
 	if (!pte_is_present(pte) || !pte_is_dirty(pte))
 		return 0;
-	if (!(atomic_read(&page->pg_flags) & PG_DIRTY))
-		atomic_or(&page->pg_flags, PG_DIRTY);
+	pm_page_set_dirty(page);
 	pte_clear_dirty(pte);
 	vmr->vm_shootdown_needed = true;
 	return 0;
@@ -412,63 +551,171 @@ static void mark_and_clear_dirty_ptes(struct page_map *pm)
 static void shootdown_vmrs(struct page_map *pm)
 {
 	struct vm_region *vmr_i;
+	struct tlb_batch tb;
 
 	/* The VMR flag shootdown_needed is owned by the PM.  Each VMR is hooked
-	 * to at most one file, so there's no issue there.  We might have a proc
-	 * that has multiple non-private VMRs in the same file, but it shouldn't
-	 * be a big enough issue to worry about. */
+	 * to at most one file, so there's no issue there.  A proc that has
+	 * multiple non-private VMRs in the same file usually has them next to
+	 * each other in the list, and those share a shootdown. */
+	tlb_batch_init(&tb, NULL);
 	spin_lock(&pm->pm_lock);
 	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
-		if (vmr_i->vm_shootdown_needed) {
-			vmr_i->vm_shootdown_needed = false;
-			proc_tlbshootdown(vmr_i->vm_proc, 0, 0);
+		if (!vmr_i->vm_shootdown_needed)
+			continue;
+		vmr_i->vm_shootdown_needed = false;
+		if (tb.p != vmr_i->vm_proc) {
+			tlb_batch_flush(&tb);
+			tlb_batch_init(&tb, vmr_i->vm_proc);
 		}
+		tlb_batch_add(&tb, vmr_i->vm_base, vmr_i->vm_end);
 	}
+	tlb_batch_flush(&tb);
 	spin_unlock(&pm->pm_lock);
 }
 
+#define PM_WB_BATCH_PGS		64
+
+/* A run of dirty pages with consecutive indexes, to write back in one op. */
+struct pm_wb_batch {
+	struct page_map			*pm;
+	unsigned long			nr_pgs;
+	struct page			*pages[PM_WB_BATCH_PGS];
+};
+
 /* Send any queued WBs that haven't been sent yet. */
-static void flush_queued_writebacks(struct page_map *pm)
+static void flush_queued_writebacks(struct pm_wb_batch *wb)
 {
-	/* TODO (WB) */
+	struct page_map *pm = wb->pm;
+
+	if (!wb->nr_pgs)
+		return;
+	if (pm->pm_op->writepages && (wb->nr_pgs > 1)) {
+		pm->pm_op->writepages(pm, wb->pages, wb->nr_pgs);
+		pm->pm_nr_wb_ops++;
+	} else {
+		for (unsigned long i = 0; i < wb->nr_pgs; i++)
+			pm->pm_op->writepage(pm, wb->pages[i]);
+		pm->pm_nr_wb_ops += wb->nr_pgs;
+	}
+	pm->pm_nr_written += wb->nr_pgs;
+	wb->nr_pgs = 0;
 }
 
-/* Batches up pages to be written back, preferably as one big op.  If we have a
- * bunch outstanding, we'll send them. */
-static void queue_writeback(struct page_map *pm, struct page *page)
+/* Batches up pages to be written back, preferably as one big op.  A page that
+ * doesn't extend the current run, or a full batch, sends what we have. */
+static void queue_writeback(struct pm_wb_batch *wb, struct page *page)
 {
-	/* TODO (WB): add a bulk op (instead of only writepage()), collect
-	 * extents, and send them to the device.  Probably do something similar
-	 * for reads. */
-	pm->pm_op->writepage(pm, page);
+	if (wb->nr_pgs &&
+	    ((wb->nr_pgs == PM_WB_BATCH_PGS) ||
+	     (page->pg_index != wb->pages[wb->nr_pgs - 1]->pg_index + 1)))
+		flush_queued_writebacks(wb);
+	wb->pages[wb->nr_pgs++] = page;
 }
 
 static bool __writeback_cb(void **slot, unsigned long tree_idx, void *arg)
 {
-	struct page_map *pm = arg;
+	struct pm_wb_batch *wb = arg;
 	struct page *page = pm_slot_get_page(*slot);
 
 	/* We're qlocked, so all items should have pages. */
 	assert(page);
-	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
-		atomic_and(&page->pg_flags, ~PG_DIRTY);
-		queue_writeback(pm, page);
-	}
+	if (pm_page_clear_dirty(wb->pm, page))
+		queue_writeback(wb, page);
 	return false;
 }
 
 /* Every dirty page gets written back, regardless of whether it's in a VMR or
- * not.  All the dirty bits get cleared too, before writing back. */
+ * not.  All the dirty bits get cleared too, before writing back.
+ *
+ * The radix walk is in index order, so runs of dirty pages go out together. */
 void pm_writeback_pages(struct page_map *pm)
 {
+	struct pm_wb_batch wb[1];
+
+	wb->pm = pm;
+	wb->nr_pgs = 0;
 	qlock(&pm->pm_qlock);
 	mark_and_clear_dirty_ptes(pm);
 	shootdown_vmrs(pm);
-	radix_for_each_slot(&pm->pm_tree, __writeback_cb, pm);
-	flush_queued_writebacks(pm);
+	radix_for_each_slot(&pm->pm_tree, __writeback_cb, wb);
+	flush_queued_writebacks(wb);
 	qunlock(&pm->pm_qlock);
 }
 
+void pm_wb_register(struct pm_wb_client *wbc)
+{
+	qlock(&pm_wb_clients_qlock);
+	TAILQ_INSERT_TAIL(&pm_wb_clients, wbc, link);
+	qunlock(&pm_wb_clients_qlock);
+}
+
+void pm_wb_unregister(struct pm_wb_client *wbc)
+{
+	qlock(&pm_wb_clients_qlock);
+	TAILQ_REMOVE(&pm_wb_clients, wbc, link);
+	qunlock(&pm_wb_clients_qlock);
+}
+
+static unsigned long pm_dirty_limit(unsigned int pct)
+{
+	return max_nr_pages / 100 * pct;
+}
+
+static int __pm_wb_kicked(void *arg)
+{
+	return pm_wb_kicked;
+}
+
+static int __pm_under_throttle(void *arg)
+{
+	return atomic_read(&pm_nr_dirty_pages) <
+	       pm_dirty_limit(pm_dirty_throttle_pct);
+}
+
+/* Writers call this after dirtying pages in pm.  Past the background limit, we
+ * kick the writeback ktask.  Past the throttle limit, we also wait for it,
+ * within reason.  Don't hold locks that writeback needs, e.g. the file's. */
+void pm_dirty_throttle(struct page_map *pm)
+{
+	unsigned long nr_dirty = atomic_read(&pm_nr_dirty_pages);
+
+	if (!pm_counts_dirty(pm))
+		return;
+	if (nr_dirty < pm_dirty_limit(pm_dirty_background_pct))
+		return;
+	if (!pm_wb_kicked) {
+		pm_wb_kicked = TRUE;
+		rendez_wakeup(&pm_wb_rv);
+	}
+	if (nr_dirty < pm_dirty_limit(pm_dirty_throttle_pct))
+		return;
+	rendez_sleep_timeout(&pm_wb_throttle_rv, __pm_under_throttle, NULL,
+	                     pm_dirty_throttle_usec);
+}
+
+static void pm_writeback_ktask(void *arg)
+{
+	struct pm_wb_client *wbc;
+
+	while (1) {
+		rendez_sleep_timeout(&pm_wb_rv, __pm_wb_kicked, NULL,
+		                     pm_wb_period_usec);
+		pm_wb_kicked = FALSE;
+		qlock(&pm_wb_clients_qlock);
+		TAILQ_FOREACH(wbc, &pm_wb_clients, link)
+			wbc->writeback(wbc);
+		qunlock(&pm_wb_clients_qlock);
+		rendez_wakeup(&pm_wb_throttle_rv);
+	}
+}
+
+linker_func_3(pm_writeback_init)
+{
+	rendez_init(&pm_wb_rv);
+	rendez_init(&pm_wb_throttle_rv);
+	ktask("pm_writeback", pm_writeback_ktask, NULL);
+}
+
 static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 {
 	struct page_map *pm = arg;
@@ -507,16 +754,18 @@ static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 	/* Need to check PG_DIRTY *after* checking VMRs.  o/w we could check,
 	 * PAUSE, see no VMRs.  But in the meantime, we had a VMR that munmapped
 	 * and wrote-back the dirty flag. */
-	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
+	if (pm_page_clear_dirty(pm, page)) {
 		/* If we want to batch these, we'll also have to batch the
 		 * freeing, which isn't a big deal.  Just do it before freeing
 		 * and before unlocking the PM; we don't want someone to load
 		 * the page from the backing store and get an old value. */
 		pm->pm_op->writepage(pm, page);
+		pm->pm_nr_written++;
+		pm->pm_nr_wb_ops++;
 	}
 	/* All clear - the page is unused and (now) clean. */
 	atomic_set(&page->pg_flags, 0);	/* catch bugs */
-	page_decref(page);
+	pm_release_page(page);
 	return true;
 }
 
@@ -534,12 +783,14 @@ void pm_free_unused_pages(struct page_map *pm)
 
 static bool __destroy_cb(void **slot, unsigned long tree_idx, void *arg)
 {
+	struct page_map *pm = arg;
 	struct page *page = pm_slot_get_page(*slot);
 
 	/* Should be no users or need to sync */
 	assert(pm_slot_check_refcnt(*slot) == 0);
+	pm_page_clear_dirty(pm, page);
 	atomic_set(&page->pg_flags, 0);	/* catch bugs */
-	page_decref(page);
+	pm_release_page(page);
 	return true;
 }
 
@@ -554,6 +805,9 @@ void print_page_map_info(struct page_map *pm)
 	struct vm_region *vmr_i;
 	printk("Page Map %p\n", pm);
 	printk("\tNum pages: %lu\n", pm->pm_num_pages);
+	printk("\tDirty: %lu, written back: %lu in %lu ops\n",
+	       atomic_read(&pm->pm_nr_dirty), pm->pm_nr_written,
+	       pm->pm_nr_wb_ops);
 	spin_lock(&pm->pm_lock);
 	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
 		printk("\tVMR proc %d: (%p - %p): 0x%08x, 0x%08x, %p, %p\n",
@@ -52,6 +52,8 @@ static void kpages_arena_init(void)
 	kpages_pg = arena_alloc(base_arena, PGSIZE, MEM_WAIT);
 	kpages_arena = arena_builder(kpages_pg, "kpages", PGSIZE, arena_alloc,
 	                             arena_free, base_arena, 8 * PGSIZE);
+	base_arenas[0] = base_arena;
+	kpages_arenas[0] = kpages_arena;
 }
 
 /**
@@ -249,7 +251,8 @@ int page_insert(pgdir_t pgdir, struct page *page, void *va, int perm)
  * of the pte for this page.  This is used by page_remove
  * but should not be used by other callers.
  *
- * For jumbos, right now this returns the first Page* in the 4MB range
+ * For jumbos, this returns the 4K page within the jumbo that va is in.  (User
+ * jumbos are 2MB).
  *
  * @param[in]  pgdir     the page directory from which we should do the lookup
  * @param[in]  va        the virtual address of the page we are looking up
@@ -267,6 +270,9 @@ page_t *page_lookup(pgdir_t pgdir, void *va, pte_t *pte_store)
 		return 0;
 	if (pte_store)
 		*pte_store = pte;
+	if (pte_is_jumbo(pte))
+		return pa2page(pte_get_paddr(pte) +
+		               ROUNDDOWN((uintptr_t)va % UJUMBO_SIZE, PGSIZE));
 	return pa2page(pte_get_paddr(pte));
 }
 
@@ -415,6 +415,7 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	spinlock_init(&p->vmr_lock);
 	spinlock_init(&p->pte_lock);
 	TAILQ_INIT(&p->vm_regions); /* could init this in the slab */
+	p->vmr_tree = RB_ROOT;
 	p->vmr_history = 0;
 	/* Initialize the vcore lists, we'll build the inactive list so that it
 	 * includes all vcores when we initialize procinfo.  Do this before
@@ -596,7 +597,7 @@ static void __set_proc_current(struct proc *p)
 	/* If the process wasn't here, then we need to load its address space */
 	if (p != pcpui->cur_proc) {
 		proc_incref(p, 1);
-		lcr3(p->env_cr3);
+		__load_addr_space(pcpui->cur_proc, p);
 		/* This is "leaving the process context" of the previous proc.
 		 * The previous lcr3 unloaded the previous proc's context.  This
 		 * should rarely happen, since we usually proactively leave
@@ -1883,6 +1884,8 @@ bool abandon_core(void)
 	 * */
 	pcpui->cur_kthread->sysc = 0;
 	pcpui->cur_kthread->errbuf = 0;	/* just in case */
+	/* They also don't get to the rest of their batch.  Someone else will. */
+	__hand_off_sysc_batch(pcpui->cur_kthread);
 	if (pcpui->cur_proc) {
 		__abandon_core();
 		return true;
@@ -1890,6 +1893,26 @@ bool abandon_core(void)
 	return false;
 }
 
+bool nohz_mcp_cores = TRUE;
+
+/* Helpers to isolate a core while an MCP owns it.  The alarms on the core's
+ * tchain move to core 0, as do any new ones (e.g. a syscall's rendez timeout),
+ * so the core takes no timer interrupts while the vcore runs.  Other than
+ * alarms, nothing in the kernel has a periodic tick on these cores: the ksched
+ * tick is on core 0, and RCU checks in on cores that are in userspace. */
+static void __nohz_enter(struct per_cpu_info *pcpui)
+{
+	if (!nohz_mcp_cores || pcpui == &per_cpu_info[0])
+		return;
+	tchain_isolate(&pcpui->tchain, &per_cpu_info[0].tchain);
+}
+
+static void __nohz_exit(struct per_cpu_info *pcpui)
+{
+	if (pcpui->tchain.redirect)
+		tchain_unisolate(&pcpui->tchain);
+}
+
 /* Helper to clear the core's owning processor and manage refcnting.  Pass in
  * core_id() to save a couple core_id() calls. */
 void clear_owning_proc(uint32_t coreid)
@@ -1897,6 +1920,7 @@ void clear_owning_proc(uint32_t coreid)
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
 	struct proc *p = pcpui->owning_proc;
 
+	__nohz_exit(pcpui);
 	__clear_owning_proc(coreid);
 	pcpui->owning_proc = 0;
 	pcpui->owning_vcoreid = 0xdeadbeef;
@@ -1921,10 +1945,7 @@ uintptr_t switch_to(struct proc *new_p)
 	/* If we aren't the proc already, then switch to it */
 	if (old_proc != new_p) {
 		pcpui->cur_proc = new_p;	/* uncounted ref */
-		if (new_p)
-			lcr3(new_p->env_cr3);
-		else
-			lcr3(boot_cr3);
+		__load_addr_space(old_proc, new_p);
 	}
 	ret = (uintptr_t)old_proc;
 	if (is_ktask(kth)) {
@@ -1955,58 +1976,149 @@ void switch_back(struct proc *new_p, uintptr_t old_ret)
 	old_proc = (struct proc*)old_ret;
 	if (old_proc != new_p) {
 		pcpui->cur_proc = old_proc;
-		if (old_proc)
-			lcr3(old_proc->env_cr3);
-		else
-			lcr3(boot_cr3);
+		__load_addr_space(new_p, old_proc);
 	}
 }
 
-/* Will send a TLB shootdown message to every vcore in the main address space
- * (aka, all vcores for now).  The message will take the start and end virtual
- * addresses as well, in case we want to be more clever about how much we
- * shootdown and batching our messages.  Should do the sanity about rounding up
- * and down in this function too.
+/* Loads new_p's page tables (or the kernel's, if new_p is 0) in place of
+ * old_p's.  Callers manage cur_proc and its refs.
  *
- * Would be nice to have a broadcast kmsg at this point.  Note this may send a
- * message to the calling core (interrupting it, possibly while holding the
- * proc_lock).  We don't need to process routine messages since it's an
- * immediate message. */
-void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
+ * Every core with a process's page tables loaded is in its tlb_cpus, which is
+ * how shootdowns find kthreads and idle cores, not just vcores.  We join
+ * new_p's set before loading its cr3: either a concurrent shootdown sees us,
+ * or its PTE changes happened before our lcr3, which flushes the TLB.  We leave
+ * old_p's set after we're off its page tables; an extra shootdown is
+ * harmless. */
+void __load_addr_space(struct proc *old_p, struct proc *new_p)
 {
-	/* TODO: need a better way to find cores running our address space.  we
-	 * can have kthreads running syscalls, async calls, processes being
-	 * created. */
-	struct vcore *vc_i;
+	uint32_t coreid = core_id();
 
-	/* TODO: we might be able to avoid locking here in the future (we must
-	 * hit all online, and we can check __mapped).  it'll be complicated. */
-	spin_lock(&p->proc_lock);
-	switch (p->state) {
-	case (PROC_RUNNING_S):
+	if (new_p) {
+		core_set_setcpu_atomic(&new_p->tlb_cpus, coreid);
+		lcr3(new_p->env_cr3);
+	} else {
+		lcr3(boot_cr3);
+	}
+	if (old_p)
+		core_set_clearcpu_atomic(&old_p->tlb_cpus, coreid);
+}
+
+/* Shootdowns of more pages than this flush the entire TLB instead. */
+unsigned long tlb_shootdown_max_pages = 32;
+
+/* Flushes [start, end) of the current address space from our TLB.  An empty
+ * range means everything. */
+static void __tlb_flush_range(uintptr_t start, uintptr_t end)
+{
+	if ((start >= end) ||
+	    ((end - start) >> PGSHIFT > tlb_shootdown_max_pages)) {
 		tlbflush();
-		break;
-	case (PROC_RUNNING_M):
-		/* TODO: (TLB) sanity checks and rounding on the ranges.
-		 *
-		 * We need to make sure that once a core that was online has
-		 * been removed from the online list, then it must receive a TLB
-		 * flush (abandon_core()) before running the process again.
-		 * Either that, or make other decisions about who to
-		 * TLB-shootdown. */
-		TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-			send_kernel_message(vc_i->pcoreid, __tlbshootdown,
-					    start, end, 0, KMSG_IMMEDIATE);
+		return;
+	}
+	for (uintptr_t va = ROUNDDOWN(start, PGSIZE); va < end; va += PGSIZE)
+		invlpg((void*)va);
+}
+
+/* Tries to defer a shootdown on an idle core until it wakes up.  Returns TRUE if
+ * it worked and we don't need to IPI the core.
+ *
+ * The core's exit from TLB_LAZY is an atomic swap, so either we set the flush
+ * flag before it leaves and it sees it, or our CAS fails. */
+static bool __tlb_lazy_defer(struct per_cpu_info *pcpui)
+{
+	long old_val;
+
+	do {
+		old_val = atomic_read(&pcpui->tlb_lazy);
+		if (!(old_val & TLB_LAZY))
+			return FALSE;
+	} while (!atomic_cas(&pcpui->tlb_lazy, old_val,
+	                     old_val | TLB_LAZY_FLUSH));
+	return TRUE;
+}
+
+/* Called by an idle core, with IRQs disabled, right before it halts.  We still
+ * have cur_proc's page tables loaded, but won't touch user memory until we call
+ * tlb_lazy_exit(). */
+void tlb_lazy_enter(void)
+{
+	atomic_set(&per_cpu_info[core_id()].tlb_lazy, TLB_LAZY);
+}
+
+/* Called when an idle core wakes up, either in smp_idle or at the start of an
+ * IRQ handler, before anything could access user memory. */
+void tlb_lazy_exit(void)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	if (!atomic_read(&pcpui->tlb_lazy))
+		return;
+	if (atomic_swap(&pcpui->tlb_lazy, 0) & TLB_LAZY_FLUSH)
+		tlbflush();
+}
+
+/* Shoots down [start, end) of p's address space on every core that has it
+ * loaded.  An empty range (e.g. 0, 0) means everything.
+ *
+ * We flush our own TLB directly, defer the flush on idle cores, and send one
+ * multicast immediate kmsg to the rest.  We don't need the proc_lock: the
+ * tlb_cpus set covers any core that could have cached our PTEs, regardless of
+ * the process's state.  Note this may send a message to a core that is holding
+ * locks we hold; it's an immediate message, so it'll still run. */
+void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
+{
+	uint32_t coreid = core_id();
+	struct core_set targets;
+	bool any = FALSE;
+
+	core_set_init(&targets);
+	/* Makes sure our PTE changes are visible before we look at tlb_cpus.
+	 * Pairs with the atomic set in __load_addr_space(). */
+	mb();
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(&p->tlb_cpus, i))
+			continue;
+		if (i == coreid) {
+			__tlb_flush_range(start, end);
+			continue;
 		}
-		break;
-	default:
-		/* TODO: til we fix shootdowns, there are some odd cases where
-		 * we have the address space loaded, but the state is in
-		 * transition. */
-		if (p == current)
-			tlbflush();
+		if (__tlb_lazy_defer(&per_cpu_info[i]))
+			continue;
+		core_set_setcpu(&targets, i);
+		any = TRUE;
 	}
-	spin_unlock(&p->proc_lock);
+	if (any)
+		send_kernel_message_cset(&targets, __tlbshootdown, start, end,
+		                         0, KMSG_IMMEDIATE);
+}
+
+void tlb_batch_init(struct tlb_batch *tb, struct proc *p)
+{
+	tb->p = p;
+	tb->start = 0;
+	tb->end = 0;
+}
+
+/* Adds [start, end) to the batch.  The batch covers the smallest range that
+ * holds all of its parts; if that's too large, the flush does everything. */
+void tlb_batch_add(struct tlb_batch *tb, uintptr_t start, uintptr_t end)
+{
+	if (tb->start == tb->end) {
+		tb->start = start;
+		tb->end = end;
+		return;
+	}
+	tb->start = MIN(tb->start, start);
+	tb->end = MAX(tb->end, end);
+}
+
+void tlb_batch_flush(struct tlb_batch *tb)
+{
+	if (tb->start == tb->end)
+		return;
+	proc_tlbshootdown(tb->p, tb->start, tb->end);
+	tb->start = 0;
+	tb->end = 0;
 }
 
 /* Helper, used by __startcore and __set_curctx, which sets up cur_ctx to run a
@@ -2240,6 +2352,7 @@ void __startcore(uint32_t srcid, long a0, long a1, long a2)
 	 * p_to_run */
 	pcpui->owning_proc = p_to_run;
 	pcpui->owning_vcoreid = vcoreid;
+	__nohz_enter(pcpui);
 	/* sender increfed again, assuming we'd install to cur_proc.  only do
 	 * this if no one else is there.  this is an optimization, since we
 	 * expect to send these __startcores to idles cores, and this saves a
@@ -2247,7 +2360,7 @@ void __startcore(uint32_t srcid, long a0, long a1, long a2)
 	 * Keep in sync with __proc_give_cores() and __proc_run_m(). */
 	if (!pcpui->cur_proc) {
 		pcpui->cur_proc = p_to_run; /* install the ref to cur_proc */
-		lcr3(p_to_run->env_cr3);
+		__load_addr_space(NULL, p_to_run);
 	} else {
 		proc_decref(p_to_run);
 	}
@@ -2394,8 +2507,7 @@ void __death(uint32_t srcid, long a0, long a1, long a2)
  * addresses from a0 to a1. */
 void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 {
-	/* TODO: (TLB) something more intelligent with the range */
-	tlbflush();
+	__tlb_flush_range(a0, a1);
 }
 
 void print_allpids(void)
@@ -2572,7 +2684,7 @@ void check_my_owner(void)
 				/* Immediate message was sent, we should get it
 				 * when we enable interrupts, which should cause
 				 * us to skip cpu_halt() */
-				if (!STAILQ_EMPTY(&pcpui->immed_amsgs))
+				if (!kmsg_ring_empty(pcpui->immed_kmsgs))
 					continue;
 				printk("Owned pcore (%d) has no owner, by %p, vc %d!\n",
 				       core_id(), p, vcore2vcoreid(p, vc_i));
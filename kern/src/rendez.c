@@ -105,6 +105,9 @@ void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
 	init_awaiter(&awaiter, rendez_alarm_handler);
 	awaiter.data = rv;
 	set_awaiter_rel(&awaiter, usec);
+	/* Sleepers only need to wake after usec.  Let short sleeps stay close
+	 * to their time, and longer ones share interrupts. */
+	set_awaiter_slack(&awaiter, MIN(usec / 8, alarm_slack_usec));
 	/* Set our alarm on this cpu's tchain.  Note that when we sleep in
 	 * cv_wait, we could be migrated, and later on we could be unsetting the
 	 * alarm remotely. */
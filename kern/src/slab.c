@@ -69,13 +69,18 @@
  *   the depot during free.  Either approach doesn't require someone else to
  *   grab a pcc lock.
  *
+ * - How do we give memory back?  Like the paper, we track a working set for
+ *   each depot: the fewest magazines that sat on each list during the last
+ *   reap interval.  Those magazines weren't needed at all during the interval,
+ *   so the reaper ktask frees them, and likewise for the empty slabs that were
+ *   never needed.  Every kmc_reap_period_usec, the reaper trims each cache
+ *   down to its working set.  If a base arena is about to fail a MEM_WAIT
+ *   allocation, kmem_reap_all() frees everything that is cached.
+ *
  * TODO:
- * - Add reclaim function.
  * - When resizing, do we want to go through the depot and consolidate
  *   magazines?  (probably not a big deal.  maybe we'd deal with it when we
  *   clean up our excess mags.)
- * - Could do some working set tracking.  Like max/min over an interval, with
- *   resetting (in the depot, used for reclaim and maybe aggressive freeing).
  * - Debugging info
  */
 
@@ -87,6 +92,8 @@
 #include <hash.h>
 #include <arena.h>
 #include <hashtable.h>
+#include <kthread.h>
+#include <linker_func.h>
 
 #define SLAB_POISON ((void*)0xdead1111)
 
@@ -94,6 +101,8 @@
  * runtime.  Though once a mag increases, it'll never decrease. */
 uint64_t resize_timeout_ns = 1000000000;
 unsigned int resize_threshold = 1;
+/* How often the reaper trims caches to their working set */
+uint64_t kmc_reap_period_usec = 15000000;
 
 /* Protected by the arenas_and_slabs_lock. */
 struct kmem_cache_tailq all_kmem_caches =
@@ -224,6 +233,8 @@ static void depot_init(struct kmem_depot *depot)
 	depot->nr_empty = 0;
 	depot->busy_count = 0;
 	depot->busy_start = 0;
+	depot->min_empty = 0;
+	depot->min_not_empty = 0;
 }
 
 static bool mag_is_empty(struct kmem_magazine *mag)
@@ -306,8 +317,7 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 		panic("Cache %s object alignment is actually MIN(PGSIZE, align (%p))",
 		      name, align);
 	kc->flags = flags;
-	/* We might want some sort of per-call site NUMA-awareness in the
-	 * future. */
+	/* The default source is NUMA-aware; see kmc_import(). */
 	kc->source = source ? source : kpages_arena;
 	TAILQ_INIT(&kc->full_slab_list);
 	TAILQ_INIT(&kc->partial_slab_list);
@@ -317,6 +327,9 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->priv = priv;
 	kc->nr_cur_alloc = 0;
 	kc->nr_direct_allocs_ever = 0;
+	kc->nr_empty_slabs = 0;
+	kc->min_empty_slabs = 0;
+	kc->nr_reaped_bytes = 0;
 	kc->alloc_hash = kc->static_hash;
 	hash_init_hh(&kc->hh);
 	for (int i = 0; i < kc->hh.nr_hash_lists; i++)
@@ -422,10 +435,53 @@ static void depot_destroy(struct kmem_cache *kc)
 	unlock_depot(depot);
 }
 
+/* Slabs that pull from the generic kpages arena get their memory from the
+ * calling core's NUMA node, and give it back to whichever node it came from.
+ * kpages_arena's own qcaches are part of node 0's arena, so they stay put. */
+static bool __kmc_numa_source(struct kmem_cache *cp)
+{
+	return cp->source == kpages_arena && !(cp->flags & KMC_QCACHE);
+}
+
+/* Pages we import from kpages point back to their cache, along with their
+ * offset into the import.  From any address in a slab, that's enough to find
+ * the cache and the start of the object (see kmalloc). */
+static void kmc_tag_pages(struct kmem_cache *cp, void *buf, size_t size)
+{
+	struct page *pg = kva2page(buf);
+
+	for (size_t off = 0; off < size; off += PGSIZE, pg++) {
+		pg->pg_private = cp;
+		pg->pg_index = off;
+		atomic_and(&pg->pg_flags, ~PG_KMREFS);
+	}
+}
+
+static void *kmc_import(struct kmem_cache *cp, size_t size, int flags)
+{
+	void *buf;
+
+	if (__kmc_numa_source(cp)) {
+		buf = kpages_alloc(size, flags);
+		if (buf)
+			kmc_tag_pages(cp, buf, size);
+		return buf;
+	}
+	return arena_alloc(cp->source, size, flags);
+}
+
+static void kmc_unimport(struct kmem_cache *cp, void *buf, size_t size)
+{
+	if (__kmc_numa_source(cp))
+		kpages_free(buf, size);
+	else
+		arena_free(cp->source, buf, size);
+}
+
 static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 {
 	if (!__use_bufctls(cp)) {
-		arena_free(cp->source, ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
+		kmc_unimport(cp, ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
 	} else {
 		struct kmem_bufctl *i, *temp;
 		void *buf_start = (void*)SIZE_MAX;
@@ -438,7 +494,7 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 			 * since we init the freelist when we reuse the slab. */
 			kmem_cache_free(kmem_bufctl_cache, i);
 		}
-		arena_free(cp->source, buf_start, cp->import_amt);
+		kmc_unimport(cp, buf_start, cp->import_amt);
 		kmem_cache_free(kmem_slab_cache, a_slab);
 	}
 }
@@ -561,6 +617,9 @@ static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags)
 		a_slab = TAILQ_FIRST(&cp->empty_slab_list);
 		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
 		TAILQ_INSERT_HEAD(&cp->partial_slab_list, a_slab, link);
+		cp->nr_empty_slabs--;
+		cp->min_empty_slabs = MIN(cp->min_empty_slabs,
+		                          cp->nr_empty_slabs);
 	}
 	// have a partial now (a_slab), get an item, return item
 	if (!__use_bufctls(cp)) {
@@ -623,6 +682,8 @@ try_alloc:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->not_empty, link);
 		depot->nr_not_empty--;
+		depot->min_not_empty = MIN(depot->min_not_empty,
+		                           depot->nr_not_empty);
 		__return_to_depot(kc, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
@@ -669,6 +730,7 @@ static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 		// if there are none, move to from partial to empty
 		TAILQ_REMOVE(&cp->partial_slab_list, a_slab, link);
 		TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+		cp->nr_empty_slabs++;
 	}
 	spin_unlock_irqsave(&cp->cache_lock);
 }
@@ -704,6 +766,7 @@ try_free:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->empty, link);
 		depot->nr_empty--;
+		depot->min_empty = MIN(depot->min_empty, depot->nr_empty);
 		__return_to_depot(kc, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
@@ -750,7 +813,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		 * allocator.  We could use xalloc to enforce the alignment, but
 		 * that'll bypass the qcaches, which we don't want.  Caller
 		 * beware. */
-		a_page = arena_alloc(cp->source, PGSIZE, MEM_ATOMIC);
+		a_page = kmc_import(cp, PGSIZE, MEM_ATOMIC);
 		if (!a_page)
 			return FALSE;
 		// the slab struct is stored at the end of the page
@@ -777,7 +840,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		a_slab = kmem_cache_alloc(kmem_slab_cache, 0);
 		if (!a_slab)
 			return FALSE;
-		buf = arena_alloc(cp->source, cp->import_amt, MEM_ATOMIC);
+		buf = kmc_import(cp, cp->import_amt, MEM_ATOMIC);
 		if (!buf) {
 			kmem_cache_free(kmem_slab_cache, a_slab);
 			return FALSE;
@@ -797,28 +860,122 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 	}
 	// add a_slab to the empty_list
 	TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+	cp->nr_empty_slabs++;
 
 	return TRUE;
 }
 
-/* This deallocs every slab from the empty list.  TODO: think a bit more about
- * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
-void kmem_cache_reap(struct kmem_cache *cp)
+/* Frees mags from the depot, giving their objects back to the slab layer: all of
+ * them, or just the ones outside the working set (the min_* watermarks, which
+ * we read under the depot lock).  Resets the depot's working set. */
+static void depot_release(struct kmem_cache *kc, bool all)
 {
-	struct kmem_slab *a_slab, *next;
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_mag_slist to_free = SLIST_HEAD_INITIALIZER(to_free);
+	struct kmem_magazine *mag;
+	unsigned int nr_full, nr_empty;
+
+	lock_depot(depot);
+	nr_full = all ? depot->nr_not_empty : depot->min_not_empty;
+	nr_empty = all ? depot->nr_empty : depot->min_empty;
+	for (; nr_full && (mag = SLIST_FIRST(&depot->not_empty)); nr_full--) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		depot->nr_not_empty--;
+		SLIST_INSERT_HEAD(&to_free, mag, link);
+	}
+	for (; nr_empty && (mag = SLIST_FIRST(&depot->empty)); nr_empty--) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		depot->nr_empty--;
+		SLIST_INSERT_HEAD(&to_free, mag, link);
+	}
+	depot->min_not_empty = depot->nr_not_empty;
+	depot->min_empty = depot->nr_empty;
+	unlock_depot(depot);
+	while ((mag = SLIST_FIRST(&to_free))) {
+		SLIST_REMOVE_HEAD(&to_free, link);
+		drain_mag(kc, mag);
+		kmem_cache_free(kmem_magazine_cache, mag);
+	}
+}
+
+/* Frees empty slabs, oldest first, back to the source: all of them, or just the
+ * ones outside the working set (min_empty_slabs, read under the cache_lock).
+ * Resets the slab layer's working set.  Returns the amount of memory freed. */
+static size_t slab_release(struct kmem_cache *cp, bool all)
+{
+	struct kmem_slab_list to_free = TAILQ_HEAD_INITIALIZER(to_free);
+	struct kmem_slab *a_slab;
+	unsigned long nr;
+	size_t amt = 0;
 
-	// Destroy all empty slabs.  Refer to the notes about the while loop
 	spin_lock_irqsave(&cp->cache_lock);
-	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
-	while (a_slab) {
-		next = TAILQ_NEXT(a_slab, link);
-		kmem_slab_destroy(cp, a_slab);
-		a_slab = next;
+	nr = all ? cp->nr_empty_slabs : cp->min_empty_slabs;
+	for (; nr && (a_slab = TAILQ_LAST(&cp->empty_slab_list,
+	                                  kmem_slab_list)); nr--) {
+		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
+		TAILQ_INSERT_HEAD(&to_free, a_slab, link);
+		cp->nr_empty_slabs--;
+		amt += __use_bufctls(cp) ? cp->import_amt : PGSIZE;
 	}
+	cp->min_empty_slabs = cp->nr_empty_slabs;
+	cp->nr_reaped_bytes += amt;
 	spin_unlock_irqsave(&cp->cache_lock);
+	while ((a_slab = TAILQ_FIRST(&to_free))) {
+		TAILQ_REMOVE(&to_free, a_slab, link);
+		kmem_slab_destroy(cp, a_slab);
+	}
+	return amt;
+}
+
+/* Trims the cache down to its working set: whatever sat unused in the depot or
+ * the empty slab list for the entire last interval. */
+static size_t kmem_cache_trim(struct kmem_cache *cp)
+{
+	depot_release(cp, FALSE);
+	return slab_release(cp, FALSE);
 }
 
+/* Frees every magazine in the depot and every empty slab.  Objects in the pcpu
+ * caches stay put.  Returns the amount of memory freed. */
+size_t kmem_cache_reap(struct kmem_cache *cp)
+{
+	depot_release(cp, TRUE);
+	return slab_release(cp, TRUE);
+}
+
+/* Synchronous reclaim, for when we're about to run out of memory.  Someone
+ * holding the arenas_and_slabs_lock may be the one allocating, so we don't
+ * wait for the lock. */
+size_t kmem_reap_all(void)
+{
+	struct kmem_cache *kc_i;
+	size_t amt = 0;
+
+	if (!canqlock(&arenas_and_slabs_lock))
+		return 0;
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
+		amt += kmem_cache_reap(kc_i);
+	qunlock(&arenas_and_slabs_lock);
+	return amt;
+}
+
+static void kmem_reaper(void *arg)
+{
+	struct kmem_cache *kc_i;
+
+	while (1) {
+		kthread_usleep(kmc_reap_period_usec);
+		qlock(&arenas_and_slabs_lock);
+		TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
+			kmem_cache_trim(kc_i);
+		qunlock(&arenas_and_slabs_lock);
+	}
+}
+
+linker_func_3(kmem_reaper_init)
+{
+	ktask("kmem_reaper", kmem_reaper, NULL);
+}
 
 /* Tracing */
 
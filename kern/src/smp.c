@@ -70,6 +70,11 @@ static void __attribute__((noreturn)) __smp_idle(void *arg)
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 
 	pcpui->cur_kthread->flags = KTH_DEFAULT_FLAGS;
+	/* Syscalls that don't return (yield) leave the rest of their batch for
+	 * another kthread.  Usually abandon_core() already handed it off. */
+	__hand_off_sysc_batch(pcpui->cur_kthread);
+	pcpui->cur_kthread->sysc_batch = 0;
+	pcpui->cur_kthread->nr_sysc_batch = 0;
 	while (1) {
 		/* This might wake a kthread (the gp ktask), so be sure to run
 		 * PRKM after reporting the quiescent state. */
@@ -78,12 +83,18 @@ static void __attribute__((noreturn)) __smp_idle(void *arg)
 		process_routine_kmsg();
 		try_run_proc();
 		cpu_bored();		/* call out to the ksched */
+		/* Spin briefly before halting.  Senders skip the IPI while we
+		 * poll, and we'll catch any RKM at the top of the loop. */
+		if (kmsg_idle_poll())
+			continue;
 		/* cpu_halt() atomically turns on interrupts and halts the core.
 		 * Important to do this, since we could have a RKM come in via
 		 * an interrupt right while PRKM is returning, and we wouldn't
 		 * catch it.  When it returns, IRQs are back off. */
 		__set_cpu_state(pcpui, CPU_STATE_IDLE);
+		tlb_lazy_enter();
 		cpu_halt();
+		tlb_lazy_exit();
 		__set_cpu_state(pcpui, CPU_STATE_KERNEL);
 	}
 	assert(0);
@@ -117,11 +128,8 @@ void smp_percpu_init(void)
 	 * kthread or to handle an RKM. */
 	kthread->flags = KTH_KTASK_FLAGS;
 	per_cpu_info[coreid].spare = 0;
-	/* Init relevant lists */
-	spinlock_init_irqsave(&per_cpu_info[coreid].immed_amsg_lock);
-	STAILQ_INIT(&per_cpu_info[coreid].immed_amsgs);
-	spinlock_init_irqsave(&per_cpu_info[coreid].routine_amsg_lock);
-	STAILQ_INIT(&per_cpu_info[coreid].routine_amsgs);
+	/* Init the KMSG rings */
+	kmsg_percpu_init(pcpui);
 	init_timer_chain(&this_pcpui_var(tchain), set_pcpu_alarm_interrupt);
 	/* Init generic tracing ring */
 	trace_buf = kpage_alloc_addr();
@@ -267,21 +275,18 @@ void smp_do_in_cores(const struct core_set *cset, void (*func)(void *),
 {
 	int cpu = core_id();
 	struct all_cpu_work acw;
+	struct core_set remote = *cset;
 
 	memset(&acw, 0, sizeof(acw));
 	completion_init(&acw.comp, core_set_remote_count(cset));
 	acw.func = func;
 	acw.opaque = opaque;
 
-	for (int i = 0; i < num_cores; i++) {
-		if (core_set_getcpu(cset, i)) {
-			if (i == cpu)
-				func(opaque);
-			else
-				send_kernel_message(i, smp_do_core_work,
-						    (long)&acw, 0, 0,
-						    KMSG_ROUTINE);
-		}
-	}
+	/* Get the remote cores going before we do our share of the work. */
+	core_set_clearcpu(&remote, cpu);
+	send_kernel_message_cset(&remote, smp_do_core_work, (long)&acw, 0, 0,
+	                         KMSG_ROUTINE);
+	if (core_set_getcpu(cset, cpu))
+		func(opaque);
 	completion_wait(&acw.comp);
 }
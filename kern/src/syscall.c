@@ -905,8 +905,8 @@ static ssize_t sys_fork(env_t* e)
 	assert(current == this_pcpui_var(owning_proc));
 	copy_current_ctx_to(&env->scp_ctx);
 
-	/* Make the new process have the same VMRs as the older.  This will copy
-	 * the contents of non MAP_SHARED pages to the new VMRs. */
+	/* Make the new process have the same VMRs as the older.  Non MAP_SHARED
+	 * pages are shared CoW between the two. */
 	if (duplicate_vmrs(e, env)) {
 		proc_destroy(env);
 		proc_decref(env);
@@ -915,9 +915,8 @@ static ssize_t sys_fork(env_t* e)
 	}
 	/* Switch to the new proc's address space and finish the syscall.  We'll
 	 * never naturally finish this syscall for the new proc, since its
-	 * memory is cloned before we return for the original process.  If we
-	 * ever do CoW for forked memory, this will be the first place that gets
-	 * CoW'd. */
+	 * memory is cloned before we return for the original process.  Our
+	 * write to the child's sysc will break the CoW on that page. */
 	temp = switch_to(env);
 	finish_sysc(current_kthread->sysc, env, 0);
 	switch_back(env, temp);
@@ -1105,8 +1104,11 @@ static int sys_exec(struct proc *p, char *path, size_t path_l,
 	proc_set_progname(p, argc ? argv[0] : NULL);
 	proc_init_procdata(p);
 	p->procinfo->program_end = 0;
-	/* When we destroy our memory regions, accessing cur_sysc would PF */
+	/* When we destroy our memory regions, accessing cur_sysc would PF.  So
+	 * would the rest of our batch, and no one is left to wait on it. */
 	current_kthread->sysc = 0;
+	current_kthread->sysc_batch = NULL;
+	current_kthread->nr_sysc_batch = 0;
 	unmap_and_destroy_vmrs(p);
 	/* close the CLOEXEC ones */
 	close_fdt(&p->open_files, TRUE);
@@ -1785,6 +1787,27 @@ static intreg_t sys_write(struct proc *p, int fd, const void *buf, size_t len)
 	return syswrite(fd, (void*)buf, len);
 }
 
+/* Sends len bytes of in_fd to out_fd, without copying.  offp is in_fd's offset
+ * if it is NULL, o/w we start at *offp and update it. */
+static intreg_t sys_sendfile(struct proc *p, int out_fd, int in_fd,
+                             off64_t *offp, size_t len)
+{
+	off64_t off;
+	long ret;
+
+	sysc_save_str("sendfile from fd %d to fd %d", in_fd, out_fd);
+	if (!offp)
+		return syssendfile(out_fd, in_fd, NULL, len);
+	if (memcpy_from_user_errno(p, &off, offp, sizeof(off64_t)))
+		return -1;
+	ret = syssendfile(out_fd, in_fd, &off, len);
+	if (ret < 0)
+		return -1;
+	if (memcpy_to_user_errno(p, offp, &off, sizeof(off64_t)))
+		return -1;
+	return ret;
+}
+
 /* Checks args/reads in the path, opens the file (relative to fromfd if the path
  * is not absolute), and inserts it into the process's open file list. */
 static intreg_t sys_openat(struct proc *p, int fromfd, const char *path,
@@ -2535,6 +2558,7 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_rename] ={(syscall_t)sys_rename, "rename"},
 	[SYS_dup_fds_to] = {(syscall_t)sys_dup_fds_to, "dup_fds_to"},
 	[SYS_tap_fds] = {(syscall_t)sys_tap_fds, "tap_fds"},
+	[SYS_sendfile] = {(syscall_t)sys_sendfile, "sendfile"},
 };
 const int max_syscall = sizeof(syscall_table)/sizeof(syscall_table[0]);
 
@@ -2614,9 +2638,81 @@ void run_local_syscall(struct syscall *sysc)
 	finish_current_sysc(retval);
 }
 
+/* Runs the syscalls in sysc[0, nr) on the calling kthread, in order.  If one of
+ * them blocks, the kthread hands the rest of the batch to a routine kmsg on its
+ * core (__hand_off_sysc_batch()), so the others don't wait on the blocked one.
+ * Once the blocked syscall finishes, we're done with the batch. */
+static void run_sysc_batch(struct syscall *sysc, unsigned int nr)
+{
+	struct kthread *kth;
+	unsigned int left;
+
+	for (unsigned int i = 0; i < nr; i++) {
+		left = nr - i - 1;
+		kth = current_kthread;
+		kth->sysc_batch = left ? sysc + i + 1 : NULL;
+		kth->nr_sysc_batch = left;
+		run_local_syscall(sysc + i);
+		/* Reload, we could have migrated. */
+		kth = current_kthread;
+		if (left && !kth->sysc_batch)
+			return;
+	}
+	kth = current_kthread;
+	kth->sysc_batch = NULL;
+	kth->nr_sysc_batch = 0;
+}
+
+/* Kmsg handler for the rest of a batch whose kthread blocked.  a2 is a counted
+ * ref on the process, which we hand to cur_proc, like restart_kthread(). */
+static void __run_sysc_batch(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct per_cpu_info *pcpui = this_pcpui_ptr();
+	struct syscall *sysc = (struct syscall*)a0;
+	unsigned int nr = (unsigned int)a1;
+	struct proc *p = (struct proc*)a2;
+	struct proc *old_proc;
+
+	if (proc_is_dying(p)) {
+		proc_decref(p);
+		return;
+	}
+	if (pcpui->cur_proc == p) {
+		proc_decref(p);
+	} else {
+		__load_addr_space(pcpui->cur_proc, p);
+		old_proc = pcpui->cur_proc;
+		pcpui->cur_proc = p;
+		if (old_proc)
+			proc_decref(old_proc);
+	}
+	run_sysc_batch(sysc, nr);
+}
+
+/* Called by a kthread that is about to block or abandon the core (a syscall
+ * that doesn't return, like a yield).  If it is in the middle of a syscall
+ * batch, the rest of the batch gets run by a fresh kthread on this core, after
+ * the current one leaves.  Needs current's address space loaded. */
+void __hand_off_sysc_batch(struct kthread *kth)
+{
+	struct proc *p = current;
+
+	if (!kth->sysc_batch || !p)
+		return;
+	proc_incref(p, 1);
+	send_kernel_message(core_id(), __run_sysc_batch, (long)kth->sysc_batch,
+	                    kth->nr_sysc_batch, (long)p, KMSG_ROUTINE);
+	kth->sysc_batch = NULL;
+	kth->nr_sysc_batch = 0;
+}
+
 /* A process can trap and call this function, which will set up the core to
- * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".  If there is
- * at least one, it will run it directly. */
+ * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".
+ *
+ * The syscalls are started in order, and each one completes on its own (SC_DONE
+ * and its ev_q), just like a single syscall.  They run back to back on this
+ * core until one of them blocks, at which point the remainder keep going
+ * without it.  Userspace cannot rely on completion order. */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 {
 	/* Careful with pcpui here, we could have migrated */
@@ -2624,12 +2720,13 @@ void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 		printk("[kernel] No nr_sysc, probably a bug, user!\n");
 		return;
 	}
-	/* For all after the first call, send ourselves a KMSG (TODO). */
-	if (nr_syscs != 1)
-		warn("Only one supported (Debutante calls: %d)\n", nr_syscs);
-	/* Call the first one directly.  (we already checked to make sure there
-	 * is 1) */
-	run_local_syscall(sysc);
+	if (nr_syscs > MAX_SYSC_BATCH ||
+	    !is_user_rwaddr(sysc, nr_syscs * sizeof(struct syscall))) {
+		printk("[kernel] bad syscall batch %p (%u) (user bug)\n", sysc,
+		       nr_syscs);
+		return;
+	}
+	run_sysc_batch(sysc, nr_syscs);
 }
 
 /* Call this when something happens on the syscall where userspace might want to
@@ -0,0 +1,112 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * Hierarchical timing wheels.  See timer_wheel.h for details. */
+
+#include <timer_wheel.h>
+#include <assert.h>
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now)
+{
+	tw->now = now;
+	tw->nr_pending = 0;
+	for (int i = 0; i < TW_NR_LVLS; i++)
+		for (int j = 0; j < TW_LVL_SIZE; j++)
+			BSD_LIST_INIT(&tw->slots[i][j]);
+}
+
+/* Puts t in the slot for its expiry, relative to tw->now.  Callers make sure
+ * t->expire >= tw->now.  t->expire == tw->now only happens during a cascade,
+ * where the level 0 slot for 'now' is about to be run. */
+static void __tw_place(struct timer_wheel *tw, struct tw_timer *t)
+{
+	uint64_t expire = t->expire;
+	uint64_t delta = expire - tw->now;
+	int lvl;
+
+	if (delta > TW_MAX_DELTA) {
+		/* Park it as far out as we can.  It'll be re-placed when that
+		 * slot cascades. */
+		expire = tw->now + TW_MAX_DELTA;
+		delta = TW_MAX_DELTA;
+	}
+	for (lvl = 0; lvl < TW_NR_LVLS - 1; lvl++) {
+		if (delta < (1ULL << (TW_LVL_BITS * (lvl + 1))))
+			break;
+	}
+	BSD_LIST_INSERT_HEAD(&tw->slots[lvl][(expire >> (TW_LVL_BITS * lvl)) &
+	                                     TW_LVL_MASK], t, link);
+}
+
+/* Arms t to expire at tick 'expire'.  If t was already pending, it is moved.
+ * Expiries in the past (or now) fire on the next tick. */
+void timer_wheel_add(struct timer_wheel *tw, struct tw_timer *t,
+                     uint64_t expire)
+{
+	if (t->pending)
+		BSD_LIST_REMOVE(t, link);
+	else
+		tw->nr_pending++;
+	t->expire = MAX(expire, tw->now + 1);
+	t->pending = TRUE;
+	__tw_place(tw, t);
+}
+
+void timer_wheel_del(struct timer_wheel *tw, struct tw_timer *t)
+{
+	if (!t->pending)
+		return;
+	BSD_LIST_REMOVE(t, link);
+	t->pending = FALSE;
+	tw->nr_pending--;
+}
+
+/* Moves every timer in lvl's slot for the current time down the wheel.
+ * Returns the index of that slot, so the caller knows whether the next level
+ * needs to cascade too. */
+static int __tw_cascade(struct timer_wheel *tw, int lvl)
+{
+	int idx = (tw->now >> (TW_LVL_BITS * lvl)) & TW_LVL_MASK;
+	struct tw_timer_list list;
+	struct tw_timer *t;
+
+	BSD_LIST_INIT(&list);
+	BSD_LIST_SWAP(&list, &tw->slots[lvl][idx], tw_timer, link);
+	while ((t = BSD_LIST_FIRST(&list))) {
+		BSD_LIST_REMOVE(t, link);
+		__tw_place(tw, t);
+	}
+	return idx;
+}
+
+/* Advances the wheel to tick 'now', running fn on each timer that expires along
+ * the way, in expiry order.  fn may rearm the timer it was passed. */
+void timer_wheel_advance(struct timer_wheel *tw, uint64_t now,
+                         tw_expire_fn fn, void *arg)
+{
+	struct tw_timer_list list;
+	struct tw_timer *t;
+	int idx;
+
+	while (tw->now < now) {
+		/* Nothing to run or cascade; just catch up. */
+		if (!tw->nr_pending) {
+			tw->now = now;
+			break;
+		}
+		tw->now++;
+		idx = tw->now & TW_LVL_MASK;
+		for (int lvl = 1; !idx && lvl < TW_NR_LVLS; lvl++)
+			idx = __tw_cascade(tw, lvl);
+		BSD_LIST_INIT(&list);
+		BSD_LIST_SWAP(&list, &tw->slots[0][tw->now & TW_LVL_MASK],
+			      tw_timer, link);
+		while ((t = BSD_LIST_FIRST(&list))) {
+			BSD_LIST_REMOVE(t, link);
+			assert(t->expire == tw->now);
+			t->pending = FALSE;
+			tw->nr_pending--;
+			fn(t, arg);
+		}
+	}
+}
@@ -13,6 +13,8 @@
 #include <kdebug.h>
 #include <kmalloc.h>
 #include <rcu.h>
+#include <core_set.h>
+#include <time.h>
 
 static void print_unhandled_trap(struct proc *p, struct user_context *ctx,
                                  unsigned int trap_nr, unsigned int err,
@@ -110,6 +112,10 @@ void copy_current_ctx_to(struct user_context *to_ctx)
 
 struct kmem_cache *kernel_msg_cache;
 
+/* How long an idle core spins, waiting for RKMs, before halting.  Senders don't
+ * IPI a core while it polls. */
+unsigned long kmsg_idle_poll_usec = 10;
+
 void kernel_msg_init(void)
 {
 	kernel_msg_cache = kmem_cache_create("kernel_msgs",
@@ -117,42 +123,189 @@ void kernel_msg_init(void)
 	                                     ARCH_CL_SIZE, 0, NULL, 0, 0, NULL);
 }
 
-uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
-                             long arg2, int type)
+static struct kmsg_ring *kmsg_ring_alloc(void)
 {
-	kernel_message_t *k_msg;
-	assert(pc);
+	struct kmsg_ring *ring;
+
+	/* Cores call this during boot, from IRQ context */
+	ring = kzmalloc_align(sizeof(struct kmsg_ring), MEM_ATOMIC,
+	                      ARCH_CL_SIZE);
+	assert(ring);
+	for (int i = 0; i < KMSG_RING_SZ; i++)
+		ring->slots[i].seq = i;
+	spinlock_init_irqsave(&ring->overflow_lock);
+	STAILQ_INIT(&ring->overflow);
+	return ring;
+}
+
+void kmsg_percpu_init(struct per_cpu_info *pcpui)
+{
+	pcpui->immed_kmsgs = kmsg_ring_alloc();
+	pcpui->routine_kmsgs = kmsg_ring_alloc();
+	pcpui->kmsg_polling = FALSE;
+}
+
+/* Tries to put msg in the ring.  Returns FALSE if the ring is full.  Callers
+ * must have IRQs disabled, since the consumer spins on slots we've claimed but
+ * not yet published. */
+static bool kmsg_ring_push(struct kmsg_ring *ring, struct kernel_message *msg)
+{
+	struct kmsg_slot *slot;
+	unsigned long pos = atomic_read(&ring->prod);
+	long diff;
+
+	while (1) {
+		slot = &ring->slots[pos & (KMSG_RING_SZ - 1)];
+		diff = (long)(ACCESS_ONCE(slot->seq) - pos);
+		if (!diff) {
+			if (atomic_cas(&ring->prod, pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			/* The slot still holds the message from one lap ago */
+			return FALSE;
+		}
+		pos = atomic_read(&ring->prod);
+	}
+	slot->msg = *msg;
+	wmb();
+	slot->seq = pos + 1;
+	return TRUE;
+}
+
+/* Pops the next message for this core into msg.  Only the ring's core calls
+ * this, with IRQs disabled.  Returns FALSE if there are no messages. */
+static bool kmsg_ring_pop(struct kmsg_ring *ring, struct kernel_message *msg)
+{
+	struct kmsg_slot *slot;
+	struct kernel_message *kmsg;
+	unsigned long cons = ring->cons;
+
+	while (cons != atomic_read(&ring->prod)) {
+		slot = &ring->slots[cons & (KMSG_RING_SZ - 1)];
+		while (ACCESS_ONCE(slot->seq) != cons + 1)
+			cpu_relax();
+		rmb();
+		*msg = slot->msg;
+		ring->cons = cons + 1;
+		/* Finish reading the slot before handing it back to senders */
+		mb();
+		slot->seq = cons + KMSG_RING_SZ;
+		return TRUE;
+	}
+	/* Lockless peek is okay; senders also use the overflow while it's not
+	 * empty. */
+	if (STAILQ_EMPTY(&ring->overflow))
+		return FALSE;
+	spin_lock(&ring->overflow_lock);
+	/* A sender's messages are published in the ring before it grabs the
+	 * overflow lock for its next one.  If we see anything in the ring now,
+	 * it came first. */
+	if (cons != atomic_read(&ring->prod)) {
+		spin_unlock(&ring->overflow_lock);
+		return kmsg_ring_pop(ring, msg);
+	}
+	kmsg = STAILQ_FIRST(&ring->overflow);
+	if (kmsg)
+		STAILQ_REMOVE_HEAD(&ring->overflow, link);
+	spin_unlock(&ring->overflow_lock);
+	if (!kmsg)
+		return FALSE;
+	*msg = *kmsg;
+	kmem_cache_free(kernel_msg_cache, kmsg);
+	return TRUE;
+}
+
+static void kmsg_enqueue(struct kmsg_ring *ring, struct kernel_message *msg)
+{
+	struct kernel_message *k_msg;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	if (STAILQ_EMPTY(&ring->overflow) && kmsg_ring_push(ring, msg)) {
+		enable_irqsave(&irq_state);
+		return;
+	}
+	enable_irqsave(&irq_state);
 	// note this will be freed on the destination core
 	k_msg = kmem_cache_alloc(kernel_msg_cache, 0);
-	k_msg->srcid = core_id();
-	k_msg->dstid = dst;
-	k_msg->pc = pc;
-	k_msg->arg0 = arg0;
-	k_msg->arg1 = arg1;
-	k_msg->arg2 = arg2;
+	*k_msg = *msg;
+	spin_lock_irqsave(&ring->overflow_lock);
+	STAILQ_INSERT_TAIL(&ring->overflow, k_msg, link);
+	ring->nr_overflowed++;
+	spin_unlock_irqsave(&ring->overflow_lock);
+}
+
+/* Queues msg on its destination core.  Returns TRUE if the destination needs an
+ * IPI to notice it. */
+static bool __post_kernel_message(struct kernel_message *msg, int type)
+{
+	struct per_cpu_info *dst_pcpui = &per_cpu_info[msg->dstid];
+
 	switch (type) {
 	case KMSG_IMMEDIATE:
-		spin_lock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
-		STAILQ_INSERT_TAIL(&per_cpu_info[dst].immed_amsgs, k_msg, link);
-		spin_unlock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
-		break;
+		kmsg_enqueue(dst_pcpui->immed_kmsgs, msg);
+		return TRUE;
 	case KMSG_ROUTINE:
-		spin_lock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
-		STAILQ_INSERT_TAIL(&per_cpu_info[dst].routine_amsgs, k_msg, link);
-		spin_unlock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
-		break;
+		kmsg_enqueue(dst_pcpui->routine_kmsgs, msg);
+		/* if we're sending a routine message locally, we don't
+		 * want/need an IPI */
+		if (msg->dstid == msg->srcid)
+			return FALSE;
+		/* Pairs with the mb in kmsg_idle_poll().  Either we see the
+		 * core polling, or it sees our message when it rechecks. */
+		mb();
+		return !ACCESS_ONCE(dst_pcpui->kmsg_polling);
 	default:
 		panic("Unknown type of kernel message!");
 	}
-	/* since we touched memory the other core will touch (the lock), we
-	 * don't need an wmb_f() */
-	/* if we're sending a routine message locally, we don't want/need an IPI
-	 */
-	if ((dst != k_msg->srcid) || (type == KMSG_IMMEDIATE))
+}
+
+uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
+                             long arg2, int type)
+{
+	struct kernel_message msg;
+
+	assert(pc);
+	msg.srcid = core_id();
+	msg.dstid = dst;
+	msg.pc = pc;
+	msg.arg0 = arg0;
+	msg.arg1 = arg1;
+	msg.arg2 = arg2;
+	if (__post_kernel_message(&msg, type))
 		send_ipi(dst, I_KERNEL_MSG);
 	return 0;
 }
 
+/* Sends the same message to every core in cset, which can include the calling
+ * core.  We queue the message on all of the cores before sending any IPIs, so
+ * the IPIs go out back to back and the cores start at about the same time. */
+void send_kernel_message_cset(const struct core_set *cset, amr_t pc, long arg0,
+                              long arg1, long arg2, int type)
+{
+	struct kernel_message msg;
+	struct core_set ipis;
+
+	assert(pc);
+	core_set_init(&ipis);
+	msg.srcid = core_id();
+	msg.pc = pc;
+	msg.arg0 = arg0;
+	msg.arg1 = arg1;
+	msg.arg2 = arg2;
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(cset, i))
+			continue;
+		msg.dstid = i;
+		if (__post_kernel_message(&msg, type))
+			core_set_setcpu(&ipis, i);
+	}
+	for (int i = 0; i < num_cores; i++) {
+		if (core_set_getcpu(&ipis, i))
+			send_ipi(i, I_KERNEL_MSG);
+	}
+}
+
 /* Kernel message IPI/IRQ handler.
  *
  * This processes immediate messages, and that's it (it used to handle routines
@@ -165,47 +318,19 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	struct kernel_message *kmsg_i, *temp;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->immed_amsgs))
-		return;
-	/* The lock serves as a cmb to force a re-read of the head of the list*/
-	spin_lock_irqsave(&pcpui->immed_amsg_lock);
-	STAILQ_FOREACH_SAFE(kmsg_i, &pcpui->immed_amsgs, link, temp) {
-		pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg_i->pc);
-		kmsg_i->pc(kmsg_i->srcid, kmsg_i->arg0, kmsg_i->arg1,
-			   kmsg_i->arg2);
-		STAILQ_REMOVE(&pcpui->immed_amsgs, kmsg_i, kernel_message,
-			      link);
-		kmem_cache_free(kernel_msg_cache, (void*)kmsg_i);
+	struct kernel_message msg;
+
+	while (kmsg_ring_pop(pcpui->immed_kmsgs, &msg)) {
+		pcpui_trace_kmsg(pcpui, (uintptr_t)msg.pc);
+		msg.pc(msg.srcid, msg.arg0, msg.arg1, msg.arg2);
 	}
-	spin_unlock_irqsave(&pcpui->immed_amsg_lock);
 }
 
 bool has_routine_kmsg(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	/* lockless peek */
-	return !STAILQ_EMPTY(&pcpui->routine_amsgs);
-}
-
-/* Helper function, gets the next routine KMSG (RKM).  Returns 0 if the list was
- * empty. */
-static kernel_message_t *get_next_rkmsg(struct per_cpu_info *pcpui)
-{
-	struct kernel_message *kmsg;
-
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->routine_amsgs))
-		return 0;
-	/* The lock serves as a cmb to force a re-read of the head of the list.
-	 * IRQs are disabled by our caller. */
-	spin_lock(&pcpui->routine_amsg_lock);
-	kmsg = STAILQ_FIRST(&pcpui->routine_amsgs);
-	if (kmsg)
-		STAILQ_REMOVE_HEAD(&pcpui->routine_amsgs, link);
-	spin_unlock(&pcpui->routine_amsg_lock);
-	return kmsg;
+	return !kmsg_ring_empty(pcpui->routine_kmsgs);
 }
 
 /* Runs a routine kernel message.  If we execute a message, this does not
@@ -217,18 +342,15 @@ void process_routine_kmsg(void)
 {
 	uint32_t pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
-	struct kernel_message msg_cp, *kmsg;
+	struct kernel_message msg_cp;
 
 	/* Important that callers have IRQs disabled when checking for RKMs.
 	 * When sending cross-core RKMs, the IPI is used to keep the core from
 	 * going to sleep - even though RKMs aren't handled in the kmsg handler.
 	 * */
 	assert(!irq_is_enabled());
-	kmsg = get_next_rkmsg(pcpui);
-	if (!kmsg)
+	if (!kmsg_ring_pop(pcpui->routine_kmsgs, &msg_cp))
 		return;
-	msg_cp = *kmsg;
-	kmem_cache_free(kernel_msg_cache, kmsg);
 	assert(msg_cp.dstid == pcoreid);
 	/* The kmsg could block.  If it does, we want the kthread code to know
 	 * it's not running on behalf of a process, and we're actually spawning
@@ -242,24 +364,55 @@ void process_routine_kmsg(void)
 	smp_idle();
 }
 
+/* Called by idle cores, with IRQs disabled, right before halting.  Spins for up
+ * to kmsg_idle_poll_usec, during which senders skip their RKM IPIs.  Returns
+ * TRUE if there is an RKM to run. */
+bool kmsg_idle_poll(void)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	uint64_t end;
+	bool ret;
+
+	if (!kmsg_idle_poll_usec)
+		return has_routine_kmsg();
+	end = read_tsc() + usec2tsc(kmsg_idle_poll_usec);
+	pcpui->kmsg_polling = TRUE;
+	mb();
+	while (!(ret = has_routine_kmsg()) && read_tsc() < end)
+		cpu_relax();
+	pcpui->kmsg_polling = FALSE;
+	/* Pairs with the mb in __post_kernel_message().  A sender that saw us
+	 * polling didn't IPI us, so we must see its message here. */
+	mb();
+	return ret || has_routine_kmsg();
+}
+
+static void __print_kmsg(struct kernel_message *kmsg, char *type)
+{
+	printk("%s KMSG on %d from %d to run %p(%s)(%p, %p, %p)\n", type,
+	       kmsg->dstid, kmsg->srcid, kmsg->pc, get_fn_name((long)kmsg->pc),
+	       kmsg->arg0, kmsg->arg1, kmsg->arg2);
+}
+
+static void __print_kmsg_ring(struct kmsg_ring *ring, char *type)
+{
+	struct kernel_message *kmsg_i;
+	unsigned long prod = atomic_read(&ring->prod);
+
+	for (unsigned long i = ring->cons; i != prod; i++)
+		__print_kmsg(&ring->slots[i & (KMSG_RING_SZ - 1)].msg, type);
+	STAILQ_FOREACH(kmsg_i, &ring->overflow, link)
+		__print_kmsg(kmsg_i, type);
+}
+
 /* extremely dangerous and racy: prints out the immed and routine kmsgs for a
  * specific core (so possibly remotely) */
 void print_kmsgs(uint32_t coreid)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
-	void __print_kmsgs(struct kernel_msg_list *list, char *type)
-	{
-		struct kernel_message *kmsg_i;
-
-		STAILQ_FOREACH(kmsg_i, list, link) {
-			printk("%s KMSG on %d from %d to run %p(%s)(%p, %p, %p)\n",
-			       type, kmsg_i->dstid, kmsg_i->srcid, kmsg_i->pc,
-			       get_fn_name((long)kmsg_i->pc),
-			       kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
-		}
-	}
-	__print_kmsgs(&pcpui->immed_amsgs, "Immedte");
-	__print_kmsgs(&pcpui->routine_amsgs, "Routine");
+
+	__print_kmsg_ring(pcpui->immed_kmsgs, "Immedte");
+	__print_kmsg_ring(pcpui->routine_kmsgs, "Routine");
 }
 
 void __kmsg_trampoline(uint32_t srcid, long a0, long a1, long a2)
@@ -270,39 +423,17 @@ void __kmsg_trampoline(uint32_t srcid, long a0, long a1, long a2)
 /* Debugging stuff */
 void kmsg_queue_stat(void)
 {
-	struct kernel_message *kmsg;
-	bool immed_emp, routine_emp;
+	struct kmsg_ring *immed, *routine;
 
 	for (int i = 0; i < num_cores; i++) {
-		spin_lock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		immed_emp = STAILQ_EMPTY(&per_cpu_info[i].immed_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		spin_lock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		routine_emp = STAILQ_EMPTY(&per_cpu_info[i].routine_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		printk("Core %d's immed_emp: %d, routine_emp %d\n", i,
-		       immed_emp, routine_emp);
-		if (!immed_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].immed_amsgs);
-			printk("Immed msg on core %d:\n", i);
-			printk("\tsrc:  %d\n", kmsg->srcid);
-			printk("\tdst:  %d\n", kmsg->dstid);
-			printk("\tpc:   %p\n", kmsg->pc);
-			printk("\targ0: %p\n", kmsg->arg0);
-			printk("\targ1: %p\n", kmsg->arg1);
-			printk("\targ2: %p\n", kmsg->arg2);
-		}
-		if (!routine_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].routine_amsgs);
-			printk("Routine msg on core %d:\n", i);
-			printk("\tsrc:  %d\n", kmsg->srcid);
-			printk("\tdst:  %d\n", kmsg->dstid);
-			printk("\tpc:   %p\n", kmsg->pc);
-			printk("\targ0: %p\n", kmsg->arg0);
-			printk("\targ1: %p\n", kmsg->arg1);
-			printk("\targ2: %p\n", kmsg->arg2);
-		}
-
+		immed = per_cpu_info[i].immed_kmsgs;
+		routine = per_cpu_info[i].routine_kmsgs;
+		printk("Core %d's immed_emp: %d, routine_emp %d, polling %d\n",
+		       i, kmsg_ring_empty(immed), kmsg_ring_empty(routine),
+		       per_cpu_info[i].kmsg_polling);
+		printk("\toverflowed: immed %lu, routine %lu\n",
+		       immed->nr_overflowed, routine->nr_overflowed);
+		print_kmsgs(i);
 	}
 }
 
@@ -0,0 +1,105 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * fork_bench: measures fork() latency as the parent's memory grows.
+ *
+ * usage: fork_bench [-l loops] [MB ...]
+ *
+ * For each size, we map and touch that much anonymous memory, then time fork()
+ * until the child has run and exited, averaged over the loops.  We also report
+ * how long it takes the child to write every page it inherited, which is where
+ * CoW pays for the copies it skipped at fork time.
+ *
+ * Sizes default to 1, 16, 256, and 1024 MB. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <parlib/parlib.h>
+#include <parlib/tsc-compat.h>
+
+static void touch_pages(char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i += PGSIZE)
+		buf[i] = (char)i;
+}
+
+static uint64_t time_fork(char *buf, size_t len, bool child_writes)
+{
+	uint64_t start;
+	pid_t pid;
+	int status;
+
+	start = read_tsc();
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(-1);
+	}
+	if (!pid) {
+		if (child_writes)
+			touch_pages(buf, len);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) != pid) {
+		perror("waitpid");
+		exit(-1);
+	}
+	return read_tsc() - start;
+}
+
+static void run_size(size_t mb, int loops)
+{
+	size_t len = mb << 20;
+	uint64_t fork_only = 0, fork_write = 0;
+	char *buf;
+
+	buf = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	           -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		exit(-1);
+	}
+	touch_pages(buf, len);
+	for (int i = 0; i < loops; i++) {
+		fork_only += time_fork(buf, len, FALSE);
+		fork_write += time_fork(buf, len, TRUE);
+	}
+	printf("%6lu MB: fork+exit %10llu usec, fork+write+exit %10llu usec\n",
+	       mb, tsc2usec(fork_only) / loops, tsc2usec(fork_write) / loops);
+	munmap(buf, len);
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t default_sizes[] = {1, 16, 256, 1024};
+	int loops = 10;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:")) != -1) {
+		switch (opt) {
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-l loops] [MB ...]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	if (loops < 1)
+		loops = 1;
+	if (optind == argc) {
+		for (int i = 0; i < COUNT_OF(default_sizes); i++)
+			run_size(default_sizes[i], loops);
+	} else {
+		for (int i = optind; i < argc; i++)
+			run_size(strtoul(argv[i], 0, 10), loops);
+	}
+	return 0;
+}
@@ -0,0 +1,179 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * jumbo_bench: compares random access over anonymous memory backed by jumbo
+ * pages against the same memory backed by 4K pages.
+ *
+ * usage: jumbo_bench [-m MB] [-a nr_accesses] [-e raw_event]
+ *
+ * We MAP_POPULATE MB (default 1024) of anonymous memory, which the kernel backs
+ * with jumbos, and time nr_accesses (default 10000000) random reads.  Then we
+ * mprotect() one page in every jumbo to the prot it already has, which splits
+ * the jumbos into 4K PTEs without changing anything else, and run it again.
+ *
+ * If #arch/perf works, we also count raw_event across all cores during each
+ * run.  The default is DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK (event 0x08, umask
+ * 0x01) on Intel, given as 0xUUEE. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include <ros/arch/perfmon.h>
+#include <ros/memops.h>
+#include <parlib/parlib.h>
+#include <parlib/core_set.h>
+#include <parlib/tsc-compat.h>
+
+#define JUMBO_SZ (2UL << 20)
+
+static int perf_fd = -1;
+
+/* Returns a perf event descriptor counting raw_event in userspace, or -1. */
+static int perf_open(uint16_t raw_event)
+{
+	uint8_t cmdbuf[1 + 4 * sizeof(uint64_t) + sizeof(uint32_t) +
+	               CORE_SET_SIZE];
+	uint8_t *wptr = cmdbuf;
+	struct core_set cores;
+	uint64_t event = 0;
+	uint32_t ped;
+
+	if (perf_fd < 0)
+		return -1;
+	PMEV_SET_EVENT(event, raw_event & 0xff);
+	PMEV_SET_MASK(event, raw_event >> 8);
+	PMEV_SET_USR(event, 1);
+	PMEV_SET_EN(event, 1);
+	parlib_get_all_core_set(&cores);
+
+	*wptr++ = PERFMON_CMD_COUNTER_OPEN;
+	wptr = put_le_u64(wptr, event);
+	wptr = put_le_u64(wptr, 0);	/* flags */
+	wptr = put_le_u64(wptr, 0);	/* trigger_count */
+	wptr = put_le_u64(wptr, 0);	/* user_data */
+	wptr = put_le_u32(wptr, CORE_SET_SIZE);
+	memcpy(wptr, cores.core_set, CORE_SET_SIZE);
+	wptr += CORE_SET_SIZE;
+	if (pwrite(perf_fd, cmdbuf, wptr - cmdbuf, 0) < 0)
+		return -1;
+	if (pread(perf_fd, cmdbuf, sizeof(uint32_t), 0) != sizeof(uint32_t))
+		return -1;
+	get_le_u32(cmdbuf, &ped);
+	return (int)ped;
+}
+
+/* Returns the count of ped across all cores, and closes it. */
+static uint64_t perf_close(int ped)
+{
+	size_t bufsz = sizeof(uint32_t) + MAX_NUM_CORES * sizeof(uint64_t);
+	uint8_t *cmdbuf = malloc(bufsz);
+	const uint8_t *rptr = cmdbuf;
+	uint64_t total = 0, val;
+	uint32_t n = 0;
+
+	assert(cmdbuf);
+	cmdbuf[0] = PERFMON_CMD_COUNTER_STATUS;
+	put_le_u32(cmdbuf + 1, ped);
+	if ((pwrite(perf_fd, cmdbuf, 1 + sizeof(uint32_t), 0) > 0) &&
+	    (pread(perf_fd, cmdbuf, bufsz, 0) >= sizeof(uint32_t)))
+		rptr = get_le_u32(rptr, &n);
+	for (uint32_t i = 0; i < MIN(n, MAX_NUM_CORES); i++) {
+		rptr = get_le_u64(rptr, &val);
+		total += val;
+	}
+	cmdbuf[0] = PERFMON_CMD_COUNTER_CLOSE;
+	put_le_u32(cmdbuf + 1, ped);
+	pwrite(perf_fd, cmdbuf, 1 + sizeof(uint32_t), 0);
+	free(cmdbuf);
+	return total;
+}
+
+static void run(const char *name, char *buf, size_t len, long nr_accesses,
+                uint16_t raw_event)
+{
+	uint64_t start, ticks, x = 88172645463325252ULL;
+	unsigned long sum = 0;
+	int ped;
+
+	ped = perf_open(raw_event);
+	start = read_tsc();
+	for (long i = 0; i < nr_accesses; i++) {
+		/* xorshift, so the PRNG doesn't touch memory */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		sum += buf[x % len];
+	}
+	ticks = read_tsc() - start;
+	printf("%-6s: %llu nsec/access", name, tsc2nsec(ticks) / nr_accesses);
+	if (ped >= 0)
+		printf(", %llu TLB misses (event 0x%04x)", perf_close(ped),
+		       raw_event);
+	printf(" (sum %lu)\n", sum);
+}
+
+int main(int argc, char **argv)
+{
+	size_t mb = 1024, len;
+	long nr_accesses = 10000000;
+	uint16_t raw_event = 0x0108;
+	char *buf;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:a:e:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mb = strtoul(optarg, 0, 0);
+			break;
+		case 'a':
+			nr_accesses = strtol(optarg, 0, 0);
+			break;
+		case 'e':
+			raw_event = strtoul(optarg, 0, 0);
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-m MB] [-a nr_accesses] [-e raw_event]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	len = MAX(mb, 2) << 20;
+	nr_accesses = MAX(1, nr_accesses);
+
+	buf = mmap(0, len, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		exit(-1);
+	}
+	for (size_t i = 0; i < len; i += PGSIZE)
+		buf[i] = (char)i;
+	perf_fd = open("#arch/perf", O_RDWR);
+	if (perf_fd < 0)
+		printf("No #arch/perf, skipping TLB miss counts\n");
+
+	printf("%lu MB, %ld random accesses, buffer at %p\n", len >> 20,
+	       nr_accesses, buf);
+	run("jumbo", buf, len, nr_accesses, raw_event);
+	for (size_t i = ROUNDUP((uintptr_t)buf, JUMBO_SZ) - (uintptr_t)buf;
+	     i + JUMBO_SZ <= len; i += JUMBO_SZ) {
+		if (mprotect(buf + i + PGSIZE, PGSIZE,
+		             PROT_READ | PROT_WRITE)) {
+			perror("mprotect");
+			exit(-1);
+		}
+	}
+	run("4K", buf, len, nr_accesses, raw_event);
+
+	if (perf_fd >= 0)
+		close(perf_fd);
+	munmap(buf, len);
+	return 0;
+}
@@ -32,6 +32,7 @@
 #include <parlib/timing.h>
 #include <parlib/spinlock.h>
 #include <parlib/mcs.h>
+#include <parlib/uthread.h>
 #include <parlib/arch/arch.h>
 #include <parlib/event.h>
 
@@ -476,7 +477,12 @@ static struct argp_option options[] = {
 	                                             "\tmcspdro\n"
 	                                             "\t__mcspdro\n"
 	                                             "\tspin\n"
-	                                             "\tspinpdr"},
+	                                             "\tspinpdr\n"
+	                                             "\tuthmtx\n"
+	                                             "\tuthrd\n"
+	                                             "\tuthwr\n"
+	                                             "(uth locks can't use "
+	                                             "vc_ctx)"},
 	{0, 0, 0, 0, "Other options (not mandatory):"},
 	{"adj_workers",	OPT_ADJ_WORKERS, 0,	0,
 	                                       "Adjust workers such that the "
@@ -631,12 +637,30 @@ lock_func(__mcspdro,
 lock_func(spinpdr,
           spin_pdr_lock(&spdr_lock);,
           spin_pdr_unlock(&spdr_lock);)
+
+/* Sleeping locks.  Uncontended, these are a CAS each way.  Contended, they
+ * spin while the holder runs, then sleep. */
+uth_mutex_t uth_mtx = UTH_MUTEX_INIT;
+uth_rwlock_t uth_rwl = UTH_RWLOCK_INIT;
+
+lock_func(uthmtx,
+          uth_mutex_lock(&uth_mtx);,
+          uth_mutex_unlock(&uth_mtx);)
+lock_func(uthrd,
+          uth_rwlock_rdlock(&uth_rwl);,
+          uth_rwlock_unlock(&uth_rwl);)
+lock_func(uthwr,
+          uth_rwlock_wrlock(&uth_rwl);,
+          uth_rwlock_unlock(&uth_rwl);)
 #else
 
 fake_lock_func(mcspdr, 0, 0);
 fake_lock_func(mcspdro, 0, 0);
 fake_lock_func(__mcspdro, 0, 0);
 fake_lock_func(spinpdr, 0, 0);
+fake_lock_func(uthmtx, 0, 0);
+fake_lock_func(uthrd, 0, 0);
+fake_lock_func(uthwr, 0, 0);
 
 #endif
 
@@ -850,6 +874,18 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 			pargs->lock_type = spinpdr_thread;
 			break;
 		}
+		if (!strcmp("uthmtx", arg)) {
+			pargs->lock_type = uthmtx_thread;
+			break;
+		}
+		if (!strcmp("uthrd", arg)) {
+			pargs->lock_type = uthrd_thread;
+			break;
+		}
+		if (!strcmp("uthwr", arg)) {
+			pargs->lock_type = uthwr_thread;
+			break;
+		}
 		printf("Unknown locktype %s\n\n", arg);
 		argp_usage(state);
 		break;
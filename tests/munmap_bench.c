@@ -0,0 +1,96 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * munmap_bench: measures munmap() latency in an MCP, which includes the TLB
+ * shootdown of every core running the address space.
+ *
+ * usage: munmap_bench [-v nr_vcores] [-l loops] [-p nr_pages]
+ *
+ * We get nr_vcores (default 64, capped at max_vcores()) and keep all but one of
+ * them spinning in userspace.  The remaining thread repeatedly maps and touches
+ * nr_pages (default 1), then times the munmap.  Compare small page counts
+ * (ranged flushes) against large ones (full flushes), and vary the number of
+ * vcores to see the cost of the IPIs. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include <parlib/parlib.h>
+#include <parlib/tsc-compat.h>
+
+static volatile bool done;
+
+static void *spinner(void *arg)
+{
+	while (!done)
+		cpu_relax();
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_vcores = 64, loops = 10000, nr_pages = 1;
+	size_t len;
+	pthread_t *threads;
+	uint64_t total = 0, start;
+	char *buf;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "v:l:p:")) != -1) {
+		switch (opt) {
+		case 'v':
+			nr_vcores = atoi(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 'p':
+			nr_pages = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-v nr_vcores] [-l loops] [-p nr_pages]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	nr_vcores = MAX(1, MIN(nr_vcores, max_vcores()));
+	loops = MAX(1, loops);
+	nr_pages = MAX(1, nr_pages);
+	len = (size_t)nr_pages * PGSIZE;
+
+	parlib_never_yield = TRUE;
+	pthread_mcp_init();
+	vcore_request_total(nr_vcores);
+	parlib_never_vc_request = TRUE;
+	threads = malloc(sizeof(pthread_t) * nr_vcores);
+	assert(threads);
+	for (int i = 0; i < nr_vcores - 1; i++)
+		pthread_create(&threads[i], NULL, spinner, NULL);
+
+	for (int i = 0; i < loops; i++) {
+		buf = mmap(0, len, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (buf == MAP_FAILED) {
+			perror("mmap");
+			exit(-1);
+		}
+		for (size_t j = 0; j < len; j += PGSIZE)
+			buf[j] = (char)j;
+		start = read_tsc();
+		munmap(buf, len);
+		total += read_tsc() - start;
+	}
+	done = TRUE;
+	for (int i = 0; i < nr_vcores - 1; i++)
+		pthread_join(threads[i], NULL);
+	printf("%d vcores, %d pages: munmap %llu nsec\n", num_vcores(),
+	       nr_pages, tsc2nsec(total) / loops);
+	free(threads);
+	return 0;
+}
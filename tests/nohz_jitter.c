@@ -0,0 +1,130 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * nohz_jitter: measures how long spinning vcores get interrupted.
+ *
+ * usage: nohz_jitter [-v nr_vcores] [-w nr_windows] [-u window_usec]
+ *
+ * Each of nr_vcores (default 4) threads spins, reading the TSC.  Time is split
+ * into nr_windows (default 10000) windows of window_usec (default 1000), and
+ * for each window we record the longest gap between two TSC reads.  A gap is
+ * time the vcore didn't run: an IRQ, a kernel message, a preemption, etc.  The
+ * histogram is of those per-window maximums, so a core with no interruptions
+ * (nohz) should be flat at the cost of a loop iteration. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include <parlib/parlib.h>
+#include <parlib/tsc-compat.h>
+#include <benchutil/measure.h>
+
+static int nr_windows = 10000;
+static uint64_t window_ticks;
+static uint64_t **max_gaps;
+static int *pcoreids;
+static pthread_barrier_t barrier;
+
+static int get_gap(void **data, int i, int j, uint64_t *sample)
+{
+	uint64_t **gaps = (uint64_t**)data;
+
+	*sample = gaps[i][j];
+	return 0;
+}
+
+static void *spinner(void *arg)
+{
+	long id = (long)arg;
+	uint64_t *gaps = max_gaps[id];
+	uint64_t prev, now, end, gap;
+
+	pthread_barrier_wait(&barrier);
+	pcoreids[id] = get_pcoreid();
+	prev = read_tsc();
+	for (int i = 0; i < nr_windows; i++) {
+		end = prev + window_ticks;
+		gaps[i] = 0;
+		do {
+			now = read_tsc();
+			gap = now - prev;
+			gaps[i] = MAX(gaps[i], gap);
+			prev = now;
+		} while (now < end);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_vcores = 4, window_usec = 1000;
+	struct sample_stats stats[1];
+	pthread_t *threads;
+	uint64_t worst;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "v:w:u:")) != -1) {
+		switch (opt) {
+		case 'v':
+			nr_vcores = atoi(optarg);
+			break;
+		case 'w':
+			nr_windows = atoi(optarg);
+			break;
+		case 'u':
+			window_usec = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-v nr_vcores] [-w nr_windows] [-u window_usec]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	nr_vcores = MAX(1, MIN(nr_vcores, max_vcores()));
+	nr_windows = MAX(1, nr_windows);
+	window_ticks = usec2tsc(MAX(1, window_usec));
+
+	max_gaps = malloc(sizeof(uint64_t*) * nr_vcores);
+	pcoreids = malloc(sizeof(int) * nr_vcores);
+	threads = malloc(sizeof(pthread_t) * nr_vcores);
+	assert(max_gaps && pcoreids && threads);
+	for (int i = 0; i < nr_vcores; i++) {
+		max_gaps[i] = malloc(sizeof(uint64_t) * nr_windows);
+		assert(max_gaps[i]);
+	}
+	pthread_barrier_init(&barrier, NULL, nr_vcores);
+
+	/* One spinner per vcore, and keep the vcores */
+	parlib_never_yield = TRUE;
+	pthread_mcp_init();
+	vcore_request_total(nr_vcores);
+	parlib_never_vc_request = TRUE;
+	for (long i = 0; i < nr_vcores; i++)
+		pthread_create(&threads[i], NULL, spinner, (void*)i);
+	for (int i = 0; i < nr_vcores; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("Longest interruption per %d usec window, %d windows, %d vcores\n",
+	       window_usec, nr_windows, nr_vcores);
+	stats->get_sample = get_gap;
+	compute_stats((void**)max_gaps, nr_vcores, nr_windows, stats);
+
+	for (int i = 0; i < nr_vcores; i++) {
+		worst = 0;
+		for (int j = 0; j < nr_windows; j++)
+			worst = MAX(worst, max_gaps[i][j]);
+		printf("\tThread %2d (pcore %3d): worst %llu nsec\n", i,
+		       pcoreids[i], tsc2nsec(worst));
+	}
+	for (int i = 0; i < nr_vcores; i++)
+		free(max_gaps[i]);
+	free(max_gaps);
+	free(pcoreids);
+	free(threads);
+	return 0;
+}
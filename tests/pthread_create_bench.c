@@ -0,0 +1,99 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * pthread_create_bench: measures the rate of creating, running, and joining
+ * short-lived pthreads, like a thread-per-request server.
+ *
+ * usage: pthread_create_bench [-v nr_vcores] [-n nr_threads] [-b batch]
+ *                             [-c cache_sz]
+ *
+ * Creates nr_threads (default 100000) threads that do nothing, batch (default
+ * 8) at a time, joining each batch before starting the next.  cache_sz sets how
+ * many stacks and TLSs each vcore caches from exited threads (0 turns the
+ * caches off, default is the library's), so compare -c 0 against the default:
+ * with the caches warm, creating a thread needs no syscalls. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include <parlib/parlib.h>
+#include <parlib/uthread.h>
+#include <parlib/tsc-compat.h>
+
+static void *noop_thread(void *arg)
+{
+	return arg;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_vcores = 1, nr_threads = 100000, batch = 8;
+	long cache_sz = -1;
+	pthread_t *threads;
+	uint64_t start, usec;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "v:n:b:c:")) != -1) {
+		switch (opt) {
+		case 'v':
+			nr_vcores = atoi(optarg);
+			break;
+		case 'n':
+			nr_threads = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'c':
+			cache_sz = strtol(optarg, 0, 0);
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-v nr_vcores] [-n nr_threads] [-b batch] [-c cache_sz]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	nr_vcores = MAX(1, MIN(nr_vcores, max_vcores()));
+	nr_threads = MAX(1, nr_threads);
+	batch = MAX(1, MIN(batch, nr_threads));
+	if (cache_sz >= 0) {
+		pthread_stack_cache_sz = cache_sz;
+		uth_tls_cache_sz = cache_sz;
+	}
+	threads = malloc(sizeof(pthread_t) * batch);
+	assert(threads);
+
+	pthread_mcp_init();
+	vcore_request_total(nr_vcores);
+	parlib_never_vc_request = TRUE;
+
+	start = read_tsc();
+	for (int i = 0; i < nr_threads; i += batch) {
+		int n = MIN(batch, nr_threads - i);
+
+		for (int j = 0; j < n; j++) {
+			if (pthread_create(&threads[j], NULL, noop_thread,
+			                   NULL)) {
+				perror("pthread_create");
+				exit(-1);
+			}
+		}
+		for (int j = 0; j < n; j++)
+			pthread_join(threads[j], NULL);
+	}
+	usec = MAX(tsc2usec(read_tsc() - start), 1);
+
+	printf("%d threads, batches of %d, %d vcores, stack cache %u, TLS cache %u\n",
+	       nr_threads, batch, num_vcores(), pthread_stack_cache_sz,
+	       uth_tls_cache_sz);
+	printf("%llu usec, %llu threads/sec, %llu nsec/thread\n", usec,
+	       (uint64_t)nr_threads * 1000000 / usec,
+	       usec * 1000 / nr_threads);
+	free(threads);
+	return 0;
+}
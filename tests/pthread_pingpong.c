@@ -0,0 +1,173 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * pthread_pingpong: measures blocking wakeups through the pthread 2LS.
+ *
+ * usage: pthread_pingpong [-v nr_vcores] [-p nr_pairs] [-f nr_fanout]
+ *                         [-l loops]
+ *
+ * Ping-pong: nr_pairs (default 1) pairs of threads take turns waking each other
+ * with semaphores, loops (default 100000) round trips each.  Every round trip
+ * is two blocks and two wakeups, so this is the cost of going through the run
+ * queues, and whether pairs on different vcores contend with each other.
+ *
+ * Fan-out: one thread wakes nr_fanout (default 32) threads, then waits for all
+ * of them to check in, loops / 100 times.  The wakees land on the waker's vcore
+ * and the other vcores have to steal them.
+ *
+ * We get nr_vcores (default 8, capped at max_vcores()) and keep them: idle
+ * vcores spin in the 2LS looking for work instead of yielding. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/param.h>
+
+#include <parlib/parlib.h>
+#include <parlib/tsc-compat.h>
+
+struct pp_pair {
+	sem_t				ping;
+	sem_t				pong;
+	pthread_t			pinger;
+	pthread_t			ponger;
+};
+
+static int loops = 100000;
+static int fanout_loops;
+static sem_t fanout_done;
+static pthread_barrier_t barrier;
+
+static void *pinger(void *arg)
+{
+	struct pp_pair *pair = arg;
+
+	pthread_barrier_wait(&barrier);
+	for (int i = 0; i < loops; i++) {
+		sem_post(&pair->pong);
+		sem_wait(&pair->ping);
+	}
+	return 0;
+}
+
+static void *ponger(void *arg)
+{
+	struct pp_pair *pair = arg;
+
+	pthread_barrier_wait(&barrier);
+	for (int i = 0; i < loops; i++) {
+		sem_wait(&pair->pong);
+		sem_post(&pair->ping);
+	}
+	return 0;
+}
+
+static void *fanout_wakee(void *arg)
+{
+	sem_t *wake = arg;
+
+	for (int i = 0; i < fanout_loops; i++) {
+		sem_wait(wake);
+		sem_post(&fanout_done);
+	}
+	return 0;
+}
+
+static void run_pingpong(int nr_pairs)
+{
+	struct pp_pair *pairs = malloc(sizeof(struct pp_pair) * nr_pairs);
+	uint64_t start, ticks;
+
+	assert(pairs);
+	pthread_barrier_init(&barrier, NULL, nr_pairs * 2 + 1);
+	for (int i = 0; i < nr_pairs; i++) {
+		sem_init(&pairs[i].ping, 0, 0);
+		sem_init(&pairs[i].pong, 0, 0);
+		pthread_create(&pairs[i].pinger, NULL, pinger, &pairs[i]);
+		pthread_create(&pairs[i].ponger, NULL, ponger, &pairs[i]);
+	}
+	pthread_barrier_wait(&barrier);
+	start = read_tsc();
+	for (int i = 0; i < nr_pairs; i++) {
+		pthread_join(pairs[i].pinger, NULL);
+		pthread_join(pairs[i].ponger, NULL);
+	}
+	ticks = read_tsc() - start;
+	printf("ping-pong: %d pairs, %d round trips: %llu nsec/round trip\n",
+	       nr_pairs, loops, tsc2nsec(ticks) / loops);
+	pthread_barrier_destroy(&barrier);
+	free(pairs);
+}
+
+static void run_fanout(int nr_fanout)
+{
+	pthread_t *threads = malloc(sizeof(pthread_t) * nr_fanout);
+	sem_t *wakes = malloc(sizeof(sem_t) * nr_fanout);
+	uint64_t start, ticks;
+
+	assert(threads && wakes);
+	sem_init(&fanout_done, 0, 0);
+	for (int i = 0; i < nr_fanout; i++) {
+		sem_init(&wakes[i], 0, 0);
+		pthread_create(&threads[i], NULL, fanout_wakee, &wakes[i]);
+	}
+	start = read_tsc();
+	for (int i = 0; i < fanout_loops; i++) {
+		for (int j = 0; j < nr_fanout; j++)
+			sem_post(&wakes[j]);
+		for (int j = 0; j < nr_fanout; j++)
+			sem_wait(&fanout_done);
+	}
+	ticks = read_tsc() - start;
+	for (int i = 0; i < nr_fanout; i++)
+		pthread_join(threads[i], NULL);
+	printf("fan-out: %d wakees, %d rounds: %llu nsec/round\n", nr_fanout,
+	       fanout_loops, tsc2nsec(ticks) / fanout_loops);
+	free(threads);
+	free(wakes);
+}
+
+int main(int argc, char **argv)
+{
+	int nr_vcores = 8, nr_pairs = 1, nr_fanout = 32;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "v:p:f:l:")) != -1) {
+		switch (opt) {
+		case 'v':
+			nr_vcores = atoi(optarg);
+			break;
+		case 'p':
+			nr_pairs = atoi(optarg);
+			break;
+		case 'f':
+			nr_fanout = atoi(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-v nr_vcores] [-p nr_pairs] [-f nr_fanout] [-l loops]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	nr_vcores = MAX(1, MIN(nr_vcores, max_vcores()));
+	loops = MAX(1, loops);
+	fanout_loops = MAX(1, loops / 100);
+
+	parlib_never_yield = TRUE;
+	pthread_mcp_init();
+	vcore_request_total(nr_vcores);
+	parlib_never_vc_request = TRUE;
+	printf("%d vcores\n", num_vcores());
+	if (nr_pairs > 0)
+		run_pingpong(nr_pairs);
+	if (nr_fanout > 0)
+		run_fanout(nr_fanout);
+	return 0;
+}
@@ -0,0 +1,86 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * readahead_bench: measures sequential read throughput of a file, with a given
+ * readahead window.
+ *
+ * usage: readahead_bench [-b buf_sz] [-w max_win_pgs] FILE
+ *
+ * Reads FILE start to finish with buf_sz (default 4096) reads, after setting
+ * the chan's readahead window limit to max_win_pgs (0 turns it off; default is
+ * the kernel's).  Prints the throughput and the chan's readahead stats.
+ *
+ * Only the first read of a file comes from the backend, so compare windows on
+ * separate, uncached copies of a file, e.g. on #gtfs. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/param.h>
+
+#include <parlib/parlib.h>
+#include <parlib/tsc-compat.h>
+
+int main(int argc, char **argv)
+{
+	size_t buf_sz = 4096, total = 0;
+	long max_win = -1;
+	struct file_ra_stats stats;
+	uint64_t start, usec;
+	ssize_t ret;
+	char *buf;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "b:w:")) != -1) {
+		switch (opt) {
+		case 'b':
+			buf_sz = strtoul(optarg, 0, 0);
+			break;
+		case 'w':
+			max_win = strtol(optarg, 0, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || !buf_sz)
+		goto usage;
+	fd = open(argv[optind], O_READ);
+	if (fd < 0) {
+		perror("open");
+		exit(-1);
+	}
+	if (max_win >= 0 && fcntl(fd, CCTL_SET_RA, max_win)) {
+		perror("fcntl CCTL_SET_RA");
+		exit(-1);
+	}
+	buf = malloc(buf_sz);
+	assert(buf);
+
+	start = read_tsc();
+	while ((ret = read(fd, buf, buf_sz)) > 0)
+		total += ret;
+	usec = MAX(tsc2usec(read_tsc() - start), 1);
+	if (ret < 0) {
+		perror("read");
+		exit(-1);
+	}
+	printf("%lu bytes in %llu usec, %llu MB/s\n", total, usec,
+	       total / usec);
+	if (fcntl(fd, CCTL_GET_RA_STATS, &stats)) {
+		perror("fcntl CCTL_GET_RA_STATS");
+		exit(-1);
+	}
+	printf("readahead: max_win %lu, win %lu, %lu seq reads, %lu random reads, %lu pages prefetched\n",
+	       stats.max_win, stats.win, stats.nr_seq_reads,
+	       stats.nr_rand_reads, stats.nr_ra_pgs);
+	free(buf);
+	close(fd);
+	return 0;
+usage:
+	fprintf(stderr, "usage: %s [-b buf_sz] [-w max_win_pgs] FILE\n",
+	        argv[0]);
+	exit(-1);
+}
@@ -0,0 +1,81 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * sysc_batch: compares the cost of N syscalls issued one trap at a time against
+ * the same N syscalls submitted in batches.
+ *
+ * usage: sysc_batch [nr_syscalls] [batch_size]
+ *
+ * We use SYS_null, so we're measuring the trap and per-syscall overhead, not
+ * the work of the syscall itself. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/param.h>
+
+#include <parlib/parlib.h>
+#include <parlib/arch/arch.h>
+#include <parlib/tsc-compat.h>
+
+static void wait_for(struct syscall *sysc)
+{
+	while (!(atomic_read(&sysc->flags) & SC_DONE))
+		cpu_relax();
+}
+
+static uint64_t run_single(unsigned int nr)
+{
+	uint64_t start = read_tsc();
+
+	for (unsigned int i = 0; i < nr; i++)
+		sys_null();
+	return read_tsc() - start;
+}
+
+static uint64_t run_batched(unsigned int nr, unsigned int batch_sz)
+{
+	struct syscall *syscs = calloc(batch_sz, sizeof(struct syscall));
+	struct sysc_batch batch;
+	unsigned int amt;
+	uint64_t start;
+
+	assert(syscs);
+	sysc_batch_init(&batch, syscs, batch_sz);
+	start = read_tsc();
+	for (unsigned int i = 0; i < nr; i += amt) {
+		amt = MIN(batch.max, nr - i);
+		for (unsigned int j = 0; j < amt; j++)
+			sysc_batch_add(&batch, SYS_null);
+		sysc_batch_submit(&batch);
+		for (unsigned int j = 0; j < amt; j++)
+			wait_for(&syscs[j]);
+	}
+	start = read_tsc() - start;
+	free(syscs);
+	return start;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr = 1000000;
+	unsigned int batch_sz = 32;
+	uint64_t single, batched;
+
+	if (argc > 1)
+		nr = strtoul(argv[1], 0, 10);
+	if (argc > 2)
+		batch_sz = strtoul(argv[2], 0, 10);
+	if (!batch_sz || batch_sz > MAX_SYSC_BATCH) {
+		fprintf(stderr, "batch size must be 1..%d\n", MAX_SYSC_BATCH);
+		exit(-1);
+	}
+	/* Warm up */
+	run_single(1000);
+	single = run_single(nr);
+	batched = run_batched(nr, batch_sz);
+	printf("%u syscalls, one per trap: %llu nsec/call\n", nr,
+	       tsc2nsec(single) / nr);
+	printf("%u syscalls, %u per trap:   %llu nsec/call\n", nr, batch_sz,
+	       tsc2nsec(batched) / nr);
+	return 0;
+}
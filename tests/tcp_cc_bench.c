@@ -0,0 +1,614 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * tcp_cc_bench: measures how quickly each TCP congestion control algorithm gets
+ * its goodput back after a loss.
+ *
+ * Like tcp_rx_scale, we bind a 'pkt' interface and play the remote end of a TCP
+ * connection by hand.  The stack sends a bulk transfer to us, and we emulate a
+ * link between the two: a bottleneck of a fixed rate with a drop-tail queue,
+ * and a fixed RTT.  On top of that, we drop one segment every loss interval, on
+ * a fixed schedule, and SACK what we get, like a real receiver would.
+ *
+ * For each loss, we report how long it took until the link was carrying at
+ * least 90% of its rate again, measured in bins of the received goodput.
+ *
+ * usage: tcp_cc_bench [-r mbit/s] [-d rtt_ms] [-q queue_ms] [-l loss_ms]
+ *                     [-t secs] [alg ...]
+ *
+ * The algorithms default to reno, cubic, and vegas.  The link defaults to 100
+ * Mbit/s, a 40 ms RTT, and a queue of one bandwidth-delay product. */
+
+#define _GNU_SOURCE /* pthread_yield */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/arch/arch.h>
+#include <parlib/timing.h>
+#include <parlib/tsc-compat.h>
+#include <parlib/uthread.h>
+#include <iplib/iplib.h>
+
+#define LOCAL_ADDR		"10.254.1.1"
+#define REMOTE_ADDR		"10.254.1.2"
+#define LISTEN_PORT_BASE	5577
+#define REMOTE_PORT		21000
+#define REMOTE_ISS		7000000
+#define TCP_FL_SYN		0x02
+#define TCP_FL_RST		0x04
+#define TCP_FL_ACK		0x10
+#define TCPOPT_NOP		1
+#define TCPOPT_MSS		2
+#define TCPOPT_WS		3
+#define TCPOPT_SACK_OK		4
+#define TCPOPT_SACK		5
+#define RCV_WS			7
+#define MAX_SACKS		3
+#define MAX_OOO			32
+#define MAX_OPTS		(4 + 8 * MAX_SACKS)
+#define MAX_PKT			(IPV4_HDR_LEN + TCP_HDR_LEN + MAX_OPTS)
+#define NR_ACKS			(1 << 16)
+#define BIN_MS			100
+#define MAX_BINS		(1 << 16)
+#define MAX_LOSSES		1024
+#define RECOVERED_PCT		90
+
+struct range {
+	uint32_t			left;
+	uint32_t			right;
+};
+
+/* An ack the link will deliver at 'due', in usec. */
+struct pending_ack {
+	uint64_t			due;
+	uint32_t			ack;
+	int				nr_sacks;
+	struct range			sacks[MAX_SACKS];
+};
+
+/* Everything about the connection under test.  The wire thread owns the
+ * receiver and link state; the ack ring is single producer (wire), single
+ * consumer (acker). */
+struct cc_run {
+	uint16_t			lport;
+	uint32_t			irs;
+	uint64_t			start;
+	uint64_t			end;
+
+	/* link */
+	uint64_t			link_free;
+	uint64_t			next_loss;
+	uint64_t			losses[MAX_LOSSES];
+	int				nr_losses;
+	uint64_t			nr_tail_drops;
+
+	/* receiver, in bytes relative to irs + 1 */
+	uint32_t			rcv_nxt;
+	struct range			ooo[MAX_OOO];
+	int				nr_ooo;
+	uint64_t			*bins;
+
+	/* acks in flight back to the stack */
+	struct pending_ack		*acks;
+	volatile uint32_t		ack_prod;
+	volatile uint32_t		ack_cons;
+};
+
+static uint8_t local_ip[IPV4_ADDR_LEN], remote_ip[IPV4_ADDR_LEN];
+static char ifc_data_path[64];
+static int ifc_data_fd;
+static unsigned int rate_mbps = 100, rtt_ms = 40, queue_ms, loss_ms = 3000;
+static unsigned int run_secs = 15;
+
+static struct cc_run *volatile cur_run;
+static volatile bool run_stop;
+static volatile uint32_t synack_seq;
+static volatile bool synack_seen;
+
+static uint64_t now_usec(void)
+{
+	return tsc2usec(read_tsc());
+}
+
+static int build_pkt(uint8_t *pkt, uint16_t lport, uint32_t seq, uint32_t ack,
+                     uint8_t flags, uint8_t *opts, int opts_len)
+{
+	int tcp_len = TCP_HDR_LEN + opts_len;
+	int len = IPV4_HDR_LEN + tcp_len;
+	uint8_t *ip = pkt, *tcp = pkt + IPV4_HDR_LEN;
+	uint8_t pseudo[12 + TCP_HDR_LEN + MAX_OPTS];
+
+	memset(pkt, 0, len);
+	ip[0] = 0x45;
+	hnputs(ip + IPV4_OFF_LEN, len);
+	ip[IPV4_OFF_TTL] = 64;
+	ip[IPV4_OFF_PROTO] = IP_TCPPROTO;
+	memcpy(ip + IPV4_OFF_SRC, remote_ip, IPV4_ADDR_LEN);
+	memcpy(ip + IPV4_OFF_DST, local_ip, IPV4_ADDR_LEN);
+	hnputs(ip + IPV4_OFF_XSUM, ip_calc_xsum(ip, IPV4_HDR_LEN));
+
+	hnputs(tcp + TCP_OFF_SRC_PORT, REMOTE_PORT);
+	hnputs(tcp + TCP_OFF_DST_PORT, lport);
+	hnputl(tcp + TCP_OFF_SEQ, seq);
+	hnputl(tcp + TCP_OFF_ACK, ack);
+	tcp[TCP_OFF_DATA] = (tcp_len / 4) << 4;
+	tcp[TCP_OFF_FL + 1] = flags;
+	hnputs(tcp + TCP_OFF_WIN, 65535);
+	memcpy(tcp + TCP_HDR_LEN, opts, opts_len);
+
+	memcpy(pseudo, remote_ip, IPV4_ADDR_LEN);
+	memcpy(pseudo + 4, local_ip, IPV4_ADDR_LEN);
+	pseudo[8] = 0;
+	pseudo[9] = IP_TCPPROTO;
+	hnputs(pseudo + 10, tcp_len);
+	memcpy(pseudo + 12, tcp, tcp_len);
+	hnputs(tcp + TCP_OFF_XSUM, ip_calc_xsum(pseudo, 12 + tcp_len));
+	return len;
+}
+
+static void send_pkt(int fd, uint8_t *pkt, int len)
+{
+	if (write(fd, pkt, len) != len) {
+		perror("pkt write");
+		exit(-1);
+	}
+}
+
+/* Our SYN offers an MSS, a window scale, and SACK.  Options are padded to a
+ * multiple of 4 bytes. */
+static void send_syn(uint16_t lport)
+{
+	uint8_t pkt[MAX_PKT];
+	uint8_t opts[] = {TCPOPT_MSS, 4, 1460 >> 8, 1460 & 0xff,
+	                  TCPOPT_NOP, TCPOPT_WS, 3, RCV_WS,
+	                  TCPOPT_NOP, TCPOPT_NOP, TCPOPT_SACK_OK, 2};
+	int len;
+
+	len = build_pkt(pkt, lport, REMOTE_ISS, 0, TCP_FL_SYN, opts,
+	                sizeof(opts));
+	send_pkt(ifc_data_fd, pkt, len);
+}
+
+static void send_ack(int fd, struct cc_run *run, struct pending_ack *pa)
+{
+	uint8_t pkt[MAX_PKT], opts[MAX_OPTS], *p = opts;
+	int len;
+
+	if (pa->nr_sacks) {
+		*p++ = TCPOPT_NOP;
+		*p++ = TCPOPT_NOP;
+		*p++ = TCPOPT_SACK;
+		*p++ = 2 + 8 * pa->nr_sacks;
+		for (int i = 0; i < pa->nr_sacks; i++) {
+			hnputl(p, run->irs + 1 + pa->sacks[i].left);
+			hnputl(p + 4, run->irs + 1 + pa->sacks[i].right);
+			p += 8;
+		}
+	}
+	len = build_pkt(pkt, run->lport, REMOTE_ISS + 1, pa->ack, TCP_FL_ACK,
+	                opts, p - opts);
+	send_pkt(fd, pkt, len);
+}
+
+/* Adds [left, right) to what the receiver has, and returns the index of the
+ * out-of-order range that now holds it, or -1 if it's in order. */
+static int rcv_data(struct cc_run *run, uint32_t left, uint32_t right)
+{
+	struct range *r;
+	int i, j;
+
+	if (right <= run->rcv_nxt)
+		return -1;
+	if (left <= run->rcv_nxt) {
+		run->rcv_nxt = right;
+		while (run->nr_ooo && run->ooo[0].left <= run->rcv_nxt) {
+			run->rcv_nxt = MAX(run->rcv_nxt, run->ooo[0].right);
+			run->nr_ooo--;
+			memmove(run->ooo, run->ooo + 1,
+			        run->nr_ooo * sizeof(struct range));
+		}
+		return -1;
+	}
+	/* Find the first range that ends at or after left, and merge into it
+	 * and its successors if we overlap or touch. */
+	for (i = 0; i < run->nr_ooo; i++) {
+		if (run->ooo[i].right >= left)
+			break;
+	}
+	if (i == run->nr_ooo || run->ooo[i].left > right) {
+		if (run->nr_ooo == MAX_OOO)
+			return -1;
+		memmove(run->ooo + i + 1, run->ooo + i,
+		        (run->nr_ooo - i) * sizeof(struct range));
+		run->ooo[i].left = left;
+		run->ooo[i].right = right;
+		run->nr_ooo++;
+		return i;
+	}
+	r = &run->ooo[i];
+	r->left = MIN(r->left, left);
+	r->right = MAX(r->right, right);
+	for (j = i + 1; j < run->nr_ooo && run->ooo[j].left <= r->right; j++)
+		r->right = MAX(r->right, run->ooo[j].right);
+	memmove(run->ooo + i + 1, run->ooo + j,
+	        (run->nr_ooo - j) * sizeof(struct range));
+	run->nr_ooo -= j - i - 1;
+	return i;
+}
+
+/* Runs a data segment through the link and the receiver, and queues the ack
+ * for it. */
+static void link_segment(struct cc_run *run, uint32_t seq, int len,
+                         uint64_t now)
+{
+	uint64_t queue_us = (uint64_t)queue_ms * 1000;
+	uint64_t start = MAX(now, run->link_free);
+	uint32_t left = seq - run->irs - 1;
+	uint32_t old_nxt = run->rcv_nxt;
+	struct pending_ack *pa;
+	int latest, bin;
+
+	if (now >= run->next_loss) {
+		if (run->nr_losses < MAX_LOSSES)
+			run->losses[run->nr_losses++] = now;
+		run->next_loss += (uint64_t)loss_ms * 1000;
+		return;
+	}
+	if (start - now > queue_us) {
+		run->nr_tail_drops++;
+		return;
+	}
+	/* Bits at Mbit/s is usec. */
+	run->link_free = start + (uint64_t)len * 8 / rate_mbps;
+
+	latest = rcv_data(run, left, left + len);
+	bin = (run->link_free - run->start) / (BIN_MS * 1000);
+	if (bin < MAX_BINS)
+		run->bins[bin] += run->rcv_nxt - old_nxt;
+
+	if (run->ack_prod - run->ack_cons == NR_ACKS)
+		return;
+	pa = &run->acks[run->ack_prod % NR_ACKS];
+	pa->due = run->link_free + (uint64_t)rtt_ms * 1000;
+	pa->ack = run->irs + 1 + run->rcv_nxt;
+	/* The first SACK block is the one with the latest segment. */
+	pa->nr_sacks = 0;
+	if (latest >= 0)
+		pa->sacks[pa->nr_sacks++] = run->ooo[latest];
+	for (int i = 0; i < run->nr_ooo && pa->nr_sacks < MAX_SACKS; i++) {
+		if (i != latest)
+			pa->sacks[pa->nr_sacks++] = run->ooo[i];
+	}
+	wmb();
+	run->ack_prod++;
+}
+
+static void handle_pkt(uint8_t *ip, uint64_t now)
+{
+	struct cc_run *run = cur_run;
+	uint8_t *tcp;
+	int len, hlen;
+
+	if ((ip[0] >> 4) != 4 || ip[IPV4_OFF_PROTO] != IP_TCPPROTO)
+		return;
+	tcp = ip + (ip[0] & 0xf) * 4;
+	if (nhgets(tcp + TCP_OFF_DST_PORT) != REMOTE_PORT)
+		return;
+	if ((tcp[TCP_OFF_FL + 1] & (TCP_FL_SYN | TCP_FL_ACK)) ==
+	    (TCP_FL_SYN | TCP_FL_ACK)) {
+		synack_seq = nhgetl(tcp + TCP_OFF_SEQ);
+		wmb();
+		synack_seen = TRUE;
+		return;
+	}
+	if (!run || nhgets(tcp + TCP_OFF_SRC_PORT) != run->lport)
+		return;
+	hlen = (ip[0] & 0xf) * 4 + (tcp[TCP_OFF_DATA] >> 4) * 4;
+	len = nhgets(ip + IPV4_OFF_LEN) - hlen;
+	if (len > 0)
+		link_segment(run, nhgetl(tcp + TCP_OFF_SEQ), len, now);
+}
+
+/* Reads everything the stack sends out the interface.  The data file is a byte
+ * stream, so packets can straddle reads. */
+static void *wire_thread(void *arg)
+{
+	static uint8_t buf[1 << 17];
+	int ret, off, len, have = 0;
+	uint64_t now;
+
+	for (;;) {
+		ret = read(ifc_data_fd, buf + have, sizeof(buf) - have);
+		if (ret <= 0) {
+			perror("pkt read");
+			exit(-1);
+		}
+		now = now_usec();
+		have += ret;
+		for (off = 0; off + IPV4_HDR_LEN <= have; off += len) {
+			len = nhgets(buf + off + IPV4_OFF_LEN);
+			if (len < IPV4_HDR_LEN) {
+				fprintf(stderr, "bad packet on the wire\n");
+				exit(-1);
+			}
+			if (off + len > have)
+				break;
+			handle_pkt(buf + off, now);
+		}
+		have -= off;
+		memmove(buf, buf + off, have);
+	}
+	return NULL;
+}
+
+/* Delivers acks once the link says they've arrived. */
+static void *ack_thread(void *arg)
+{
+	struct cc_run *run = arg;
+	struct pending_ack *pa;
+	int fd;
+
+	fd = open(ifc_data_path, O_WRONLY);
+	if (fd < 0) {
+		perror("ipifc data");
+		exit(-1);
+	}
+	while (!run_stop) {
+		if (run->ack_cons == run->ack_prod) {
+			pthread_yield();
+			continue;
+		}
+		rmb();
+		pa = &run->acks[run->ack_cons % NR_ACKS];
+		if (now_usec() < pa->due) {
+			pthread_yield();
+			continue;
+		}
+		send_ack(fd, run, pa);
+		run->ack_cons++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *send_thread(void *arg)
+{
+	int fd = (int)(long)arg;
+	static char buf[1 << 16];
+
+	while (!run_stop) {
+		if (write(fd, buf, sizeof(buf)) <= 0)
+			break;
+	}
+	return NULL;
+}
+
+/* Announces on lport with the algorithm, and handshakes a connection to it.
+ * Returns the data fd of the accepted call. */
+static int connect_run(struct cc_run *run, char *alg, int *afd)
+{
+	uint8_t pkt[MAX_PKT];
+	char buf[64], adir[40], ldir[40];
+	int lcfd, dfd, len;
+
+	snprintf(buf, sizeof(buf), "tcp!*!%d", run->lport);
+	*afd = announce9(buf, adir, 0);
+	if (*afd < 0) {
+		perror("announce9");
+		exit(-1);
+	}
+	/* Calls inherit the listener's algorithm. */
+	len = snprintf(buf, sizeof(buf), "cong %s", alg);
+	if (write(*afd, buf, len) != len) {
+		perror(alg);
+		exit(-1);
+	}
+
+	synack_seen = FALSE;
+	send_syn(run->lport);
+	while (!synack_seen)
+		pthread_yield();
+	rmb();
+	run->irs = synack_seq;
+	len = build_pkt(pkt, run->lport, REMOTE_ISS + 1, run->irs + 1,
+	                TCP_FL_ACK, NULL, 0);
+	send_pkt(ifc_data_fd, pkt, len);
+
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0) {
+		perror("listen9");
+		exit(-1);
+	}
+	dfd = accept9(lcfd, ldir);
+	if (dfd < 0) {
+		perror("accept9");
+		exit(-1);
+	}
+	close(lcfd);
+	return dfd;
+}
+
+static void report(char *alg, struct cc_run *run)
+{
+	uint64_t link_bytes = (uint64_t)rate_mbps * 1000000 / 8 * BIN_MS / 1000;
+	uint64_t total = 0, rec, rec_sum = 0, rec_max = 0;
+	int nr_bins = (run->end - run->start) / (BIN_MS * 1000);
+	int bin, nr_rec = 0;
+
+	nr_bins = MIN(nr_bins, MAX_BINS);
+	for (int i = 0; i < nr_bins; i++)
+		total += run->bins[i];
+	for (int i = 0; i < run->nr_losses; i++) {
+		bin = (run->losses[i] - run->start) / (BIN_MS * 1000) + 1;
+		while (bin < nr_bins &&
+		       run->bins[bin] * 100 < link_bytes * RECOVERED_PCT)
+			bin++;
+		if (bin >= nr_bins)
+			break;
+		rec = (run->start + (uint64_t)(bin + 1) * BIN_MS * 1000 -
+		       run->losses[i]) / 1000;
+		rec_sum += rec;
+		rec_max = MAX(rec_max, rec);
+		nr_rec++;
+	}
+	printf("%-8s %10.1f %8d %8llu", alg,
+	       (double)total * 8 / (nr_bins * BIN_MS * 1000.0),
+	       run->nr_losses, (unsigned long long)run->nr_tail_drops);
+	if (nr_rec)
+		printf(" %12llu %12llu\n", (unsigned long long)(rec_sum / nr_rec),
+		       (unsigned long long)rec_max);
+	else
+		printf(" %12s %12s\n", "never", "never");
+}
+
+static void run_one(char *alg, uint16_t lport)
+{
+	struct cc_run *run = calloc(1, sizeof(struct cc_run));
+	pthread_t sender, acker;
+	uint8_t pkt[MAX_PKT];
+	int afd, dfd, len;
+
+	run->lport = lport;
+	run->bins = calloc(MAX_BINS, sizeof(uint64_t));
+	run->acks = calloc(NR_ACKS, sizeof(struct pending_ack));
+	run_stop = FALSE;
+	cur_run = run;
+	dfd = connect_run(run, alg, &afd);
+
+	run->start = now_usec();
+	run->link_free = run->start;
+	run->next_loss = run->start + (uint64_t)loss_ms * 1000;
+	if (pthread_create(&acker, NULL, ack_thread, run) ||
+	    pthread_create(&sender, NULL, send_thread, (void *)(long)dfd)) {
+		perror("pthread_create");
+		exit(-1);
+	}
+	uthread_sleep(run_secs);
+	run_stop = TRUE;
+	run->end = now_usec();
+	pthread_join(acker, NULL);
+
+	/* Kill the connection from our side, so the sender's write fails. */
+	len = build_pkt(pkt, lport, REMOTE_ISS + 1, 0, TCP_FL_RST, NULL, 0);
+	send_pkt(ifc_data_fd, pkt, len);
+	pthread_join(sender, NULL);
+	cur_run = NULL;
+
+	report(alg, run);
+	close(dfd);
+	close(afd);
+	free(run->acks);
+	free(run->bins);
+	free(run);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-r mbit/s] [-d rtt_ms] [-q queue_ms] [-l loss_ms] [-t secs] [alg ...]\n",
+	        prog);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	char *default_algs[] = {"reno", "cubic", "vegas"};
+	char **algs = default_algs;
+	int nr_algs = ARRAY_SIZE(default_algs);
+	char buf[128];
+	int ifc_ctl, ifc_id, ret, c;
+	pthread_t wire;
+
+	while ((c = getopt(argc, argv, "r:d:q:l:t:")) != -1) {
+		switch (c) {
+		case 'r':
+			rate_mbps = atoi(optarg);
+			break;
+		case 'd':
+			rtt_ms = atoi(optarg);
+			break;
+		case 'q':
+			queue_ms = atoi(optarg);
+			break;
+		case 'l':
+			loss_ms = atoi(optarg);
+			break;
+		case 't':
+			run_secs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!rate_mbps || !rtt_ms || !loss_ms || !run_secs)
+		usage(argv[0]);
+	if (!queue_ms)
+		queue_ms = rtt_ms;
+	if (optind < argc) {
+		algs = argv + optind;
+		nr_algs = argc - optind;
+	}
+	v4parseip(local_ip, LOCAL_ADDR);
+	v4parseip(remote_ip, REMOTE_ADDR);
+
+	ifc_ctl = open("/net/ipifc/clone", O_RDWR);
+	if (ifc_ctl < 0) {
+		perror("ipifc clone");
+		exit(-1);
+	}
+	ret = read(ifc_ctl, buf, sizeof(buf) - 1);
+	if (ret <= 0) {
+		perror("ipifc ctl read");
+		exit(-1);
+	}
+	buf[ret] = 0;
+	ifc_id = atoi(buf);
+	if (write(ifc_ctl, "bind pkt", 8) < 0) {
+		perror("bind pkt");
+		exit(-1);
+	}
+	ret = snprintf(buf, sizeof(buf), "add %s 255.255.255.0", LOCAL_ADDR);
+	if (write(ifc_ctl, buf, ret) < 0) {
+		perror("ipifc add");
+		exit(-1);
+	}
+	snprintf(ifc_data_path, sizeof(ifc_data_path), "/net/ipifc/%d/data",
+	         ifc_id);
+	ifc_data_fd = open(ifc_data_path, O_RDWR);
+	if (ifc_data_fd < 0) {
+		perror("ipifc data");
+		exit(-1);
+	}
+
+	/* The wire, the acker, and the sender each want a core to themselves,
+	 * so that the link's timing is what we say it is. */
+	parlib_never_yield = TRUE;
+	pthread_mcp_init();
+	vcore_request_total(4);
+	parlib_never_vc_request = TRUE;
+	if (pthread_create(&wire, NULL, wire_thread, NULL)) {
+		perror("pthread_create");
+		exit(-1);
+	}
+
+	printf("Link %u Mbit/s, RTT %u ms, queue %u ms, a loss every %u ms, %u sec per run\n",
+	       rate_mbps, rtt_ms, queue_ms, loss_ms, run_secs);
+	printf("%-8s %10s %8s %8s %12s %12s\n", "alg", "Mbit/s", "losses",
+	       "drops", "avg_rec_ms", "max_rec_ms");
+	for (int i = 0; i < nr_algs; i++)
+		run_one(algs[i], LISTEN_PORT_BASE + i);
+
+	/* The wire thread never returns; exit takes it down. */
+	close(ifc_data_fd);
+	close(ifc_ctl);
+	return 0;
+}
@@ -0,0 +1,285 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * tcp_rx_scale: measures how TCP input scales with cores.
+ *
+ * We bind a 'pkt' interface, which lets us write raw IP packets into the stack
+ * through the interface's data file.  Whatever the stack sends out that
+ * interface comes back on the same file.  We play the remote end of one TCP
+ * connection per thread, handshake each of them by hand, and then have every
+ * thread blast ACKs at its own connection.  A write to the data file runs
+ * ipiput4() and tcpiput() in the writer's context, so this measures how well
+ * input to independent connections runs in parallel.
+ *
+ * usage: tcp_rx_scale [max_threads] [msec_per_run] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/arch/arch.h>
+#include <parlib/timing.h>
+#include <parlib/tsc-compat.h>
+#include <iplib/iplib.h>
+
+#define LOCAL_ADDR		"10.254.0.1"
+#define REMOTE_ADDR		"10.254.0.2"
+#define LISTEN_PORT		5566
+#define REMOTE_PORT_BASE	20000
+#define TCP_FL_SYN		0x02
+#define TCP_FL_ACK		0x10
+#define PKT_SZ			(IPV4_HDR_LEN + TCP_HDR_LEN)
+
+struct rx_conn {
+	uint16_t			rport;
+	uint32_t			snd_nxt;
+	uint32_t			rcv_nxt;
+	int				data_fd;
+	uint8_t				ack_pkt[PKT_SZ];
+	uint64_t			nr_pkts;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static uint8_t local_ip[IPV4_ADDR_LEN], remote_ip[IPV4_ADDR_LEN];
+static char ifc_data_path[64];
+static int ifc_data_fd;
+static uint64_t run_deadline;
+
+static void build_pkt(uint8_t *pkt, uint16_t rport, uint32_t seq, uint32_t ack,
+                      uint8_t flags)
+{
+	uint8_t *ip = pkt, *tcp = pkt + IPV4_HDR_LEN;
+	uint8_t pseudo[12 + TCP_HDR_LEN];
+
+	memset(pkt, 0, PKT_SZ);
+	ip[0] = 0x45;
+	hnputs(ip + IPV4_OFF_LEN, PKT_SZ);
+	ip[IPV4_OFF_TTL] = 64;
+	ip[IPV4_OFF_PROTO] = IP_TCPPROTO;
+	memcpy(ip + IPV4_OFF_SRC, remote_ip, IPV4_ADDR_LEN);
+	memcpy(ip + IPV4_OFF_DST, local_ip, IPV4_ADDR_LEN);
+	hnputs(ip + IPV4_OFF_XSUM, ip_calc_xsum(ip, IPV4_HDR_LEN));
+
+	hnputs(tcp + TCP_OFF_SRC_PORT, rport);
+	hnputs(tcp + TCP_OFF_DST_PORT, LISTEN_PORT);
+	hnputl(tcp + TCP_OFF_SEQ, seq);
+	hnputl(tcp + TCP_OFF_ACK, ack);
+	tcp[TCP_OFF_DATA] = (TCP_HDR_LEN / 4) << 4;
+	tcp[TCP_OFF_FL + 1] = flags;
+	hnputs(tcp + TCP_OFF_WIN, 65535);
+
+	memcpy(pseudo, remote_ip, IPV4_ADDR_LEN);
+	memcpy(pseudo + 4, local_ip, IPV4_ADDR_LEN);
+	pseudo[8] = 0;
+	pseudo[9] = IP_TCPPROTO;
+	hnputs(pseudo + 10, TCP_HDR_LEN);
+	memcpy(pseudo + 12, tcp, TCP_HDR_LEN);
+	hnputs(tcp + TCP_OFF_XSUM, ip_calc_xsum(pseudo, sizeof(pseudo)));
+}
+
+static void send_pkt(int fd, uint8_t *pkt)
+{
+	if (write(fd, pkt, PKT_SZ) != PKT_SZ) {
+		perror("pkt write");
+		exit(-1);
+	}
+}
+
+/* Reads from the interface until we see the SYN-ACK for rport.  The data file
+ * is a byte stream, so a read can return more than one packet. */
+static uint32_t wait_for_synack(uint16_t rport)
+{
+	uint8_t buf[4096], *ip, *tcp;
+	int ret, off, len;
+
+	for (;;) {
+		ret = read(ifc_data_fd, buf, sizeof(buf));
+		if (ret <= 0) {
+			perror("pkt read");
+			exit(-1);
+		}
+		for (off = 0; off + IPV4_HDR_LEN <= ret; off += len) {
+			ip = buf + off;
+			len = nhgets(ip + IPV4_OFF_LEN);
+			if (len < IPV4_HDR_LEN || off + len > ret)
+				break;
+			if ((ip[0] >> 4) != 4 || ip[IPV4_OFF_PROTO] != IP_TCPPROTO)
+				continue;
+			tcp = ip + (ip[0] & 0xf) * 4;
+			if (nhgets(tcp + TCP_OFF_DST_PORT) != rport)
+				continue;
+			if ((tcp[TCP_OFF_FL + 1] & (TCP_FL_SYN | TCP_FL_ACK)) !=
+			    (TCP_FL_SYN | TCP_FL_ACK))
+				continue;
+			return nhgetl(tcp + TCP_OFF_SEQ);
+		}
+	}
+}
+
+/* Handshakes conn with our listener, then accepts it so the listener's incall
+ * queue doesn't fill up. */
+static void connect_one(struct rx_conn *conn, char *adir)
+{
+	uint8_t pkt[PKT_SZ];
+	char ldir[40];
+	int lcfd;
+
+	build_pkt(pkt, conn->rport, conn->snd_nxt, 0, TCP_FL_SYN);
+	send_pkt(ifc_data_fd, pkt);
+	conn->snd_nxt++;
+	conn->rcv_nxt = wait_for_synack(conn->rport) + 1;
+	build_pkt(conn->ack_pkt, conn->rport, conn->snd_nxt, conn->rcv_nxt,
+	          TCP_FL_ACK);
+	send_pkt(ifc_data_fd, conn->ack_pkt);
+
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0) {
+		perror("listen9");
+		exit(-1);
+	}
+	conn->data_fd = accept9(lcfd, ldir);
+	if (conn->data_fd < 0) {
+		perror("accept9");
+		exit(-1);
+	}
+	close(lcfd);
+}
+
+static void *blast_acks(void *arg)
+{
+	struct rx_conn *conn = arg;
+	int fd;
+
+	/* Each thread gets its own chan, so they don't share an fd. */
+	fd = open(ifc_data_path, O_WRONLY);
+	if (fd < 0) {
+		perror("ipifc data");
+		exit(-1);
+	}
+	conn->nr_pkts = 0;
+	while (read_tsc() < run_deadline) {
+		send_pkt(fd, conn->ack_pkt);
+		conn->nr_pkts++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static uint64_t run_once(struct rx_conn *conns, int nr_threads,
+                         unsigned int msec)
+{
+	pthread_t *threads = malloc(sizeof(pthread_t) * nr_threads);
+	uint64_t total = 0;
+
+	run_deadline = read_tsc() + msec2tsc(msec);
+	for (int i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, blast_acks, &conns[i])) {
+			perror("pthread_create");
+			exit(-1);
+		}
+	}
+	for (int i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+		total += conns[i].nr_pkts;
+	}
+	free(threads);
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = max_vcores();
+	unsigned int msec = 1000;
+	struct rx_conn *conns;
+	char buf[128], adir[40];
+	int ifc_ctl, ifc_id, afd, ret;
+	uint64_t pkts, base_pkts = 0;
+
+	if (argc > 1)
+		max_threads = MIN(atoi(argv[1]), max_vcores());
+	if (argc > 2)
+		msec = atoi(argv[2]);
+	if (max_threads < 1 || !msec) {
+		fprintf(stderr, "usage: %s [max_threads] [msec_per_run]\n",
+		        argv[0]);
+		exit(-1);
+	}
+	v4parseip(local_ip, LOCAL_ADDR);
+	v4parseip(remote_ip, REMOTE_ADDR);
+
+	ifc_ctl = open("/net/ipifc/clone", O_RDWR);
+	if (ifc_ctl < 0) {
+		perror("ipifc clone");
+		exit(-1);
+	}
+	ret = read(ifc_ctl, buf, sizeof(buf) - 1);
+	if (ret <= 0) {
+		perror("ipifc ctl read");
+		exit(-1);
+	}
+	buf[ret] = 0;
+	ifc_id = atoi(buf);
+	if (write(ifc_ctl, "bind pkt", 8) < 0) {
+		perror("bind pkt");
+		exit(-1);
+	}
+	ret = snprintf(buf, sizeof(buf), "add %s 255.255.255.0", LOCAL_ADDR);
+	if (write(ifc_ctl, buf, ret) < 0) {
+		perror("ipifc add");
+		exit(-1);
+	}
+	snprintf(ifc_data_path, sizeof(ifc_data_path), "/net/ipifc/%d/data",
+	         ifc_id);
+	ifc_data_fd = open(ifc_data_path, O_RDWR);
+	if (ifc_data_fd < 0) {
+		perror("ipifc data");
+		exit(-1);
+	}
+
+	snprintf(buf, sizeof(buf), "tcp!*!%d", LISTEN_PORT);
+	afd = announce9(buf, adir, 0);
+	if (afd < 0) {
+		perror("announce9");
+		exit(-1);
+	}
+
+	conns = calloc(max_threads, sizeof(struct rx_conn));
+	for (int i = 0; i < max_threads; i++) {
+		conns[i].rport = REMOTE_PORT_BASE + i;
+		conns[i].snd_nxt = 1000000 * (i + 1);
+		connect_one(&conns[i], adir);
+	}
+
+	parlib_never_yield = TRUE;
+	pthread_need_tls(FALSE);
+	pthread_mcp_init();
+	vcore_request_total(max_threads);
+	parlib_never_vc_request = TRUE;
+
+	printf("TCP input, %d msec per run\n", msec);
+	printf("%8s %14s %10s\n", "threads", "pkts/sec", "speedup");
+	for (int n = 1; ; n = MIN(n * 2, max_threads)) {
+		pkts = run_once(conns, n, msec) * 1000 / msec;
+		if (n == 1)
+			base_pkts = pkts;
+		printf("%8d %14llu %9.2fx\n", n, (unsigned long long)pkts,
+		       (double)pkts / base_pkts);
+		if (n == max_threads)
+			break;
+	}
+
+	for (int i = 0; i < max_threads; i++)
+		close(conns[i].data_fd);
+	free(conns);
+	close(afd);
+	close(ifc_data_fd);
+	/* pkt interfaces unbind when their ctl is closed. */
+	close(ifc_ctl);
+	return 0;
+}
@@ -0,0 +1,84 @@
+/* Copyright (c) 2026 Google Inc.
+ * See LICENSE for details.
+ *
+ * writeback_bench: measures buffered write throughput and the cost of the
+ * writeback behind it.
+ *
+ * usage: writeback_bench [-m MB] [-b buf_sz] FILE
+ *
+ * Writes MB (default 256) to FILE in buf_sz (default 65536) writes, then
+ * fsync()s.  Writes go to the page cache; the writeback ktask flushes them in
+ * the background and throttles us if we dirty too much.  The fsync time is
+ * whatever writeback was left.  On #gtfs, compare the PM's write op count
+ * (CCTL_DEBUG, e.g. tests/chan_debug) to the number of pages to see the
+ * coalescing. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/param.h>
+
+#include <parlib/parlib.h>
+#include <parlib/tsc-compat.h>
+
+int main(int argc, char **argv)
+{
+	size_t mb = 256, buf_sz = 65536, len, amt;
+	uint64_t start, write_usec, sync_usec;
+	ssize_t ret;
+	char *buf;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "m:b:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mb = strtoul(optarg, 0, 0);
+			break;
+		case 'b':
+			buf_sz = strtoul(optarg, 0, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || !buf_sz || !mb)
+		goto usage;
+	len = mb << 20;
+	buf = malloc(buf_sz);
+	assert(buf);
+	memset(buf, 0xab, buf_sz);
+	fd = open(argv[optind], O_WRITE | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		exit(-1);
+	}
+
+	start = read_tsc();
+	for (size_t i = 0; i < len; i += amt) {
+		amt = MIN(buf_sz, len - i);
+		ret = write(fd, buf, amt);
+		if (ret != amt) {
+			perror("write");
+			exit(-1);
+		}
+	}
+	write_usec = MAX(tsc2usec(read_tsc() - start), 1);
+	start = read_tsc();
+	if (fsync(fd)) {
+		perror("fsync");
+		exit(-1);
+	}
+	sync_usec = tsc2usec(read_tsc() - start);
+
+	printf("%lu MB: write %llu MB/s (%llu usec), fsync %llu usec\n", mb,
+	       len / write_usec, write_usec, sync_usec);
+	free(buf);
+	close(fd);
+	return 0;
+usage:
+	fprintf(stderr, "usage: %s [-m MB] [-b buf_sz] FILE\n", argv[0]);
+	exit(-1);
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <sys/tls.h>
 #include <parlib/vcore.h>
 #include <ldsodefs.h>
@@ -13,13 +14,9 @@ void *get_tls_desc(void)
 	return __get_tls_desc();
 }
 
-/* Get a TLS, returns 0 on failure.  Vcores have their own TLS, and any thread
- * created by a user-level scheduler needs to create a TLS as well. */
-void *allocate_tls(void)
+/* Sets up the parts of the TCB that _dl_allocate_tls() doesn't. */
+static void __init_tcb_head(void *tcb)
 {
-	void *tcb = _dl_allocate_tls(NULL);
-	if (!tcb)
-		return 0;
 #ifdef TLS_TCB_AT_TP
 	/* Make sure the TLS is set up properly - its tcb pointer points to
 	 * itself.  Keep this in sync with sysdeps/akaros/XXX/tls.h.  For
@@ -31,6 +28,16 @@ void *allocate_tls(void)
 	head->pointer_guard = THREAD_SELF->header.pointer_guard;
 	head->stack_guard = THREAD_SELF->header.stack_guard;
 #endif
+}
+
+/* Get a TLS, returns 0 on failure.  Vcores have their own TLS, and any thread
+ * created by a user-level scheduler needs to create a TLS as well. */
+void *allocate_tls(void)
+{
+	void *tcb = _dl_allocate_tls(NULL);
+	if (!tcb)
+		return 0;
+	__init_tcb_head(tcb);
 	return tcb;
 }
 
@@ -40,13 +47,40 @@ void free_tls(void *tcb)
 	_dl_deallocate_tls(tcb, TRUE);
 }
 
-/* Reinitialize / reset / refresh a TLS to its initial values.  This doesn't do
- * it properly yet, it merely frees and re-allocates the TLS, which is why we're
- * slightly ghetto and return the pointer you should use for the TCB. */
+/* Reinitialize / reset / refresh a TLS to its initial values, returning the
+ * pointer you should use for the TCB.  We reuse the TLS in place, which lets
+ * 2LSs cache TLSs for new threads without going back to malloc.  If modules
+ * were loaded since the TLS was made, its dtv might be too small, so we fall
+ * back to freeing and reallocating. */
 void *reinit_tls(void *tcb)
 {
+	dtv_t *dtv = GET_DTV(tcb);
+
 	/* TODO: keep this in sync with the methods used in
 	 * allocate_transition_tls() */
-	free_tls(tcb);
-	return allocate_tls();
+	if (GL(dl_tls_max_dtv_idx) > dtv[-1].counter) {
+		free_tls(tcb);
+		return allocate_tls();
+	}
+	/* Free the blocks of dynamically loaded modules, like
+	 * _dl_deallocate_tls(), but keep the dtv and the static TLS.
+	 * _dl_allocate_tls_init() skips the slots of dlclosed modules, so we
+	 * mark the slots unallocated ourselves; o/w they'd get freed again. */
+	for (size_t cnt = 0; cnt < dtv[-1].counter; ++cnt) {
+		if (!dtv[1 + cnt].pointer.is_static
+		    && dtv[1 + cnt].pointer.val != TLS_DTV_UNALLOCATED) {
+			free(dtv[1 + cnt].pointer.val);
+			dtv[1 + cnt].pointer.val = TLS_DTV_UNALLOCATED;
+			dtv[1 + cnt].pointer.is_static = false;
+		}
+	}
+#ifdef TLS_TCB_AT_TP
+	/* _dl_allocate_tls() hands out a zeroed TCB */
+	memset(tcb, 0, TLS_TCB_SIZE);
+	INSTALL_DTV(tcb, dtv - 1);
+#endif
+	/* Recopies the static TLS images and resets the dtv */
+	tcb = _dl_allocate_tls_init(tcb);
+	__init_tcb_head(tcb);
+	return tcb;
 }
@@ -58,11 +58,29 @@ int sys_poke_ksched(int pid, unsigned int res_type);
 int sys_abort_sysc(struct syscall *sysc);
 int sys_abort_sysc_fd(int fd);
 int sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs);
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
 
 void syscall_async(struct syscall *sysc, unsigned long num, ...);
 void syscall_async_evq(struct syscall *sysc, struct event_queue *evq, unsigned
 		       long num, ...);
 
+/* Batches of async syscalls, submitted with a single trap.  The caller owns the
+ * array of syscalls, which must stay put until each one is SC_DONE.  Each sysc
+ * completes on its own, in no particular order. */
+struct sysc_batch {
+	struct syscall			*syscs;
+	unsigned int			nr;
+	unsigned int			max;
+};
+
+void sysc_batch_init(struct sysc_batch *b, struct syscall *syscs,
+                     unsigned int max);
+struct syscall *sysc_batch_add(struct sysc_batch *b, unsigned long num, ...);
+struct syscall *sysc_batch_add_evq(struct sysc_batch *b,
+                                   struct event_queue *evq,
+                                   unsigned long num, ...);
+void sysc_batch_submit(struct sysc_batch *b);
+
 /* Control variables */
 extern bool parlib_wants_to_be_mcp;	/* instructs the 2LS to be an MCP */
 extern bool parlib_never_yield;	/* instructs the 2LS to not yield vcores */
@@ -149,6 +149,13 @@ struct uth_join_request {
 	void				**retval_loc;
 };
 
+/* Max number of TLSs from exited uthreads each vcore keeps for new uthreads.
+ * 0 turns off the caching. */
+extern unsigned int uth_tls_cache_sz;
+/* 2LSs call this from vcore context each time vcoreid is about to yield.  A
+ * vcore that keeps yielding without making uthreads gives its TLSs back. */
+void uth_tls_cache_trim(uint32_t vcoreid);
+
 /* uthread_init() does the uthread initialization of a uthread that the caller
  * created.  Call this whenever you are "starting over" with a thread.  Pass in
  * attr, if you want to override any defaults. */
@@ -236,7 +243,7 @@ static inline bool uthread_is_thread0(struct uthread *uth)
 /* Uthread Mutexes / CVs / etc. */
 
 typedef struct uth_semaphore uth_semaphore_t;
-typedef struct uth_semaphore uth_mutex_t;
+typedef struct uth_mutex uth_mutex_t;
 typedef struct uth_recurse_mutex uth_recurse_mutex_t;
 typedef struct uth_cond_var uth_cond_var_t;
 typedef struct uth_rwlock uth_rwlock_t;
@@ -248,6 +255,15 @@ struct uth_semaphore {
 	uth_sync_t			sync_obj;
 };
 #define UTH_SEMAPHORE_INIT(n) { PARLIB_ONCE_INIT, (n) }
+
+/* Uncontended mutexes only touch state; the rest is for sleepers. */
+struct uth_mutex {
+	parlib_once_t			once_ctl;
+	uint32_t			state;
+	uint32_t			owner_vcoreid;	/* hint for spinners */
+	struct spin_pdr_lock		lock;
+	uth_sync_t			sync_obj;
+};
 #define UTH_MUTEX_INIT { PARLIB_ONCE_INIT }
 
 struct uth_recurse_mutex {
@@ -267,9 +283,8 @@ struct uth_cond_var {
 
 struct uth_rwlock {
 	parlib_once_t			once_ctl;
+	uint32_t			state;	/* nr_readers, writer, waiters */
 	struct spin_pdr_lock		lock;
-	unsigned int			nr_readers;
-	bool				has_writer;
 	uth_sync_t			readers;
 	uth_sync_t			writers;
 };
@@ -285,6 +300,10 @@ void uth_semaphore_down(uth_semaphore_t *sem);
 bool uth_semaphore_trydown(uth_semaphore_t *sem);
 void uth_semaphore_up(uth_semaphore_t *sem);
 
+/* How many times a mutex locker polls a lockholder that is running on another
+ * vcore before going to sleep. */
+extern unsigned int uth_mutex_spins;
+
 void uth_mutex_init(uth_mutex_t *m);
 void uth_mutex_destroy(uth_mutex_t *m);
 uth_mutex_t *uth_mutex_alloc(void);
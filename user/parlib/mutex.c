@@ -6,6 +6,8 @@
  * functions.  2LSs implement their own sync objects (bottom of the file). */
 
 #include <parlib/uthread.h>
+#include <parlib/vcore.h>
+#include <parlib/arch/atomic.h>
 #include <sys/queue.h>
 #include <parlib/spinlock.h>
 #include <parlib/alarm.h>
@@ -54,7 +56,7 @@ static void set_timeout_alarm(struct alarm_waiter *waiter,
 	set_alarm(waiter);
 }
 
-/************** Semaphores and Mutexes **************/
+/************** Semaphores **************/
 
 static void __uth_semaphore_init(void *arg)
 {
@@ -186,34 +188,52 @@ void uth_semaphore_up(uth_semaphore_t *sem)
 		uthread_runnable(uth);
 }
 
+/************** Mutexes **************/
+
+/* A mutex's fast path is a single CAS on its state, which works on a statically
+ * initialized mutex too: only sleepers need the spinlock and sync_obj, so we
+ * initialize those with the once_ctl on the slow path.
+ *
+ * A locker that misses spins for a while, so long as the lockholder's vcore is
+ * running and no one is sleeping, hoping the holder unlocks soon.  Then it sets
+ * CONTENDED and sleeps.  Unlockers that see CONTENDED hand the mutex directly
+ * to a sleeper, the same way semaphores pass along their count. */
+#define UTH_MTX_UNLOCKED	0
+#define UTH_MTX_LOCKED		1
+#define UTH_MTX_CONTENDED	2	/* locked, and there may be sleepers */
+
+unsigned int uth_mutex_spins = 1000;
+
 /* Takes a void * since it's called by parlib_run_once(), which enables us to
  * statically initialize the mutex.  This init does everything not done by the
  * static initializer.  Note we do not allow 'static' destruction.  (No one
  * calls free). */
 static void __uth_mutex_init(void *arg)
 {
-	struct uth_semaphore *mtx = (struct uth_semaphore*)arg;
+	struct uth_mutex *mtx = (struct uth_mutex*)arg;
 
-	__uth_semaphore_init(mtx);
-	mtx->count = 1;
+	spin_pdr_init(&mtx->lock);
+	__uth_sync_init(&mtx->sync_obj);
 }
 
 void uth_mutex_init(uth_mutex_t *mtx)
 {
+	mtx->state = UTH_MTX_UNLOCKED;
+	mtx->owner_vcoreid = 0;
 	__uth_mutex_init(mtx);
 	parlib_set_ran_once(&mtx->once_ctl);
 }
 
 void uth_mutex_destroy(uth_mutex_t *mtx)
 {
-	uth_semaphore_destroy(mtx);
+	__uth_sync_destroy(&mtx->sync_obj);
 }
 
 uth_mutex_t *uth_mutex_alloc(void)
 {
-	struct uth_semaphore *mtx;
+	struct uth_mutex *mtx;
 
-	mtx = malloc(sizeof(struct uth_semaphore));
+	mtx = malloc(sizeof(struct uth_mutex));
 	assert(mtx);
 	uth_mutex_init(mtx);
 	return mtx;
@@ -221,30 +241,122 @@ uth_mutex_t *uth_mutex_alloc(void)
 
 void uth_mutex_free(uth_mutex_t *mtx)
 {
-	uth_semaphore_free(mtx);
+	uth_mutex_destroy(mtx);
+	free(mtx);
+}
+
+static bool __uth_mutex_trylock(struct uth_mutex *mtx)
+{
+	if (!atomic_cas_u32(&mtx->state, UTH_MTX_UNLOCKED, UTH_MTX_LOCKED))
+		return FALSE;
+	mtx->owner_vcoreid = vcore_id();
+	return TRUE;
+}
+
+/* Spinning only helps if the lockholder is running on another vcore and no one
+ * is sleeping; sleepers get the mutex handed to them, so it never looks
+ * unlocked. */
+static bool __uth_mutex_should_spin(struct uth_mutex *mtx)
+{
+	uint32_t owner_vcoreid = ACCESS_ONCE(mtx->owner_vcoreid);
+
+	if (ACCESS_ONCE(mtx->state) == UTH_MTX_CONTENDED)
+		return FALSE;
+	if (!in_multi_mode() || owner_vcoreid == vcore_id())
+		return FALSE;
+	return vcore_is_mapped(owner_vcoreid) &&
+	       !vcore_is_preempted(owner_vcoreid);
+}
+
+static bool __uth_mutex_spin_lock(struct uth_mutex *mtx)
+{
+	for (unsigned int i = 0; i < uth_mutex_spins; i++) {
+		if (ACCESS_ONCE(mtx->state) == UTH_MTX_UNLOCKED &&
+		    __uth_mutex_trylock(mtx))
+			return TRUE;
+		if (!__uth_mutex_should_spin(mtx))
+			return FALSE;
+		cpu_relax();
+	}
+	return FALSE;
+}
+
+static void __mutex_cb(struct uthread *uth, void *arg)
+{
+	struct uth_mutex *mtx = (struct uth_mutex*)arg;
+
+	/* Same as semaphores: tell the 2LS before unlocking, and the mutex lock
+	 * is grabbed before any locks the 2LS might grab. */
+	uthread_has_blocked(uth, UTH_EXT_BLK_MUTEX);
+	__uth_sync_enqueue(uth, &mtx->sync_obj);
+	spin_pdr_unlock(&mtx->lock);
 }
 
 bool uth_mutex_timed_lock(uth_mutex_t *mtx, const struct timespec *abs_timeout)
 {
+	struct alarm_waiter waiter[1];
+	struct timeout_blob blob[1];
+
+	assert_can_block();
+	if (__uth_mutex_trylock(mtx) || __uth_mutex_spin_lock(mtx))
+		return TRUE;
 	parlib_run_once(&mtx->once_ctl, __uth_mutex_init, mtx);
-	return uth_semaphore_timed_down(mtx, abs_timeout);
+	spin_pdr_lock(&mtx->lock);
+	/* Once we say CONTENDED, unlockers will take the slow path and find us
+	 * on the sync_obj.  If it was unlocked, it's ours, and no one is asleep
+	 * (they'd have been handed the mutex), so it's just LOCKED. */
+	if (atomic_swap_u32(&mtx->state, UTH_MTX_CONTENDED) ==
+	    UTH_MTX_UNLOCKED) {
+		mtx->state = UTH_MTX_LOCKED;
+		spin_pdr_unlock(&mtx->lock);
+		mtx->owner_vcoreid = vcore_id();
+		return TRUE;
+	}
+	if (abs_timeout) {
+		set_timeout_blob(blob, &mtx->sync_obj, &mtx->lock);
+		set_timeout_alarm(waiter, blob, abs_timeout);
+	}
+	uthread_yield(TRUE, __mutex_cb, mtx);
+	if (abs_timeout) {
+		/* We're guaranteed the alarm will either be cancelled or the
+		 * handler complete when unset_alarm() returns. */
+		unset_alarm(waiter);
+		if (blob->timed_out)
+			return FALSE;
+	}
+	/* The unlocker handed us the mutex */
+	mtx->owner_vcoreid = vcore_id();
+	return TRUE;
 }
 
 void uth_mutex_lock(uth_mutex_t *mtx)
 {
-	parlib_run_once(&mtx->once_ctl, __uth_mutex_init, mtx);
-	uth_semaphore_down(mtx);
+	uth_mutex_timed_lock(mtx, NULL);
 }
 
 bool uth_mutex_trylock(uth_mutex_t *mtx)
 {
-	parlib_run_once(&mtx->once_ctl, __uth_mutex_init, mtx);
-	return uth_semaphore_trydown(mtx);
+	assert_can_block();
+	return __uth_mutex_trylock(mtx);
 }
 
+/* Safe to call from vcore context; CVs unlock from their yield callback. */
 void uth_mutex_unlock(uth_mutex_t *mtx)
 {
-	uth_semaphore_up(mtx);
+	struct uthread *uth;
+
+	if (atomic_cas_u32(&mtx->state, UTH_MTX_LOCKED, UTH_MTX_UNLOCKED))
+		return;
+	/* CONTENDED, so whoever set it ran the once. */
+	spin_pdr_lock(&mtx->lock);
+	uth = __uth_sync_get_next(&mtx->sync_obj);
+	if (!uth)
+		mtx->state = UTH_MTX_UNLOCKED;
+	else if (__uth_sync_is_empty(&mtx->sync_obj))
+		mtx->state = UTH_MTX_LOCKED;
+	spin_pdr_unlock(&mtx->lock);
+	if (uth)
+		uthread_runnable(uth);
 }
 
 /************** Recursive mutexes **************/
@@ -253,11 +365,7 @@ static void __uth_recurse_mutex_init(void *arg)
 {
 	struct uth_recurse_mutex *r_mtx = (struct uth_recurse_mutex*)arg;
 
-	__uth_mutex_init(&r_mtx->mtx);
-	/* Since we always manually call __uth_mutex_init(), there's no reason
-	 * to mess with the regular mutex's static initializer.  Just say it's
-	 * been done. */
-	parlib_set_ran_once(&r_mtx->mtx.once_ctl);
+	uth_mutex_init(&r_mtx->mtx);
 	r_mtx->lockholder = NULL;
 	r_mtx->count = 0;
 }
@@ -270,7 +378,7 @@ void uth_recurse_mutex_init(uth_recurse_mutex_t *r_mtx)
 
 void uth_recurse_mutex_destroy(uth_recurse_mutex_t *r_mtx)
 {
-	uth_semaphore_destroy(&r_mtx->mtx);
+	uth_mutex_destroy(&r_mtx->mtx);
 }
 
 uth_recurse_mutex_t *uth_recurse_mutex_alloc(void)
@@ -293,8 +401,10 @@ bool uth_recurse_mutex_timed_lock(uth_recurse_mutex_t *r_mtx,
                                   const struct timespec *abs_timeout)
 {
 	assert_can_block();
-	parlib_run_once(&r_mtx->once_ctl, __uth_recurse_mutex_init, r_mtx);
-	/* We don't have to worry about races on current_uthread or count.  They
+	/* No once: a statically initialized r_mtx is already unlocked, with no
+	 * lockholder, and the mutex handles its own initialization.
+	 *
+	 * We don't have to worry about races on current_uthread or count.  They
 	 * are only written by the initial lockholder, and this check will only
 	 * be true for the initial lockholder, which cannot concurrently call
 	 * this function twice (a thread is single-threaded).
@@ -323,7 +433,6 @@ bool uth_recurse_mutex_trylock(uth_recurse_mutex_t *r_mtx)
 	bool ret;
 
 	assert_can_block();
-	parlib_run_once(&r_mtx->once_ctl, __uth_recurse_mutex_init, r_mtx);
 	if (r_mtx->lockholder == current_uthread) {
 		r_mtx->count++;
 		return TRUE;
@@ -386,14 +495,14 @@ void uth_cond_var_free(uth_cond_var_t *cv)
 
 struct uth_cv_link {
 	struct uth_cond_var			*cv;
-	struct uth_semaphore		*mtx;
+	struct uth_mutex			*mtx;
 };
 
 static void __cv_wait_cb(struct uthread *uth, void *arg)
 {
 	struct uth_cv_link *link = (struct uth_cv_link*)arg;
 	struct uth_cond_var *cv = link->cv;
-	struct uth_semaphore *mtx = link->mtx;
+	struct uth_mutex *mtx = link->mtx;
 
 	/* We need to tell the 2LS that its thread blocked.  We need to do this
 	 * before unlocking the cv, since as soon as we unlock, the cv could be
@@ -469,8 +578,8 @@ static void __cv_wait_cb(struct uthread *uth, void *arg)
  * mutex to avoid the races mentioned above.
  *
  * As far as lock ordering goes, once the sleeper holds the mutex and is on the
- * CV's list, it can unlock in any order it wants.  However, unlocking a mutex
- * actually requires grabbing its spinlock.  So as to not have a lock ordering
+ * CV's list, it can unlock in any order it wants.  However, unlocking a
+ * contended mutex requires grabbing its spinlock.  So as to not have a lock ordering
  * between *spinlocks*, we let go of the CV's spinlock before unlocking the
  * mutex.  There is an ordering between the mutex and the CV spinlock (mutex->cv
  * spin), but there is no ordering between the mutex spin and cv spin.  And of
@@ -624,20 +733,28 @@ void uth_cond_var_unlock(uth_cond_var_t *cv)
 
 /************** Reader-writer Sleeping Locks **************/
 
+/* The state is the number of readers, plus bits for a writer holding the lock
+ * and for sleepers.  Uncontended read locks and unlocks are a CAS on the count,
+ * and uncontended write locks and unlocks are a CAS between 0 and WRITER.
+ * Anyone who sleeps first sets WAITERS (with the spinlock held), which sends
+ * the unlockers down the slow path to wake them.  While WRITER is set, only the
+ * writer's fast unlock or someone holding the spinlock changes the state. */
+#define UTH_RWL_WRITER		(1U << 31)
+#define UTH_RWL_WAITERS		(1U << 30)
+#define UTH_RWL_READERS		(UTH_RWL_WAITERS - 1)
 
 static void __uth_rwlock_init(void *arg)
 {
 	struct uth_rwlock *rwl = (struct uth_rwlock*)arg;
 
 	spin_pdr_init(&rwl->lock);
-	rwl->nr_readers = 0;
-	rwl->has_writer = FALSE;
 	__uth_sync_init(&rwl->readers);
 	__uth_sync_init(&rwl->writers);
 }
 
 void uth_rwlock_init(uth_rwlock_t *rwl)
 {
+	rwl->state = 0;
 	__uth_rwlock_init(rwl);
 	parlib_set_ran_once(&rwl->once_ctl);
 }
@@ -664,6 +781,49 @@ void uth_rwlock_free(uth_rwlock_t *rwl)
 	free(rwl);
 }
 
+static bool __uth_rwlock_try_rdlock(struct uth_rwlock *rwl)
+{
+	uint32_t state;
+
+	do {
+		state = ACCESS_ONCE(rwl->state);
+		/* Readers always make progress when there is no writer */
+		if (state & UTH_RWL_WRITER)
+			return FALSE;
+	} while (!atomic_cas_u32(&rwl->state, state, state + 1));
+	return TRUE;
+}
+
+static bool __uth_rwlock_try_wrlock(struct uth_rwlock *rwl)
+{
+	uint32_t state;
+
+	do {
+		state = ACCESS_ONCE(rwl->state);
+		/* Writers require total mutual exclusion - no writers or
+		 * readers */
+		if (state & (UTH_RWL_WRITER | UTH_RWL_READERS))
+			return FALSE;
+	} while (!atomic_cas_u32(&rwl->state, state, state | UTH_RWL_WRITER));
+	return TRUE;
+}
+
+/* Caller holds the spinlock.  Sets WAITERS, so long as the lock is still held
+ * in a way that blocks us (any of busy_bits).  Returns FALSE if it isn't, and
+ * the caller should try to lock again. */
+static bool __uth_rwlock_set_waiters(struct uth_rwlock *rwl,
+                                     uint32_t busy_bits)
+{
+	uint32_t state;
+
+	do {
+		state = ACCESS_ONCE(rwl->state);
+		if (!(state & busy_bits))
+			return FALSE;
+	} while (!atomic_cas_u32(&rwl->state, state, state | UTH_RWL_WAITERS));
+	return TRUE;
+}
+
 /* Readers and writers block until they have the lock.  The delicacies are dealt
  * with by the unlocker. */
 static void __rwlock_rd_cb(struct uthread *uth, void *arg)
@@ -678,30 +838,23 @@ static void __rwlock_rd_cb(struct uthread *uth, void *arg)
 void uth_rwlock_rdlock(uth_rwlock_t *rwl)
 {
 	assert_can_block();
+	if (__uth_rwlock_try_rdlock(rwl))
+		return;
 	parlib_run_once(&rwl->once_ctl, __uth_rwlock_init, rwl);
 	spin_pdr_lock(&rwl->lock);
-	/* Readers always make progress when there is no writer */
-	if (!rwl->has_writer) {
-		rwl->nr_readers++;
-		spin_pdr_unlock(&rwl->lock);
-		return;
+	while (!__uth_rwlock_try_rdlock(rwl)) {
+		if (__uth_rwlock_set_waiters(rwl, UTH_RWL_WRITER)) {
+			uthread_yield(TRUE, __rwlock_rd_cb, rwl);
+			return;
+		}
 	}
-	uthread_yield(TRUE, __rwlock_rd_cb, rwl);
+	spin_pdr_unlock(&rwl->lock);
 }
 
 bool uth_rwlock_try_rdlock(uth_rwlock_t *rwl)
 {
-	bool ret = FALSE;
-
 	assert_can_block();
-	parlib_run_once(&rwl->once_ctl, __uth_rwlock_init, rwl);
-	spin_pdr_lock(&rwl->lock);
-	if (!rwl->has_writer) {
-		rwl->nr_readers++;
-		ret = TRUE;
-	}
-	spin_pdr_unlock(&rwl->lock);
-	return ret;
+	return __uth_rwlock_try_rdlock(rwl);
 }
 
 static void __rwlock_wr_cb(struct uthread *uth, void *arg)
@@ -716,76 +869,114 @@ static void __rwlock_wr_cb(struct uthread *uth, void *arg)
 void uth_rwlock_wrlock(uth_rwlock_t *rwl)
 {
 	assert_can_block();
+	if (__uth_rwlock_try_wrlock(rwl))
+		return;
 	parlib_run_once(&rwl->once_ctl, __uth_rwlock_init, rwl);
 	spin_pdr_lock(&rwl->lock);
-	/* Writers require total mutual exclusion - no writers or readers */
-	if (!rwl->has_writer && !rwl->nr_readers) {
-		rwl->has_writer = TRUE;
-		spin_pdr_unlock(&rwl->lock);
-		return;
+	while (!__uth_rwlock_try_wrlock(rwl)) {
+		if (__uth_rwlock_set_waiters(rwl, UTH_RWL_WRITER |
+		                                  UTH_RWL_READERS)) {
+			uthread_yield(TRUE, __rwlock_wr_cb, rwl);
+			return;
+		}
 	}
-	uthread_yield(TRUE, __rwlock_wr_cb, rwl);
+	spin_pdr_unlock(&rwl->lock);
 }
 
 bool uth_rwlock_try_wrlock(uth_rwlock_t *rwl)
 {
-	bool ret = FALSE;
-
 	assert_can_block();
-	parlib_run_once(&rwl->once_ctl, __uth_rwlock_init, rwl);
-	spin_pdr_lock(&rwl->lock);
-	if (!rwl->has_writer && !rwl->nr_readers) {
-		rwl->has_writer = TRUE;
-		ret = TRUE;
-	}
-	spin_pdr_unlock(&rwl->lock);
-	return ret;
+	return __uth_rwlock_try_wrlock(rwl);
+}
+
+/* Caller holds the spinlock.  Returns the WAITERS bit, if anyone is still
+ * asleep. */
+static uint32_t __rw_waiters_bit(struct uth_rwlock *rwl)
+{
+	if (__uth_sync_is_empty(&rwl->writers) &&
+	    __uth_sync_is_empty(&rwl->readers))
+		return 0;
+	return UTH_RWL_WAITERS;
 }
 
 /* Let's try to wake writers (yes, this is a policy decision), and if none, wake
  * all the readers.  The invariant there is that if there is no writer, then
- * there are no waiting readers. */
+ * there are no waiting readers.
+ *
+ * We hold WRITER, so no one else can change the state. */
 static void __rw_unlock_writer(struct uth_rwlock *rwl,
                                struct uth_tailq *restartees)
 {
 	struct uthread *uth;
+	uint32_t state;
 
 	uth = __uth_sync_get_next(&rwl->writers);
 	if (uth) {
 		TAILQ_INSERT_TAIL(restartees, uth, sync_next);
+		state = UTH_RWL_WRITER;
 	} else {
-		rwl->has_writer = FALSE;
+		state = 0;
 		while ((uth = __uth_sync_get_next(&rwl->readers))) {
 			TAILQ_INSERT_TAIL(restartees, uth, sync_next);
-			rwl->nr_readers++;
+			state++;
 		}
 	}
+	rwl->state = state | __rw_waiters_bit(rwl);
 }
 
+/* We were the last reader when we looked, but new readers can still come in
+ * until we hand the lock to a writer.  Only writers sleep when there are
+ * readers. */
 static void __rw_unlock_reader(struct uth_rwlock *rwl,
                                struct uth_tailq *restartees)
 {
 	struct uthread *uth;
-
-	rwl->nr_readers--;
-	if (!rwl->nr_readers) {
-		uth = __uth_sync_get_next(&rwl->writers);
-		if (uth) {
-			TAILQ_INSERT_TAIL(restartees, uth, sync_next);
-			rwl->has_writer = TRUE;
+	uint32_t state, new_state;
+
+	do {
+		state = ACCESS_ONCE(rwl->state);
+		if ((state & UTH_RWL_READERS) > 1) {
+			/* The other readers will wake the writers */
+			new_state = state - 1;
+		} else if (__uth_sync_is_empty(&rwl->writers)) {
+			new_state = 0;
+		} else {
+			new_state = UTH_RWL_WRITER | UTH_RWL_WAITERS;
 		}
-	}
+	} while (!atomic_cas_u32(&rwl->state, state, new_state));
+	if (!(new_state & UTH_RWL_WRITER))
+		return;
+	uth = __uth_sync_get_next(&rwl->writers);
+	TAILQ_INSERT_TAIL(restartees, uth, sync_next);
+	rwl->state = UTH_RWL_WRITER | __rw_waiters_bit(rwl);
 }
 
 /* Unlock works for either readers or writer locks.  You can tell which you were
- * based on whether has_writer is set or not. */
+ * based on whether WRITER is set or not.  We only need the slow path to wake
+ * sleepers: a writer with WAITERS, or the last reader with WAITERS. */
 void uth_rwlock_unlock(uth_rwlock_t *rwl)
 {
 	struct uth_tailq restartees = TAILQ_HEAD_INITIALIZER(restartees);
 	struct uthread *i, *safe;
-
+	uint32_t state, new_state;
+
+	do {
+		state = ACCESS_ONCE(rwl->state);
+		if (state & UTH_RWL_WRITER) {
+			if (state & UTH_RWL_WAITERS)
+				goto slow_path;
+			new_state = 0;
+		} else {
+			if ((state & UTH_RWL_WAITERS) &&
+			    (state & UTH_RWL_READERS) == 1)
+				goto slow_path;
+			new_state = state - 1;
+		}
+	} while (!atomic_cas_u32(&rwl->state, state, new_state));
+	return;
+slow_path:
 	spin_pdr_lock(&rwl->lock);
-	if (rwl->has_writer)
+	if (rwl->state & UTH_RWL_WRITER)
 		__rw_unlock_writer(rwl, &restartees);
 	else
 		__rw_unlock_reader(rwl, &restartees);
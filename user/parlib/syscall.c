@@ -5,6 +5,7 @@
 #include <parlib/serialize.h>
 #include <parlib/assert.h>
 #include <parlib/stdio.h>
+#include <sys/param.h>
 
 int sys_proc_destroy(int pid, int exitcode)
 {
@@ -181,6 +182,11 @@ int sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs)
 	return ros_syscall(SYS_tap_fds, tap_reqs, nr_reqs, 0, 0, 0, 0);
 }
 
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	return ros_syscall(SYS_sendfile, out_fd, in_fd, offset, count, 0, 0);
+}
+
 void syscall_async(struct syscall *sysc, unsigned long num, ...)
 {
 	va_list args;
@@ -221,3 +227,68 @@ void syscall_async_evq(struct syscall *sysc, struct event_queue *evq,
 	va_end(args);
 	__ros_arch_syscall((long)sysc, 1);
 }
+
+void sysc_batch_init(struct sysc_batch *b, struct syscall *syscs,
+                     unsigned int max)
+{
+	b->syscs = syscs;
+	b->nr = 0;
+	b->max = MIN(max, MAX_SYSC_BATCH);
+}
+
+static struct syscall *__sysc_batch_add(struct sysc_batch *b,
+                                        struct event_queue *evq,
+                                        unsigned long num, va_list args)
+{
+	struct syscall *sysc;
+
+	if (b->nr == b->max)
+		return NULL;
+	sysc = &b->syscs[b->nr++];
+	sysc->num = num;
+	atomic_set(&sysc->flags, evq ? SC_UEVENT : 0);
+	sysc->ev_q = evq;
+	sysc->arg0 = va_arg(args, long);
+	sysc->arg1 = va_arg(args, long);
+	sysc->arg2 = va_arg(args, long);
+	sysc->arg3 = va_arg(args, long);
+	sysc->arg4 = va_arg(args, long);
+	sysc->arg5 = va_arg(args, long);
+	return sysc;
+}
+
+/* Appends a syscall to the batch, returning NULL if the batch is full.  Like
+ * syscall_async(), we pull all six args regardless. */
+struct syscall *sysc_batch_add(struct sysc_batch *b, unsigned long num, ...)
+{
+	struct syscall *sysc;
+	va_list args;
+
+	va_start(args, num);
+	sysc = __sysc_batch_add(b, NULL, num, args);
+	va_end(args);
+	return sysc;
+}
+
+struct syscall *sysc_batch_add_evq(struct sysc_batch *b,
+                                   struct event_queue *evq,
+                                   unsigned long num, ...)
+{
+	struct syscall *sysc;
+	va_list args;
+
+	va_start(args, num);
+	sysc = __sysc_batch_add(b, evq, num, args);
+	va_end(args);
+	return sysc;
+}
+
+/* Traps once for the whole batch, then empties it.  The kernel runs the
+ * syscalls in order until one blocks; the rest carry on without it. */
+void sysc_batch_submit(struct sysc_batch *b)
+{
+	if (!b->nr)
+		return;
+	__ros_arch_syscall((long)b->syscs, b->nr);
+	b->nr = 0;
+}
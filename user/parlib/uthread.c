@@ -9,6 +9,8 @@
 #include <parlib/uthread.h>
 #include <parlib/event.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
 #include <parlib/assert.h>
 #include <parlib/stdio.h>
 #include <parlib/arch/trap.h>
@@ -19,6 +21,21 @@ __thread struct uthread *current_uthread = 0;
  * extensively about the details.  Will call out when necessary. */
 static struct event_queue *preempt_ev_q;
 
+/* Per-vcore caches of TLSs from exited uthreads.  A new uthread that gets one
+ * only needs a reinit_tls(), instead of allocating (and later freeing) a whole
+ * TLS.  Each vcore keeps up to uth_tls_cache_sz; the rest get freed.  Idle
+ * vcores drain their caches gradually, see uth_tls_cache_trim(). */
+#define UTH_TLS_CACHE_MAX 32
+#define UTH_TLS_CACHE_IDLE_YIELDS 4
+struct uth_tls_cache {
+	unsigned int			nr;
+	unsigned int			nr_idle;	/* yields since last use */
+	void				*tls_descs[UTH_TLS_CACHE_MAX];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct uth_tls_cache *uth_tls_caches;
+unsigned int uth_tls_cache_sz = 8;
+
 /* Helpers: */
 #define UTH_TLSDESC_NOTLS (void*)(-1)
 static inline bool __uthread_has_tls(struct uthread *uthread);
@@ -236,6 +253,11 @@ void uthread_2ls_init(struct uthread *uthread,
 		assert(!ev_handlers[EV_SYSCALL]);
 		ev_handlers[EV_SYSCALL] = new_h;
 	}
+	if (!posix_memalign((void**)&uth_tls_caches,
+	                    __alignof__(struct uth_tls_cache),
+	                    sizeof(struct uth_tls_cache) * max_vcores()))
+		memset(uth_tls_caches, 0,
+		       sizeof(struct uth_tls_cache) * max_vcores());
 	uthread_init_thread0(uthread);
 	uthread_track_thread0(uthread);
 	/* Switch our errno/errstr functions to be uthread-aware.  See glibc's
@@ -1246,11 +1268,74 @@ static inline bool __uthread_has_tls(struct uthread *uthread)
 	return uthread->tls_desc != UTH_TLSDESC_NOTLS;
 }
 
+/* Returns a cached TLS from this vcore, or 0.  Uthreads disable notifs so they
+ * don't migrate while using a vcore's cache. */
+static void *uth_tls_cache_get(void)
+{
+	struct uth_tls_cache *tc;
+	void *tls_desc = 0;
+
+	if (!uth_tls_caches)
+		return 0;
+	uth_disable_notifs();
+	tc = &uth_tls_caches[vcore_id()];
+	tc->nr_idle = 0;
+	if (tc->nr)
+		tls_desc = tc->tls_descs[--tc->nr];
+	uth_enable_notifs();
+	return tls_desc;
+}
+
+/* Tries to cache tls_desc on this vcore, returning FALSE if the cache is
+ * full. */
+static bool uth_tls_cache_put(void *tls_desc)
+{
+	struct uth_tls_cache *tc;
+	bool ret = FALSE;
+
+	if (!uth_tls_caches)
+		return FALSE;
+	uth_disable_notifs();
+	tc = &uth_tls_caches[vcore_id()];
+	tc->nr_idle = 0;
+	if (tc->nr < MIN(uth_tls_cache_sz, UTH_TLS_CACHE_MAX)) {
+		tc->tls_descs[tc->nr++] = tls_desc;
+		ret = TRUE;
+	}
+	uth_enable_notifs();
+	return ret;
+}
+
+/* Once vcoreid has been idle for UTH_TLS_CACHE_IDLE_YIELDS yields in a row,
+ * frees half of its cached TLSs (rounding up, so the cache drains to 0). */
+void uth_tls_cache_trim(uint32_t vcoreid)
+{
+	struct uth_tls_cache *tc;
+	unsigned int keep;
+
+	assert(in_vcore_context());
+	if (!uth_tls_caches)
+		return;
+	tc = &uth_tls_caches[vcoreid];
+	if (!tc->nr || ++tc->nr_idle < UTH_TLS_CACHE_IDLE_YIELDS)
+		return;
+	tc->nr_idle = 0;
+	keep = tc->nr / 2;
+	while (tc->nr > keep)
+		free_tls(tc->tls_descs[--tc->nr]);
+}
+
 /* TLS helpers */
 static int __uthread_allocate_tls(struct uthread *uthread)
 {
+	void *tls_desc;
+
 	assert(!uthread->tls_desc);
-	uthread->tls_desc = allocate_tls();
+	tls_desc = uth_tls_cache_get();
+	if (tls_desc)
+		uthread->tls_desc = reinit_tls(tls_desc);
+	else
+		uthread->tls_desc = allocate_tls();
 	if (!uthread->tls_desc) {
 		errno = ENOMEM;
 		return -1;
@@ -1270,7 +1355,8 @@ static int __uthread_reinit_tls(struct uthread *uthread)
 
 static void __uthread_free_tls(struct uthread *uthread)
 {
-	free_tls(uthread->tls_desc);
+	if (!uth_tls_cache_put(uthread->tls_desc))
+		free_tls(uthread->tls_desc);
 	uthread->tls_desc = NULL;
 }
 
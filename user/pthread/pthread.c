@@ -12,6 +12,7 @@
 #include <parlib/arch/arch.h>
 #include <sys/queue.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 #include <parlib/event.h>
 #include <parlib/ucq.h>
 #include <parlib/signal.h>
@@ -35,11 +36,46 @@
  * pthread.c.  After that, we can have a signal handling thread (even for
  * 'thread0'), which allows us to close() or do other vcore-ctx-unsafe ops. */
 
-struct pthread_queue ready_queue = TAILQ_HEAD_INITIALIZER(ready_queue);
-struct pthread_queue active_queue = TAILQ_HEAD_INITIALIZER(active_queue);
-struct mcs_pdr_lock queue_lock;
-int threads_ready = 0;
-int threads_active = 0;
+/* Per-vcore run queues.  A vcore puts threads it makes runnable on its own
+ * queue.  The most recent wakee goes in the 'next' slot, so a thread woken by a
+ * thread on this vcore runs here next, while what they shared is still in the
+ * cache.  Everyone else, including a wakee bumped out of 'next', waits in FIFO
+ * order.  So that two threads waking each other can't starve the FIFO, 'next'
+ * only runs PTH_RUNQ_MAX_NEXT times in a row before the FIFO gets a turn.  Idle
+ * vcores steal the oldest thread of a random vcore's queue, which is the least
+ * likely to be cache-hot.
+ *
+ * Only code running on vcore V pushes onto V's queue, so when V finds its
+ * queue empty and yields, it can't strand anyone there. */
+#define PTH_RUNQ_MAX_NEXT 8
+struct pth_runq {
+	struct spin_pdr_lock		lock;
+	struct pthread_tcb		*next;
+	unsigned int			nr_next_runs;	/* in a row */
+	struct pthread_queue		ready;
+	unsigned int			nr_ready;	/* including next */
+	uint32_t			rand_state;	/* picks victims */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct pth_runq *pth_runqs;
+
+/* Per-vcore caches of default-sized stacks from exited threads, so short-lived
+ * threads don't mmap, fault in, and munmap a stack each.  Each vcore keeps up
+ * to pthread_stack_cache_sz.  An idle vcore gives back half of its stacks
+ * after every PTH_STACK_CACHE_IDLE_YIELDS yields in a row without using its
+ * cache, so a vcore that bounces between work and yielding keeps its stacks,
+ * and one that stays idle eventually has none. */
+#define PTH_STACK_CACHE_MAX 32
+#define PTH_STACK_CACHE_IDLE_YIELDS 4
+struct pth_stack_cache {
+	unsigned int			nr;
+	unsigned int			nr_idle;	/* yields since last use */
+	void				*stacktops[PTH_STACK_CACHE_MAX];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct pth_stack_cache *pth_stack_caches;
+unsigned int pthread_stack_cache_sz = 8;
+atomic_t threads_ready;
 atomic_t threads_total;
 bool need_tls = TRUE;
 static uint64_t fork_generation;
@@ -89,6 +125,138 @@ struct schedule_ops *sched_ops = &pthread_sched_ops;
 static void __pthread_free_stack(struct pthread_tcb *pt);
 static int __pthread_allocate_stack(struct pthread_tcb *pt);
 static void __pth_yield_cb(struct uthread *uthread, void *junk);
+static void pth_stack_cache_trim(uint32_t vcoreid);
+
+/* Threads from an older fork generation stay put: in the parent they are
+ * runnable again after the fork, and in the child they never run. */
+static bool __pth_can_run(struct pthread_tcb *pth)
+{
+	return pth->fork_generation >= fork_generation;
+}
+
+/* Removes and returns the oldest thread in rq's FIFO that can run, if any. */
+static struct pthread_tcb *__pth_runq_take_fifo(struct pth_runq *rq)
+{
+	struct pthread_tcb *pth;
+
+	TAILQ_FOREACH(pth, &rq->ready, tq_next) {
+		if (__pth_can_run(pth)) {
+			TAILQ_REMOVE(&rq->ready, pth, tq_next);
+			rq->nr_ready--;
+			atomic_dec(&threads_ready);
+			return pth;
+		}
+	}
+	return NULL;
+}
+
+/* Removes and returns rq's next thread, if it can run. */
+static struct pthread_tcb *__pth_runq_take_next(struct pth_runq *rq)
+{
+	struct pthread_tcb *pth = rq->next;
+
+	if (!pth || !__pth_can_run(pth))
+		return NULL;
+	rq->next = NULL;
+	rq->nr_ready--;
+	atomic_dec(&threads_ready);
+	return pth;
+}
+
+/* Pops a thread off vcoreid's own queue: usually the next thread, but the
+ * oldest one if next has had its turns. */
+static struct pthread_tcb *pth_runq_pop(uint32_t vcoreid)
+{
+	struct pth_runq *rq = &pth_runqs[vcoreid];
+	struct pthread_tcb *pth = NULL;
+
+	if (!ACCESS_ONCE(rq->nr_ready))
+		return NULL;
+	spin_pdr_lock(&rq->lock);
+	if (rq->nr_next_runs < PTH_RUNQ_MAX_NEXT)
+		pth = __pth_runq_take_next(rq);
+	if (pth) {
+		rq->nr_next_runs++;
+	} else {
+		rq->nr_next_runs = 0;
+		pth = __pth_runq_take_fifo(rq);
+		if (!pth)
+			pth = __pth_runq_take_next(rq);
+	}
+	spin_pdr_unlock(&rq->lock);
+	return pth;
+}
+
+/* Steals the oldest thread from another vcore's queue, checking every vcore
+ * once, starting from a random one.  We don't wait on busy queues; *missed
+ * tells the caller whether we skipped one that had threads. */
+static struct pthread_tcb *pth_runq_steal(uint32_t vcoreid, bool *missed)
+{
+	struct pth_runq *rq = &pth_runqs[vcoreid];
+	struct pth_runq *victim;
+	struct pthread_tcb *pth;
+	uint32_t x = rq->rand_state;
+	int nr_vcores = max_vcores();
+	int start;
+
+	*missed = FALSE;
+	/* xorshift32; good enough to spread out the thieves */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	rq->rand_state = x;
+	start = x % nr_vcores;
+	for (int i = 0; i < nr_vcores; i++) {
+		victim = &pth_runqs[(start + i) % nr_vcores];
+		if (victim == rq || !ACCESS_ONCE(victim->nr_ready))
+			continue;
+		if (!spin_pdr_trylock(&victim->lock)) {
+			*missed = TRUE;
+			continue;
+		}
+		pth = __pth_runq_take_fifo(victim);
+		if (!pth)
+			pth = __pth_runq_take_next(victim);
+		spin_pdr_unlock(&victim->lock);
+		if (pth)
+			return pth;
+	}
+	return NULL;
+}
+
+/* Pushes pth onto rq, locked.  If run_next, pth takes the next slot, and
+ * whoever had it goes on the FIFO.  O/w, pth goes behind everyone else. */
+static void __pth_runq_push(struct pth_runq *rq, struct pthread_tcb *pth,
+                            bool run_next)
+{
+	if (run_next) {
+		if (rq->next)
+			TAILQ_INSERT_TAIL(&rq->ready, rq->next, tq_next);
+		rq->next = pth;
+	} else {
+		TAILQ_INSERT_TAIL(&rq->ready, pth, tq_next);
+	}
+	rq->nr_ready++;
+	atomic_inc(&threads_ready);
+}
+
+/* Locks the queue of the vcore we're running on.  Uthreads must not migrate
+ * between picking the queue and locking it, so we disable notifs first. */
+static struct pth_runq *pth_runq_lock_local(void)
+{
+	struct pth_runq *rq;
+
+	uth_disable_notifs();
+	rq = &pth_runqs[vcore_id()];
+	spin_pdr_lock(&rq->lock);
+	return rq;
+}
+
+static void pth_runq_unlock_local(struct pth_runq *rq)
+{
+	spin_pdr_unlock(&rq->lock);
+	uth_enable_notifs();
+}
 
 /* Called from vcore entry.  Options usually include restarting whoever was
  * running there before or running a new thread.  Events are handled out of
@@ -106,6 +274,7 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 	}
 	/* no one currently running, so lets get someone from the ready queue */
 	struct pthread_tcb *new_thread = NULL;
+	bool missed;
 
 	/* Try to get a thread.  If we get one, we'll break out and run it.  If
 	 * not, we'll try to yield.  vcore_yield() might return, if we lost a
@@ -114,20 +283,12 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 	do {
 		handle_events(vcoreid);
 		__check_preempt_pending(vcoreid);
-		mcs_pdr_lock(&queue_lock);
-		TAILQ_FOREACH(new_thread, &ready_queue, tq_next) {
-			if (new_thread->fork_generation < fork_generation)
-				continue;
-			break;
-		}
+		new_thread = pth_runq_pop(vcoreid);
+		if (!new_thread)
+			new_thread = pth_runq_steal(vcoreid, &missed);
 		if (new_thread) {
-			TAILQ_REMOVE(&ready_queue, new_thread, tq_next);
 			assert(new_thread->state == PTH_RUNNABLE);
 			new_thread->state = PTH_RUNNING;
-			TAILQ_INSERT_TAIL(&active_queue, new_thread, tq_next);
-			threads_active++;
-			threads_ready--;
-			mcs_pdr_unlock(&queue_lock);
 			/* If you see what looks like the same uthread running
 			 * in multiple places, your list might be jacked up.
 			 * Turn this on. */
@@ -137,8 +298,14 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 			       ((struct uthread*)new_thread)->flags);
 			break;
 		}
-		mcs_pdr_unlock(&queue_lock);
+		/* A victim's lock was busy; it might have had work for us. */
+		if (missed)
+			continue;
 		/* no new thread, try to yield */
+		if (!parlib_never_yield) {
+			pth_stack_cache_trim(vcoreid);
+			uth_tls_cache_trim(vcoreid);
+		}
 		printd("[P] No threads, vcore %d is yielding\n", vcore_id());
 		/* TODO: you can imagine having something smarter here, like
 		 * spin for a bit before yielding. */
@@ -164,6 +331,8 @@ static void __pthread_run(void)
 static void pth_thread_runnable(struct uthread *uthread)
 {
 	struct pthread_tcb *pthread = (struct pthread_tcb*)uthread;
+	struct pth_runq *rq;
+	bool run_next;
 
 	/* At this point, the 2LS can see why the thread blocked and was woken
 	 * up in the first place (coupling these things together).  On the yield
@@ -184,17 +353,20 @@ static void pth_thread_runnable(struct uthread *uthread)
 		panic("Odd state %d for pthread %08p\n", pthread->state,
 		      pthread);
 	}
+	/* Threads that yielded or lost their core go behind the others;
+	 * everyone else (new threads, wakees) runs next on the waker's vcore. */
+	run_next = (pthread->state != PTH_BLK_YIELDING) &&
+	           (pthread->state != PTH_BLK_PAUSED);
 	pthread->state = PTH_RUNNABLE;
-	/* Insert the newly created thread into the ready queue of threads.  It
-	 * will be removed from this queue later when vcore_entry() comes up */
-	mcs_pdr_lock(&queue_lock);
+	/* Insert the thread into our vcore's ready queue.  It will be removed
+	 * later when vcore_entry() comes up, here or on a thief. */
+	rq = pth_runq_lock_local();
 	/* Again, GIANT WARNING: if you change this, change batch wakeup code */
-	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
-	threads_ready++;
-	mcs_pdr_unlock(&queue_lock);
+	__pth_runq_push(rq, pthread, run_next);
+	pth_runq_unlock_local(rq);
 	/* Smarter schedulers should look at the num_vcores() and how much work
 	 * is going on to make a decision about how many vcores to request. */
-	vcore_request_more(threads_ready);
+	vcore_request_more(atomic_read(&threads_ready));
 }
 
 /* For some reason not under its control, the uthread stopped running (compared
@@ -485,17 +657,17 @@ static void pth_thread_bulk_runnable(uth_sync_t *wakees)
 {
 	struct uthread *uth_i;
 	struct pthread_tcb *pth_i;
+	struct pth_runq *rq;
 
 	/* Amortize the lock grabbing over all restartees */
-	mcs_pdr_lock(&queue_lock);
+	rq = pth_runq_lock_local();
 	while ((uth_i = __uth_sync_get_next(wakees))) {
 		pth_i = (struct pthread_tcb*)uth_i;
 		pth_i->state = PTH_RUNNABLE;
-		TAILQ_INSERT_TAIL(&ready_queue, pth_i, tq_next);
-		threads_ready++;
+		__pth_runq_push(rq, pth_i, FALSE);
 	}
-	mcs_pdr_unlock(&queue_lock);
-	vcore_request_more(threads_ready);
+	pth_runq_unlock_local(rq);
+	vcore_request_more(atomic_read(&threads_ready));
 }
 
 /* Akaros pthread extensions / hacks */
@@ -526,9 +698,68 @@ int pthread_attr_destroy(pthread_attr_t *a)
 	return 0;
 }
 
+/* Returns a cached default-sized stack from this vcore, or 0.  Uthreads
+ * disable notifs so they don't migrate while using a vcore's cache. */
+static void *pth_stack_cache_get(void)
+{
+	struct pth_stack_cache *sc;
+	void *stacktop = 0;
+
+	uth_disable_notifs();
+	sc = &pth_stack_caches[vcore_id()];
+	sc->nr_idle = 0;
+	if (sc->nr)
+		stacktop = sc->stacktops[--sc->nr];
+	uth_enable_notifs();
+	return stacktop;
+}
+
+/* Tries to cache a default-sized stack on this vcore, returning FALSE if the
+ * cache is full. */
+static bool pth_stack_cache_put(void *stacktop)
+{
+	struct pth_stack_cache *sc;
+	bool ret = FALSE;
+
+	uth_disable_notifs();
+	sc = &pth_stack_caches[vcore_id()];
+	sc->nr_idle = 0;
+	if (sc->nr < MIN(pthread_stack_cache_sz, PTH_STACK_CACHE_MAX)) {
+		sc->stacktops[sc->nr++] = stacktop;
+		ret = TRUE;
+	}
+	uth_enable_notifs();
+	return ret;
+}
+
+/* Called from vcore context each time vcoreid is about to yield.  Once the
+ * vcore has been idle for PTH_STACK_CACHE_IDLE_YIELDS yields in a row, unmaps
+ * half of its cached stacks (rounding up, so the cache drains to 0). */
+static void pth_stack_cache_trim(uint32_t vcoreid)
+{
+	struct pth_stack_cache *sc = &pth_stack_caches[vcoreid];
+	unsigned int keep;
+	int ret;
+
+	if (!sc->nr || ++sc->nr_idle < PTH_STACK_CACHE_IDLE_YIELDS)
+		return;
+	sc->nr_idle = 0;
+	keep = sc->nr / 2;
+	while (sc->nr > keep) {
+		ret = munmap(sc->stacktops[--sc->nr] - PTHREAD_STACK_SIZE,
+		             PTHREAD_STACK_SIZE);
+		assert(!ret);
+	}
+}
+
 static void __pthread_free_stack(struct pthread_tcb *pt)
 {
-	int ret = munmap(pt->stacktop - pt->stacksize, pt->stacksize);
+	int ret;
+
+	if (pt->stacksize == PTHREAD_STACK_SIZE &&
+	    pth_stack_cache_put(pt->stacktop))
+		return;
+	ret = munmap(pt->stacktop - pt->stacksize, pt->stacksize);
 	assert(!ret);
 }
 
@@ -536,6 +767,12 @@ static int __pthread_allocate_stack(struct pthread_tcb *pt)
 {
 	int force_a_page_fault;
 	assert(pt->stacksize);
+	/* Cached stacks already have their top faulted in */
+	if (pt->stacksize == PTHREAD_STACK_SIZE) {
+		pt->stacktop = pth_stack_cache_get();
+		if (pt->stacktop)
+			return 0;
+	}
 	void* stackbot = mmap(0, pt->stacksize,
 	                      PROT_READ | PROT_WRITE | PROT_EXEC,
 	                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
@@ -640,7 +877,24 @@ void pth_sched_init(void)
 	struct pthread_tcb *t;
 	int ret;
 
-	mcs_pdr_init(&queue_lock);
+	ret = posix_memalign((void**)&pth_runqs, __alignof__(struct pth_runq),
+	                     sizeof(struct pth_runq) * max_vcores());
+	assert(!ret);
+	for (int i = 0; i < max_vcores(); i++) {
+		spin_pdr_init(&pth_runqs[i].lock);
+		pth_runqs[i].next = NULL;
+		pth_runqs[i].nr_next_runs = 0;
+		TAILQ_INIT(&pth_runqs[i].ready);
+		pth_runqs[i].nr_ready = 0;
+		pth_runqs[i].rand_state = i + 1;	/* xorshift needs != 0 */
+	}
+	atomic_init(&threads_ready, 0);
+	ret = posix_memalign((void**)&pth_stack_caches,
+	                     __alignof__(struct pth_stack_cache),
+	                     sizeof(struct pth_stack_cache) * max_vcores());
+	assert(!ret);
+	memset(pth_stack_caches, 0,
+	       sizeof(struct pth_stack_cache) * max_vcores());
 	fork_generation = INIT_FORK_GENERATION;
 	/* Create a pthread_tcb for the main thread */
 	ret = posix_memalign((void**)&t, __alignof__(struct pthread_tcb),
@@ -656,11 +910,6 @@ void pth_sched_init(void)
 	/* implies that sigmasks are longs, which they are. */
 	assert(t->id == 0);
 	SLIST_INIT(&t->cr_stack);
-	/* Put the new pthread (thread0) on the active queue */
-	mcs_pdr_lock(&queue_lock);
-	threads_active++;
-	TAILQ_INSERT_TAIL(&active_queue, t, tq_next);
-	mcs_pdr_unlock(&queue_lock);
 	/* Tell the kernel where and how we want to receive events.  This is
 	 * just an example of what to do to have a notification turned on.
 	 * We're turning on USER_IPIs, posting events to vcore 0's vcpd, and
@@ -791,15 +1040,12 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	return 0;
 }
 
-/* Helper that all pthread-controlled yield paths call.  Just does some
- * accounting.  This is another example of how the much-loathed (and loved)
- * active queue is keeping us honest.  Need to export for sem and friends. */
+/* Helper that all pthread-controlled yield paths call.  There used to be a
+ * global active queue to maintain here, but it was a global lock on every
+ * context switch.  Running threads aren't tracked anymore; this is the hook
+ * for any per-yield accounting.  Need to export for sem and friends. */
 void __pthread_generic_yield(struct pthread_tcb *pthread)
 {
-	mcs_pdr_lock(&queue_lock);
-	threads_active--;
-	TAILQ_REMOVE(&active_queue, pthread, tq_next);
-	mcs_pdr_unlock(&queue_lock);
 }
 
 int pthread_join(struct pthread_tcb *join_target, void **retval)
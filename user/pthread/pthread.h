@@ -138,6 +138,8 @@ typedef dtls_key_t pthread_key_t;
 void pthread_need_tls(bool need);			/* default is TRUE */
 void pthread_mcp_init(void);
 void __pthread_generic_yield(struct pthread_tcb *pthread);
+/* Max default-sized stacks each vcore caches for new threads; 0 turns it off */
+extern unsigned int pthread_stack_cache_sz;
 
 /* Profiling alarms for pthreads.  (profalarm.c) */
 void enable_profalarm(uint64_t usecs);